@@ -148,6 +148,10 @@ extern "C" {
 #define ARES_FLAG_NOALIASES     (1 << 6)
 #define ARES_FLAG_NOCHECKRESP   (1 << 7)
 #define ARES_FLAG_EDNS          (1 << 8)
+#define ARES_FLAG_DEFERSEND     (1 << 9)
+#define ARES_FLAG_SRVHEALTH     (1 << 10)
+#define ARES_FLAG_PARALLELSEARCH (1 << 11)
+#define ARES_FLAG_COALESCE      (1 << 12)
 
 /* Option mask values */
 #define ARES_OPT_FLAGS          (1 << 0)
@@ -168,6 +172,16 @@ extern "C" {
 #define ARES_OPT_EDNSPSZ        (1 << 15)
 #define ARES_OPT_NOROTATE       (1 << 16)
 #define ARES_OPT_RESOLVCONF     (1 << 17)
+#define ARES_OPT_QUERY_CACHE    (1 << 18)
+#define ARES_OPT_UDP_POOL       (1 << 19)
+#define ARES_OPT_UDP_MAX_QUERIES (1 << 20)
+#define ARES_OPT_POOL_MAX_FREE  (1 << 21)
+#define ARES_OPT_TCP_IDLE_TIMEOUT (1 << 22)
+#define ARES_OPT_RTO            (1 << 23)
+#define ARES_OPT_HEDGE          (1 << 24)
+#define ARES_OPT_RELOAD         (1 << 25)
+#define ARES_OPT_NEG_CACHE      (1 << 26)
+#define ARES_OPT_SUBMIT_QUEUE   (1 << 27)
 
 /* Nameinfo flag values */
 #define ARES_NI_NOFQDN                  (1 << 0)
@@ -212,6 +226,37 @@ extern "C" {
 #define ARES_GETSOCK_WRITABLE(bits,num) (bits & (1 << ((num) + \
                                          ARES_GETSOCK_MAXNUM)))
 
+/* Socket events for ares_process_fds() */
+#define ARES_FD_EVENT_READ              (1 << 0)
+#define ARES_FD_EVENT_WRITE             (1 << 1)
+
+/* ares_process_fds() flags */
+#define ARES_PROCESS_FLAG_SKIP_NON_FD   (1 << 0)
+
+/* Counters that can be read with ares_get_stat() */
+#define ARES_STAT_UDP_RECV_CALLS        0 /* receive calls on UDP sockets */
+#define ARES_STAT_UDP_RECV_PACKETS      1 /* datagrams those calls returned */
+#define ARES_STAT_UDP_SEND_CALLS        2 /* send calls on UDP sockets */
+#define ARES_STAT_UDP_SEND_PACKETS      3 /* datagrams those calls sent */
+#define ARES_STAT_POOL_HITS             4 /* allocations from a free list */
+#define ARES_STAT_POOL_MISSES           5 /* allocations from ares_malloc */
+#define ARES_STAT_HEDGES_SENT           6 /* queries also sent to a 2nd server */
+#define ARES_STAT_HEDGE_WINS            7 /* of those, answered by the 2nd */
+#define ARES_STAT_MEMORY_BYTES          8 /* bytes of memory the channel holds */
+
+/* Per-server values that can be read with ares_get_server_stat() */
+#define ARES_SERVER_STAT_TCP_CONNECTS   0 /* TCP connections opened */
+#define ARES_SERVER_STAT_TCP_QUERIES    1 /* queries sent over TCP */
+#define ARES_SERVER_STAT_TCP_BYTES_SENT 2 /* bytes written to TCP */
+#define ARES_SERVER_STAT_TCP_BYTES_RECV 3 /* bytes read from TCP */
+#define ARES_SERVER_STAT_TCP_INFLIGHT   4 /* TCP queries awaiting an answer */
+#define ARES_SERVER_STAT_ANSWERS        5 /* answers accepted */
+#define ARES_SERVER_STAT_TIMEOUTS       6 /* queries that timed out */
+#define ARES_SERVER_STAT_SERVFAILS      7 /* SERVFAIL or REFUSED answers */
+#define ARES_SERVER_STAT_SRTT           8 /* smoothed round trip time, usec */
+#define ARES_SERVER_STAT_RTTVAR         9 /* round trip time variation, usec */
+#define ARES_SERVER_STAT_RTO           10 /* retransmission timeout, msec */
+
 /* c-ares library initialization flag values */
 #define ARES_LIB_INIT_NONE   (0)
 #define ARES_LIB_INIT_WIN32  (1 << 0)
@@ -238,6 +283,12 @@ typedef void (*ares_sock_state_cb)(void *data,
                                    int readable,
                                    int writable);
 
+/* A socket an event loop found ready, for ares_process_fds() */
+struct ares_fd_events {
+  ares_socket_t fd;
+  unsigned int events; /* ARES_FD_EVENT_* bits */
+};
+
 struct apattern;
 
 /* NOTE about the ares_options struct to users and developers.
@@ -277,6 +328,20 @@ struct ares_options {
   int nsort;
   int ednspsz;
   char *resolvconf_path;
+  unsigned int qcache_max_ttl;
+  int qcache_max_entries;
+  int udp_pool_size;
+  int udp_max_queries;
+  int pool_max_free;
+  int tcp_idle_timeout;
+  int rto_min;
+  int rto_max;
+  int hedge_delay;
+  int hedge_percentile;
+  int reload_interval;
+  unsigned int negcache_max_ttl;
+  int negcache_max_entries;
+  int submit_queue_size;
 };
 
 struct hostent;
@@ -285,9 +350,16 @@ struct sockaddr;
 struct ares_channeldata;
 struct ares_addrinfo;
 struct ares_addrinfo_hints;
+struct ares_addrinfo_batch_item;
+struct ares_handledata;
+struct ares_resolverdata;
 
 typedef struct ares_channeldata *ares_channel;
 
+typedef struct ares_handledata *ares_handle;
+
+typedef struct ares_resolverdata *ares_resolver;
+
 typedef void (*ares_callback)(void *arg,
                               int status,
                               int timeouts,
@@ -318,6 +390,11 @@ typedef void (*ares_addrinfo_callback)(void *arg,
                                    int timeouts,
                                    struct ares_addrinfo *res);
 
+typedef void (*ares_addrinfo_batch_callback)(void *arg,
+                                             int status,
+                                             struct ares_addrinfo_batch_item *items,
+                                             size_t nitems);
+
 CARES_EXTERN int ares_library_init(int flags);
 
 CARES_EXTERN int ares_library_init_mem(int flags,
@@ -352,10 +429,14 @@ CARES_EXTERN void ares_destroy_options(struct ares_options *options);
 CARES_EXTERN int ares_dup(ares_channel *dest,
                           ares_channel src);
 
+CARES_EXTERN int ares_reinit(ares_channel channel);
+
 CARES_EXTERN void ares_destroy(ares_channel channel);
 
 CARES_EXTERN void ares_cancel(ares_channel channel);
 
+CARES_EXTERN void ares_cancel_query(ares_handle handle);
+
 /* These next 3 configure local binding for the out-going socket
  * connection.  Use these to specify source IP and/or network device
  * on multi-homed systems.
@@ -390,6 +471,14 @@ CARES_EXTERN void ares_getaddrinfo(ares_channel channel,
 
 CARES_EXTERN void ares_freeaddrinfo(struct ares_addrinfo* ai);
 
+CARES_EXTERN void ares_getaddrinfo_batch(ares_channel channel,
+                                         struct ares_addrinfo_batch_item *items,
+                                         size_t nitems,
+                                         size_t max_outstanding,
+                                         int tries,
+                                         ares_addrinfo_batch_callback callback,
+                                         void *arg);
+
 /*
  * Virtual function set to have user-managed socket IO.
  * Note that all functions need to be defined, and when
@@ -431,6 +520,85 @@ CARES_EXTERN void ares_search(ares_channel channel,
                               ares_callback callback,
                               void *arg);
 
+/* Like the functions above, but return a handle ares_cancel_query() can
+ * cancel the operation with, until its callback has been invoked.  NULL
+ * is returned when the callback has been invoked already. */
+CARES_EXTERN ares_handle ares_send_handle(ares_channel channel,
+                                          const unsigned char *qbuf,
+                                          int qlen,
+                                          ares_callback callback,
+                                          void *arg);
+
+CARES_EXTERN ares_handle ares_query_handle(ares_channel channel,
+                                           const char *name,
+                                           int dnsclass,
+                                           int type,
+                                           ares_callback callback,
+                                           void *arg);
+
+CARES_EXTERN ares_handle ares_search_handle(ares_channel channel,
+                                            const char *name,
+                                            int dnsclass,
+                                            int type,
+                                            ares_callback callback,
+                                            void *arg);
+
+CARES_EXTERN ares_handle ares_getaddrinfo_handle(ares_channel channel,
+                                                 const char* node,
+                                                 const char* service,
+                                                 const struct ares_addrinfo_hints* hints,
+                                                 ares_addrinfo_callback callback,
+                                                 void* arg);
+
+/* Thread-safe versions of ares_send() and ares_getaddrinfo() for channels
+ * with ARES_OPT_SUBMIT_QUEUE: the request is started by the thread that
+ * processes the channel, which ares_submit_fd() becomes readable for. */
+CARES_EXTERN int ares_submit_send(ares_channel channel,
+                                  const unsigned char *qbuf,
+                                  int qlen,
+                                  ares_callback callback,
+                                  void *arg);
+
+CARES_EXTERN int ares_submit_getaddrinfo(ares_channel channel,
+                                         const char* node,
+                                         const char* service,
+                                         const struct ares_addrinfo_hints* hints,
+                                         ares_addrinfo_callback callback,
+                                         void* arg);
+
+CARES_EXTERN ares_socket_t ares_submit_fd(ares_channel channel);
+
+/* A resolver made of copies of a channel with ARES_OPT_SUBMIT_QUEUE, each
+ * processed by a thread of its own, that lookups are spread over by
+ * name. */
+CARES_EXTERN int ares_resolver_init(ares_resolver *resolver,
+                                    ares_channel channel,
+                                    int nchannels);
+
+CARES_EXTERN void ares_resolver_destroy(ares_resolver resolver);
+
+CARES_EXTERN int ares_resolver_nchannels(ares_resolver resolver);
+
+CARES_EXTERN ares_channel ares_resolver_channel(ares_resolver resolver,
+                                                int index);
+
+CARES_EXTERN int ares_resolver_send(ares_resolver resolver,
+                                    const unsigned char *qbuf,
+                                    int qlen,
+                                    ares_callback callback,
+                                    void *arg);
+
+CARES_EXTERN int ares_resolver_getaddrinfo(ares_resolver resolver,
+                                           const char* node,
+                                           const char* service,
+                                           const struct ares_addrinfo_hints* hints,
+                                           ares_addrinfo_callback callback,
+                                           void* arg);
+
+CARES_EXTERN int ares_resolver_get_stat(ares_resolver resolver,
+                                        int stat,
+                                        unsigned long *value);
+
 CARES_EXTERN void ares_gethostbyname(ares_channel channel,
                                      const char *name,
                                      int family,
@@ -476,6 +644,20 @@ CARES_EXTERN void ares_process_fd(ares_channel channel,
                                   ares_socket_t read_fd,
                                   ares_socket_t write_fd);
 
+CARES_EXTERN int ares_process_fds(ares_channel channel,
+                                  const struct ares_fd_events *events,
+                                  size_t nevents,
+                                  int flags);
+
+CARES_EXTERN int ares_get_stat(ares_channel channel,
+                               int stat,
+                               unsigned long *value);
+
+CARES_EXTERN int ares_get_server_stat(ares_channel channel,
+                                      int server,
+                                      int stat,
+                                      unsigned long *value);
+
 CARES_EXTERN int ares_create_query(const char *name,
                                    int dnsclass,
                                    int type,
@@ -618,6 +800,36 @@ struct ares_addrinfo_hints {
   int ai_protocol;
 };
 
+/*
+ * An address found by ares_getaddrinfo_batch(), with its TTL (0 if it did
+ * not come from DNS).
+ */
+struct ares_addrinfo_batch_addr {
+  int family;
+  int ttl;
+  union {
+    struct in_addr       addr4;
+    struct ares_in6_addr addr6;
+  } addr;
+};
+
+/*
+ * One name of an ares_getaddrinfo_batch() call: node, service and hints are
+ * filled in by the caller as for ares_getaddrinfo(), the rest with the
+ * results of the lookup.  port is the one service names, in host byte
+ * order, and addrs points into storage shared by the whole batch.
+ */
+struct ares_addrinfo_batch_item {
+  const char                            *node;
+  const char                            *service;
+  const struct ares_addrinfo_hints      *hints;
+  int                                    status;
+  int                                    timeouts;
+  unsigned short                         port;
+  size_t                                 naddrs;
+  const struct ares_addrinfo_batch_addr *addrs;
+};
+
 /*
 ** Parse the buffer, starting at *abuf and of length alen bytes, previously
 ** obtained from an ares_search call.  Put the results in *host, if nonnull.
@@ -19,7 +19,10 @@
 #include "ares.h"
 #include "ares_private.h"
 
-void ares__close_sockets(ares_channel channel, struct server_state *server)
+/* Close a server's TCP connection and drop whatever was queued for it or
+ * read from it.
+ */
+void ares__close_tcp(ares_channel channel, struct server_state *server)
 {
   struct send_request *sendreq;
 
@@ -31,31 +34,287 @@ void ares__close_sockets(ares_channel channel, struct server_state *server)
       server->qhead = sendreq->next;
       if (sendreq->data_storage != NULL)
         ares_free(sendreq->data_storage);
-      ares_free(sendreq);
+      ares__pool_free(channel, sendreq);
     }
   server->qtail = NULL;
 
-  /* Reset any existing input buffer. */
-  if (server->tcp_buffer)
-    ares_free(server->tcp_buffer);
-  server->tcp_buffer = NULL;
-  server->tcp_lenbuf_pos = 0;
+  /* Drop any partial answer; the buffer itself is kept for the next
+   * connection. */
+  server->tcp_rbuf_len = 0;
+
+  if (server->tcp_conn.fd != ARES_SOCKET_BAD)
+    {
+      ares__close_connection(channel, &server->tcp_conn);
+      server->tcp_connection_generation = ++channel->tcp_connection_generation;
+    }
+}
+
+void ares__close_sockets(ares_channel channel, struct server_state *server)
+{
+  struct list_node *list_head;
+  struct list_node *list_node;
+
+  ares__close_tcp(channel, server);
 
   /* Reset brokenness */
   server->is_broken = 0;
 
-  /* Close the TCP and UDP sockets. */
-  if (server->tcp_socket != ARES_SOCKET_BAD)
+  /* Close the UDP sockets. */
+  list_head = &(server->connections);
+  for (list_node = list_head->next; list_node != list_head;
+       list_node = list_node->next)
+    ares__close_connection(channel, list_node->data);
+}
+
+/* Free the closed UDP connections of an idle server beyond the pool size,
+ * as are opened when a query id is in use on all the others.
+ */
+static void free_surplus_conns(ares_channel channel,
+                               struct server_state *server)
+{
+  struct list_node *list_node = server->connections.next;
+  struct server_connection *conn;
+  int n = 0;
+
+  while (list_node != &(server->connections))
     {
-      SOCK_STATE_CALLBACK(channel, server->tcp_socket, 0, 0);
-      ares__close_socket(channel, server->tcp_socket);
-      server->tcp_socket = ARES_SOCKET_BAD;
-      server->tcp_connection_generation = ++channel->tcp_connection_generation;
+      conn = list_node->data;
+      list_node = list_node->next;
+      if (++n > channel->udp_pool_size && conn->fd == ARES_SOCKET_BAD)
+        {
+          ares__remove_from_list(&(conn->node));
+          ares_free(conn);
+        }
+    }
+}
+
+/* Simple cleanup policy: once no queries are remaining, close all network
+ * sockets unless STAYOPEN is set.  With a TCP idle timeout the TCP
+ * connections stay up; ares__close_idle_tcp() closes them later.  The
+ * buffers answers are read into, and the UDP connections beyond the pool
+ * size, go with the sockets once processing is over, so that an idle
+ * channel holds little memory.
+ */
+void ares__close_unused_sockets(ares_channel channel)
+{
+  struct server_state *server;
+  struct list_node *list_head;
+  struct list_node *list_node;
+  int i;
+
+  if ((channel->flags & ARES_FLAG_STAYOPEN) ||
+      !ares__is_list_empty(&(channel->all_queries)) || !channel->servers)
+    return;
+
+  for (i = 0; i < channel->nservers; i++)
+    {
+      server = &channel->servers[i];
+      if (channel->tcp_idle_timeout <= 0 || server->is_broken)
+        {
+          ares__close_sockets(channel, server);
+          continue;
+        }
+      list_head = &(server->connections);
+      for (list_node = list_head->next; list_node != list_head;
+           list_node = list_node->next)
+        ares__close_connection(channel, list_node->data);
+    }
+
+  /* Answers may still be read from the buffers while processing */
+  if (channel->processing)
+    return;
+  for (i = 0; i < channel->nservers; i++)
+    {
+      server = &channel->servers[i];
+      if (server->tcp_conn.fd == ARES_SOCKET_BAD && server->tcp_rbuf)
+        {
+          ares_free(server->tcp_rbuf);
+          server->tcp_rbuf = NULL;
+          server->tcp_rbuf_alloc = 0;
+        }
+      free_surplus_conns(channel, server);
+    }
+  if (channel->udp_recv_bufs)
+    {
+      ares_free(channel->udp_recv_bufs);
+      channel->udp_recv_bufs = NULL;
+    }
+}
+
+/* Is this TCP connection open but neither sending nor awaiting anything? */
+static int tcp_idle(struct server_state *server)
+{
+  return server->tcp_conn.fd != ARES_SOCKET_BAD && !server->qhead &&
+         server->tcp_inflight == 0;
+}
+
+/* When is the idle TCP connection of this server due to be closed? */
+static void tcp_idle_expiry(ares_channel channel, struct server_state *server,
+                            struct timeval *expiry)
+{
+  *expiry = server->tcp_last_used;
+  expiry->tv_sec += channel->tcp_idle_timeout / 1000;
+  expiry->tv_usec += (channel->tcp_idle_timeout % 1000) * 1000;
+  if (expiry->tv_usec >= 1000000)
+    {
+      expiry->tv_sec++;
+      expiry->tv_usec -= 1000000;
+    }
+}
+
+/* Find when the first idle TCP connection is due to be closed.  Returns 0
+ * if there is none.
+ */
+int ares__tcp_idle_deadline(ares_channel channel, struct timeval *deadline)
+{
+  struct server_state *server;
+  struct timeval expiry;
+  int found = 0;
+  int i;
+
+  if (channel->tcp_idle_timeout <= 0 || (channel->flags & ARES_FLAG_STAYOPEN))
+    return 0;
+
+  for (i = 0; i < channel->nservers; i++)
+    {
+      server = &channel->servers[i];
+      if (!tcp_idle(server))
+        continue;
+      tcp_idle_expiry(channel, server, &expiry);
+      if (!found || ares__timedout(deadline, &expiry))
+        *deadline = expiry;
+      found = 1;
+    }
+  return found;
+}
+
+/* Close the TCP connections that have been idle for longer than
+ * channel->tcp_idle_timeout.
+ */
+void ares__close_idle_tcp(ares_channel channel, struct timeval *now)
+{
+  struct server_state *server;
+  struct timeval expiry;
+  int i;
+
+  if (channel->tcp_idle_timeout <= 0 || (channel->flags & ARES_FLAG_STAYOPEN))
+    return;
+
+  for (i = 0; i < channel->nservers; i++)
+    {
+      server = &channel->servers[i];
+      if (!tcp_idle(server))
+        continue;
+      tcp_idle_expiry(channel, server, &expiry);
+      if (ares__timedout(now, &expiry))
+        ares__close_tcp(channel, server);
     }
-  if (server->udp_socket != ARES_SOCKET_BAD)
+}
+
+void ares__init_connection(struct server_connection *conn,
+                           struct server_state *server, int is_tcp)
+{
+  conn->fd = ARES_SOCKET_BAD;
+  conn->server = server;
+  conn->is_tcp = is_tcp;
+  conn->total_queries = 0;
+  ares__init_list_head(&(conn->queries_to_conn));
+  ares__init_list_head(&(conn->udp_pending));
+  ares__init_list_node(&(conn->node), conn);
+  ares__init_list_node(&(conn->node_by_fd), conn);
+}
+
+void ares__close_connection(ares_channel channel,
+                            struct server_connection *conn)
+{
+  if (conn->fd != ARES_SOCKET_BAD)
     {
-      SOCK_STATE_CALLBACK(channel, server->udp_socket, 0, 0);
-      ares__close_socket(channel, server->udp_socket);
-      server->udp_socket = ARES_SOCKET_BAD;
+      ares__list_table_remove(&(channel->conns_by_fd), &(conn->node_by_fd));
+      SOCK_STATE_CALLBACK(channel, conn->fd, 0, 0);
+      ares__close_socket(channel, conn->fd);
+      conn->fd = ARES_SOCKET_BAD;
     }
+  conn->total_queries = 0;
+}
+
+/* Close a retired socket once no query is waiting on it any more. */
+static void release_conn(ares_channel channel, struct server_connection *conn)
+{
+  if (channel->udp_max_queries > 0 &&
+      conn->total_queries >= channel->udp_max_queries &&
+      ares__is_list_empty(&(conn->queries_to_conn)))
+    ares__close_connection(channel, conn);
+}
+
+/* Hash a query id together with the UDP socket it is in flight on, or
+ * NULL, for channel->queries_by_qid and channel->hedges_by_qid.  The same
+ * id may be in flight on different sockets at once, so that a channel is
+ * not limited to 65536 queries in flight.
+ */
+unsigned int ares__qid_hash(const struct server_connection *conn,
+                            unsigned short qid)
+{
+  size_t addr = (size_t)conn;
+
+  return (unsigned int)((addr >> 4) * 2654435761U) ^ qid;
+}
+
+/* Put a query on the UDP socket it is being sent on, where the answer is
+ * to come in.
+ */
+void ares__attach_query_conn(ares_channel channel, struct query *query,
+                             struct server_connection *conn)
+{
+  query->conn = conn;
+  ares__insert_in_list(&(query->queries_to_conn), &(conn->queries_to_conn));
+  conn->total_queries++;
+  ares__list_table_move(&(channel->queries_by_qid), &(query->queries_by_qid),
+                        ares__qid_hash(conn, query->qid));
+}
+
+/* Likewise for the socket a hedged copy of the query goes out on. */
+void ares__attach_hedge_conn(ares_channel channel, struct query *query,
+                             struct server_connection *conn)
+{
+  query->hedge_conn = conn;
+  ares__insert_in_list(&(query->hedge_to_conn), &(conn->queries_to_conn));
+  conn->total_queries++;
+  ares__list_table_insert(&(channel->hedges_by_qid),
+                          &(query->hedges_by_qid),
+                          ares__qid_hash(conn, query->qid));
+}
+
+/* Take a query off the UDP socket it was last sent on.  Any answer that
+ * still comes in on that socket will be ignored.
+ */
+void ares__detach_query_conn(ares_channel channel, struct query *query)
+{
+  struct server_connection *conn = query->conn;
+
+  if (!conn)
+    return;
+
+  ares__remove_from_list(&(query->queries_to_conn));
+  ares__remove_from_list(&(query->udp_pending));
+  query->conn = NULL;
+  if (query->queries_by_qid.next)
+    ares__list_table_move(&(channel->queries_by_qid),
+                          &(query->queries_by_qid),
+                          ares__qid_hash(NULL, query->qid));
+  release_conn(channel, conn);
+}
+
+/* Likewise for the socket a hedged copy of the query went out on. */
+void ares__detach_hedge_conn(ares_channel channel, struct query *query)
+{
+  struct server_connection *conn = query->hedge_conn;
+
+  query->hedge_armed = 0;
+  if (!conn)
+    return;
+
+  ares__remove_from_list(&(query->hedge_to_conn));
+  ares__list_table_remove(&(channel->hedges_by_qid), &(query->hedges_by_qid));
+  query->hedge_conn = NULL;
+  release_conn(channel, conn);
 }
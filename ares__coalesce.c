@@ -0,0 +1,183 @@
+/* Copyright (C) 2019 by The c-ares project
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+#include "ares_setup.h"
+
+#ifdef HAVE_NETINET_IN_H
+#  include <netinet/in.h>
+#endif
+#ifdef HAVE_ARPA_NAMESER_H
+#  include <arpa/nameser.h>
+#else
+#  include "nameser.h"
+#endif
+#ifdef HAVE_ARPA_NAMESER_COMPAT_H
+#  include <arpa/nameser_compat.h>
+#endif
+
+#include "ares.h"
+#include "ares_dns.h"
+#include "ares_private.h"
+
+/* With ARES_FLAG_COALESCE, a request that is the same as one already in
+ * flight, all but the query id, is not sent again.  Its caller waits on the
+ * query in flight instead, and gets a copy of its answer, under its own
+ * query id.  Queries in flight are found by hashing their requests.
+ */
+
+struct query_waiter {
+  struct list_node node;
+  ares_callback callback;
+  void *arg;
+  unsigned short qid;
+};
+
+static unsigned int coalesce_hash(const unsigned char *qbuf, int qlen)
+{
+  unsigned int hash = 2166136261U;
+  int i;
+
+  /* Everything but the query id */
+  for (i = 2; i < qlen; i++)
+    {
+      hash ^= qbuf[i];
+      hash *= 16777619U;
+    }
+  return hash;
+}
+
+struct query *ares__coalesce_find(ares_channel channel,
+                                  const unsigned char *qbuf, int qlen)
+{
+  struct list_node *list_head;
+  struct list_node *list_node;
+  struct query *query;
+  unsigned int hash;
+
+  if (qlen < HFIXEDSZ)
+    return NULL;
+
+  hash = coalesce_hash(qbuf, qlen);
+  list_head = ares__list_table_bucket(&channel->queries_by_question, hash);
+  for (list_node = list_head->next; list_node != list_head;
+       list_node = list_node->next)
+    {
+      query = list_node->data;
+      if (query->question_hash == hash && query->qlen == qlen &&
+          memcmp(query->qbuf + 2, qbuf + 2, qlen - 2) == 0)
+        return query;
+    }
+  return NULL;
+}
+
+void ares__coalesce_insert(ares_channel channel, struct query *query)
+{
+  query->question_hash = coalesce_hash(query->qbuf, query->qlen);
+  ares__list_table_insert(&(channel->queries_by_question),
+                          &(query->queries_by_question), query->question_hash);
+}
+
+int ares__coalesce_attach(ares_channel channel, struct query *query,
+                          const unsigned char *qbuf,
+                          ares_callback callback, void *arg)
+{
+  struct query_waiter *waiter;
+
+  waiter = ares__pool_alloc(channel, sizeof(struct query_waiter));
+  if (!waiter)
+    return ARES_ENOMEM;
+  waiter->callback = callback;
+  waiter->arg = arg;
+  waiter->qid = DNS_HEADER_QID(qbuf);
+  ares__init_list_node(&(waiter->node), waiter);
+  /* At the tail, so that callers are called back in the order they came */
+  ares__insert_in_list(&(waiter->node), &(query->waiters));
+  return ARES_SUCCESS;
+}
+
+void ares__coalesce_free_waiters(ares_channel channel, struct query *query)
+{
+  struct query_waiter *waiter;
+
+  while (!ares__is_list_empty(&(query->waiters)))
+    {
+      waiter = query->waiters.next->data;
+      ares__remove_from_list(&(waiter->node));
+      ares__pool_free(channel, waiter);
+    }
+}
+
+/* Return the memory taken by the callers waiting on a query. */
+size_t ares__coalesce_memory(struct query *query)
+{
+  struct list_node *node;
+  size_t bytes = 0;
+
+  for (node = query->waiters.next; node != &(query->waiters);
+       node = node->next)
+    bytes += ares__pool_block_size(sizeof(struct query_waiter));
+  return bytes;
+}
+
+/* Call back the caller of a query that ended, and all who wait on it. */
+void ares__query_callback(ares_channel channel, struct query *query,
+                          int status, int timeouts,
+                          unsigned char *abuf, int alen)
+{
+  unsigned char stackbuf[MAXENDSSZ + 1];
+  unsigned char *buf;
+  struct query_waiter *waiter;
+  struct list_node waiters;
+
+  /* Callers asking the same question from here on need a query of their
+   * own, and the waiters are ours to call back, whatever the callbacks do
+   * to the query. */
+  ares__list_table_remove(&(channel->queries_by_question),
+                          &(query->queries_by_question));
+  ares__init_list_head(&waiters);
+  if (!ares__is_list_empty(&(query->waiters)))
+    {
+      waiters.next = query->waiters.next;
+      waiters.prev = query->waiters.prev;
+      waiters.next->prev = &waiters;
+      waiters.prev->next = &waiters;
+      ares__init_list_head(&(query->waiters));
+    }
+
+  query->callback(query->arg, status, timeouts, abuf, alen);
+
+  while (!ares__is_list_empty(&waiters))
+    {
+      waiter = waiters.next->data;
+      ares__remove_from_list(&(waiter->node));
+      if (!abuf)
+        waiter->callback(waiter->arg, status, timeouts, NULL, 0);
+      else
+        {
+          buf = (alen <= (int)sizeof(stackbuf)) ? stackbuf : ares_malloc(alen);
+          if (!buf)
+            waiter->callback(waiter->arg, ARES_ENOMEM, timeouts, NULL, 0);
+          else
+            {
+              memcpy(buf, abuf, alen);
+              DNS_HEADER_SET_QID(buf, waiter->qid);
+              waiter->callback(waiter->arg, status, timeouts, buf, alen);
+              if (buf != stackbuf)
+                ares_free(buf);
+            }
+        }
+      ares__pool_free(channel, waiter);
+    }
+}
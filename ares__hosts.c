@@ -0,0 +1,657 @@
+/* Copyright (C) 2019 by The c-ares project
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+#include "ares_setup.h"
+
+#ifdef HAVE_NETINET_IN_H
+#  include <netinet/in.h>
+#endif
+#ifdef HAVE_NETDB_H
+#  include <netdb.h>
+#endif
+
+#include "ares.h"
+#include "ares_platform.h"
+#include "ares_private.h"
+
+/* The hosts file, parsed once and indexed.  Each line of the file becomes
+ * a hostent, as ares__get_hostent() reads it, and every name and alias of
+ * a line as well as its address is hashed into a table pointing back at
+ * it, so that a lookup costs a stat() of the file and a hash probe rather
+ * than reading the whole file.  The channel keeps the last file it read;
+ * when stat() shows it changed, or a lookup names another file, it is read
+ * again.
+ */
+
+struct hosts_link {
+  unsigned int hash;
+  int entry;          /* index into entries */
+  const char *name;   /* the name hashed, or NULL for the address */
+  int next;           /* next link in the same bucket, or -1 */
+};
+
+struct ares_hosts {
+  char *path;
+  struct ares_filestamp stamp;
+  struct hostent **entries;   /* in file order */
+  int nentries;
+  struct hosts_link *links;
+  int nlinks;
+  int *name_buckets;
+  int *addr_buckets;
+  unsigned int mask;          /* number of buckets, less one */
+};
+
+static unsigned int hash_name(const char *name)
+{
+  unsigned int hash = 2166136261U;
+
+  while (*name)
+    {
+      hash ^= (unsigned char)TOLOWER(*name);
+      hash *= 16777619U;
+      name++;
+    }
+  return hash;
+}
+
+static unsigned int hash_addr(int family, const void *addr, size_t len)
+{
+  const unsigned char *p = addr;
+  unsigned int hash = 2166136261U ^ (unsigned int)family;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    {
+      hash ^= p[i];
+      hash *= 16777619U;
+    }
+  return hash;
+}
+
+void ares__hosts_destroy(struct ares_hosts *hosts)
+{
+  int i;
+
+  if (!hosts)
+    return;
+  for (i = 0; i < hosts->nentries; i++)
+    ares_free_hostent(hosts->entries[i]);
+  if (hosts->entries)
+    ares_free(hosts->entries);
+  if (hosts->links)
+    ares_free(hosts->links);
+  if (hosts->name_buckets)
+    ares_free(hosts->name_buckets);
+  if (hosts->addr_buckets)
+    ares_free(hosts->addr_buckets);
+  ares_free(hosts->path);
+  ares_free(hosts);
+}
+
+/* Return the memory held by the index and the entries it was built from. */
+size_t ares__hosts_memory(struct ares_hosts *hosts)
+{
+  struct hostent *ent;
+  size_t bytes;
+  char **alias;
+  int i;
+
+  if (!hosts)
+    return 0;
+
+  bytes = sizeof(struct ares_hosts) + strlen(hosts->path) + 1 +
+          hosts->nentries * sizeof(struct hostent *) +
+          hosts->nlinks * sizeof(struct hosts_link);
+  if (hosts->name_buckets)
+    bytes += 2 * (hosts->mask + 1) * sizeof(int);
+  for (i = 0; i < hosts->nentries; i++)
+    {
+      ent = hosts->entries[i];
+      bytes += sizeof(struct hostent) + strlen(ent->h_name) + 1 +
+               2 * sizeof(char *) + ent->h_length + sizeof(char *);
+      for (alias = ent->h_aliases; *alias; alias++)
+        bytes += sizeof(char *) + strlen(*alias) + 1;
+    }
+  return bytes;
+}
+
+/* Hash the names and addresses of all entries.  Links are pushed onto the
+ * front of their buckets working back from the end of the file, so each
+ * bucket lists its entries in file order.
+ */
+static int hosts_index(struct ares_hosts *hosts)
+{
+  struct hostent *ent;
+  struct hosts_link *link;
+  unsigned int nbuckets = 16;
+  int nlinks = 0;
+  int i, j;
+  char **alias;
+
+  for (i = 0; i < hosts->nentries; i++)
+    {
+      nlinks += 2;
+      for (alias = hosts->entries[i]->h_aliases; *alias; alias++)
+        nlinks++;
+    }
+  while (nbuckets < (unsigned int)nlinks)
+    nbuckets <<= 1;
+
+  hosts->links = ares_malloc(nlinks * sizeof(struct hosts_link) + 1);
+  hosts->name_buckets = ares_malloc(nbuckets * sizeof(int));
+  hosts->addr_buckets = ares_malloc(nbuckets * sizeof(int));
+  if (!hosts->links || !hosts->name_buckets || !hosts->addr_buckets)
+    return ARES_ENOMEM;
+  hosts->mask = nbuckets - 1;
+  for (j = 0; j < (int)nbuckets; j++)
+    {
+      hosts->name_buckets[j] = -1;
+      hosts->addr_buckets[j] = -1;
+    }
+
+  for (i = hosts->nentries - 1; i >= 0; i--)
+    {
+      ent = hosts->entries[i];
+
+      link = &hosts->links[hosts->nlinks];
+      link->hash = hash_addr(ent->h_addrtype, ent->h_addr_list[0],
+                             ent->h_length);
+      link->entry = i;
+      link->name = NULL;
+      link->next = hosts->addr_buckets[link->hash & hosts->mask];
+      hosts->addr_buckets[link->hash & hosts->mask] = hosts->nlinks++;
+
+      /* Aliases first, so that the official name ends up in front. */
+      for (alias = ent->h_aliases; *alias; alias++)
+        ;
+      while (alias-- > ent->h_aliases)
+        {
+          link = &hosts->links[hosts->nlinks];
+          link->hash = hash_name(*alias);
+          link->entry = i;
+          link->name = *alias;
+          link->next = hosts->name_buckets[link->hash & hosts->mask];
+          hosts->name_buckets[link->hash & hosts->mask] = hosts->nlinks++;
+        }
+      link = &hosts->links[hosts->nlinks];
+      link->hash = hash_name(ent->h_name);
+      link->entry = i;
+      link->name = ent->h_name;
+      link->next = hosts->name_buckets[link->hash & hosts->mask];
+      hosts->name_buckets[link->hash & hosts->mask] = hosts->nlinks++;
+    }
+  return ARES_SUCCESS;
+}
+
+/* Read and index the hosts file at path. */
+static int hosts_load(const char *path, struct ares_hosts **hostsp)
+{
+  struct ares_hosts *hosts;
+  struct hostent *host;
+  struct hostent **entries;
+  int alloc = 0;
+  int status;
+  int error;
+  FILE *fp;
+
+  hosts = ares_malloc(sizeof(struct ares_hosts));
+  if (!hosts)
+    return ARES_ENOMEM;
+  memset(hosts, 0, sizeof(struct ares_hosts));
+  hosts->path = ares_strdup(path);
+  if (!hosts->path)
+    {
+      ares_free(hosts);
+      return ARES_ENOMEM;
+    }
+
+  /* Stamp the file before reading it, so that a change made while we
+     read is noticed next time. */
+  ares__filestamp_update(path, &hosts->stamp);
+
+  fp = fopen(path, "r");
+  if (!fp)
+    {
+      error = ERRNO;
+      switch(error)
+        {
+        case ENOENT:
+        case ESRCH:
+          /* No file is just an empty index. */
+          break;
+        default:
+          DEBUGF(fprintf(stderr, "fopen() failed with error: %d %s\n",
+                         error, strerror(error)));
+          DEBUGF(fprintf(stderr, "Error opening file: %s\n", path));
+          ares__hosts_destroy(hosts);
+          return ARES_EFILE;
+        }
+    }
+  else
+    {
+      while ((status = ares__get_hostent(fp, AF_UNSPEC, &host)) ==
+             ARES_SUCCESS)
+        {
+          if (hosts->nentries == alloc)
+            {
+              alloc = alloc ? alloc * 2 : 64;
+              entries = ares_realloc(hosts->entries,
+                                     alloc * sizeof(struct hostent *));
+              if (!entries)
+                {
+                  ares_free_hostent(host);
+                  status = ARES_ENOMEM;
+                  break;
+                }
+              hosts->entries = entries;
+            }
+          hosts->entries[hosts->nentries++] = host;
+        }
+      fclose(fp);
+      if (status != ARES_EOF)
+        {
+          ares__hosts_destroy(hosts);
+          return status;
+        }
+    }
+
+  status = hosts_index(hosts);
+  if (status != ARES_SUCCESS)
+    {
+      ares__hosts_destroy(hosts);
+      return status;
+    }
+  *hostsp = hosts;
+  return ARES_SUCCESS;
+}
+
+/* Find the hosts file to use: path if given, else the system's. */
+static const char *hosts_path(const char *path, char *buf, size_t buflen)
+{
+#ifdef WIN32
+  win_platform platform;
+#endif
+
+  if (path)
+    return path;
+
+#ifdef WIN32
+  buf[0] = '\0';
+
+  platform = ares__getplatform();
+
+  if (platform == WIN_NT) {
+    char tmp[MAX_PATH];
+    HKEY hkeyHosts;
+
+    if (RegOpenKeyExA(HKEY_LOCAL_MACHINE, WIN_NS_NT_KEY, 0, KEY_READ,
+                     &hkeyHosts) == ERROR_SUCCESS)
+    {
+      DWORD dwLength = MAX_PATH;
+      RegQueryValueExA(hkeyHosts, DATABASEPATH, NULL, NULL, (LPBYTE)tmp,
+                      &dwLength);
+      ExpandEnvironmentStringsA(tmp, buf, (DWORD)buflen);
+      RegCloseKey(hkeyHosts);
+    }
+  }
+  else if (platform == WIN_9X)
+    GetWindowsDirectoryA(buf, (UINT)buflen);
+  else
+    return NULL;
+
+  if (strlen(buf) + strlen(WIN_PATH_HOSTS) >= buflen)
+    return NULL;
+  strcat(buf, WIN_PATH_HOSTS);
+  return buf;
+
+#elif defined(WATT32)
+  {
+    extern const char *_w32_GetHostsFile (void);
+    (void)buf;
+    (void)buflen;
+    return _w32_GetHostsFile();
+  }
+#else
+  (void)buf;
+  (void)buflen;
+  return PATH_HOSTS;
+#endif
+}
+
+/* Get the index of the hosts file at path (or the system's, if NULL),
+ * reading the file if we have not yet or it changed since.
+ */
+static int hosts_get(ares_channel channel, const char *path,
+                     struct ares_hosts **hostsp)
+{
+#ifdef WIN32
+  char buf[MAX_PATH];
+#else
+  char buf[1];
+#endif
+  struct ares_hosts *hosts = channel->hosts;
+  struct ares_filestamp stamp;
+  int status;
+
+  path = hosts_path(path, buf, sizeof(buf));
+  if (!path)
+    return ARES_ENOTFOUND;
+
+  if (hosts && strcmp(hosts->path, path) == 0)
+    {
+      stamp = hosts->stamp;
+      if (!ares__filestamp_update(path, &stamp))
+        {
+          *hostsp = hosts;
+          return ARES_SUCCESS;
+        }
+    }
+
+  status = hosts_load(path, &hosts);
+  if (status != ARES_SUCCESS)
+    return status;
+  ares__hosts_destroy(channel->hosts);
+  channel->hosts = hosts;
+  *hostsp = hosts;
+  return ARES_SUCCESS;
+}
+
+/* Make a copy of an entry that ares_free_hostent() can free. */
+static int copy_hostent(const struct hostent *ent, struct hostent **host)
+{
+  struct hostent *copy;
+  int naliases = 0;
+  int i;
+
+  *host = NULL;
+  while (ent->h_aliases[naliases])
+    naliases++;
+
+  copy = ares_malloc(sizeof(struct hostent));
+  if (!copy)
+    return ARES_ENOMEM;
+  copy->h_addrtype = ent->h_addrtype;
+  copy->h_length = ent->h_length;
+  copy->h_name = ares_strdup(ent->h_name);
+  copy->h_aliases = ares_malloc((naliases + 1) * sizeof(char *));
+  copy->h_addr_list = ares_malloc(2 * sizeof(char *));
+  if (copy->h_addr_list)
+    {
+      copy->h_addr_list[0] = ares_malloc(ent->h_length);
+      copy->h_addr_list[1] = NULL;
+    }
+  if (copy->h_aliases)
+    {
+      for (i = 0; i < naliases; i++)
+        {
+          copy->h_aliases[i] = ares_strdup(ent->h_aliases[i]);
+          if (!copy->h_aliases[i])
+            break;
+        }
+      copy->h_aliases[i] = NULL;
+    }
+  if (!copy->h_name || !copy->h_aliases || !copy->h_addr_list ||
+      !copy->h_addr_list[0] || i < naliases)
+    {
+      if (copy->h_name)
+        ares_free(copy->h_name);
+      if (copy->h_aliases)
+        {
+          for (i = 0; copy->h_aliases[i]; i++)
+            ares_free(copy->h_aliases[i]);
+          ares_free(copy->h_aliases);
+        }
+      if (copy->h_addr_list)
+        {
+          if (copy->h_addr_list[0])
+            ares_free(copy->h_addr_list[0]);
+          ares_free(copy->h_addr_list);
+        }
+      ares_free(copy);
+      return ARES_ENOMEM;
+    }
+  memcpy(copy->h_addr_list[0], ent->h_addr_list[0], ent->h_length);
+  *host = copy;
+  return ARES_SUCCESS;
+}
+
+/* Step through the entries carrying name, in file order, each once.  Start
+ * with *link set to -1; returns the next entry or NULL.
+ */
+static struct hostent *next_by_name(struct ares_hosts *hosts, const char *name,
+                                    unsigned int hash, int *link)
+{
+  int last = (*link == -1) ? -1 : hosts->links[*link].entry;
+  int i = (*link == -1) ? hosts->name_buckets[hash & hosts->mask] :
+                          hosts->links[*link].next;
+
+  for (; i != -1; i = hosts->links[i].next)
+    {
+      if (hosts->links[i].hash == hash && hosts->links[i].entry != last &&
+          strcasecmp(hosts->links[i].name, name) == 0)
+        {
+          *link = i;
+          return hosts->entries[hosts->links[i].entry];
+        }
+    }
+  return NULL;
+}
+
+/* Find the first line of the hosts file naming name with an address of the
+ * given family (or any, for AF_UNSPEC). */
+int ares__hosts_lookup_name(ares_channel channel, const char *name,
+                            int family, struct hostent **host)
+{
+  struct ares_hosts *hosts;
+  struct hostent *ent;
+  unsigned int hash;
+  int link = -1;
+  int status;
+
+  *host = NULL;
+  if (family != AF_INET && family != AF_INET6 && family != AF_UNSPEC)
+    return ARES_EBADFAMILY;
+  status = hosts_get(channel, NULL, &hosts);
+  if (status != ARES_SUCCESS)
+    return status;
+
+  hash = hash_name(name);
+  while ((ent = next_by_name(hosts, name, hash, &link)) != NULL)
+    {
+      if (family == AF_UNSPEC || ent->h_addrtype == family)
+        return copy_hostent(ent, host);
+    }
+  return ARES_ENOTFOUND;
+}
+
+/* Hand the address of every line of the hosts file at path (or the
+ * system's, if NULL) naming name, of the given family (or any, for
+ * AF_UNSPEC), to callback in file order, without copying the
+ * entries.  Stops at the first failure callback returns. */
+int ares__hosts_addrs(ares_channel channel, const char *path,
+                      const char *name, int family,
+                      int (*callback)(void *arg, int family, const void *addr),
+                      void *arg)
+{
+  struct ares_hosts *hosts;
+  struct hostent *ent;
+  unsigned int hash;
+  int link = -1;
+  int found = 0;
+  int status;
+
+  status = hosts_get(channel, path, &hosts);
+  if (status != ARES_SUCCESS)
+    return status;
+
+  hash = hash_name(name);
+  while ((ent = next_by_name(hosts, name, hash, &link)) != NULL)
+    {
+      if (family != AF_UNSPEC && ent->h_addrtype != family)
+        continue;
+      status = callback(arg, ent->h_addrtype, ent->h_addr_list[0]);
+      if (status != ARES_SUCCESS)
+        return status;
+      found = 1;
+    }
+  return found ? ARES_SUCCESS : ARES_ENOTFOUND;
+}
+
+/* Find the first line of the hosts file for the address addr. */
+int ares__hosts_lookup_addr(ares_channel channel,
+                            const struct ares_addr *addr,
+                            struct hostent **host)
+{
+  struct ares_hosts *hosts;
+  struct hostent *ent;
+  const void *bytes;
+  size_t len;
+  unsigned int hash;
+  int status;
+  int i;
+
+  *host = NULL;
+  status = hosts_get(channel, NULL, &hosts);
+  if (status != ARES_SUCCESS)
+    return status;
+
+  if (addr->family == AF_INET)
+    {
+      bytes = &addr->addrV4;
+      len = sizeof(addr->addrV4);
+    }
+  else
+    {
+      bytes = &addr->addrV6;
+      len = sizeof(addr->addrV6);
+    }
+  hash = hash_addr(addr->family, bytes, len);
+  for (i = hosts->addr_buckets[hash & hosts->mask]; i != -1;
+       i = hosts->links[i].next)
+    {
+      ent = hosts->entries[hosts->links[i].entry];
+      if (hosts->links[i].hash == hash && ent->h_addrtype == addr->family &&
+          memcmp(ent->h_addr_list[0], bytes, len) == 0)
+        return copy_hostent(ent, host);
+    }
+  return ARES_ENOTFOUND;
+}
+
+#define MAX_ALIASES 40
+
+/* Add the addresses of every line of the hosts file at path (or the
+ * system's, if NULL) naming name to ai, as ares__readaddrinfo() does.
+ */
+int ares__hosts_addrinfo(ares_channel channel, const char *path,
+                         const char *name, unsigned short port,
+                         const struct ares_addrinfo_hints *hints,
+                         struct ares_addrinfo *ai)
+{
+  struct ares_hosts *hosts;
+  struct hostent *ent;
+  struct ares_addrinfo_cname *cname, *cnames = NULL;
+  struct ares_addrinfo_node *node, *nodes = NULL;
+  struct sockaddr_in *sin;
+  struct sockaddr_in6 *sin6;
+  unsigned int hash;
+  int link = -1;
+  int found = 0;
+  int status;
+  int i;
+
+  switch (hints->ai_family) {
+    case AF_INET:
+    case AF_INET6:
+    case AF_UNSPEC:
+      break;
+    default:
+      return ARES_EBADFAMILY;
+  }
+  status = hosts_get(channel, path, &hosts);
+  if (status != ARES_SUCCESS)
+    return status;
+
+  hash = hash_name(name);
+  while ((ent = next_by_name(hosts, name, hash, &link)) != NULL)
+    {
+      if (hints->ai_family != AF_UNSPEC && ent->h_addrtype != hints->ai_family)
+        continue;
+
+      node = ares__append_addrinfo_node(&nodes);
+      if (!node)
+        goto enomem;
+      node->ai_family = ent->h_addrtype;
+      if (ent->h_addrtype == AF_INET)
+        {
+          node->ai_addrlen = sizeof(struct sockaddr_in);
+          sin = ares_malloc(sizeof(struct sockaddr_in));
+          if (!sin)
+            goto enomem;
+          memset(sin, 0, sizeof(struct sockaddr_in));
+          sin->sin_family = AF_INET;
+          sin->sin_port = htons(port);
+          memcpy(&sin->sin_addr, ent->h_addr_list[0], sizeof(sin->sin_addr));
+          node->ai_addr = (struct sockaddr *)sin;
+        }
+      else
+        {
+          node->ai_addrlen = sizeof(struct sockaddr_in6);
+          sin6 = ares_malloc(sizeof(struct sockaddr_in6));
+          if (!sin6)
+            goto enomem;
+          memset(sin6, 0, sizeof(struct sockaddr_in6));
+          sin6->sin6_family = AF_INET6;
+          sin6->sin6_port = htons(port);
+          memcpy(&sin6->sin6_addr, ent->h_addr_list[0],
+                 sizeof(sin6->sin6_addr));
+          node->ai_addr = (struct sockaddr *)sin6;
+        }
+      found = 1;
+
+      if (hints->ai_flags & ARES_AI_CANONNAME)
+        {
+          for (i = 0; ent->h_aliases[i] && i < MAX_ALIASES; i++)
+            {
+              cname = ares__append_addrinfo_cname(&cnames);
+              if (!cname)
+                goto enomem;
+              cname->alias = ares_strdup(ent->h_aliases[i]);
+              cname->name = ares_strdup(ent->h_name);
+              if (!cname->alias || !cname->name)
+                goto enomem;
+            }
+          /* No aliases, cname only. */
+          if (i == 0)
+            {
+              cname = ares__append_addrinfo_cname(&cnames);
+              if (!cname)
+                goto enomem;
+              cname->name = ares_strdup(ent->h_name);
+              if (!cname->name)
+                goto enomem;
+            }
+        }
+    }
+
+  ares__addrinfo_cat_cnames(&ai->cnames, cnames);
+  ares__addrinfo_cat_nodes(&ai->nodes, nodes);
+  return found ? ARES_SUCCESS : ARES_ENOTFOUND;
+
+enomem:
+  ares__freeaddrinfo_cnames(cnames);
+  ares__freeaddrinfo_nodes(nodes);
+  return ARES_ENOMEM;
+}
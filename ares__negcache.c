@@ -0,0 +1,267 @@
+/* Copyright (C) 2019 by The c-ares project
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+#include "ares_setup.h"
+
+#ifdef HAVE_NETINET_IN_H
+#  include <netinet/in.h>
+#endif
+#ifdef HAVE_ARPA_NAMESER_H
+#  include <arpa/nameser.h>
+#else
+#  include "nameser.h"
+#endif
+#ifdef HAVE_ARPA_NAMESER_COMPAT_H
+#  include <arpa/nameser_compat.h>
+#endif
+
+#include "ares.h"
+#include "ares_dns.h"
+#include "ares_private.h"
+
+/* The negative cache remembers which of the names tried by ares_search()
+ * do not exist, so that the search can skip them rather than ask again.
+ * Unlike the answer cache it keeps no messages: an entry is the name,
+ * lower-cased and without a trailing dot, with the class and type asked
+ * for and the time the denial expires, taken from the SOA record of the
+ * NXDOMAIN answer as RFC 2308 has it.
+ */
+
+struct negcache_entry {
+  /* Links into the hash bucket and the least-recently-used list */
+  struct list_node node_by_key;
+  struct list_node node_by_use;
+
+  unsigned int hash;
+  time_t expire_time;
+  int dnsclass;
+  int type;
+
+  /* Lives in the same allocation as the entry itself */
+  char *name;
+};
+
+struct ares_negcache {
+  struct list_node *buckets;
+  unsigned int nbuckets;   /* always a power of two */
+  /* Most recently used entry first */
+  struct list_node by_use;
+  int nentries;
+  int max_entries;
+  unsigned int max_ttl;
+};
+
+/* Length of name without any trailing dot */
+static size_t negcache_namelen(const char *name)
+{
+  size_t len = strlen(name);
+
+  if (len > 0 && name[len - 1] == '.')
+    len--;
+  return len;
+}
+
+static unsigned int negcache_hash(const char *name, size_t len,
+                                  int dnsclass, int type)
+{
+  unsigned int hash = 2166136261U;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    {
+      hash ^= (unsigned char)TOLOWER(name[i]);
+      hash *= 16777619U;
+    }
+  hash ^= (unsigned int)type;
+  hash *= 16777619U;
+  hash ^= (unsigned int)dnsclass;
+  hash *= 16777619U;
+  return hash;
+}
+
+static void negcache_remove(struct ares_negcache *cache,
+                            struct negcache_entry *entry)
+{
+  ares__remove_from_list(&entry->node_by_key);
+  ares__remove_from_list(&entry->node_by_use);
+  cache->nentries--;
+  ares_free(entry);
+}
+
+static struct negcache_entry *negcache_find(struct ares_negcache *cache,
+                                            const char *name, size_t len,
+                                            int dnsclass, int type,
+                                            unsigned int hash)
+{
+  struct list_node *list_head;
+  struct list_node *list_node;
+
+  list_head = &cache->buckets[hash & (cache->nbuckets - 1)];
+  for (list_node = list_head->next; list_node != list_head;
+       list_node = list_node->next)
+    {
+      struct negcache_entry *entry = list_node->data;
+      if (entry->hash == hash && entry->type == type &&
+          entry->dnsclass == dnsclass && strlen(entry->name) == len &&
+          strncasecmp(entry->name, name, len) == 0)
+        return entry;
+    }
+  return NULL;
+}
+
+int ares__negcache_create(ares_channel channel)
+{
+  struct ares_negcache *cache;
+  unsigned int i;
+
+  cache = ares_malloc(sizeof(struct ares_negcache));
+  if (!cache)
+    return ARES_ENOMEM;
+
+  /* Aim for an average bucket length of at most one */
+  cache->nbuckets = 16;
+  while (cache->nbuckets < (unsigned int)channel->negcache_max_entries &&
+         cache->nbuckets < 65536)
+    cache->nbuckets <<= 1;
+
+  cache->buckets = ares_malloc(cache->nbuckets * sizeof(struct list_node));
+  if (!cache->buckets)
+    {
+      ares_free(cache);
+      return ARES_ENOMEM;
+    }
+  for (i = 0; i < cache->nbuckets; i++)
+    ares__init_list_head(&cache->buckets[i]);
+  ares__init_list_head(&cache->by_use);
+  cache->nentries = 0;
+  cache->max_entries = channel->negcache_max_entries;
+  cache->max_ttl = channel->negcache_max_ttl;
+
+  channel->negcache = cache;
+  return ARES_SUCCESS;
+}
+
+void ares__negcache_flush(struct ares_negcache *cache)
+{
+  if (!cache)
+    return;
+
+  while (!ares__is_list_empty(&cache->by_use))
+    negcache_remove(cache, cache->by_use.next->data);
+}
+
+void ares__negcache_destroy(struct ares_negcache *cache)
+{
+  if (!cache)
+    return;
+
+  ares__negcache_flush(cache);
+  ares_free(cache->buckets);
+  ares_free(cache);
+}
+
+/* Return the memory held by the cache and its entries. */
+size_t ares__negcache_memory(struct ares_negcache *cache)
+{
+  struct list_node *list_node;
+  struct negcache_entry *entry;
+  size_t bytes;
+
+  if (!cache)
+    return 0;
+
+  bytes = sizeof(struct ares_negcache) +
+          cache->nbuckets * sizeof(struct list_node);
+  for (list_node = cache->by_use.next; list_node != &cache->by_use;
+       list_node = list_node->next)
+    {
+      entry = list_node->data;
+      bytes += sizeof(struct negcache_entry) + strlen(entry->name) + 1;
+    }
+  return bytes;
+}
+
+void ares__negcache_insert(struct ares_negcache *cache, const char *name,
+                           int dnsclass, int type,
+                           const unsigned char *abuf, int alen,
+                           struct timeval *now)
+{
+  struct negcache_entry *entry;
+  unsigned int hash, ttl;
+  size_t len, i;
+
+  if (alen < HFIXEDSZ || DNS_HEADER_RCODE(abuf) != NXDOMAIN)
+    return;
+
+  ttl = ares__answer_ttl(abuf, alen);
+  if (ttl > cache->max_ttl)
+    ttl = cache->max_ttl;
+  if (ttl == 0)
+    return;
+
+  len = negcache_namelen(name);
+  hash = negcache_hash(name, len, dnsclass, type);
+  entry = negcache_find(cache, name, len, dnsclass, type, hash);
+  if (entry)
+    negcache_remove(cache, entry);
+
+  /* Make room by evicting the least recently used entry */
+  if (cache->nentries >= cache->max_entries)
+    negcache_remove(cache, cache->by_use.prev->data);
+
+  entry = ares_malloc(sizeof(struct negcache_entry) + len + 1);
+  if (!entry)
+    return;
+
+  entry->name = (char *)(entry + 1);
+  for (i = 0; i < len; i++)
+    entry->name[i] = (char)TOLOWER(name[i]);
+  entry->name[len] = '\0';
+  entry->hash = hash;
+  entry->dnsclass = dnsclass;
+  entry->type = type;
+  entry->expire_time = now->tv_sec + (time_t)ttl;
+
+  ares__init_list_node(&entry->node_by_key, entry);
+  ares__init_list_node(&entry->node_by_use, entry);
+  ares__insert_in_list(&entry->node_by_key,
+                       &cache->buckets[hash & (cache->nbuckets - 1)]);
+  ares__insert_in_list(&entry->node_by_use, cache->by_use.next);
+  cache->nentries++;
+}
+
+int ares__negcache_fetch(struct ares_negcache *cache, const char *name,
+                         int dnsclass, int type, struct timeval *now)
+{
+  struct negcache_entry *entry;
+  size_t len;
+
+  len = negcache_namelen(name);
+  entry = negcache_find(cache, name, len, dnsclass, type,
+                        negcache_hash(name, len, dnsclass, type));
+  if (!entry)
+    return 0;
+
+  if (entry->expire_time <= now->tv_sec)
+    {
+      negcache_remove(cache, entry);
+      return 0;
+    }
+
+  /* Mark as most recently used */
+  ares__remove_from_list(&entry->node_by_use);
+  ares__insert_in_list(&entry->node_by_use, cache->by_use.next);
+  return 1;
+}
@@ -0,0 +1,130 @@
+/* Copyright (C) 2019 by The c-ares project
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+#include "ares_setup.h"
+
+#include "ares.h"
+#include "ares_private.h"
+
+/* Memory for the short-lived objects of a query (the query itself, its
+ * packet buffers, send requests and so on) comes from per-channel free
+ * lists, one per size class, so that a busy channel recycles blocks
+ * instead of calling malloc and free for each query.  Each block starts
+ * with a header naming its size class, so blocks are freed without the
+ * caller having to remember their size.  Up to channel->pool_max_free
+ * blocks are kept per class; the rest go back to ares_free().
+ */
+
+union pool_block {
+  union pool_block *next; /* while on a free list */
+  int size_class;         /* while handed out; -1 for oversized blocks */
+  /* keep the memory that follows suitably aligned for any use */
+  double align_d;
+  void *align_p;
+  long align_l;
+};
+
+static const size_t pool_sizes[ARES_NPOOLS] = { 64, 256, 512, 1280, 4096 };
+
+void *ares__pool_alloc(ares_channel channel, size_t size)
+{
+  union pool_block *block;
+  int i;
+
+  for (i = 0; i < ARES_NPOOLS; i++)
+    if (size <= pool_sizes[i])
+      break;
+
+  if (i < ARES_NPOOLS && channel->pools[i].head)
+    {
+      block = channel->pools[i].head;
+      channel->pools[i].head = block->next;
+      channel->pools[i].nfree--;
+      channel->stats[ARES_STAT_POOL_HITS]++;
+    }
+  else
+    {
+      block = ares_malloc(sizeof(union pool_block) +
+                          (i < ARES_NPOOLS ? pool_sizes[i] : size));
+      if (!block)
+        return NULL;
+      channel->stats[ARES_STAT_POOL_MISSES]++;
+    }
+
+  block->size_class = (i < ARES_NPOOLS) ? i : -1;
+  return block + 1;
+}
+
+void ares__pool_free(ares_channel channel, void *ptr)
+{
+  union pool_block *block;
+  int i;
+
+  if (!ptr)
+    return;
+
+  block = (union pool_block *)ptr - 1;
+  i = block->size_class;
+  if (i < 0 || channel->pools[i].nfree >= channel->pool_max_free)
+    {
+      ares_free(block);
+      return;
+    }
+
+  block->next = channel->pools[i].head;
+  channel->pools[i].head = block;
+  channel->pools[i].nfree++;
+}
+
+/* Return the memory a block handed out for size bytes really takes. */
+size_t ares__pool_block_size(size_t size)
+{
+  int i;
+
+  for (i = 0; i < ARES_NPOOLS; i++)
+    if (size <= pool_sizes[i])
+      return sizeof(union pool_block) + pool_sizes[i];
+  return sizeof(union pool_block) + size;
+}
+
+/* Return the memory held by the blocks kept on the channel's free lists. */
+size_t ares__pool_memory(ares_channel channel)
+{
+  size_t bytes = 0;
+  int i;
+
+  for (i = 0; i < ARES_NPOOLS; i++)
+    bytes += channel->pools[i].nfree *
+             (sizeof(union pool_block) + pool_sizes[i]);
+  return bytes;
+}
+
+/* Release every block kept on the channel's free lists. */
+void ares__pool_destroy(ares_channel channel)
+{
+  union pool_block *block;
+  int i;
+
+  for (i = 0; i < ARES_NPOOLS; i++)
+    {
+      while (channel->pools[i].head)
+        {
+          block = channel->pools[i].head;
+          channel->pools[i].head = block->next;
+          ares_free(block);
+        }
+      channel->pools[i].nfree = 0;
+    }
+}
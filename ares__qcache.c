@@ -0,0 +1,430 @@
+/* Copyright (C) 2019 by The c-ares project
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+#include "ares_setup.h"
+
+#ifdef HAVE_NETINET_IN_H
+#  include <netinet/in.h>
+#endif
+#ifdef HAVE_ARPA_NAMESER_H
+#  include <arpa/nameser.h>
+#else
+#  include "nameser.h"
+#endif
+#ifdef HAVE_ARPA_NAMESER_COMPAT_H
+#  include <arpa/nameser_compat.h>
+#endif
+
+#include "ares.h"
+#include "ares_dns.h"
+#include "ares_private.h"
+
+/* The cache key is the lower-cased, uncompressed question section of the
+ * request (name, type and class) preceded by one byte holding the request
+ * flags that can change the answer a server gives us.
+ */
+#define QCACHE_KEY_MAX      (1 + MAXCDNAME + 1 + QFIXEDSZ)
+#define QCACHE_KEY_RD       0x01
+#define QCACHE_KEY_CD       0x02
+#define QCACHE_KEY_EDNS     0x04
+
+struct qcache_entry {
+  /* Links into the hash bucket and the least-recently-used list */
+  struct list_node node_by_key;
+  struct list_node node_by_use;
+
+  unsigned int hash;
+  time_t insert_time;
+  time_t expire_time;
+
+  /* Both buffers live in the same allocation as the entry itself */
+  unsigned char *key;
+  int keylen;
+  unsigned char *abuf;
+  int alen;
+};
+
+struct ares_qcache {
+  struct list_node *buckets;
+  unsigned int nbuckets;   /* always a power of two */
+  /* Most recently used entry first */
+  struct list_node by_use;
+  int nentries;
+  int max_entries;
+  unsigned int max_ttl;
+};
+
+/* Build the cache key for the request in qbuf. Returns the key length, or 0
+ * if the request is not something we are willing to cache.
+ */
+static int qcache_key(const unsigned char *qbuf, int qlen, unsigned char *key)
+{
+  const unsigned char *p;
+  int keylen = 1;
+  int len;
+
+  if (qlen < HFIXEDSZ || DNS_HEADER_QDCOUNT(qbuf) != 1 ||
+      DNS_HEADER_OPCODE(qbuf) != QUERY)
+    return 0;
+
+  key[0] = 0;
+  if (DNS_HEADER_RD(qbuf))
+    key[0] |= QCACHE_KEY_RD;
+  if (qbuf[3] & 0x10)
+    key[0] |= QCACHE_KEY_CD;
+  if (DNS_HEADER_ARCOUNT(qbuf))
+    key[0] |= QCACHE_KEY_EDNS;
+
+  p = qbuf + HFIXEDSZ;
+  for (;;)
+    {
+      if (p >= qbuf + qlen)
+        return 0;
+      len = *p;
+      /* Requests we generate never use compression; don't bother with those
+       * that do. */
+      if (len & INDIR_MASK)
+        return 0;
+      if (p + 1 + len > qbuf + qlen || keylen + 1 + len > QCACHE_KEY_MAX)
+        return 0;
+      key[keylen++] = (unsigned char)len;
+      p++;
+      if (len == 0)
+        break;
+      while (len--)
+        {
+          key[keylen++] = (unsigned char)TOLOWER(*p);
+          p++;
+        }
+    }
+
+  if (p + QFIXEDSZ > qbuf + qlen || keylen + QFIXEDSZ > QCACHE_KEY_MAX)
+    return 0;
+  memcpy(key + keylen, p, QFIXEDSZ);
+  return keylen + QFIXEDSZ;
+}
+
+/* FNV-1a */
+static unsigned int qcache_hash(const unsigned char *key, int keylen)
+{
+  unsigned int hash = 2166136261U;
+  int i;
+
+  for (i = 0; i < keylen; i++)
+    {
+      hash ^= key[i];
+      hash *= 16777619U;
+    }
+  return hash;
+}
+
+/* Skip over a (possibly compressed) domain name. Returns a pointer to the
+ * first byte after the name, or NULL if it runs off the end of the message.
+ */
+static const unsigned char *qcache_skip_name(const unsigned char *p,
+                                             const unsigned char *abuf,
+                                             int alen)
+{
+  while (p < abuf + alen)
+    {
+      if ((*p & INDIR_MASK) == INDIR_MASK)
+        return (p + 2 <= abuf + alen) ? p + 2 : NULL;
+      if (*p == 0)
+        return p + 1;
+      p += *p + 1;
+    }
+  return NULL;
+}
+
+/* Walk all resource records of an answer. If delta is zero, compute the TTL
+ * for which the answer may be cached and return it; 0 means "don't cache".
+ * Otherwise subtract delta seconds from every TTL in the (writable) packet.
+ */
+static unsigned int qcache_ttls(unsigned char *abuf, int alen,
+                                unsigned int delta)
+{
+  const unsigned char *p;
+  unsigned int ttl = 0xffffffffU;
+  unsigned int soa_ttl = 0;
+  unsigned int rrttl, minimum;
+  int i, nrr, type, rdlen;
+  int ancount = DNS_HEADER_ANCOUNT(abuf);
+  int nscount = DNS_HEADER_NSCOUNT(abuf);
+  int rcode = DNS_HEADER_RCODE(abuf);
+
+  p = qcache_skip_name(abuf + HFIXEDSZ, abuf, alen);
+  if (!p || p + QFIXEDSZ > abuf + alen)
+    return 0;
+  p += QFIXEDSZ;
+
+  nrr = ancount + nscount + DNS_HEADER_ARCOUNT(abuf);
+  for (i = 0; i < nrr; i++)
+    {
+      p = qcache_skip_name(p, abuf, alen);
+      if (!p || p + RRFIXEDSZ > abuf + alen)
+        return 0;
+      type = DNS_RR_TYPE(p);
+      rrttl = DNS_RR_TTL(p);
+      rdlen = DNS_RR_LEN(p);
+      if (p + RRFIXEDSZ + rdlen > abuf + alen)
+        return 0;
+
+      /* The OPT pseudo-RR uses the TTL field for flags */
+      if (type != T_OPT)
+        {
+          if (delta)
+            {
+              DNS_RR_SET_TTL((unsigned char *)p,
+                             rrttl > delta ? rrttl - delta : 0);
+            }
+          else
+            {
+              if (rrttl < ttl)
+                ttl = rrttl;
+              /* RFC 2308: negative answers are cached for the lesser of the
+               * SOA's own TTL and its MINIMUM field. */
+              if (type == T_SOA && i >= ancount && i < ancount + nscount &&
+                  rdlen >= 20)
+                {
+                  minimum = DNS__32BIT(p + RRFIXEDSZ + rdlen - 4);
+                  soa_ttl = (rrttl < minimum) ? rrttl : minimum;
+                }
+            }
+        }
+      p += RRFIXEDSZ + rdlen;
+    }
+
+  if (delta)
+    return 0;
+
+  if (rcode == NXDOMAIN || ancount == 0)
+    return soa_ttl;
+
+  return (ttl == 0xffffffffU) ? 0 : ttl;
+}
+
+/* How long the answer in abuf may be cached for, by its TTLs; 0 if not. */
+unsigned int ares__answer_ttl(const unsigned char *abuf, int alen)
+{
+  if (alen < HFIXEDSZ)
+    return 0;
+  return qcache_ttls((unsigned char *)abuf, alen, 0);
+}
+
+static void qcache_remove(struct ares_qcache *cache,
+                          struct qcache_entry *entry)
+{
+  ares__remove_from_list(&entry->node_by_key);
+  ares__remove_from_list(&entry->node_by_use);
+  cache->nentries--;
+  ares_free(entry);
+}
+
+static struct qcache_entry *qcache_find(struct ares_qcache *cache,
+                                        const unsigned char *key,
+                                        int keylen, unsigned int hash)
+{
+  struct list_node *list_head;
+  struct list_node *list_node;
+
+  list_head = &cache->buckets[hash & (cache->nbuckets - 1)];
+  for (list_node = list_head->next; list_node != list_head;
+       list_node = list_node->next)
+    {
+      struct qcache_entry *entry = list_node->data;
+      if (entry->hash == hash && entry->keylen == keylen &&
+          memcmp(entry->key, key, keylen) == 0)
+        return entry;
+    }
+  return NULL;
+}
+
+int ares__qcache_create(ares_channel channel)
+{
+  struct ares_qcache *cache;
+  unsigned int i;
+
+  cache = ares_malloc(sizeof(struct ares_qcache));
+  if (!cache)
+    return ARES_ENOMEM;
+
+  /* Aim for an average bucket length of at most one */
+  cache->nbuckets = 16;
+  while (cache->nbuckets < (unsigned int)channel->qcache_max_entries &&
+         cache->nbuckets < 65536)
+    cache->nbuckets <<= 1;
+
+  cache->buckets = ares_malloc(cache->nbuckets * sizeof(struct list_node));
+  if (!cache->buckets)
+    {
+      ares_free(cache);
+      return ARES_ENOMEM;
+    }
+  for (i = 0; i < cache->nbuckets; i++)
+    ares__init_list_head(&cache->buckets[i]);
+  ares__init_list_head(&cache->by_use);
+  cache->nentries = 0;
+  cache->max_entries = channel->qcache_max_entries;
+  cache->max_ttl = channel->qcache_max_ttl;
+
+  channel->qcache = cache;
+  return ARES_SUCCESS;
+}
+
+void ares__qcache_destroy(struct ares_qcache *cache)
+{
+  if (!cache)
+    return;
+
+  while (!ares__is_list_empty(&cache->by_use))
+    qcache_remove(cache, cache->by_use.next->data);
+  ares_free(cache->buckets);
+  ares_free(cache);
+}
+
+/* Return the memory held by the cache and its entries. */
+size_t ares__qcache_memory(struct ares_qcache *cache)
+{
+  struct list_node *list_node;
+  struct qcache_entry *entry;
+  size_t bytes;
+
+  if (!cache)
+    return 0;
+
+  bytes = sizeof(struct ares_qcache) +
+          cache->nbuckets * sizeof(struct list_node);
+  for (list_node = cache->by_use.next; list_node != &cache->by_use;
+       list_node = list_node->next)
+    {
+      entry = list_node->data;
+      bytes += sizeof(struct qcache_entry) + entry->keylen + entry->alen;
+    }
+  return bytes;
+}
+
+void ares__qcache_insert(struct ares_qcache *cache,
+                         const unsigned char *qbuf, int qlen,
+                         const unsigned char *abuf, int alen,
+                         struct timeval *now)
+{
+  unsigned char key[QCACHE_KEY_MAX];
+  struct qcache_entry *entry;
+  unsigned int hash, ttl;
+  int keylen, rcode;
+
+  if (alen < HFIXEDSZ || DNS_HEADER_TC(abuf))
+    return;
+
+  /* Only positive answers and authoritative denials are worth keeping */
+  rcode = DNS_HEADER_RCODE(abuf);
+  if (rcode != NOERROR && rcode != NXDOMAIN)
+    return;
+
+  keylen = qcache_key(qbuf, qlen, key);
+  if (keylen == 0)
+    return;
+
+  ttl = qcache_ttls((unsigned char *)abuf, alen, 0);
+  if (ttl > cache->max_ttl)
+    ttl = cache->max_ttl;
+  if (ttl == 0)
+    return;
+
+  hash = qcache_hash(key, keylen);
+  entry = qcache_find(cache, key, keylen, hash);
+  if (entry)
+    qcache_remove(cache, entry);
+
+  /* Make room by evicting the least recently used entry */
+  if (cache->nentries >= cache->max_entries)
+    qcache_remove(cache, cache->by_use.prev->data);
+
+  entry = ares_malloc(sizeof(struct qcache_entry) + keylen + alen);
+  if (!entry)
+    return;
+
+  entry->key = (unsigned char *)(entry + 1);
+  entry->keylen = keylen;
+  memcpy(entry->key, key, keylen);
+  entry->abuf = entry->key + keylen;
+  entry->alen = alen;
+  memcpy(entry->abuf, abuf, alen);
+  entry->hash = hash;
+  entry->insert_time = now->tv_sec;
+  entry->expire_time = now->tv_sec + (time_t)ttl;
+
+  ares__init_list_node(&entry->node_by_key, entry);
+  ares__init_list_node(&entry->node_by_use, entry);
+  ares__insert_in_list(&entry->node_by_key,
+                       &cache->buckets[hash & (cache->nbuckets - 1)]);
+  ares__insert_in_list(&entry->node_by_use, cache->by_use.next);
+  cache->nentries++;
+}
+
+int ares__qcache_fetch(struct ares_qcache *cache,
+                       const unsigned char *qbuf, int qlen,
+                       struct timeval *now,
+                       ares_callback callback, void *arg)
+{
+  unsigned char key[QCACHE_KEY_MAX];
+  unsigned char stackbuf[MAXENDSSZ + 1];
+  unsigned char *abuf;
+  struct qcache_entry *entry;
+  int keylen, alen;
+
+  keylen = qcache_key(qbuf, qlen, key);
+  if (keylen == 0)
+    return ARES_ENOTFOUND;
+
+  entry = qcache_find(cache, key, keylen, qcache_hash(key, keylen));
+  if (!entry)
+    return ARES_ENOTFOUND;
+
+  if (entry->expire_time <= now->tv_sec)
+    {
+      qcache_remove(cache, entry);
+      return ARES_ENOTFOUND;
+    }
+
+  /* Mark as most recently used */
+  ares__remove_from_list(&entry->node_by_use);
+  ares__insert_in_list(&entry->node_by_use, cache->by_use.next);
+
+  /* Hand the callback its own copy, since it may well issue new queries that
+   * end up evicting this very entry. */
+  alen = entry->alen;
+  if (alen <= (int)sizeof(stackbuf))
+    abuf = stackbuf;
+  else
+    {
+      abuf = ares_malloc(alen);
+      if (!abuf)
+        return ARES_ENOTFOUND;
+    }
+  memcpy(abuf, entry->abuf, alen);
+
+  /* Answer with the caller's query id and age the TTLs */
+  abuf[0] = qbuf[0];
+  abuf[1] = qbuf[1];
+  if (now->tv_sec > entry->insert_time)
+    qcache_ttls(abuf, alen, (unsigned int)(now->tv_sec - entry->insert_time));
+
+  callback(arg, ARES_SUCCESS, 0, abuf, alen);
+
+  if (abuf != stackbuf)
+    ares_free(abuf);
+  return ARES_SUCCESS;
+}
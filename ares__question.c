@@ -0,0 +1,218 @@
+/* Copyright (C) 2019 by The c-ares project
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+#include "ares_setup.h"
+
+#ifdef HAVE_NETINET_IN_H
+#  include <netinet/in.h>
+#endif
+#ifdef HAVE_ARPA_NAMESER_H
+#  include <arpa/nameser.h>
+#else
+#  include "nameser.h"
+#endif
+#ifdef HAVE_ARPA_NAMESER_COMPAT_H
+#  include <arpa/nameser_compat.h>
+#endif
+
+#include "ares.h"
+#include "ares_dns.h"
+#include "ares_private.h"
+
+/* Answers are matched to queries by comparing their question sections.
+ * The questions of a query are normalized once, when it is sent: names
+ * are written out uncompressed with ASCII letters lowercased, each
+ * followed by its type and class.  Incoming answers are then compared
+ * against that form directly in wire format, following compression
+ * pointers as needed, so matching never allocates or decodes names into
+ * strings.
+ */
+
+/* Find where the (possibly compressed) name at p ends in the message.
+ * Returns NULL if it runs off the end of the message.
+ */
+const unsigned char *ares__skip_name(const unsigned char *p,
+                                     const unsigned char *msg, int mlen)
+{
+  while (p < msg + mlen)
+    {
+      if ((*p & INDIR_MASK) == INDIR_MASK)
+        return (p + 2 <= msg + mlen) ? p + 2 : NULL;
+      if (*p & INDIR_MASK)
+        return NULL; /* reserved label type */
+      if (*p == 0)
+        return p + 1;
+      p += *p + 1;
+    }
+  return NULL;
+}
+
+/* Write the normalized form of the name at p to out, if out is not NULL.
+ * Returns the length of the normalized name, or -1 if the name is
+ * malformed.
+ */
+static int normalize_name(const unsigned char *p, const unsigned char *msg,
+                          int mlen, unsigned char *out)
+{
+  int outlen = 0;
+  int jumps = 0;
+  int len;
+
+  for (;;)
+    {
+      if (p >= msg + mlen)
+        return -1;
+      if ((*p & INDIR_MASK) == INDIR_MASK)
+        {
+          /* Following more pointers than the message is long means we
+           * are going round in circles. */
+          if (p + 1 >= msg + mlen || ++jumps > mlen)
+            return -1;
+          p = msg + (((*p & ~INDIR_MASK) << 8) | p[1]);
+          continue;
+        }
+      if (*p & INDIR_MASK)
+        return -1;
+
+      len = *p++;
+      if (p + len > msg + mlen)
+        return -1;
+      if (out)
+        out[outlen] = (unsigned char)len;
+      outlen++;
+      if (len == 0)
+        return outlen;
+      while (len--)
+        {
+          if (out)
+            out[outlen] = (unsigned char)TOLOWER(*p);
+          outlen++;
+          p++;
+        }
+    }
+}
+
+/* Write the normalized questions of the DNS message msg to out, if out
+ * is not NULL; call with out NULL first to learn how much room they need.
+ * Returns the length of the normalized questions, or -1 if the message
+ * holds malformed questions.
+ */
+int ares__normalize_questions(const unsigned char *msg, int mlen,
+                              unsigned char *out)
+{
+  const unsigned char *p;
+  int qdcount, i;
+  int outlen = 0;
+  int len;
+
+  if (mlen < HFIXEDSZ)
+    return -1;
+
+  qdcount = DNS_HEADER_QDCOUNT(msg);
+  p = msg + HFIXEDSZ;
+  for (i = 0; i < qdcount; i++)
+    {
+      len = normalize_name(p, msg, mlen, out ? out + outlen : NULL);
+      if (len < 0)
+        return -1;
+      outlen += len;
+      p = ares__skip_name(p, msg, mlen);
+      if (!p || p + QFIXEDSZ > msg + mlen)
+        return -1;
+      if (out)
+        memcpy(out + outlen, p, QFIXEDSZ);
+      outlen += QFIXEDSZ;
+      p += QFIXEDSZ;
+    }
+  return outlen;
+}
+
+/* Does the name at p in the message abuf equal the normalized name norm? */
+static int same_name(const unsigned char *p, const unsigned char *abuf,
+                     int alen, const unsigned char *norm)
+{
+  int jumps = 0;
+  int len;
+
+  for (;;)
+    {
+      if (p >= abuf + alen)
+        return 0;
+      if ((*p & INDIR_MASK) == INDIR_MASK)
+        {
+          if (p + 1 >= abuf + alen || ++jumps > alen)
+            return 0;
+          p = abuf + (((*p & ~INDIR_MASK) << 8) | p[1]);
+          continue;
+        }
+
+      /* Comparing lengths first keeps us within norm, which is always a
+       * well-formed name. */
+      len = *p++;
+      if (len != *norm++)
+        return 0;
+      if (len == 0)
+        return 1;
+      if (p + len > abuf + alen)
+        return 0;
+      while (len--)
+        {
+          if (TOLOWER(*p) != *norm)
+            return 0;
+          p++;
+          norm++;
+        }
+    }
+}
+
+/* Does the answer in abuf carry the same questions as the query whose
+ * questions were normalized into norm (normlen bytes, qdcount of them)?
+ */
+int ares__same_questions(const unsigned char *norm, int normlen, int qdcount,
+                         const unsigned char *abuf, int alen)
+{
+  const unsigned char *end = norm + normlen;
+  const unsigned char *q;
+  const unsigned char *qfixed;
+  const unsigned char *a;
+  const unsigned char *afixed;
+  int j;
+
+  if (normlen < 0 || alen < HFIXEDSZ || DNS_HEADER_QDCOUNT(abuf) != qdcount)
+    return 0;
+
+  /* For each question of the query, find it in the answer. */
+  for (q = norm; q < end; q = qfixed + QFIXEDSZ)
+    {
+      for (qfixed = q; *qfixed; qfixed += *qfixed + 1)
+        ;
+      qfixed++;
+
+      a = abuf + HFIXEDSZ;
+      for (j = 0; j < qdcount; j++)
+        {
+          afixed = ares__skip_name(a, abuf, alen);
+          if (!afixed || afixed + QFIXEDSZ > abuf + alen)
+            return 0;
+          if (memcmp(afixed, qfixed, QFIXEDSZ) == 0 &&
+              same_name(a, abuf, alen, q))
+            break;
+          a = afixed + QFIXEDSZ;
+        }
+      if (j == qdcount)
+        return 0;
+    }
+  return 1;
+}
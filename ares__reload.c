@@ -0,0 +1,101 @@
+/* Copyright (C) 2019 by The c-ares project
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+#include "ares_setup.h"
+
+#if defined(HAVE_SYS_STAT_H) || defined(WIN32)
+#  include <sys/stat.h>
+#endif
+
+#include "ares.h"
+#include "ares_private.h"
+
+/* Noticing that the system configuration changed.  Rather than reading
+ * files again, we compare what stat() says about them with what it said
+ * last time: a file that is rewritten changes its modification time or
+ * size, and one that is replaced by renaming another over it changes its
+ * inode.
+ */
+
+/* Record what stat() says about the file at path (which may be NULL for
+ * none) in stamp.  Returns nonzero if that differs from what was recorded
+ * there before.
+ */
+int ares__filestamp_update(const char *path, struct ares_filestamp *stamp)
+{
+  struct ares_filestamp now;
+  struct stat st;
+
+  memset(&now, 0, sizeof(now));
+  if (path && stat(path, &st) == 0)
+    {
+      now.exists = 1;
+      now.mtime = st.st_mtime;
+      now.size = (long)st.st_size;
+      now.dev = (unsigned long)st.st_dev;
+      now.ino = (unsigned long)st.st_ino;
+    }
+
+  /* Field by field, as the padding of the structures need not match */
+  if (now.exists == stamp->exists && now.mtime == stamp->mtime &&
+      now.size == stamp->size && now.dev == stamp->dev &&
+      now.ino == stamp->ino)
+    return 0;
+  *stamp = now;
+  return 1;
+}
+
+/* Has the channel's resolv.conf changed since we last looked? */
+int ares__resolvconf_changed(ares_channel channel)
+{
+  const char *path = channel->resolvconf_path;
+
+#ifdef PATH_RESOLV_CONF
+  if (!path)
+    path = PATH_RESOLV_CONF;
+#endif
+  return ares__filestamp_update(path, &channel->resolvconf_stamp);
+}
+
+/* With ARES_OPT_RELOAD, look at resolv.conf at most once every
+ * reload_interval milliseconds, and apply it again if it changed.  This is
+ * called as queries are started, which is never while the channel is
+ * processing, unless from a callback; then we try again next time.
+ */
+void ares__reload_check(ares_channel channel)
+{
+  struct timeval now;
+
+  if (channel->reload_interval <= 0 || channel->processing)
+    return;
+
+  now = ares__tvnow();
+  if (!ares__timedout(&now, &channel->reload_checked))
+    return;
+  channel->reload_checked = now;
+  channel->reload_checked.tv_sec += channel->reload_interval / 1000;
+  channel->reload_checked.tv_usec += (channel->reload_interval % 1000) * 1000;
+  if (channel->reload_checked.tv_usec >= 1000000)
+    {
+      channel->reload_checked.tv_sec++;
+      channel->reload_checked.tv_usec -= 1000000;
+    }
+
+  if (ares__resolvconf_changed(channel) && ares_reinit(channel) != ARES_SUCCESS)
+    {
+      /* Forget what we saw, so that the next check tries again. */
+      channel->resolvconf_stamp.exists = -1;
+    }
+}
@@ -0,0 +1,356 @@
+/* Copyright (C) 2019 by The c-ares project
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+#include "ares_setup.h"
+
+#include "ares.h"
+#include "ares_private.h"
+#include "ares_atomic.h"
+
+/* Every server keeps a smoothed round trip time and a count of the
+ * timeouts and server failures it has given us in a row.  A server that
+ * fails is put on probation for a while, twice as long for each further
+ * failure, and not chosen while better servers are available.  Queries
+ * that were already sent when a failure was seen do not count again, so
+ * a burst of queries timing out together is a single failure.  Once its
+ * probation is over it is sent a single query as a probe: an answer
+ * restores it, another failure puts it back on probation for longer.
+ *
+ * With ARES_FLAG_SRVHEALTH the channel sends each query to the best server
+ * by these measures, and moves on to the next best one on failure, instead
+ * of going through the servers in the configured order.
+ *
+ * The channels of an ares_resolver each run in a thread of their own, but
+ * share the failures they see through an ares_health: a word per server,
+ * in the order of the channels' server list, counting the failures and
+ * recoveries seen so far in its upper bits, with whether the last one was
+ * a failure in its lowest bit.  A channel bumps the word when one of its
+ * own servers fails or recovers, and takes in what the others saw when it
+ * next chooses a server, as if it had seen that itself.
+ */
+
+struct ares_health {
+  int nservers;
+  volatile unsigned int events[1];  /* nservers of them */
+};
+
+#define HEALTH_FAILED 1U
+
+/* How long a server stays on probation after its first failure, and at
+ * most after many failures */
+#define PROBATION_MIN_MS 500
+#define PROBATION_MAX_MS 60000
+
+/* Once a server's round trip time histogram holds this many samples all
+ * counts are halved, so that it follows changes in the server's latency;
+ * with fewer than RTT_HIST_MIN samples it gives no percentiles yet. */
+#define RTT_HIST_MAX 1024
+#define RTT_HIST_MIN 16
+
+static long tvdiff_usec(struct timeval *later, struct timeval *earlier)
+{
+  return (later->tv_sec - earlier->tv_sec) * 1000000L +
+         (later->tv_usec - earlier->tv_usec);
+}
+
+static void rtt_hist_add(struct server_state *server, long rtt)
+{
+  int i = 0;
+
+  while (i < ARES_RTT_BUCKETS - 1 && (rtt >> (i + 1)) != 0)
+    i++;
+  server->rtt_hist[i]++;
+  if (++server->rtt_samples < RTT_HIST_MAX)
+    return;
+
+  server->rtt_samples = 0;
+  for (i = 0; i < ARES_RTT_BUCKETS; i++)
+    {
+      server->rtt_hist[i] /= 2;
+      server->rtt_samples += server->rtt_hist[i];
+    }
+}
+
+static void start_probation(struct server_state *server, struct timeval *now)
+{
+  int ms = PROBATION_MIN_MS;
+  int i;
+
+  for (i = 1; i < server->failures && ms < PROBATION_MAX_MS; i++)
+    ms *= 2;
+  if (ms > PROBATION_MAX_MS)
+    ms = PROBATION_MAX_MS;
+
+  server->probation_until = *now;
+  server->probation_until.tv_sec += ms / 1000;
+  server->probation_until.tv_usec += (ms % 1000) * 1000;
+  if (server->probation_until.tv_usec >= 1000000)
+    {
+      server->probation_until.tv_sec++;
+      server->probation_until.tv_usec -= 1000000;
+    }
+}
+
+struct ares_health *ares__health_create(int nservers)
+{
+  struct ares_health *health;
+  int i;
+
+  health = ares_malloc(sizeof(struct ares_health) +
+                       (nservers > 1 ? nservers - 1 : 0) *
+                       sizeof(unsigned int));
+  if (!health)
+    return NULL;
+  health->nservers = nservers;
+  for (i = 0; i < nservers; i++)
+    health->events[i] = 0;
+  return health;
+}
+
+void ares__health_destroy(struct ares_health *health)
+{
+  if (health)
+    ares_free(health);
+}
+
+/* Tell the other channels sharing channel->health that the server failed
+ * or recovered. */
+static void health_publish(ares_channel channel, int whichserver,
+                           unsigned int failed)
+{
+#ifdef ARES_HAVE_ATOMICS
+  struct ares_health *health = channel->health;
+  unsigned int seen;
+  unsigned int next;
+
+  if (!health || whichserver >= health->nservers)
+    return;
+  seen = ATOMIC_LOAD(&health->events[whichserver]);
+  do
+    next = ((seen + 2) & ~HEALTH_FAILED) | failed;
+  while (!ATOMIC_CAS(&health->events[whichserver], seen, next));
+  channel->servers[whichserver].health_seen = next;
+#else
+  (void)channel;
+  (void)whichserver;
+  (void)failed;
+#endif
+}
+
+/* Take in the failures and recoveries the other channels sharing
+ * channel->health saw since we last looked.  A failure of a server that is
+ * on probation here already does not count again. */
+static void health_sync(ares_channel channel, struct timeval *now)
+{
+#ifdef ARES_HAVE_ATOMICS
+  struct ares_health *health = channel->health;
+  struct server_state *server;
+  unsigned int events;
+  int i;
+
+  for (i = 0; i < channel->nservers && i < health->nservers; i++)
+    {
+      server = &channel->servers[i];
+      events = ATOMIC_LOAD(&health->events[i]);
+      if (events == server->health_seen)
+        continue;
+      server->health_seen = events;
+      if (!(events & HEALTH_FAILED))
+        server->failures = 0;
+      else if (!server->failures ||
+               ares__timedout(now, &server->probation_until))
+        {
+          server->failures++;
+          server->failed_at = *now;
+          start_probation(server, now);
+        }
+    }
+#else
+  (void)channel;
+  (void)now;
+#endif
+}
+
+/* The server answered the query.  If the query was sent only this once,
+ * the answer also gives us a round trip time; after a retry we could not
+ * tell which attempt it answers (Karn's rule).  The estimates are kept as
+ * RFC 6298 describes for TCP.
+ */
+void ares__server_answered(ares_channel channel, int whichserver,
+                           struct query *query, struct timeval *now)
+{
+  struct server_state *server = &channel->servers[whichserver];
+  long rtt;
+  long delta;
+
+  server->stats[ARES_SERVER_STAT_ANSWERS]++;
+  if (server->failures)
+    {
+      server->failures = 0;
+      health_publish(channel, whichserver, 0);
+    }
+
+  if (whichserver != query->server || query->try_count != 0)
+    return;
+  rtt = tvdiff_usec(now, &query->ts);
+  if (rtt <= 0)
+    rtt = 1;
+  rtt_hist_add(server, rtt);
+  if (server->srtt == 0)
+    {
+      server->srtt = rtt;
+      server->rttvar = rtt / 2;
+      return;
+    }
+  delta = server->srtt - rtt;
+  if (delta < 0)
+    delta = -delta;
+  server->rttvar += (delta - server->rttvar) / 4;
+  server->srtt += (rtt - server->srtt) / 8;
+  if (server->srtt <= 0)
+    server->srtt = 1;
+}
+
+/* The time in milliseconds to wait for an answer from the server before
+ * retrying, when channel->rto_min is set.  A server that has not answered
+ * yet gets the fixed timeout.
+ */
+int ares__server_rto(ares_channel channel, struct server_state *server)
+{
+  long rto;
+
+  if (server->srtt == 0)
+    rto = channel->timeout;
+  else
+    {
+      /* SRTT + max(G, 4 * RTTVAR), with a clock granularity of 1ms */
+      rto = 4 * server->rttvar;
+      if (rto < 1000)
+        rto = 1000;
+      rto = (server->srtt + rto + 999) / 1000;
+    }
+
+  if (rto < channel->rto_min)
+    rto = channel->rto_min;
+  if (rto > channel->rto_max)
+    rto = channel->rto_max;
+  return (int)rto;
+}
+
+/* How many milliseconds to wait for an answer from the server before
+ * also sending the query to another one, or -1 not to.  Without a fixed
+ * delay, the wait is the configured percentile of the server's round trip
+ * times, rounded up to the end of its histogram bucket.
+ */
+int ares__server_hedge_delay(ares_channel channel,
+                             struct server_state *server)
+{
+  unsigned int target;
+  unsigned int seen = 0;
+  int i;
+
+  if (channel->hedge_delay > 0)
+    return channel->hedge_delay;
+  if (channel->hedge_percentile <= 0 || server->rtt_samples < RTT_HIST_MIN)
+    return -1;
+
+  target = (server->rtt_samples * channel->hedge_percentile + 99) / 100;
+  for (i = 0; i < ARES_RTT_BUCKETS - 1; i++)
+    {
+      seen += server->rtt_hist[i];
+      if (seen >= target)
+        break;
+    }
+  return (int)(((2L << i) + 999) / 1000);
+}
+
+/* The server timed out or failed the query; stat says which. */
+void ares__server_failed(ares_channel channel, int whichserver,
+                         struct query *query, int stat, struct timeval *now)
+{
+  struct server_state *server = &channel->servers[whichserver];
+
+  server->stats[stat]++;
+  if (server->failures && !ares__timedout(&query->ts, &server->failed_at))
+    return;
+  server->failures++;
+  server->failed_at = *now;
+  start_probation(server, now);
+  health_publish(channel, whichserver, HEALTH_FAILED);
+}
+
+/* Can the query be sent to this server at all? */
+static int server_usable(ares_channel channel, struct query *query, int i)
+{
+  struct server_state *server = &channel->servers[i];
+
+  return !server->is_broken && !query->server_info[i].skip_server &&
+         !(query->using_tcp &&
+           query->server_info[i].tcp_connection_generation ==
+           server->tcp_connection_generation);
+}
+
+/* Choose the server to send the query to next, other than the one it was
+ * last sent to (exclude, or -1 for a new query).  Servers whose probation
+ * is over get a probe first, then the healthy server with the lowest
+ * round trip time (or none measured yet), and failing those the server
+ * that comes off probation soonest.
+ */
+int ares__choose_server(ares_channel channel, struct query *query,
+                        int exclude, struct timeval *now)
+{
+  struct server_state *server;
+  int probe = -1;
+  int best = -1;
+  int soonest = -1;
+  int i;
+
+  if (channel->health)
+    health_sync(channel, now);
+
+  for (i = 0; i < channel->nservers; i++)
+    {
+      if ((i == exclude && channel->nservers > 1) ||
+          !server_usable(channel, query, i))
+        continue;
+      server = &channel->servers[i];
+      if (server->failures == 0)
+        {
+          if (best == -1 || server->srtt < channel->servers[best].srtt)
+            best = i;
+        }
+      else if (ares__timedout(now, &server->probation_until))
+        {
+          if (probe == -1)
+            probe = i;
+        }
+      else if (soonest == -1 ||
+               ares__timedout(&channel->servers[soonest].probation_until,
+                              &server->probation_until))
+        soonest = i;
+    }
+
+  if (probe != -1)
+    {
+      /* Let only this query probe it until the probe is answered */
+      start_probation(&channel->servers[probe], now);
+      return probe;
+    }
+  if (best != -1)
+    return best;
+  if (soonest != -1)
+    return soonest;
+  return (exclude + 1) % channel->nservers;
+}
@@ -55,6 +55,7 @@
 struct addrinfo_sort_elem
 {
   struct ares_addrinfo_node *ai;
+  ares_sockaddr dst_addr;
   int has_src_addr;
   ares_sockaddr src_addr;
   int original_order;
@@ -301,11 +302,11 @@ static int rfc6724_compare(const void *ptr1, const void *ptr2)
 
   /* Rule 2: Prefer matching scope. */
   scope_src1 = get_scope(&a1->src_addr.sa);
-  scope_dst1 = get_scope(a1->ai->ai_addr);
+  scope_dst1 = get_scope(&a1->dst_addr.sa);
   scope_match1 = (scope_src1 == scope_dst1);
 
   scope_src2 = get_scope(&a2->src_addr.sa);
-  scope_dst2 = get_scope(a2->ai->ai_addr);
+  scope_dst2 = get_scope(&a2->dst_addr.sa);
   scope_match2 = (scope_src2 == scope_dst2);
 
   if (scope_match1 != scope_match2)
@@ -319,11 +320,11 @@ static int rfc6724_compare(const void *ptr1, const void *ptr2)
 
   /* Rule 5: Prefer matching label. */
   label_src1 = get_label(&a1->src_addr.sa);
-  label_dst1 = get_label(a1->ai->ai_addr);
+  label_dst1 = get_label(&a1->dst_addr.sa);
   label_match1 = (label_src1 == label_dst1);
 
   label_src2 = get_label(&a2->src_addr.sa);
-  label_dst2 = get_label(a2->ai->ai_addr);
+  label_dst2 = get_label(&a2->dst_addr.sa);
   label_match2 = (label_src2 == label_dst2);
 
   if (label_match1 != label_match2)
@@ -332,8 +333,8 @@ static int rfc6724_compare(const void *ptr1, const void *ptr2)
     }
 
   /* Rule 6: Prefer higher precedence. */
-  precedence1 = get_precedence(a1->ai->ai_addr);
-  precedence2 = get_precedence(a2->ai->ai_addr);
+  precedence1 = get_precedence(&a1->dst_addr.sa);
+  precedence2 = get_precedence(&a2->dst_addr.sa);
   if (precedence1 != precedence2)
     {
       return precedence2 - precedence1;
@@ -348,15 +349,13 @@ static int rfc6724_compare(const void *ptr1, const void *ptr2)
     }
 
   /* Rule 9: Use longest matching prefix. */
-  if (a1->has_src_addr && a1->ai->ai_addr->sa_family == AF_INET6 &&
-      a2->has_src_addr && a2->ai->ai_addr->sa_family == AF_INET6)
+  if (a1->has_src_addr && a1->dst_addr.sa.sa_family == AF_INET6 &&
+      a2->has_src_addr && a2->dst_addr.sa.sa_family == AF_INET6)
     {
       const struct sockaddr_in6 *a1_src = &a1->src_addr.sa6;
-      const struct sockaddr_in6 *a1_dst =
-          (const struct sockaddr_in6 *)a1->ai->ai_addr;
+      const struct sockaddr_in6 *a1_dst = &a1->dst_addr.sa6;
       const struct sockaddr_in6 *a2_src = &a2->src_addr.sa6;
-      const struct sockaddr_in6 *a2_dst =
-          (const struct sockaddr_in6 *)a2->ai->ai_addr;
+      const struct sockaddr_in6 *a2_dst = &a2->dst_addr.sa6;
       prefixlen1 = common_prefix_len(&a1_src->sin6_addr, &a1_dst->sin6_addr);
       prefixlen2 = common_prefix_len(&a2_src->sin6_addr, &a2_dst->sin6_addr);
       if (prefixlen1 != prefixlen2)
@@ -435,6 +434,30 @@ static int find_src_addr(ares_channel channel,
   return 1;
 }
 
+/*
+ * Find the source address of each element, whose destination address and
+ * original order are set, and sort the elements in RFC6724 order.
+ */
+static int sort_elems(ares_channel channel, struct addrinfo_sort_elem *elems,
+                      int nelem)
+{
+  int i;
+
+  for (i = 0; i < nelem; ++i)
+    {
+      elems[i].has_src_addr = find_src_addr(channel, &elems[i].dst_addr.sa,
+                                            &elems[i].src_addr.sa);
+      if (elems[i].has_src_addr == -1)
+        {
+          return ARES_ENOTFOUND;
+        }
+    }
+
+  qsort((void *)elems, nelem, sizeof(struct addrinfo_sort_elem),
+        rfc6724_compare);
+  return ARES_SUCCESS;
+}
+
 /*
  * Sort the linked list starting at sentinel->ai_next in RFC6724 order.
  * Will leave the list unchanged if an error occurs.
@@ -443,7 +466,6 @@ int ares__sortaddrinfo(ares_channel channel, struct ares_addrinfo_node *list_sen
 {
   struct ares_addrinfo_node *cur;
   int nelem = 0, i;
-  int has_src_addr;
   struct addrinfo_sort_elem *elems;
 
   cur = list_sentinel->ai_next;
@@ -468,19 +490,19 @@ int ares__sortaddrinfo(ares_channel channel, struct ares_addrinfo_node *list_sen
       assert(cur != NULL);
       elems[i].ai = cur;
       elems[i].original_order = i;
-      has_src_addr = find_src_addr(channel, cur->ai_addr, &elems[i].src_addr.sa);
-      if (has_src_addr == -1)
-        {
-          ares_free(elems);
-          return ARES_ENOTFOUND;
-        }
-      elems[i].has_src_addr = has_src_addr;
+      memset(&elems[i].dst_addr, 0, sizeof(elems[i].dst_addr));
+      memcpy(&elems[i].dst_addr, cur->ai_addr,
+             (size_t)cur->ai_addrlen < sizeof(elems[i].dst_addr) ?
+             (size_t)cur->ai_addrlen : sizeof(elems[i].dst_addr));
     }
 
   /* Sort the addresses, and rearrange the linked list so it matches the sorted
    * order. */
-  qsort((void *)elems, nelem, sizeof(struct addrinfo_sort_elem),
-        rfc6724_compare);
+  if (sort_elems(channel, elems, nelem) != ARES_SUCCESS)
+    {
+      ares_free(elems);
+      return ARES_ENOTFOUND;
+    }
 
   list_sentinel->ai_next = elems[0].ai;
   for (i = 0; i < nelem - 1; ++i)
@@ -492,3 +514,73 @@ int ares__sortaddrinfo(ares_channel channel, struct ares_addrinfo_node *list_sen
   ares_free(elems);
   return ARES_SUCCESS;
 }
+
+/*
+ * Sort the addresses of an ares_getaddrinfo_batch() item in RFC6724 order,
+ * in place.  Will leave them unchanged if an error occurs.
+ */
+int ares__sortaddrs(ares_channel channel,
+                    struct ares_addrinfo_batch_addr *addrs, size_t naddrs)
+{
+  struct ares_addrinfo_batch_addr tmp;
+  struct addrinfo_sort_elem *elems;
+  int nelem, i, j, k;
+
+  if (naddrs > INT_MAX / sizeof(struct addrinfo_sort_elem))
+    {
+      return ARES_ENOMEM;
+    }
+  nelem = (int)naddrs;
+  elems = (struct addrinfo_sort_elem *)ares_malloc(
+      nelem * sizeof(struct addrinfo_sort_elem));
+  if (!elems)
+    {
+      return ARES_ENOMEM;
+    }
+
+  for (i = 0; i < nelem; ++i)
+    {
+      elems[i].ai = NULL;
+      elems[i].original_order = i;
+      memset(&elems[i].dst_addr, 0, sizeof(elems[i].dst_addr));
+      if (addrs[i].family == AF_INET)
+        {
+          elems[i].dst_addr.sa4.sin_family = AF_INET;
+          memcpy(&elems[i].dst_addr.sa4.sin_addr, &addrs[i].addr.addr4,
+                 sizeof(struct in_addr));
+        }
+      else
+        {
+          elems[i].dst_addr.sa6.sin6_family = AF_INET6;
+          memcpy(&elems[i].dst_addr.sa6.sin6_addr, &addrs[i].addr.addr6,
+                 sizeof(struct ares_in6_addr));
+        }
+    }
+
+  if (sort_elems(channel, elems, nelem) != ARES_SUCCESS)
+    {
+      ares_free(elems);
+      return ARES_ENOTFOUND;
+    }
+
+  /* Position i takes the address that was at elems[i].original_order: move
+   * them a cycle at a time, marking each position done as it is filled. */
+  for (i = 0; i < nelem; ++i)
+    {
+      if (elems[i].original_order == i)
+        {
+          continue;
+        }
+      tmp = addrs[i];
+      for (j = i; (k = elems[j].original_order) != i; j = k)
+        {
+          addrs[j] = addrs[k];
+          elems[j].original_order = j;
+        }
+      addrs[j] = tmp;
+      elems[j].original_order = j;
+    }
+
+  ares_free(elems);
+  return ARES_SUCCESS;
+}
@@ -0,0 +1,193 @@
+/* Copyright (C) 2019 by The c-ares project
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+#include "ares_setup.h"
+
+#include "ares.h"
+#include "ares_private.h"
+
+/* Queries that have been sent are kept in a binary min-heap ordered by
+ * their timeout, so the next query to expire is always at index 0.  Each
+ * query remembers its own position in the heap (timeout_idx, -1 when it
+ * is not in it) so it can be moved or removed without a search.
+ */
+
+#define HEAP_PARENT(i) (((i) - 1) / 2)
+#define HEAP_LEFT(i)   (2 * (i) + 1)
+
+/* return true if query a expires before query b */
+static int expires_before(const struct query *a, const struct query *b)
+{
+  if (a->timeout.tv_sec != b->timeout.tv_sec)
+    return a->timeout.tv_sec < b->timeout.tv_sec;
+  return a->timeout.tv_usec < b->timeout.tv_usec;
+}
+
+static void heap_set(ares_channel channel, int idx, struct query *query)
+{
+  channel->queries_by_timeout[idx] = query;
+  query->timeout_idx = idx;
+}
+
+static void sift_up(ares_channel channel, int idx)
+{
+  struct query *query = channel->queries_by_timeout[idx];
+
+  while (idx > 0)
+    {
+      struct query *parent = channel->queries_by_timeout[HEAP_PARENT(idx)];
+      if (!expires_before(query, parent))
+        break;
+      heap_set(channel, idx, parent);
+      idx = HEAP_PARENT(idx);
+    }
+  heap_set(channel, idx, query);
+}
+
+static void sift_down(ares_channel channel, int idx)
+{
+  struct query *query = channel->queries_by_timeout[idx];
+  int count = channel->nqueries_by_timeout;
+
+  for (;;)
+    {
+      int child = HEAP_LEFT(idx);
+      if (child >= count)
+        break;
+      if (child + 1 < count &&
+          expires_before(channel->queries_by_timeout[child + 1],
+                         channel->queries_by_timeout[child]))
+        child++;
+      if (!expires_before(channel->queries_by_timeout[child], query))
+        break;
+      heap_set(channel, idx, channel->queries_by_timeout[child]);
+      idx = child;
+    }
+  heap_set(channel, idx, query);
+}
+
+/* Make sure the heap has room for one more query, so that sending a new
+ * query through ares__timeout_heap_update() never has to allocate.  Called
+ * from ares_send() before the query is linked into the channel.
+ */
+int ares__timeout_heap_reserve(ares_channel channel)
+{
+  struct query **heap;
+  int alloc;
+
+  if (channel->nqueries_by_timeout < channel->queries_by_timeout_alloc)
+    return ARES_SUCCESS;
+
+  alloc = channel->queries_by_timeout_alloc ?
+          channel->queries_by_timeout_alloc * 2 : 16;
+  heap = ares_realloc(channel->queries_by_timeout, alloc * sizeof(*heap));
+  if (!heap)
+    return ARES_ENOMEM;
+
+  channel->queries_by_timeout = heap;
+  channel->queries_by_timeout_alloc = alloc;
+  return ARES_SUCCESS;
+}
+
+/* Give back room once the heap is down to a quarter of it, so that a
+ * burst of queries does not leave an idle channel holding on to room for
+ * them.  The first 16 places are kept for the queries to come. */
+static void heap_shrink(ares_channel channel)
+{
+  struct query **heap;
+  int alloc = channel->queries_by_timeout_alloc;
+
+  while (alloc > 16 && channel->nqueries_by_timeout < alloc / 4)
+    alloc /= 2;
+  if (alloc == channel->queries_by_timeout_alloc)
+    return;
+
+  heap = ares_realloc(channel->queries_by_timeout, alloc * sizeof(*heap));
+  if (!heap)
+    return;
+  channel->queries_by_timeout = heap;
+  channel->queries_by_timeout_alloc = alloc;
+}
+
+/* (Re)position a query in the heap after its timeout has been set. */
+void ares__timeout_heap_update(ares_channel channel, struct query *query)
+{
+  int idx = query->timeout_idx;
+
+  if (idx < 0)
+    {
+      idx = channel->nqueries_by_timeout++;
+      heap_set(channel, idx, query);
+      sift_up(channel, idx);
+      return;
+    }
+
+  if (idx > 0 &&
+      expires_before(query, channel->queries_by_timeout[HEAP_PARENT(idx)]))
+    sift_up(channel, idx);
+  else
+    sift_down(channel, idx);
+}
+
+void ares__timeout_heap_remove(ares_channel channel, struct query *query)
+{
+  int idx = query->timeout_idx;
+  struct query *last;
+
+  if (idx < 0)
+    return;
+
+  query->timeout_idx = -1;
+  last = channel->queries_by_timeout[--channel->nqueries_by_timeout];
+  if (last != query)
+    {
+      heap_set(channel, idx, last);
+      ares__timeout_heap_update(channel, last);
+    }
+  heap_shrink(channel);
+}
+
+static void collect_expired(ares_channel channel, int idx,
+                            struct timeval *now, struct list_node *expired)
+{
+  struct query *query;
+
+  if (idx >= channel->nqueries_by_timeout)
+    return;
+  query = channel->queries_by_timeout[idx];
+  if (!ares__timedout(now, &query->timeout))
+    return; /* nor has anything below it */
+
+  ares__insert_in_list(&(query->queries_timed_out), expired);
+  collect_expired(channel, HEAP_LEFT(idx), now, expired);
+  collect_expired(channel, HEAP_LEFT(idx) + 1, now, expired);
+}
+
+/* Link every query whose timeout has passed into the given list.  The
+ * queries stay in the heap; this only visits the expired part of it.
+ */
+void ares__timeout_heap_expired(ares_channel channel, struct timeval *now,
+                                struct list_node *expired)
+{
+  collect_expired(channel, 0, now, expired);
+}
+
+/* Return the query that expires first, or NULL if none is waiting. */
+struct query *ares__timeout_heap_first(ares_channel channel)
+{
+  if (channel->nqueries_by_timeout == 0)
+    return NULL;
+  return channel->queries_by_timeout[0];
+}
@@ -0,0 +1,256 @@
+/* Copyright (C) 2019 by The c-ares project
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+#include "ares_setup.h"
+
+#include "ares.h"
+#include "ares_private.h"
+
+/* Replacing the server list of a busy channel.  Servers that appear in
+ * both the old and the new list keep their state: their sockets, the
+ * queries waiting on them and what we measured about them all move to
+ * their place in the new list.  Queries waiting on a server that is no
+ * longer listed are sent again to one of the new servers, and every
+ * query's per-server information is rearranged to match the new list.
+ */
+
+static int same_server(const struct ares_addr *a, const struct ares_addr *b)
+{
+  if (a->family != b->family || a->udp_port != b->udp_port ||
+      a->tcp_port != b->tcp_port)
+    return 0;
+  if (a->family == AF_INET)
+    return memcmp(&a->addrV4, &b->addrV4, sizeof(a->addrV4)) == 0;
+  return memcmp(&a->addrV6, &b->addrV6, sizeof(a->addrV6)) == 0;
+}
+
+/* The list node (or head) at "from" has been copied to "to"; point its
+ * neighbours at the new location. */
+static void relink(struct list_node *to, struct list_node *from)
+{
+  if (!to->next)
+    return; /* not in a list */
+  if (to->next == from)
+    {
+      to->next = to;
+      to->prev = to;
+      return;
+    }
+  to->next->prev = to;
+  to->prev->next = to;
+}
+
+/* Move the state of a server to a new place in memory.  Only the socket
+ * index and the lists point into a server_state, besides its UDP sockets. */
+static void move_server(struct server_state *to, struct server_state *from)
+{
+  struct list_node *list_node;
+  struct server_connection *conn;
+
+  *to = *from;
+  relink(&to->queries_to_server, &from->queries_to_server);
+  relink(&to->connections, &from->connections);
+  relink(&to->tcp_conn.queries_to_conn, &from->tcp_conn.queries_to_conn);
+  relink(&to->tcp_conn.udp_pending, &from->tcp_conn.udp_pending);
+  relink(&to->tcp_conn.node, &from->tcp_conn.node);
+  relink(&to->tcp_conn.node_by_fd, &from->tcp_conn.node_by_fd);
+  to->tcp_conn.node.data = &to->tcp_conn;
+  to->tcp_conn.node_by_fd.data = &to->tcp_conn;
+  to->tcp_conn.server = to;
+
+  for (list_node = to->connections.next; list_node != &to->connections;
+       list_node = list_node->next)
+    {
+      conn = list_node->data;
+      conn->server = to;
+    }
+}
+
+int ares__update_servers(ares_channel channel, const struct ares_addr *addrs,
+                         int naddrs)
+{
+  struct server_state *old = channel->servers;
+  int nold = old ? channel->nservers : 0;
+  struct server_state *servers;
+  struct query_server_info **infos = NULL;
+  struct query_server_info *info;
+  struct query *query;
+  struct list_node *list_node;
+  struct list_node reroute;
+  struct timeval now;
+  int *map = NULL;
+  int nqueries = 0;
+  int status = ARES_ENOMEM;
+  int i, j, k;
+
+  /* Processing that calls back into us may still be using the old list,
+   * and queries in flight need somewhere to go. */
+  if (channel->processing ||
+      (naddrs == 0 && !ares__is_list_empty(&(channel->all_queries))))
+    return ARES_ENOTIMP;
+
+  if (naddrs == 0)
+    {
+      channel->health = NULL;
+      ares__destroy_servers_state(channel);
+      return ARES_SUCCESS;
+    }
+
+  /* Get all the memory we need first, so that we never fail half way. */
+  for (list_node = channel->all_queries.next;
+       list_node != &(channel->all_queries); list_node = list_node->next)
+    nqueries++;
+  servers = ares_malloc(naddrs * sizeof(struct server_state));
+  if (!servers)
+    return ARES_ENOMEM;
+  if (nold)
+    {
+      map = ares_malloc(nold * sizeof(int));
+      if (!map)
+        goto out;
+    }
+  if (nqueries)
+    {
+      infos = ares_malloc(nqueries * sizeof(struct query_server_info *));
+      if (!infos)
+        goto out;
+      memset(infos, 0, nqueries * sizeof(struct query_server_info *));
+      for (k = 0; k < nqueries; k++)
+        {
+          infos[k] = ares__pool_alloc(channel, naddrs *
+                                      sizeof(struct query_server_info));
+          if (!infos[k])
+            goto out;
+        }
+    }
+
+  /* Lay out the new list, moving over the servers we already had. */
+  for (j = 0; j < nold; j++)
+    map[j] = -1;
+  for (i = 0; i < naddrs; i++)
+    {
+      for (j = 0; j < nold; j++)
+        if (map[j] == -1 && same_server(&addrs[i], &old[j].addr))
+          break;
+      if (j < nold)
+        {
+          map[j] = i;
+          move_server(&servers[i], &old[j]);
+        }
+      else
+        {
+          servers[i].addr = addrs[i];
+          ares__init_server_state(channel, &servers[i]);
+        }
+    }
+
+  /* Rearrange what each query knows about the servers, and take the
+   * queries waiting on a server that is going away off it. */
+  ares__init_list_head(&reroute);
+  k = 0;
+  for (list_node = channel->all_queries.next;
+       list_node != &(channel->all_queries); list_node = list_node->next)
+    {
+      query = list_node->data;
+      info = infos[k];
+      infos[k++] = NULL;
+      for (i = 0; i < naddrs; i++)
+        {
+          info[i].skip_server = 0;
+          info[i].tcp_connection_generation = 0;
+        }
+      for (j = 0; j < nold; j++)
+        if (map[j] != -1)
+          info[map[j]] = query->server_info[j];
+      ares__pool_free(channel, query->server_info);
+      query->server_info = info;
+
+      if (query->hedge_conn)
+        for (j = 0; j < nold; j++)
+          if (map[j] == -1 && query->hedge_conn->server == &old[j])
+            {
+              ares__detach_hedge_conn(channel, query);
+              break;
+            }
+
+      /* The count of queries on a TCP connection moved with its server */
+      if (query->tcp_server != -1)
+        query->tcp_server = map[query->tcp_server];
+      if (map[query->server] != -1)
+        {
+          query->server = map[query->server];
+          continue;
+        }
+      ares__detach_query_conn(channel, query);
+      ares__detach_hedge_conn(channel, query);
+      ares__remove_from_list(&(query->queries_to_server));
+      ares__insert_in_list(&(query->queries_timed_out), &reroute);
+    }
+
+  for (j = 0; j < nold; j++)
+    if (map[j] == -1)
+      ares__destroy_server_state(channel, &old[j]);
+  ares_free(old);
+  channel->servers = servers;
+  channel->nservers = naddrs;
+
+  /* The failures shared with the other channels of a resolver are kept by
+   * position in the server list, so stop sharing them once it changes. */
+  if (naddrs != nold)
+    channel->health = NULL;
+  for (j = 0; j < nold; j++)
+    if (map[j] != j)
+      channel->health = NULL;
+  if (channel->last_server >= naddrs)
+    channel->last_server = 0;
+  servers = NULL;
+  status = ARES_SUCCESS;
+
+  /* Names the old servers denied may well exist for the new ones. */
+  ares__negcache_flush(channel->negcache);
+
+  /* Send the queries of the servers that went away to the new ones.  This
+   * may end some of them, so the channel counts as processing meanwhile. */
+  now = ares__tvnow();
+  channel->processing++;
+  while (!ares__is_list_empty(&reroute))
+    {
+      query = reroute.next->data;
+      ares__remove_from_list(&(query->queries_timed_out));
+      if (channel->flags & ARES_FLAG_SRVHEALTH)
+        query->server = ares__choose_server(channel, query, -1, &now);
+      else
+        {
+          query->server = channel->last_server;
+          if (channel->rotate == 1)
+            channel->last_server = (channel->last_server + 1) % naddrs;
+        }
+      ares__send_query(channel, query, &now);
+    }
+  channel->processing--;
+
+out:
+  if (infos)
+    {
+      for (k = 0; k < nqueries; k++)
+        ares__pool_free(channel, infos[k]);
+      ares_free(infos);
+    }
+  if (map)
+    ares_free(map);
+  if (servers)
+    ares_free(servers);
+  return status;
+}
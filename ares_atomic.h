@@ -0,0 +1,63 @@
+#ifndef HEADER_CARES_ATOMIC_H
+#define HEADER_CARES_ATOMIC_H
+
+/* Copyright (C) 2019 by The c-ares project
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+#include "ares_setup.h"
+
+/* Atomic operations on volatile unsigned ints, or unsigned longs, which
+ * are no wider on Windows, for the little state that is shared between
+ * threads (ares_submit.c, ares__server_health.c, ares_stats.c).
+ * ARES_HAVE_ATOMICS is only defined where the compiler provides them.
+ * Loads acquire, stores release and the others do both; a failed
+ * ATOMIC_CAS(p, o, n) leaves the value it found in o.
+ */
+
+#if defined(__GNUC__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))
+#  define ARES_HAVE_ATOMICS 1
+#  define ATOMIC_LOAD(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#  define ATOMIC_STORE(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#  define ATOMIC_SWAP(p, v)   __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#  define ATOMIC_CAS(p, o, n) \
+     __atomic_compare_exchange_n((p), &(o), (n), 0, __ATOMIC_ACQ_REL, \
+                                 __ATOMIC_ACQUIRE)
+#elif defined(_MSC_VER)
+#  define ARES_HAVE_ATOMICS 1
+   /* Interlocked functions are full barriers.  A plain volatile read is
+      only ordered with /volatile:ms, which ARM targets do not default to,
+      so loads go through a compare exchange that never changes the value */
+#  define ATOMIC_LOAD(p) \
+     ((unsigned int)InterlockedCompareExchange((volatile LONG *)(p), 0, 0))
+#  define ATOMIC_STORE(p, v)  InterlockedExchange((volatile LONG *)(p), (v))
+#  define ATOMIC_SWAP(p, v)   InterlockedExchange((volatile LONG *)(p), (v))
+#  define ATOMIC_CAS(p, o, n) ares_atomic_cas((p), &(o), (n))
+
+static __inline int ares_atomic_cas(volatile unsigned int *p,
+                                    unsigned int *o, unsigned int n)
+{
+  unsigned int seen;
+
+  seen = (unsigned int)InterlockedCompareExchange((volatile LONG *)p,
+                                                  (LONG)n, (LONG)*o);
+  if (seen == *o)
+    return 1;
+  *o = seen;
+  return 0;
+}
+#endif
+
+#endif /* HEADER_CARES_ATOMIC_H */
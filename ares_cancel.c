@@ -28,8 +28,9 @@ void ares_cancel(ares_channel channel)
   struct query *query;
   struct list_node list_head_copy;
   struct list_node* list_head;
-  struct list_node* list_node;
-  int i;
+
+  /* Requests other threads submitted are cancelled before they start */
+  ares__submitq_fail(channel, ARES_ECANCELLED);
 
   if (!ares__is_list_empty(&(channel->all_queries)))
   {
@@ -44,20 +45,139 @@ void ares_cancel(ares_channel channel)
     list_head_copy.next->prev = &list_head_copy;
     list_head->prev = list_head;
     list_head->next = list_head;
-    for (list_node = list_head_copy.next; list_node != &list_head_copy; )
+    channel->processing++;
+    /* Callbacks may cancel any of the other queries, so always take the
+     * first one left. */
+    while (!ares__is_list_empty(&list_head_copy))
     {
-      query = list_node->data;
-      list_node = list_node->next;  /* since we're deleting the query */
-      query->callback(query->arg, ARES_ECANCELLED, 0, NULL, 0);
-      ares__free_query(query);
+      query = list_head_copy.next->data;
+      ares__query_callback(channel, query, ARES_ECANCELLED, 0, NULL, 0);
+      ares__free_query(channel, query);
     }
+    channel->processing--;
   }
-  if (!(channel->flags & ARES_FLAG_STAYOPEN) && ares__is_list_empty(&(channel->all_queries)))
-  {
-    if (channel->servers)
+  ares__close_unused_sockets(channel);
+}
+
+/*
+ * ares_cancel_query() cancels the one operation started by an ares_*_handle()
+ * function: the queries sent for it end with ARES_ECANCELLED, which the
+ * layers above them pass on to the caller without sending anything more.
+ */
+void ares_cancel_query(ares_handle handle)
+{
+  ares_channel channel;
+  struct query *query;
+  struct list_node list_head_copy;
+  struct list_node* list_head;
+
+  if (!handle || handle->done || handle->cancelled)
+    return;
+
+  channel = handle->channel;
+  handle->cancelled = 1;
+  handle->cancelling = 1;
+  channel->processing++;
+  /* Take the queries off the handle before ending any of them: the first
+   * one to end may finish the operation, and the handle then lets go of the
+   * others, such as those of a parallel search, which must still be ended.
+   * No more are sent for a cancelled handle. */
+  if (!ares__is_list_empty(&(handle->queries)))
     {
-      for (i = 0; i < channel->nservers; i++)
-        ares__close_sockets(channel, &channel->servers[i]);
+      list_head = &(handle->queries);
+      list_head_copy.prev = list_head->prev;
+      list_head_copy.next = list_head->next;
+      list_head_copy.prev->next = &list_head_copy;
+      list_head_copy.next->prev = &list_head_copy;
+      list_head->prev = list_head;
+      list_head->next = list_head;
+      while (!ares__is_list_empty(&list_head_copy))
+        {
+          query = list_head_copy.next->data;
+          ares__query_callback(channel, query, ARES_ECANCELLED, 0, NULL, 0);
+          ares__free_query(channel, query);
+        }
     }
-  }
+  channel->processing--;
+  handle->cancelling = 0;
+
+  /* Held on to above, in case the caller was called back while at it */
+  if (handle->done && !handle->starting)
+    ares_free(handle);
+  ares__close_unused_sockets(channel);
+}
+
+ares_handle ares__handle_create(ares_channel channel, ares_callback callback,
+                                ares_addrinfo_callback ai_callback,
+                                void *arg)
+{
+  ares_handle handle;
+
+  handle = ares_malloc(sizeof(struct ares_handledata));
+  if (!handle)
+    return NULL;
+  handle->channel = channel;
+  ares__init_list_head(&(handle->queries));
+  handle->callback = callback;
+  handle->ai_callback = ai_callback;
+  handle->arg = arg;
+  handle->starting = 1;
+  handle->cancelling = 0;
+  handle->cancelled = 0;
+  handle->done = 0;
+  return handle;
+}
+
+/* Called when the ares_*_handle() function is about to return handle. */
+ares_handle ares__handle_started(ares_handle handle)
+{
+  if (handle->done)
+    {
+      /* Called back already, so there is nothing left to cancel */
+      ares_free(handle);
+      return NULL;
+    }
+  handle->starting = 0;
+  return handle;
+}
+
+/* The operation is over: queries sent for it that are still in flight,
+ * such as those of a parallel search that lost, are no longer its own. */
+static void handle_done(ares_handle handle)
+{
+  struct query *query;
+
+  while (!ares__is_list_empty(&(handle->queries)))
+    {
+      query = handle->queries.next->data;
+      ares__remove_from_list(&(query->node_by_handle));
+      query->handle = NULL;
+    }
+  handle->done = 1;
+}
+
+static void handle_release(ares_handle handle)
+{
+  if (!handle->starting && !handle->cancelling)
+    ares_free(handle);
+}
+
+void ares__handle_callback(void *arg, int status, int timeouts,
+                           unsigned char *abuf, int alen)
+{
+  ares_handle handle = (ares_handle) arg;
+
+  handle_done(handle);
+  handle->callback(handle->arg, status, timeouts, abuf, alen);
+  handle_release(handle);
+}
+
+void ares__handle_ai_callback(void *arg, int status, int timeouts,
+                              struct ares_addrinfo *res)
+{
+  ares_handle handle = (ares_handle) arg;
+
+  handle_done(handle);
+  handle->ai_callback(handle->arg, status, timeouts, res);
+  handle_release(handle);
 }
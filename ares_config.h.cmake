@@ -211,9 +211,15 @@
 /* Define to 1 if you have the recvfrom function. */
 #cmakedefine HAVE_RECVFROM
 
+/* Define to 1 if you have the recvmmsg function. */
+#cmakedefine HAVE_RECVMMSG
+
 /* Define to 1 if you have the send function. */
 #cmakedefine HAVE_SEND
 
+/* Define to 1 if you have the sendmmsg function. */
+#cmakedefine HAVE_SENDMMSG
+
 /* Define to 1 if you have the setsockopt function. */
 #cmakedefine HAVE_SETSOCKOPT
 
@@ -87,6 +87,19 @@
 int ares_create_query(const char *name, int dnsclass, int type,
                       unsigned short id, int rd, unsigned char **bufp,
                       int *buflenp, int max_udp_size)
+{
+  return ares__create_query(name, dnsclass, type, id, rd, NULL, 0,
+                            bufp, buflenp, max_udp_size);
+}
+
+/* Like ares_create_query(), but builds the query in the caller's buffer
+ * of size space when it is large enough, only allocating one otherwise.
+ * The caller must free *bufp only if it differs from space.
+ */
+int ares__create_query(const char *name, int dnsclass, int type,
+                       unsigned short id, int rd, unsigned char *space,
+                       size_t spacelen, unsigned char **bufp,
+                       int *buflenp, int max_udp_size)
 {
   size_t len;
   unsigned char *q;
@@ -108,9 +121,14 @@ int ares_create_query(const char *name, int dnsclass, int type,
    */
   len = strlen(name) + 2 + HFIXEDSZ + QFIXEDSZ +
     (max_udp_size ? EDNSFIXEDSZ : 0);
-  buf = ares_malloc(len);
-  if (!buf)
-    return ARES_ENOMEM;
+  if (space && len <= spacelen)
+    buf = space;
+  else
+    {
+      buf = ares_malloc(len);
+      if (!buf)
+        return ARES_ENOMEM;
+    }
 
   /* Set up the header. */
   q = buf;
@@ -138,7 +156,8 @@ int ares_create_query(const char *name, int dnsclass, int type,
   while (*name)
     {
       if (*name == '.') {
-        ares_free (buf);
+        if (buf != space)
+          ares_free (buf);
         return ARES_EBADNAME;
       }
 
@@ -151,7 +170,8 @@ int ares_create_query(const char *name, int dnsclass, int type,
           len++;
         }
       if (len > MAXLABEL) {
-        ares_free (buf);
+        if (buf != space)
+          ares_free (buf);
         return ARES_EBADNAME;
       }
 
@@ -194,7 +214,8 @@ int ares_create_query(const char *name, int dnsclass, int type,
    * to 255 octets or less."). */
   if (buflen > (size_t)(MAXCDNAME + HFIXEDSZ + QFIXEDSZ +
                 (max_udp_size ? EDNSFIXEDSZ : 0))) {
-    ares_free (buf);
+    if (buf != space)
+      ares_free (buf);
     return ARES_EBADNAME;
   }
 
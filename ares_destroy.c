@@ -44,36 +44,38 @@ void ares_destroy(ares_channel channel)
 {
   int i;
   struct query *query;
-  struct list_node* list_head;
-  struct list_node* list_node;
 
   if (!channel)
     return;
 
-  list_head = &(channel->all_queries);
-  for (list_node = list_head->next; list_node != list_head; )
+  /* Requests other threads submitted are not started any more */
+  ares__submitq_fail(channel, ARES_EDESTRUCTION);
+
+  /* Callbacks may cancel any of the other queries, so always take the
+   * first one left. */
+  while (!ares__is_list_empty(&(channel->all_queries)))
     {
-      query = list_node->data;
-      list_node = list_node->next;  /* since we're deleting the query */
-      query->callback(query->arg, ARES_EDESTRUCTION, 0, NULL, 0);
-      ares__free_query(query);
+      query = channel->all_queries.next->data;
+      ares__query_callback(channel, query, ARES_EDESTRUCTION, 0, NULL, 0);
+      ares__free_query(channel, query);
     }
 #ifndef NDEBUG
   /* Freeing the query should remove it from all the lists in which it sits,
    * so all query lists should be empty now.
    */
   assert(ares__is_list_empty(&(channel->all_queries)));
-  for (i = 0; i < ARES_QID_TABLE_SIZE; i++)
-    {
-      assert(ares__is_list_empty(&(channel->queries_by_qid[i])));
-    }
-  for (i = 0; i < ARES_TIMEOUT_TABLE_SIZE; i++)
-    {
-      assert(ares__is_list_empty(&(channel->queries_by_timeout[i])));
-    }
+  assert(channel->queries_by_qid.count == 0);
+  assert(channel->hedges_by_qid.count == 0);
+  assert(channel->queries_by_question.count == 0);
+  assert(channel->nqueries_by_timeout == 0);
 #endif
 
   ares__destroy_servers_state(channel);
+  ares_free(channel->queries_by_timeout);
+  ares__list_table_destroy(&(channel->queries_by_qid));
+  ares__list_table_destroy(&(channel->hedges_by_qid));
+  ares__list_table_destroy(&(channel->queries_by_question));
+  ares__list_table_destroy(&(channel->conns_by_fd));
 
   if (channel->domains) {
     for (i = 0; i < channel->ndomains; i++)
@@ -90,24 +92,46 @@ void ares_destroy(ares_channel channel)
   if (channel->resolvconf_path)
     ares_free(channel->resolvconf_path);
 
+  ares__hosts_destroy(channel->hosts);
+  ares__qcache_destroy(channel->qcache);
+  ares__negcache_destroy(channel->negcache);
+  ares__submitq_destroy(channel);
+  ares_free(channel->udp_recv_bufs);
+  ares__pool_destroy(channel);
+
   ares_free(channel);
 }
 
 void ares__destroy_servers_state(ares_channel channel)
 {
-  struct server_state *server;
   int i;
 
   if (channel->servers)
     {
       for (i = 0; i < channel->nservers; i++)
-        {
-          server = &channel->servers[i];
-          ares__close_sockets(channel, server);
-          assert(ares__is_list_empty(&server->queries_to_server));
-        }
+        ares__destroy_server_state(channel, &channel->servers[i]);
       ares_free(channel->servers);
       channel->servers = NULL;
     }
   channel->nservers = -1;
 }
+
+/* Close the sockets of a server no query is waiting on and free its
+ * resources. */
+void ares__destroy_server_state(ares_channel channel,
+                                struct server_state *server)
+{
+  struct server_connection *conn;
+
+  ares__close_sockets(channel, server);
+  assert(ares__is_list_empty(&server->queries_to_server));
+  while (!ares__is_list_empty(&server->connections))
+    {
+      conn = server->connections.next->data;
+      ares__remove_from_list(&conn->node);
+      ares_free(conn);
+    }
+  if (server->tcp_rbuf)
+    ares_free(server->tcp_rbuf);
+  server->tcp_rbuf = NULL;
+}
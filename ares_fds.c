@@ -23,11 +23,19 @@
 int ares_fds(ares_channel channel, fd_set *read_fds, fd_set *write_fds)
 {
   struct server_state *server;
+  struct server_connection *conn;
+  struct list_node* list_head;
+  struct list_node* list_node;
   ares_socket_t nfds;
   int i;
 
+  int active_queries;
+
+  /* Queries held back by ARES_FLAG_DEFERSEND go out before we wait. */
+  ares__send_pending(channel);
+
   /* Are there any active queries? */
-  int active_queries = !ares__is_list_empty(&(channel->all_queries));
+  active_queries = !ares__is_list_empty(&(channel->all_queries));
 
   nfds = 0;
   for (i = 0; i < channel->nservers; i++)
@@ -36,23 +44,28 @@ int ares_fds(ares_channel channel, fd_set *read_fds, fd_set *write_fds)
       /* We only need to register interest in UDP sockets if we have
        * outstanding queries.
        */
-      if (active_queries && server->udp_socket != ARES_SOCKET_BAD)
+      list_head = &(server->connections);
+      for (list_node = list_head->next; active_queries && list_node != list_head;
+           list_node = list_node->next)
         {
-          FD_SET(server->udp_socket, read_fds);
-          if (server->udp_socket >= nfds)
-            nfds = server->udp_socket + 1;
+          conn = list_node->data;
+          if (conn->fd == ARES_SOCKET_BAD)
+            continue;
+          FD_SET(conn->fd, read_fds);
+          if (conn->fd >= nfds)
+            nfds = conn->fd + 1;
         }
       /* We always register for TCP events, because we want to know
        * when the other side closes the connection, so we don't waste
        * time trying to use a broken connection.
        */
-      if (server->tcp_socket != ARES_SOCKET_BAD)
+      if (server->tcp_conn.fd != ARES_SOCKET_BAD)
        {
-         FD_SET(server->tcp_socket, read_fds);
+         FD_SET(server->tcp_conn.fd, read_fds);
          if (server->qhead)
-           FD_SET(server->tcp_socket, write_fds);
-         if (server->tcp_socket >= nfds)
-           nfds = server->tcp_socket + 1;
+           FD_SET(server->tcp_conn.fd, write_fds);
+         if (server->tcp_conn.fd >= nfds)
+           nfds = server->tcp_conn.fd + 1;
 	}
     }
   return (int)nfds;
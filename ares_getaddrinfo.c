@@ -71,11 +71,14 @@ struct host_query
   ares_addrinfo_callback callback;
   void *arg;
   struct ares_addrinfo_hints hints;
-  int sent_family; /* this family is what was is being used */
+  int remaining;   /* number of DNS answers we are still waiting for */
+  int status;      /* merged status of the DNS answers received so far */
   int timeouts;    /* number of timeouts we saw for this request */
+  char *lookups;   /* our copy, as ares_reinit() may replace the channel's */
   const char *remaining_lookups; /* types of lookup we need to perform ("fb" by
                                     default, file and dns respectively) */
   struct ares_addrinfo *ai;      /* store results between lookups */
+  ares_handle handle;            /* the caller's, if any, for every query */
 };
 
 static const struct ares_addrinfo_hints default_hints = {
@@ -421,15 +424,13 @@ static void end_hquery(struct host_query *hquery, int status)
     }
 
   hquery->callback(hquery->arg, status, hquery->timeouts, hquery->ai);
+  ares_free(hquery->lookups);
   ares_free(hquery->name);
   ares_free(hquery);
 }
 
 static int file_lookup(struct host_query *hquery)
 {
-  FILE *fp;
-  int error;
-  int status;
   const char *path_hosts = NULL;
 
   if (hquery->hints.ai_flags & ARES_AI_ENVHOSTS)
@@ -437,67 +438,8 @@ static int file_lookup(struct host_query *hquery)
       path_hosts = getenv("CARES_HOSTS");
     }
 
-  if (!path_hosts)
-    {
-#ifdef WIN32
-      char PATH_HOSTS[MAX_PATH];
-      win_platform platform;
-
-      PATH_HOSTS[0] = '\0';
-
-      platform = ares__getplatform();
-
-      if (platform == WIN_NT)
-        {
-          char tmp[MAX_PATH];
-          HKEY hkeyHosts;
-
-          if (RegOpenKeyEx(HKEY_LOCAL_MACHINE, WIN_NS_NT_KEY, 0, KEY_READ,
-                           &hkeyHosts) == ERROR_SUCCESS)
-            {
-              DWORD dwLength = MAX_PATH;
-              RegQueryValueEx(hkeyHosts, DATABASEPATH, NULL, NULL, (LPBYTE)tmp,
-                              &dwLength);
-              ExpandEnvironmentStrings(tmp, PATH_HOSTS, MAX_PATH);
-              RegCloseKey(hkeyHosts);
-            }
-        }
-      else if (platform == WIN_9X)
-        GetWindowsDirectory(PATH_HOSTS, MAX_PATH);
-      else
-        return ARES_ENOTFOUND;
-
-      strcat(PATH_HOSTS, WIN_PATH_HOSTS);
-      path_hosts = PATH_HOSTS;
-
-#elif defined(WATT32)
-      const char *PATH_HOSTS = _w32_GetHostsFile();
-
-      if (!PATH_HOSTS)
-        return ARES_ENOTFOUND;
-#endif
-      path_hosts = PATH_HOSTS;
-    }
-
-  fp = fopen(path_hosts, "r");
-  if (!fp)
-    {
-      error = ERRNO;
-      switch (error)
-        {
-        case ENOENT:
-        case ESRCH:
-          return ARES_ENOTFOUND;
-        default:
-          DEBUGF(fprintf(stderr, "fopen() failed with error: %d %s\n", error,
-                         strerror(error)));
-          DEBUGF(fprintf(stderr, "Error opening file: %s\n", path_hosts));
-          return ARES_EFILE;
-        }
-    }
-  status = ares__readaddrinfo(fp, hquery->name, hquery->port, &hquery->hints, hquery->ai);
-  fclose(fp);
-  return status;
+  return ares__hosts_addrinfo(hquery->channel, path_hosts, hquery->name,
+                              hquery->port, &hquery->hints, hquery->ai);
 }
 
 static void next_lookup(struct host_query *hquery, int status_code)
@@ -512,18 +454,33 @@ static void next_lookup(struct host_query *hquery, int status_code)
         case 'b':
           /* DNS lookup */
           hquery->remaining_lookups = p + 1;
-          if ((hquery->hints.ai_family == AF_INET6) ||
-              (hquery->hints.ai_family == AF_UNSPEC)) {
-            /* if inet6 or unspec, start out with AAAA */
-            hquery->sent_family = AF_INET6;
-            ares_search(hquery->channel, hquery->name, C_IN, T_AAAA,
-                        host_callback, hquery);
-          }
-          else {
-            hquery->sent_family = AF_INET;
-            ares_search(hquery->channel, hquery->name, C_IN, T_A,
-                        host_callback, hquery);
-          }
+          /* With an unspecified family the AAAA and A queries are sent
+             together, so a slow or lost answer for one of them does not
+             hold back the other.  Both answers are merged into hquery->ai
+             and the lookup finishes once the last one has arrived.  The
+             counter must be set before anything is sent since an answer
+             may be delivered before ares_search() returns. */
+          hquery->status = ARES_SUCCESS;
+          switch (hquery->hints.ai_family)
+            {
+              case AF_INET:
+                hquery->remaining = 1;
+                ares__search(hquery->channel, hquery->name, C_IN, T_A,
+                             hquery->handle, host_callback, hquery);
+                break;
+              case AF_INET6:
+                hquery->remaining = 1;
+                ares__search(hquery->channel, hquery->name, C_IN, T_AAAA,
+                             hquery->handle, host_callback, hquery);
+                break;
+              case AF_UNSPEC:
+                hquery->remaining = 2;
+                ares__search(hquery->channel, hquery->name, C_IN, T_AAAA,
+                             hquery->handle, host_callback, hquery);
+                ares__search(hquery->channel, hquery->name, C_IN, T_A,
+                             hquery->handle, host_callback, hquery);
+                break;
+            }
           return;
 
         case 'f':
@@ -545,52 +502,105 @@ static void next_lookup(struct host_query *hquery, int status_code)
   end_hquery(hquery, status);
 }
 
+/* Resolve service, a name or a number, into a port number in host byte
+ * order, as the ARES_AI_NUMERICSERV flag allows.  A NULL service gives 0.
+ */
+int ares__addrinfo_port(const char *service, int flags, unsigned short *port)
+{
+  *port = 0;
+  if (!service)
+    {
+      return ARES_SUCCESS;
+    }
+
+  if (!(flags & ARES_AI_NUMERICSERV))
+    {
+      *port = lookup_service(service, 0);
+    }
+  if (!*port)
+    {
+      *port = (unsigned short)strtoul(service, NULL, 0);
+    }
+  return *port ? ARES_SUCCESS : ARES_ESERVICE;
+}
+
+/* Combine the failure of one DNS answer with those seen before it, so the
+ * result does not depend on which of the parallel answers came in last.
+ * Destruction always wins, then cancellation, then an answer from the
+ * servers (no such name, then no such record) over a transport level
+ * error. */
+int ares__addrinfo_merge_status(int prev, int cur)
+{
+  if (prev == ARES_SUCCESS)
+    return cur;
+  if (prev == ARES_EDESTRUCTION || cur == ARES_EDESTRUCTION)
+    return ARES_EDESTRUCTION;
+  if (prev == ARES_ECANCELLED || cur == ARES_ECANCELLED)
+    return ARES_ECANCELLED;
+  if (prev == ARES_ENOTFOUND || cur == ARES_ENOTFOUND)
+    return ARES_ENOTFOUND;
+  if (prev == ARES_ENODATA || cur == ARES_ENODATA)
+    return ARES_ENODATA;
+  return cur;
+}
+
 static void host_callback(void *arg, int status, int timeouts,
                           unsigned char *abuf, int alen)
 {
   struct host_query *hquery = (struct host_query *) arg;
   hquery->timeouts += timeouts;
+  hquery->remaining--;
+
   if (status == ARES_SUCCESS)
-    {
-      if (hquery->sent_family == AF_INET)
-        {
-          status = ares__parse_into_addrinfo(abuf, alen, hquery->ai);
-        }
-      else if (hquery->sent_family == AF_INET6)
-        {
-          status = ares__parse_into_addrinfo(abuf, alen, hquery->ai);
-          if (hquery->hints.ai_family == AF_UNSPEC)
-            {
-              /* Now look for A records and append them to existing results. */
-              hquery->sent_family = AF_INET;
-              ares_search(hquery->channel, hquery->name, C_IN, T_A,
-                          host_callback, hquery);
-              return;
-            }
-        }
-      end_hquery(hquery, status);
-    }
-  else if ((status == ARES_ENODATA || status == ARES_ESERVFAIL ||
-            status == ARES_ECONNREFUSED || status == ARES_EBADRESP ||
-            status == ARES_ETIMEOUT) &&
-           (hquery->sent_family == AF_INET6 &&
-            hquery->hints.ai_family == AF_UNSPEC))
-    {
-      /* The AAAA query yielded no useful result.  Now look up an A instead. */
-      hquery->sent_family = AF_INET;
-      ares_search(hquery->channel, hquery->name, C_IN, T_A, host_callback,
-                  hquery);
-    }
-  else if (status == ARES_EDESTRUCTION)
-    end_hquery(hquery, status);
+    status = ares__parse_into_addrinfo(abuf, alen, hquery->ai);
+  if (status != ARES_SUCCESS)
+    hquery->status = ares__addrinfo_merge_status(hquery->status, status);
+
+  if (hquery->remaining)
+    return;
+
+  /* A cancelled lookup must not go on to the other sources */
+  if (hquery->status == ARES_EDESTRUCTION ||
+      hquery->status == ARES_ECANCELLED)
+    end_hquery(hquery, hquery->status);
+  else if (hquery->ai->nodes)
+    end_hquery(hquery, ARES_SUCCESS);
   else
-    next_lookup(hquery, status);
+    next_lookup(hquery, hquery->status);
 }
 
 void ares_getaddrinfo(ares_channel channel,
                       const char* name, const char* service,
                       const struct ares_addrinfo_hints* hints,
                       ares_addrinfo_callback callback, void* arg)
+{
+  ares__getaddrinfo(channel, name, service, hints, NULL, callback, arg);
+}
+
+ares_handle ares_getaddrinfo_handle(ares_channel channel,
+                                    const char* name, const char* service,
+                                    const struct ares_addrinfo_hints* hints,
+                                    ares_addrinfo_callback callback,
+                                    void* arg)
+{
+  ares_handle handle;
+
+  handle = ares__handle_create(channel, NULL, callback, arg);
+  if (!handle)
+    {
+      callback(arg, ARES_ENOMEM, 0, NULL);
+      return NULL;
+    }
+  ares__getaddrinfo(channel, name, service, hints, handle,
+                    ares__handle_ai_callback, handle);
+  return ares__handle_started(handle);
+}
+
+void ares__getaddrinfo(ares_channel channel,
+                       const char* name, const char* service,
+                       const struct ares_addrinfo_hints* hints,
+                       ares_handle handle, ares_addrinfo_callback callback,
+                       void* arg)
 {
   struct host_query *hquery;
   unsigned short port = 0;
@@ -614,30 +624,10 @@ void ares_getaddrinfo(ares_channel channel,
       return;
     }
 
-  if (service)
+  if (ares__addrinfo_port(service, hints->ai_flags, &port) != ARES_SUCCESS)
     {
-      if (hints->ai_flags & ARES_AI_NUMERICSERV)
-        {
-          port = (unsigned short)strtoul(service, NULL, 0);
-          if (!port)
-            {
-              callback(arg, ARES_ESERVICE, 0, NULL);
-              return;
-            }
-        }
-      else
-        {
-          port = lookup_service(service, 0);
-          if (!port)
-            {
-              port = (unsigned short)strtoul(service, NULL, 0);
-              if (!port)
-                {
-                  callback(arg, ARES_ESERVICE, 0, NULL);
-                  return;
-                }
-            }
-        }
+      callback(arg, ARES_ESERVICE, 0, NULL);
+      return;
     }
 
   ai = ares__malloc_addrinfo();
@@ -669,16 +659,27 @@ void ares_getaddrinfo(ares_channel channel,
       callback(arg, ARES_ENOMEM, 0, NULL);
       return;
     }
+  hquery->lookups = ares_strdup(channel->lookups);
+  if (!hquery->lookups)
+    {
+      ares_free(hquery->name);
+      ares_free(hquery);
+      ares_freeaddrinfo(ai);
+      callback(arg, ARES_ENOMEM, 0, NULL);
+      return;
+    }
 
   hquery->port = port;
   hquery->channel = channel;
   hquery->hints = *hints;
-  hquery->sent_family = -1; /* nothing is sent yet */
+  hquery->remaining = 0;
+  hquery->status = ARES_SUCCESS;
   hquery->callback = callback;
   hquery->arg = arg;
-  hquery->remaining_lookups = channel->lookups;
+  hquery->remaining_lookups = hquery->lookups;
   hquery->timeouts = 0;
   hquery->ai = ai;
+  hquery->handle = handle;
 
   /* Start performing lookups according to channel->lookups. */
   next_lookup(hquery, ARES_ECONNREFUSED /* initial error code */);
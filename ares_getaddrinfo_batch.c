@@ -0,0 +1,509 @@
+/* Copyright (C) 2019 by The c-ares project
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+#include "ares_setup.h"
+
+#ifdef HAVE_NETINET_IN_H
+#  include <netinet/in.h>
+#endif
+#ifdef HAVE_ARPA_NAMESER_H
+#  include <arpa/nameser.h>
+#else
+#  include "nameser.h"
+#endif
+#ifdef HAVE_ARPA_NAMESER_COMPAT_H
+#  include <arpa/nameser_compat.h>
+#endif
+
+#include "ares.h"
+#include "ares_dns.h"
+#include "ares_private.h"
+
+/* A batch resolves an array of names as ares_getaddrinfo() would, keeping
+ * at most max_outstanding of them in flight and starting the next one as
+ * each finishes.  It does not go through ares_getaddrinfo() though, as that
+ * costs a few allocations per name and a result list to free for each:
+ *
+ * - the batch and one record per item are a single allocation;
+ * - the DNS answers are parsed in place, and the addresses of all items
+ *   are appended to one array as they come in, each item chaining its own
+ *   through a parallel array of links;
+ * - once every item is done the array is sorted by item in place, so each
+ *   item's addresses are contiguous, then each item's addresses in RFC 6724
+ *   order unless its hints ask otherwise, and a single callback gets them
+ *   all.
+ *
+ * Items whose lookup failed on a timeout or a server error are queued for
+ * another try, behind the items not started yet, while they have tries
+ * left.
+ */
+
+#define BATCH_NONE ((size_t)-1)
+
+struct addrinfo_batch;
+
+struct batch_record {
+  struct addrinfo_batch *batch;
+  size_t first;       /* the item's first address, or BATCH_NONE */
+  size_t last;        /* and its last one */
+  size_t retry_next;  /* next item in the retry queue */
+  const char *lookup; /* next source to try, in batch->lookups */
+  int family;         /* from the item's hints */
+  int flags;
+  int remaining;      /* DNS answers still to come */
+  int status;
+  int tries;          /* attempts left, counting the one in progress */
+  int asked_dns;      /* set once a DNS query was sent for the item */
+};
+
+struct addrinfo_batch {
+  ares_channel channel;
+  struct ares_addrinfo_batch_item *items;
+  size_t nitems;
+  size_t next;             /* first item not started yet */
+  size_t retry_head;       /* items to try again, in order */
+  size_t retry_tail;
+  size_t outstanding;      /* items started but not finished */
+  size_t max_outstanding;  /* 0 for no limit */
+  int starting;            /* set while start_items() is running */
+  int status;              /* ARES_SUCCESS unless the batch was cut short */
+  char lookups[3];         /* the channel's lookups when the batch began */
+  ares_addrinfo_batch_callback callback;
+  void *arg;
+  struct ares_addrinfo_batch_addr *addrs;
+  size_t *links;           /* next address of the same item, per address */
+  size_t naddrs;
+  size_t maxaddrs;
+  struct batch_record *records;
+};
+
+static void start_items(struct addrinfo_batch *batch);
+static void next_lookup(struct batch_record *rec);
+
+static int add_addr(void *arg, int family, const void *addr)
+{
+  struct batch_record *rec = (struct batch_record *) arg;
+  struct addrinfo_batch *batch = rec->batch;
+  struct ares_addrinfo_batch_item *item = &batch->items[rec - batch->records];
+  struct ares_addrinfo_batch_addr *addrs;
+  size_t *links;
+  size_t max;
+  size_t n;
+
+  if (batch->naddrs == batch->maxaddrs)
+    {
+      max = batch->maxaddrs ? 2 * batch->maxaddrs : 16;
+      if (max > (size_t)-1 / sizeof(struct ares_addrinfo_batch_addr))
+        return ARES_ENOMEM;
+      addrs = ares_realloc(batch->addrs,
+                           max * sizeof(struct ares_addrinfo_batch_addr));
+      if (!addrs)
+        return ARES_ENOMEM;
+      batch->addrs = addrs;
+      links = ares_realloc(batch->links, max * sizeof(size_t));
+      if (!links)
+        return ARES_ENOMEM;
+      batch->links = links;
+      batch->maxaddrs = max;
+    }
+
+  n = batch->naddrs++;
+  memset(&batch->addrs[n], 0, sizeof(batch->addrs[n]));
+  batch->addrs[n].family = family;
+  if (family == AF_INET)
+    memcpy(&batch->addrs[n].addr.addr4, addr, sizeof(struct in_addr));
+  else
+    memcpy(&batch->addrs[n].addr.addr6, addr, sizeof(struct ares_in6_addr));
+  batch->links[n] = BATCH_NONE;
+  if (rec->first == BATCH_NONE)
+    rec->first = n;
+  else
+    batch->links[rec->last] = n;
+  rec->last = n;
+  item->naddrs++;
+  return ARES_SUCCESS;
+}
+
+/* Add the A and AAAA records of the answer section of a DNS answer. */
+static int add_answer(struct batch_record *rec,
+                      const unsigned char *abuf, int alen)
+{
+  const unsigned char *p = abuf + HFIXEDSZ;
+  const unsigned char *end = abuf + alen;
+  int qdcount, ancount;
+  int type, len;
+  int added = 0;
+  int status;
+
+  if (alen < HFIXEDSZ)
+    return ARES_EBADRESP;
+  qdcount = DNS_HEADER_QDCOUNT(abuf);
+  ancount = DNS_HEADER_ANCOUNT(abuf);
+
+  while (qdcount--)
+    {
+      p = ares__skip_name(p, abuf, alen);
+      if (!p || p + QFIXEDSZ > end)
+        return ARES_EBADRESP;
+      p += QFIXEDSZ;
+    }
+
+  while (ancount--)
+    {
+      p = ares__skip_name(p, abuf, alen);
+      if (!p || p + RRFIXEDSZ > end)
+        return ARES_EBADRESP;
+      type = DNS_RR_TYPE(p);
+      len = DNS_RR_LEN(p);
+      if (p + RRFIXEDSZ + len > end)
+        return ARES_EBADRESP;
+      if (DNS_RR_CLASS(p) == C_IN &&
+          ((type == T_A && len == sizeof(struct in_addr)) ||
+           (type == T_AAAA && len == sizeof(struct ares_in6_addr))))
+        {
+          status = add_addr(rec, type == T_A ? AF_INET : AF_INET6,
+                            p + RRFIXEDSZ);
+          if (status != ARES_SUCCESS)
+            return status;
+          rec->batch->addrs[rec->last].ttl = (int)DNS_RR_TTL(p);
+          added = 1;
+        }
+      p += RRFIXEDSZ + len;
+    }
+
+  return added ? ARES_SUCCESS : ARES_ENODATA;
+}
+
+/* Add the address if the name is a numeric one, as ares_getaddrinfo()
+ * does without looking it up.  Returns 0 if it is not.
+ */
+static int add_numeric(struct batch_record *rec, int family, const char *name,
+                       int *status)
+{
+  struct in_addr addr4;
+  struct ares_in6_addr addr6;
+
+  if ((family == AF_INET || family == AF_UNSPEC) &&
+      ares_inet_pton(AF_INET, name, &addr4) > 0)
+    *status = add_addr(rec, AF_INET, &addr4);
+  else if ((family == AF_INET6 || family == AF_UNSPEC) &&
+           ares_inet_pton(AF_INET6, name, &addr6) > 0)
+    *status = add_addr(rec, AF_INET6, &addr6);
+  else
+    return 0;
+  return 1;
+}
+
+/* Fail the items not started yet, as the batch cannot go on. */
+static void abort_items(struct addrinfo_batch *batch, int status)
+{
+  batch->status = status;
+  for (; batch->retry_head != BATCH_NONE;
+       batch->retry_head = batch->records[batch->retry_head].retry_next)
+    batch->items[batch->retry_head].status = status;
+  for (; batch->next < batch->nitems; batch->next++)
+    batch->items[batch->next].status = status;
+}
+
+/* Sort the addresses by item, in place: work out where each one goes by
+ * following the chains, then swap them into place a cycle at a time.
+ */
+static void gather_addrs(struct addrinfo_batch *batch)
+{
+  struct ares_addrinfo_batch_addr tmp;
+  size_t pos = 0;
+  size_t i, j, k;
+
+  for (i = 0; i < batch->nitems; i++)
+    {
+      batch->items[i].addrs =
+        batch->items[i].naddrs ? &batch->addrs[pos] : NULL;
+      for (k = batch->records[i].first; k != BATCH_NONE; k = j)
+        {
+          j = batch->links[k];
+          batch->links[k] = pos++;
+        }
+    }
+
+  for (i = 0; i < batch->naddrs; i++)
+    {
+      while (batch->links[i] != i)
+        {
+          j = batch->links[i];
+          tmp = batch->addrs[i];
+          batch->addrs[i] = batch->addrs[j];
+          batch->addrs[j] = tmp;
+          batch->links[i] = batch->links[j];
+          batch->links[j] = j;
+        }
+    }
+}
+
+/* Sort each item's addresses as ares_getaddrinfo() sorts its list, and
+ * like it keep them in the order found if that fails. */
+static void sort_addrs(struct addrinfo_batch *batch)
+{
+  struct ares_addrinfo_batch_item *item;
+  size_t i;
+
+  for (i = 0; i < batch->nitems; i++)
+    {
+      item = &batch->items[i];
+      if (item->naddrs > 1 && !(batch->records[i].flags & ARES_AI_NOSORT))
+        ares__sortaddrs(batch->channel,
+                        (struct ares_addrinfo_batch_addr *)item->addrs,
+                        item->naddrs);
+    }
+}
+
+static void end_batch(struct addrinfo_batch *batch)
+{
+  gather_addrs(batch);
+  if (batch->status != ARES_EDESTRUCTION)
+    sort_addrs(batch);
+  if (batch->callback)
+    batch->callback(batch->arg, batch->status, batch->items, batch->nitems);
+  if (batch->addrs)
+    ares_free(batch->addrs);
+  if (batch->links)
+    ares_free(batch->links);
+  ares_free(batch);
+}
+
+static int retry_status(int status)
+{
+  return status == ARES_ETIMEOUT || status == ARES_ECONNREFUSED ||
+         status == ARES_ESERVFAIL;
+}
+
+static void end_item(struct batch_record *rec, int status)
+{
+  struct addrinfo_batch *batch = rec->batch;
+  size_t i = rec - batch->records;
+
+  batch->outstanding--;
+  batch->items[i].status = status;
+  if (status != ARES_SUCCESS && rec->asked_dns && retry_status(status) &&
+      --rec->tries > 0)
+    {
+      rec->retry_next = BATCH_NONE;
+      if (batch->retry_head == BATCH_NONE)
+        batch->retry_head = i;
+      else
+        batch->records[batch->retry_tail].retry_next = i;
+      batch->retry_tail = i;
+    }
+
+  /* Do not start new lookups on a channel being cancelled or destroyed */
+  if (status == ARES_ECANCELLED || status == ARES_EDESTRUCTION)
+    abort_items(batch, status);
+
+  if (!batch->starting)
+    start_items(batch);
+}
+
+static void dns_callback(void *arg, int status, int timeouts,
+                         unsigned char *abuf, int alen)
+{
+  struct batch_record *rec = (struct batch_record *) arg;
+
+  rec->batch->items[rec - rec->batch->records].timeouts += timeouts;
+  rec->remaining--;
+
+  if (status == ARES_SUCCESS)
+    status = add_answer(rec, abuf, alen);
+  if (status != ARES_SUCCESS)
+    rec->status = ares__addrinfo_merge_status(rec->status, status);
+
+  if (rec->remaining)
+    return;
+
+  if (rec->status == ARES_EDESTRUCTION || rec->status == ARES_ECANCELLED ||
+      rec->status == ARES_ENOMEM)
+    end_item(rec, rec->status);
+  else if (rec->first != BATCH_NONE)
+    end_item(rec, ARES_SUCCESS);
+  else
+    next_lookup(rec);
+}
+
+/* Try the sources of the channel in order, as ares_getaddrinfo() does. */
+static void next_lookup(struct batch_record *rec)
+{
+  struct addrinfo_batch *batch = rec->batch;
+  struct ares_addrinfo_batch_item *item = &batch->items[rec - batch->records];
+  int status;
+
+  for (; *rec->lookup; rec->lookup++)
+    {
+      switch (*rec->lookup)
+        {
+        case 'b':
+          /* As for ares_getaddrinfo(), the AAAA and A queries of an
+             unspecified family go out together; remaining must be set
+             before either is sent, as an answer may come at once. */
+          rec->lookup++;
+          rec->status = ARES_SUCCESS;
+          rec->asked_dns = 1;
+          if (rec->family == AF_UNSPEC)
+            {
+              rec->remaining = 2;
+              ares_search(batch->channel, item->node, C_IN, T_AAAA,
+                          dns_callback, rec);
+              ares_search(batch->channel, item->node, C_IN, T_A,
+                          dns_callback, rec);
+            }
+          else
+            {
+              rec->remaining = 1;
+              ares_search(batch->channel, item->node, C_IN,
+                          rec->family == AF_INET ? T_A : T_AAAA,
+                          dns_callback, rec);
+            }
+          return;
+
+        case 'f':
+          status = ares__hosts_addrs(batch->channel,
+                                     (rec->flags & ARES_AI_ENVHOSTS) ?
+                                     getenv("CARES_HOSTS") : NULL,
+                                     item->node, rec->family, add_addr, rec);
+          if (status == ARES_SUCCESS || status == ARES_ENOMEM)
+            {
+              end_item(rec, status);
+              return;
+            }
+          break;
+        }
+    }
+  end_item(rec, rec->status);
+}
+
+static void start_item(struct addrinfo_batch *batch, size_t i)
+{
+  struct batch_record *rec = &batch->records[i];
+  struct ares_addrinfo_batch_item *item = &batch->items[i];
+  int status;
+
+  batch->outstanding++;
+  rec->lookup = batch->lookups;
+  rec->remaining = 0;
+  rec->status = ARES_ECONNREFUSED; /* as ares_getaddrinfo() starts with */
+  rec->family = item->hints ? item->hints->ai_family : AF_UNSPEC;
+  rec->flags = item->hints ? item->hints->ai_flags : 0;
+
+  if (rec->family != AF_INET && rec->family != AF_INET6 &&
+      rec->family != AF_UNSPEC)
+    end_item(rec, ARES_ENOTIMP);
+  else if (ares__addrinfo_port(item->service, rec->flags,
+                               &item->port) != ARES_SUCCESS)
+    end_item(rec, ARES_ESERVICE);
+  else if (add_numeric(rec, rec->family, item->node, &status))
+    end_item(rec, status);
+  else
+    next_lookup(rec);
+}
+
+/* Start as many items as the limit allows, those to try again first.
+ * Lookups that finish at once (numeric addresses, hosts file entries) come
+ * back here through the loop rather than by recursion, however many of
+ * them there are.
+ */
+static void start_items(struct addrinfo_batch *batch)
+{
+  size_t i;
+
+  batch->starting = 1;
+  while ((batch->retry_head != BATCH_NONE || batch->next < batch->nitems) &&
+         (!batch->max_outstanding ||
+          batch->outstanding < batch->max_outstanding))
+    {
+      if (batch->retry_head != BATCH_NONE)
+        {
+          i = batch->retry_head;
+          batch->retry_head = batch->records[i].retry_next;
+        }
+      else
+        i = batch->next++;
+      start_item(batch, i);
+    }
+  batch->starting = 0;
+
+  if (!batch->outstanding)
+    end_batch(batch);
+}
+
+void ares_getaddrinfo_batch(ares_channel channel,
+                            struct ares_addrinfo_batch_item *items,
+                            size_t nitems, size_t max_outstanding, int tries,
+                            ares_addrinfo_batch_callback callback, void *arg)
+{
+  struct addrinfo_batch *batch;
+  size_t i;
+
+  for (i = 0; i < nitems; i++)
+    {
+      items[i].status = ARES_SUCCESS;
+      items[i].timeouts = 0;
+      items[i].port = 0;
+      items[i].naddrs = 0;
+      items[i].addrs = NULL;
+    }
+
+  if (nitems > ((size_t)-1 - sizeof(struct addrinfo_batch)) /
+                 sizeof(struct batch_record))
+    batch = NULL;
+  else
+    batch = ares_malloc(sizeof(struct addrinfo_batch) +
+                        nitems * sizeof(struct batch_record));
+  if (!batch)
+    {
+      for (i = 0; i < nitems; i++)
+        items[i].status = ARES_ENOMEM;
+      if (callback)
+        callback(arg, ARES_ENOMEM, items, nitems);
+      return;
+    }
+
+  batch->channel = channel;
+  batch->items = items;
+  batch->nitems = nitems;
+  batch->next = 0;
+  batch->retry_head = BATCH_NONE;
+  batch->retry_tail = BATCH_NONE;
+  batch->outstanding = 0;
+  batch->max_outstanding = max_outstanding;
+  batch->starting = 0;
+  batch->status = ARES_SUCCESS;
+  strncpy(batch->lookups, channel->lookups, sizeof(batch->lookups) - 1);
+  batch->lookups[sizeof(batch->lookups) - 1] = '\0';
+  batch->callback = callback;
+  batch->arg = arg;
+  batch->addrs = NULL;
+  batch->links = NULL;
+  batch->naddrs = 0;
+  batch->maxaddrs = 0;
+  batch->records = (struct batch_record *)(batch + 1);
+  for (i = 0; i < nitems; i++)
+    {
+      batch->records[i].batch = batch;
+      batch->records[i].first = BATCH_NONE;
+      batch->records[i].last = BATCH_NONE;
+      batch->records[i].retry_next = BATCH_NONE;
+      batch->records[i].tries = tries < 1 ? 1 : tries;
+      batch->records[i].asked_dns = 0;
+    }
+
+  start_items(batch);
+}
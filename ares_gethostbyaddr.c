@@ -49,6 +49,7 @@ struct addr_query {
   ares_host_callback callback;
   void *arg;
 
+  char *lookups; /* our copy, as ares_reinit() may replace the channel's */
   const char *remaining_lookups;
   int timeouts;
 };
@@ -58,7 +59,6 @@ static void addr_callback(void *arg, int status, int timeouts,
                           unsigned char *abuf, int alen);
 static void end_aquery(struct addr_query *aquery, int status,
                        struct hostent *host);
-static int file_lookup(struct ares_addr *addr, struct hostent **host);
 static void ptr_rr_name(char *name, const struct ares_addr *addr);
 
 void ares_gethostbyaddr(ares_channel channel, const void *addr, int addrlen,
@@ -85,6 +85,13 @@ void ares_gethostbyaddr(ares_channel channel, const void *addr, int addrlen,
       callback(arg, ARES_ENOMEM, 0, NULL);
       return;
     }
+  aquery->lookups = ares_strdup(channel->lookups);
+  if (!aquery->lookups)
+    {
+      ares_free(aquery);
+      callback(arg, ARES_ENOMEM, 0, NULL);
+      return;
+    }
   aquery->channel = channel;
   if (family == AF_INET)
     memcpy(&aquery->addr.addrV4, addr, sizeof(aquery->addr.addrV4));
@@ -93,7 +100,7 @@ void ares_gethostbyaddr(ares_channel channel, const void *addr, int addrlen,
   aquery->addr.family = family;
   aquery->callback = callback;
   aquery->arg = arg;
-  aquery->remaining_lookups = channel->lookups;
+  aquery->remaining_lookups = aquery->lookups;
   aquery->timeouts = 0;
 
   next_lookup(aquery);
@@ -117,7 +124,8 @@ static void next_lookup(struct addr_query *aquery)
                      aquery);
           return;
         case 'f':
-          status = file_lookup(&aquery->addr, &host);
+          status = ares__hosts_lookup_addr(aquery->channel, &aquery->addr,
+                                           &host);
 
           /* this status check below previously checked for !ARES_ENOTFOUND,
              but we should not assume that this single error code is the one
@@ -169,99 +177,10 @@ static void end_aquery(struct addr_query *aquery, int status,
   aquery->callback(aquery->arg, status, aquery->timeouts, host);
   if (host)
     ares_free_hostent(host);
+  ares_free(aquery->lookups);
   ares_free(aquery);
 }
 
-static int file_lookup(struct ares_addr *addr, struct hostent **host)
-{
-  FILE *fp;
-  int status;
-  int error;
-
-#ifdef WIN32
-  char PATH_HOSTS[MAX_PATH];
-  win_platform platform;
-
-  PATH_HOSTS[0] = '\0';
-
-  platform = ares__getplatform();
-
-  if (platform == WIN_NT) {
-    char tmp[MAX_PATH];
-    HKEY hkeyHosts;
-
-    if (RegOpenKeyExA(HKEY_LOCAL_MACHINE, WIN_NS_NT_KEY, 0, KEY_READ,
-                     &hkeyHosts) == ERROR_SUCCESS)
-    {
-      DWORD dwLength = MAX_PATH;
-      RegQueryValueExA(hkeyHosts, DATABASEPATH, NULL, NULL, (LPBYTE)tmp,
-                      &dwLength);
-      ExpandEnvironmentStringsA(tmp, PATH_HOSTS, MAX_PATH);
-      RegCloseKey(hkeyHosts);
-    }
-  }
-  else if (platform == WIN_9X)
-    GetWindowsDirectoryA(PATH_HOSTS, MAX_PATH);
-  else
-    return ARES_ENOTFOUND;
-
-  strcat(PATH_HOSTS, WIN_PATH_HOSTS);
-
-#elif defined(WATT32)
-  extern const char *_w32_GetHostsFile (void);
-  const char *PATH_HOSTS = _w32_GetHostsFile();
-
-  if (!PATH_HOSTS)
-    return ARES_ENOTFOUND;
-#endif
-
-  fp = fopen(PATH_HOSTS, "r");
-  if (!fp)
-    {
-      error = ERRNO;
-      switch(error)
-        {
-        case ENOENT:
-        case ESRCH:
-          return ARES_ENOTFOUND;
-        default:
-          DEBUGF(fprintf(stderr, "fopen() failed with error: %d %s\n",
-                         error, strerror(error)));
-          DEBUGF(fprintf(stderr, "Error opening file: %s\n",
-                         PATH_HOSTS));
-          *host = NULL;
-          return ARES_EFILE;
-        }
-    }
-  while ((status = ares__get_hostent(fp, addr->family, host)) == ARES_SUCCESS)
-    {
-      if (addr->family != (*host)->h_addrtype)
-        {
-          ares_free_hostent(*host);
-          continue;
-        }
-      if (addr->family == AF_INET)
-        {
-          if (memcmp((*host)->h_addr, &addr->addrV4,
-                     sizeof(addr->addrV4)) == 0)
-            break;
-        }
-      else if (addr->family == AF_INET6)
-        {
-          if (memcmp((*host)->h_addr, &addr->addrV6,
-                     sizeof(addr->addrV6)) == 0)
-            break;
-        }
-      ares_free_hostent(*host);
-    }
-  fclose(fp);
-  if (status == ARES_EOF)
-    status = ARES_ENOTFOUND;
-  if (status != ARES_SUCCESS)
-    *host = NULL;
-  return status;
-}
-
 static void ptr_rr_name(char *name, const struct ares_addr *addr)
 {
   if (addr->family == AF_INET)
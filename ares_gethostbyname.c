@@ -57,6 +57,7 @@ struct host_query {
   void *arg;
   int sent_family; /* this family is what was is being used */
   int want_family; /* this family is what is asked for in the API */
+  char *lookups; /* our copy, as ares_reinit() may replace the channel's */
   const char *remaining_lookups;
   int timeouts;
 };
@@ -68,7 +69,8 @@ static void end_hquery(struct host_query *hquery, int status,
                        struct hostent *host);
 static int fake_hostent(const char *name, int family,
                         ares_host_callback callback, void *arg);
-static int file_lookup(const char *name, int family, struct hostent **host);
+static int file_lookup(ares_channel channel, const char *name, int family,
+                       struct hostent **host);
 static void sort_addresses(struct hostent *host,
                            const struct apattern *sortlist, int nsort);
 static void sort6_addresses(struct hostent *host,
@@ -121,9 +123,16 @@ void ares_gethostbyname(ares_channel channel, const char *name, int family,
     callback(arg, ARES_ENOMEM, 0, NULL);
     return;
   }
+  hquery->lookups = ares_strdup(channel->lookups);
+  if (!hquery->lookups) {
+    ares_free(hquery->name);
+    ares_free(hquery);
+    callback(arg, ARES_ENOMEM, 0, NULL);
+    return;
+  }
   hquery->callback = callback;
   hquery->arg = arg;
-  hquery->remaining_lookups = channel->lookups;
+  hquery->remaining_lookups = hquery->lookups;
   hquery->timeouts = 0;
 
   /* Start performing lookups according to channel->lookups. */
@@ -159,7 +168,8 @@ static void next_lookup(struct host_query *hquery, int status_code)
 
         case 'f':
           /* Host file lookup */
-          status = file_lookup(hquery->name, hquery->want_family, &host);
+          status = file_lookup(hquery->channel, hquery->name,
+                               hquery->want_family, &host);
 
           /* this status check below previously checked for !ARES_ENOTFOUND,
              but we should not assume that this single error code is the one
@@ -234,6 +244,7 @@ static void end_hquery(struct host_query *hquery, int status,
   hquery->callback(hquery->arg, status, hquery->timeouts, host);
   if (host)
     ares_free_hostent(host);
+  ares_free(hquery->lookups);
   ares_free(hquery->name);
   ares_free(hquery);
 }
@@ -318,7 +329,6 @@ int ares_gethostbyname_file(ares_channel channel, const char *name,
 {
   int result;
 
-  /* We only take the channel to ensure that ares_init() been called. */
   if(channel == NULL)
     {
       /* Anything will do, really.  This seems fine, and is consistent with
@@ -330,7 +340,7 @@ int ares_gethostbyname_file(ares_channel channel, const char *name,
   /* Just chain to the internal implementation we use here; it's exactly
    * what we want.
    */
-  result = file_lookup(name, family, host);
+  result = file_lookup(channel, name, family, host);
   if(result != ARES_SUCCESS)
     {
       /* We guarantee a NULL hostent on failure. */
@@ -339,92 +349,17 @@ int ares_gethostbyname_file(ares_channel channel, const char *name,
   return result;
 }
 
-static int file_lookup(const char *name, int family, struct hostent **host)
+static int file_lookup(ares_channel channel, const char *name, int family,
+                       struct hostent **host)
 {
-  FILE *fp;
-  char **alias;
-  int status;
-  int error;
-
-#ifdef WIN32
-  char PATH_HOSTS[MAX_PATH];
-  win_platform platform;
-
-  PATH_HOSTS[0] = '\0';
-
-  platform = ares__getplatform();
-
-  if (platform == WIN_NT) {
-    char tmp[MAX_PATH];
-    HKEY hkeyHosts;
-
-    if (RegOpenKeyExA(HKEY_LOCAL_MACHINE, WIN_NS_NT_KEY, 0, KEY_READ,
-                     &hkeyHosts) == ERROR_SUCCESS)
-    {
-      DWORD dwLength = MAX_PATH;
-      RegQueryValueExA(hkeyHosts, DATABASEPATH, NULL, NULL, (LPBYTE)tmp,
-                      &dwLength);
-      ExpandEnvironmentStringsA(tmp, PATH_HOSTS, MAX_PATH);
-      RegCloseKey(hkeyHosts);
-    }
-  }
-  else if (platform == WIN_9X)
-    GetWindowsDirectoryA(PATH_HOSTS, MAX_PATH);
-  else
-    return ARES_ENOTFOUND;
-
-  strcat(PATH_HOSTS, WIN_PATH_HOSTS);
-
-#elif defined(WATT32)
-  extern const char *_w32_GetHostsFile (void);
-  const char *PATH_HOSTS = _w32_GetHostsFile();
-
-  if (!PATH_HOSTS)
-    return ARES_ENOTFOUND;
-#endif
-
   /* Per RFC 7686, reject queries for ".onion" domain names with NXDOMAIN. */
   if (ares__is_onion_domain(name))
-    return ARES_ENOTFOUND;
-
-
-  fp = fopen(PATH_HOSTS, "r");
-  if (!fp)
-    {
-      error = ERRNO;
-      switch(error)
-        {
-        case ENOENT:
-        case ESRCH:
-          return ARES_ENOTFOUND;
-        default:
-          DEBUGF(fprintf(stderr, "fopen() failed with error: %d %s\n",
-                         error, strerror(error)));
-          DEBUGF(fprintf(stderr, "Error opening file: %s\n",
-                         PATH_HOSTS));
-          *host = NULL;
-          return ARES_EFILE;
-        }
-    }
-  while ((status = ares__get_hostent(fp, family, host)) == ARES_SUCCESS)
     {
-      if (strcasecmp((*host)->h_name, name) == 0)
-        break;
-      for (alias = (*host)->h_aliases; *alias; alias++)
-        {
-          if (strcasecmp(*alias, name) == 0)
-            break;
-        }
-      if (*alias)
-        break;
-      ares_free_hostent(*host);
+      *host = NULL;
+      return ARES_ENOTFOUND;
     }
-  fclose(fp);
-  if (status == ARES_EOF)
-    status = ARES_ENOTFOUND;
-  if (status != ARES_SUCCESS)
-    *host = NULL;
-  return status;
+
+  return ares__hosts_lookup_name(channel, name, family, host);
 }
 
 static void sort_addresses(struct hostent *host,
@@ -22,13 +22,21 @@ int ares_getsock(ares_channel channel,
                  int numsocks) /* size of the 'socks' array */
 {
   struct server_state *server;
+  struct server_connection *conn;
+  struct list_node* list_head;
+  struct list_node* list_node;
   int i;
   int sockindex=0;
   int bitmap = 0;
   unsigned int setbits = 0xffffffff;
 
+  int active_queries;
+
+  /* Queries held back by ARES_FLAG_DEFERSEND go out before we wait. */
+  ares__send_pending(channel);
+
   /* Are there any active queries? */
-  int active_queries = !ares__is_list_empty(&(channel->all_queries));
+  active_queries = !ares__is_list_empty(&(channel->all_queries));
 
   for (i = 0; i < channel->nservers; i++)
     {
@@ -36,11 +44,16 @@ int ares_getsock(ares_channel channel,
       /* We only need to register interest in UDP sockets if we have
        * outstanding queries.
        */
-      if (active_queries && server->udp_socket != ARES_SOCKET_BAD)
+      list_head = &(server->connections);
+      for (list_node = list_head->next; active_queries && list_node != list_head;
+           list_node = list_node->next)
         {
+          conn = list_node->data;
+          if (conn->fd == ARES_SOCKET_BAD)
+            continue;
           if(sockindex >= numsocks || sockindex >= ARES_GETSOCK_MAXNUM)
-            break;
-          socks[sockindex] = server->udp_socket;
+            return bitmap;
+          socks[sockindex] = conn->fd;
           bitmap |= ARES_GETSOCK_READABLE(setbits, sockindex);
           sockindex++;
         }
@@ -48,11 +61,11 @@ int ares_getsock(ares_channel channel,
        * when the other side closes the connection, so we don't waste
        * time trying to use a broken connection.
        */
-      if (server->tcp_socket != ARES_SOCKET_BAD)
+      if (server->tcp_conn.fd != ARES_SOCKET_BAD)
        {
          if(sockindex >= numsocks || sockindex >= ARES_GETSOCK_MAXNUM)
            break;
-         socks[sockindex] = server->tcp_socket;
+         socks[sockindex] = server->tcp_conn.fd;
          bitmap |= ARES_GETSOCK_READABLE(setbits, sockindex);
 
          if (server->qhead && active_queries)
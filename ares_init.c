@@ -102,6 +102,30 @@ static char *try_config(char *s, const char *opt, char scc);
                              x->ndots > -1 && x->timeout > -1 && \
                              x->tries > -1)
 
+/* Hashes of the entries of the channel's tables, for spreading them over
+ * more or fewer buckets */
+static unsigned int query_qid_hash(const void *data)
+{
+  const struct query *query = data;
+  return ares__qid_hash(query->conn, query->qid);
+}
+
+static unsigned int hedge_qid_hash(const void *data)
+{
+  const struct query *query = data;
+  return ares__qid_hash(query->hedge_conn, query->qid);
+}
+
+static unsigned int query_question_hash(const void *data)
+{
+  return ((const struct query *)data)->question_hash;
+}
+
+static unsigned int conn_fd_hash(const void *data)
+{
+  return (unsigned int)((const struct server_connection *)data)->fd;
+}
+
 int ares_init(ares_channel *channelptr)
 {
   return ares_init_options(channelptr, NULL, 0);
@@ -111,9 +135,7 @@ int ares_init_options(ares_channel *channelptr, struct ares_options *options,
                       int optmask)
 {
   ares_channel channel;
-  int i;
   int status = ARES_SUCCESS;
-  struct timeval now;
 
 #ifdef CURLDEBUG
   const char *env = getenv("CARES_MEMDEBUG");
@@ -138,8 +160,6 @@ int ares_init_options(ares_channel *channelptr, struct ares_options *options,
     return ARES_ENOMEM;
   }
 
-  now = ares__tvnow();
-
   /* Set everything to distinguished values so we know they haven't
    * been set yet.
    */
@@ -170,9 +190,39 @@ int ares_init_options(ares_channel *channelptr, struct ares_options *options,
   channel->sock_funcs = NULL;
   channel->sock_func_cb_data = NULL;
   channel->resolvconf_path = NULL;
+  channel->qcache_max_ttl = 0;
+  channel->qcache_max_entries = -1;
+  channel->qcache = NULL;
+  channel->negcache_max_ttl = 0;
+  channel->negcache_max_entries = -1;
+  channel->negcache = NULL;
+  channel->submit_queue_size = -1;
+  channel->submitq = NULL;
+  channel->udp_pool_size = -1;
+  channel->udp_max_queries = -1;
+  channel->pool_max_free = -1;
+  channel->tcp_idle_timeout = -1;
+  channel->rto_min = -1;
+  channel->rto_max = -1;
+  channel->hedge_delay = -1;
+  channel->hedge_percentile = -1;
+  channel->reload_interval = -1;
+  channel->reload_checked.tv_sec = 0;
+  channel->reload_checked.tv_usec = 0;
+  memset(&channel->resolvconf_stamp, 0, sizeof(channel->resolvconf_stamp));
+  channel->hosts = NULL;
+  channel->health = NULL;
+  memset(channel->pools, 0, sizeof(channel->pools));
+  channel->udp_recv_bufs = NULL;
+  channel->processing = 0;
+  memset(channel->stats, 0, sizeof(channel->stats));
+  memset((void *)channel->published_stats, 0,
+         sizeof(channel->published_stats));
 
   channel->last_server = 0;
-  channel->last_timeout_processed = (time_t)now.tv_sec;
+  channel->queries_by_timeout = NULL;
+  channel->nqueries_by_timeout = 0;
+  channel->queries_by_timeout_alloc = 0;
 
   memset(&channel->local_dev_name, 0, sizeof(channel->local_dev_name));
   channel->local_ip4 = 0;
@@ -180,14 +230,10 @@ int ares_init_options(ares_channel *channelptr, struct ares_options *options,
 
   /* Initialize our lists of queries */
   ares__init_list_head(&(channel->all_queries));
-  for (i = 0; i < ARES_QID_TABLE_SIZE; i++)
-    {
-      ares__init_list_head(&(channel->queries_by_qid[i]));
-    }
-  for (i = 0; i < ARES_TIMEOUT_TABLE_SIZE; i++)
-    {
-      ares__init_list_head(&(channel->queries_by_timeout[i]));
-    }
+  ares__init_list_table(&(channel->queries_by_qid), query_qid_hash);
+  ares__init_list_table(&(channel->hedges_by_qid), hedge_qid_hash);
+  ares__init_list_table(&(channel->queries_by_question), query_question_hash);
+  ares__init_list_table(&(channel->conns_by_fd), conn_fd_hash);
 
   /* Initialize configuration by each of the four sources, from highest
    * precedence to lowest.
@@ -231,6 +277,27 @@ int ares_init_options(ares_channel *channelptr, struct ares_options *options,
                      ares_strerror(status)));
   }
 
+  if (status == ARES_SUCCESS && channel->qcache_max_ttl > 0) {
+    status = ares__qcache_create(channel);
+    if (status != ARES_SUCCESS)
+      DEBUGF(fprintf(stderr, "Error: ares__qcache_create failed: %s\n",
+                     ares_strerror(status)));
+  }
+
+  if (status == ARES_SUCCESS && channel->negcache_max_ttl > 0) {
+    status = ares__negcache_create(channel);
+    if (status != ARES_SUCCESS)
+      DEBUGF(fprintf(stderr, "Error: ares__negcache_create failed: %s\n",
+                     ares_strerror(status)));
+  }
+
+  if (status == ARES_SUCCESS && channel->submit_queue_size > 0) {
+    status = ares__submitq_create(channel);
+    if (status != ARES_SUCCESS)
+      DEBUGF(fprintf(stderr, "Error: ares__submitq_create failed: %s\n",
+                     ares_strerror(status)));
+  }
+
 done:
   if (status != ARES_SUCCESS)
     {
@@ -245,6 +312,9 @@ done:
         ares_free(channel->lookups);
       if(channel->resolvconf_path)
         ares_free(channel->resolvconf_path);
+      ares__qcache_destroy(channel->qcache);
+      ares__negcache_destroy(channel->negcache);
+      ares__submitq_destroy(channel);
       ares_free(channel);
       return status;
     }
@@ -255,6 +325,9 @@ done:
 
   ares__init_servers_state(channel);
 
+  /* Remember the resolv.conf we read, to tell when it changes. */
+  ares__resolvconf_changed(channel);
+
   *channelptr = channel;
   return ARES_SUCCESS;
 }
@@ -328,9 +401,148 @@ int ares_dup(ares_channel *dest, ares_channel src)
     }
   }
 
+  /* Keep the same settings out of the way of ares_reinit(). */
+  (*dest)->optmask = src->optmask;
+
   return ARES_SUCCESS; /* everything went fine */
 }
 
+/* ares_reinit() reads the system configuration again (the environment and
+   resolv.conf or its equivalent) and applies it to a live channel.  What
+   was set through options or ares_set_servers() and friends is kept. */
+int ares_reinit(ares_channel channel)
+{
+  struct ares_channeldata conf;
+  struct ares_addr *addrs = NULL;
+  int optmask;
+  int nservers;
+  int status;
+  int i;
+
+  if (!channel)
+    return ARES_ENODATA;
+
+  /* A callback may not pull the configuration out from under the
+     processing that called it. */
+  if (channel->processing)
+    return ARES_ENOTIMP;
+
+  /* Gather the configuration in a scratch channel, with what we keep
+     marked as already set so that it is neither read nor defaulted. */
+  optmask = channel->optmask;
+  memset(&conf, 0, sizeof(conf));
+  conf.flags = channel->flags;
+  conf.timeout = (optmask & (ARES_OPT_TIMEOUT|ARES_OPT_TIMEOUTMS)) ?
+                 channel->timeout : -1;
+  conf.tries = (optmask & ARES_OPT_TRIES) ? channel->tries : -1;
+  conf.ndots = (optmask & ARES_OPT_NDOTS) ? channel->ndots : -1;
+  conf.rotate = (optmask & (ARES_OPT_ROTATE|ARES_OPT_NOROTATE)) ?
+                channel->rotate : -1;
+  conf.udp_port = channel->udp_port;
+  conf.tcp_port = channel->tcp_port;
+  conf.ednspsz = channel->ednspsz;
+  conf.nservers = (optmask & ARES_OPT_SERVERS) ? 0 : -1;
+  conf.ndomains = (optmask & ARES_OPT_DOMAINS) ? 0 : -1;
+  conf.nsort = (optmask & ARES_OPT_SORTLIST) ? 0 : -1;
+  conf.qcache_max_entries = channel->qcache_max_entries;
+  conf.negcache_max_entries = channel->negcache_max_entries;
+  conf.udp_pool_size = channel->udp_pool_size;
+  conf.udp_max_queries = channel->udp_max_queries;
+  conf.pool_max_free = channel->pool_max_free;
+  conf.tcp_idle_timeout = channel->tcp_idle_timeout;
+  conf.rto_min = channel->rto_min;
+  conf.hedge_delay = channel->hedge_delay;
+  conf.reload_interval = channel->reload_interval;
+  if ((optmask & ARES_OPT_LOOKUPS) && channel->lookups)
+    {
+      conf.lookups = ares_strdup(channel->lookups);
+      if (!conf.lookups)
+        return ARES_ENOMEM;
+    }
+  if (channel->resolvconf_path)
+    {
+      conf.resolvconf_path = ares_strdup(channel->resolvconf_path);
+      if (!conf.resolvconf_path)
+        {
+          status = ARES_ENOMEM;
+          goto done;
+        }
+    }
+
+  /* As at init time, what could not be read is filled in with defaults,
+     unless we ran out of memory. */
+  status = init_by_environment(&conf);
+  if (status == ARES_SUCCESS)
+    status = init_by_resolv_conf(&conf);
+  if (status == ARES_ENOMEM)
+    goto done;
+  status = init_by_defaults(&conf);
+  if (status != ARES_SUCCESS)
+    goto done;
+
+  /* Servers first, as that is the only change that can fail. */
+  if (!(optmask & ARES_OPT_SERVERS))
+    {
+      nservers = conf.nservers;
+      if ((channel->flags & ARES_FLAG_PRIMARY) && nservers > 1)
+        nservers = 1;
+      addrs = ares_malloc(nservers * sizeof(struct ares_addr));
+      if (!addrs)
+        {
+          status = ARES_ENOMEM;
+          goto done;
+        }
+      for (i = 0; i < nservers; i++)
+        addrs[i] = conf.servers[i].addr;
+      status = ares__update_servers(channel, addrs, nservers);
+      ares_free(addrs);
+      if (status != ARES_SUCCESS)
+        goto done;
+    }
+
+  if (!(optmask & ARES_OPT_DOMAINS))
+    {
+      if (channel->domains)
+        ares_strsplit_free(channel->domains, channel->ndomains);
+      channel->domains = conf.domains;
+      channel->ndomains = conf.ndomains;
+      conf.domains = NULL;
+    }
+  if (!(optmask & ARES_OPT_SORTLIST))
+    {
+      if (channel->sortlist)
+        ares_free(channel->sortlist);
+      channel->sortlist = conf.sortlist;
+      channel->nsort = conf.nsort;
+      conf.sortlist = NULL;
+    }
+  if (!(optmask & ARES_OPT_LOOKUPS))
+    {
+      ares_free(channel->lookups);
+      channel->lookups = conf.lookups;
+      conf.lookups = NULL;
+    }
+  channel->timeout = conf.timeout;
+  channel->tries = conf.tries;
+  channel->ndots = conf.ndots;
+  channel->rotate = conf.rotate;
+
+  ares__resolvconf_changed(channel);
+
+done:
+  if (conf.servers)
+    ares_free(conf.servers);
+  if (conf.domains)
+    ares_strsplit_free(conf.domains, conf.ndomains);
+  if (conf.sortlist)
+    ares_free(conf.sortlist);
+  if (conf.lookups)
+    ares_free(conf.lookups);
+  if (conf.resolvconf_path)
+    ares_free(conf.resolvconf_path);
+  return status;
+}
+
 /* Save options from initialized channel */
 int ares_save_options(ares_channel channel, struct ares_options *options,
                       int *optmask)
@@ -356,6 +568,28 @@ int ares_save_options(ares_channel channel, struct ares_options *options,
   if (channel->resolvconf_path)
     (*optmask) |= ARES_OPT_RESOLVCONF;
 
+  if (channel->qcache_max_ttl > 0)
+    (*optmask) |= ARES_OPT_QUERY_CACHE;
+  if (channel->negcache_max_ttl > 0)
+    (*optmask) |= ARES_OPT_NEG_CACHE;
+  if (channel->submit_queue_size > 0)
+    (*optmask) |= ARES_OPT_SUBMIT_QUEUE;
+
+  if (channel->udp_pool_size != DEFAULT_UDP_POOL_SIZE)
+    (*optmask) |= ARES_OPT_UDP_POOL;
+  if (channel->udp_max_queries > 0)
+    (*optmask) |= ARES_OPT_UDP_MAX_QUERIES;
+  if (channel->pool_max_free != DEFAULT_POOL_MAX_FREE)
+    (*optmask) |= ARES_OPT_POOL_MAX_FREE;
+  if (channel->tcp_idle_timeout > 0)
+    (*optmask) |= ARES_OPT_TCP_IDLE_TIMEOUT;
+  if (channel->rto_min > 0)
+    (*optmask) |= ARES_OPT_RTO;
+  if (channel->hedge_delay > 0 || channel->hedge_percentile > 0)
+    (*optmask) |= ARES_OPT_HEDGE;
+  if (channel->reload_interval > 0)
+    (*optmask) |= ARES_OPT_RELOAD;
+
   /* Copy easy stuff */
   options->flags   = channel->flags;
 
@@ -368,6 +602,20 @@ int ares_save_options(ares_channel channel, struct ares_options *options,
   options->tcp_port = ntohs(aresx_sitous(channel->tcp_port));
   options->sock_state_cb     = channel->sock_state_cb;
   options->sock_state_cb_data = channel->sock_state_cb_data;
+  options->qcache_max_ttl = channel->qcache_max_ttl;
+  options->qcache_max_entries = channel->qcache_max_entries;
+  options->udp_pool_size = channel->udp_pool_size;
+  options->udp_max_queries = channel->udp_max_queries;
+  options->pool_max_free = channel->pool_max_free;
+  options->tcp_idle_timeout = channel->tcp_idle_timeout;
+  options->rto_min = channel->rto_min;
+  options->rto_max = channel->rto_max;
+  options->hedge_delay = channel->hedge_delay;
+  options->hedge_percentile = channel->hedge_percentile;
+  options->reload_interval = channel->reload_interval;
+  options->negcache_max_ttl = channel->negcache_max_ttl;
+  options->negcache_max_entries = channel->negcache_max_entries;
+  options->submit_queue_size = channel->submit_queue_size;
 
   /* Copy IPv4 servers that use the default port */
   if (channel->nservers) {
@@ -551,6 +799,56 @@ static int init_by_options(ares_channel channel,
         return ARES_ENOMEM;
     }
 
+  /* Set up the answer cache, if wanted. */
+  if (optmask & ARES_OPT_QUERY_CACHE)
+    {
+      channel->qcache_max_ttl = options->qcache_max_ttl;
+      if (options->qcache_max_entries > 0)
+        channel->qcache_max_entries = options->qcache_max_entries;
+    }
+
+  /* And the negative cache for ares_search(). */
+  if (optmask & ARES_OPT_NEG_CACHE)
+    {
+      channel->negcache_max_ttl = options->negcache_max_ttl;
+      if (options->negcache_max_entries > 0)
+        channel->negcache_max_entries = options->negcache_max_entries;
+    }
+
+  /* And the queue other threads submit requests through. */
+  if ((optmask & ARES_OPT_SUBMIT_QUEUE) && channel->submit_queue_size == -1)
+    channel->submit_queue_size = options->submit_queue_size;
+
+  if ((optmask & ARES_OPT_UDP_POOL) && channel->udp_pool_size == -1 &&
+      options->udp_pool_size > 0)
+    channel->udp_pool_size = options->udp_pool_size;
+  if ((optmask & ARES_OPT_UDP_MAX_QUERIES) && channel->udp_max_queries == -1)
+    channel->udp_max_queries = options->udp_max_queries;
+  if ((optmask & ARES_OPT_POOL_MAX_FREE) && channel->pool_max_free == -1 &&
+      options->pool_max_free >= 0)
+    channel->pool_max_free = options->pool_max_free;
+  if ((optmask & ARES_OPT_TCP_IDLE_TIMEOUT) && channel->tcp_idle_timeout == -1 &&
+      options->tcp_idle_timeout >= 0)
+    channel->tcp_idle_timeout = options->tcp_idle_timeout;
+  if ((optmask & ARES_OPT_RTO) && channel->rto_min == -1 &&
+      options->rto_min > 0 && options->rto_max >= options->rto_min)
+    {
+      channel->rto_min = options->rto_min;
+      channel->rto_max = options->rto_max;
+    }
+  if ((optmask & ARES_OPT_HEDGE) && channel->hedge_delay == -1 &&
+      (options->hedge_delay > 0 ||
+       (options->hedge_percentile > 0 && options->hedge_percentile < 100)))
+    {
+      channel->hedge_delay = options->hedge_delay > 0 ?
+                             options->hedge_delay : 0;
+      channel->hedge_percentile = options->hedge_delay > 0 ?
+                                  0 : options->hedge_percentile;
+    }
+  if ((optmask & ARES_OPT_RELOAD) && channel->reload_interval == -1 &&
+      options->reload_interval > 0)
+    channel->reload_interval = options->reload_interval;
+
   channel->optmask = optmask;
 
   return ARES_SUCCESS;
@@ -1871,6 +2169,32 @@ static int init_by_defaults(ares_channel channel)
   if (channel->ednspsz == -1)
     channel->ednspsz = EDNSPACKETSZ;
 
+  if (channel->qcache_max_entries == -1)
+    channel->qcache_max_entries = DEFAULT_QCACHE_ENTRIES;
+  if (channel->negcache_max_entries == -1)
+    channel->negcache_max_entries = DEFAULT_NEGCACHE_ENTRIES;
+
+  if (channel->udp_pool_size == -1)
+    channel->udp_pool_size = DEFAULT_UDP_POOL_SIZE;
+  if (channel->udp_max_queries == -1)
+    channel->udp_max_queries = 0;
+  if (channel->pool_max_free == -1)
+    channel->pool_max_free = DEFAULT_POOL_MAX_FREE;
+  if (channel->tcp_idle_timeout == -1)
+    channel->tcp_idle_timeout = 0;
+  if (channel->rto_min == -1)
+    {
+      channel->rto_min = 0;
+      channel->rto_max = 0;
+    }
+  if (channel->hedge_delay == -1)
+    {
+      channel->hedge_delay = 0;
+      channel->hedge_percentile = 0;
+    }
+  if (channel->reload_interval == -1)
+    channel->reload_interval = 0;
+
   if (channel->nservers == -1) {
     /* If nobody specified servers, try a local named. */
     channel->servers = ares_malloc(sizeof(struct server_state));
@@ -2587,29 +2911,45 @@ int ares_set_sortlist(ares_channel channel, const char *sortstr)
       ares_free(channel->sortlist);
     channel->sortlist = sortlist;
     channel->nsort = nsort;
+    channel->optmask |= ARES_OPT_SORTLIST;
   }
   return status;
 }
 
 void ares__init_servers_state(ares_channel channel)
 {
-  struct server_state *server;
   int i;
 
   for (i = 0; i < channel->nservers; i++)
-    {
-      server = &channel->servers[i];
-      server->udp_socket = ARES_SOCKET_BAD;
-      server->tcp_socket = ARES_SOCKET_BAD;
-      server->tcp_connection_generation = ++channel->tcp_connection_generation;
-      server->tcp_lenbuf_pos = 0;
-      server->tcp_buffer_pos = 0;
-      server->tcp_buffer = NULL;
-      server->tcp_length = 0;
-      server->qhead = NULL;
-      server->qtail = NULL;
-      ares__init_list_head(&server->queries_to_server);
-      server->channel = channel;
-      server->is_broken = 0;
-    }
+    ares__init_server_state(channel, &channel->servers[i]);
+}
+
+/* Set up the state of a server whose address has been filled in. */
+void ares__init_server_state(ares_channel channel, struct server_state *server)
+{
+  ares__init_connection(&server->tcp_conn, server, 1);
+  server->tcp_connection_generation = ++channel->tcp_connection_generation;
+  server->tcp_rbuf = NULL;
+  server->tcp_rbuf_alloc = 0;
+  server->tcp_rbuf_len = 0;
+  server->tcp_last_used.tv_sec = 0;
+  server->tcp_last_used.tv_usec = 0;
+  server->tcp_inflight = 0;
+  server->srtt = 0;
+  server->rttvar = 0;
+  memset(server->rtt_hist, 0, sizeof(server->rtt_hist));
+  server->rtt_samples = 0;
+  server->failures = 0;
+  server->failed_at.tv_sec = 0;
+  server->failed_at.tv_usec = 0;
+  server->probation_until.tv_sec = 0;
+  server->probation_until.tv_usec = 0;
+  server->health_seen = 0;
+  memset(server->stats, 0, sizeof(server->stats));
+  server->qhead = NULL;
+  server->qtail = NULL;
+  ares__init_list_head(&server->queries_to_server);
+  ares__init_list_head(&server->connections);
+  server->channel = channel;
+  server->is_broken = 0;
 }
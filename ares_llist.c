@@ -61,3 +61,101 @@ void ares__remove_from_list(struct list_node* node) {
   }
 }
 
+/* Initialize an empty table of lists, with its only bucket inside it */
+void ares__init_list_table(struct list_table* table,
+                           unsigned int (*hash)(const void *data)) {
+  ares__init_list_head(&table->first);
+  table->buckets = &table->first;
+  table->nbuckets = 1;
+  table->count = 0;
+  table->hash = hash;
+}
+
+/* Returns the list of the nodes that may have the given hash */
+struct list_node* ares__list_table_bucket(struct list_table* table,
+                                          unsigned int hash) {
+  return &table->buckets[hash & (table->nbuckets - 1)];
+}
+
+/* Spreads the nodes over nbuckets buckets.  If there is no memory for
+ * them, the table is left as it is, which only makes its lists longer.
+ */
+static void list_table_resize(struct list_table* table, size_t nbuckets) {
+  struct list_node *buckets;
+  struct list_node *old_buckets = table->buckets;
+  size_t old_nbuckets = table->nbuckets;
+  struct list_node *node;
+  size_t i;
+
+  if (nbuckets == 1) {
+    buckets = &table->first;
+  } else {
+    buckets = ares_malloc(nbuckets * sizeof(struct list_node));
+    if (!buckets)
+      return;
+  }
+  for (i = 0; i < nbuckets; i++)
+    ares__init_list_head(&buckets[i]);
+
+  table->buckets = buckets;
+  table->nbuckets = nbuckets;
+  for (i = 0; i < old_nbuckets; i++) {
+    while (!ares__is_list_empty(&old_buckets[i])) {
+      node = old_buckets[i].next;
+      ares__remove_from_list(node);
+      ares__insert_in_list(node,
+          ares__list_table_bucket(table, table->hash(node->data)));
+    }
+  }
+  if (old_buckets != &table->first)
+    ares_free(old_buckets);
+}
+
+/* Inserts node at the end of the list for hash, first making more buckets
+ * if there are more nodes than buckets */
+void ares__list_table_insert(struct list_table* table,
+                             struct list_node* node, unsigned int hash) {
+  if (table->count >= table->nbuckets)
+    list_table_resize(table, table->nbuckets * 2);
+  ares__insert_in_list(node, ares__list_table_bucket(table, hash));
+  table->count++;
+}
+
+/* Moves a node of the table to the list for a new hash, as when what it
+ * is hashed on changes */
+void ares__list_table_move(struct list_table* table,
+                           struct list_node* node, unsigned int hash) {
+  ares__remove_from_list(node);
+  ares__insert_in_list(node, ares__list_table_bucket(table, hash));
+}
+
+/* Removes the node from the table, if it is in it, and gives back buckets
+ * once the table is down to a quarter of them, or all of them once it is
+ * empty */
+void ares__list_table_remove(struct list_table* table,
+                             struct list_node* node) {
+  if (node->next == NULL)
+    return;
+  ares__remove_from_list(node);
+  table->count--;
+  if (table->nbuckets > 1 && table->count == 0)
+    list_table_resize(table, 1);
+  else if (table->count < table->nbuckets / 4)
+    list_table_resize(table, table->nbuckets / 2);
+}
+
+/* Frees the buckets of an empty table */
+void ares__list_table_destroy(struct list_table* table) {
+  if (table->buckets != &table->first)
+    ares_free(table->buckets);
+  ares__init_list_head(&table->first);
+  table->buckets = &table->first;
+  table->nbuckets = 1;
+}
+
+/* Returns the memory held by the table outside of its own structure */
+size_t ares__list_table_memory(const struct list_table* table) {
+  if (table->buckets == &table->first)
+    return 0;
+  return table->nbuckets * sizeof(struct list_node);
+}
@@ -36,4 +36,36 @@ void ares__insert_in_list(struct list_node* new_node,
 
 void ares__remove_from_list(struct list_node* node);
 
+/* Lists hashed into buckets whose number follows the number of nodes in
+ * them, from the single bucket inside the table up to one bucket per node,
+ * so that an empty table takes no memory of its own.  hash gives the hash
+ * of a node's data again when the nodes are spread over new buckets.
+ */
+struct list_table {
+  struct list_node *buckets;
+  struct list_node first;
+  size_t nbuckets;    /* always a power of two */
+  size_t count;
+  unsigned int (*hash)(const void *data);
+};
+
+void ares__init_list_table(struct list_table* table,
+                           unsigned int (*hash)(const void *data));
+
+struct list_node* ares__list_table_bucket(struct list_table* table,
+                                          unsigned int hash);
+
+void ares__list_table_insert(struct list_table* table,
+                             struct list_node* node, unsigned int hash);
+
+void ares__list_table_move(struct list_table* table,
+                           struct list_node* node, unsigned int hash);
+
+void ares__list_table_remove(struct list_table* table,
+                             struct list_node* node);
+
+void ares__list_table_destroy(struct list_table* table);
+
+size_t ares__list_table_memory(const struct list_table* table);
+
 #endif /* __ARES_LLIST_H */
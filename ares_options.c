@@ -144,7 +144,9 @@ int ares_set_servers(ares_channel channel,
                      struct ares_addr_node *servers)
 {
   struct ares_addr_node *srvr;
+  struct ares_addr *addrs = NULL;
   int num_srvrs = 0;
+  int status;
   int i;
 
   if (ares_library_initialized() != ARES_SUCCESS)
@@ -153,11 +155,6 @@ int ares_set_servers(ares_channel channel,
   if (!channel)
     return ARES_ENODATA;
 
-  if (!ares__is_list_empty(&channel->all_queries))
-    return ARES_ENOTIMP;
-
-  ares__destroy_servers_state(channel);
-
   for (srvr = servers; srvr; srvr = srvr->next)
     {
       num_srvrs++;
@@ -165,38 +162,43 @@ int ares_set_servers(ares_channel channel,
 
   if (num_srvrs > 0)
     {
-      /* Allocate storage for servers state */
-      channel->servers = ares_malloc(num_srvrs * sizeof(struct server_state));
-      if (!channel->servers)
+      addrs = ares_malloc(num_srvrs * sizeof(struct ares_addr));
+      if (!addrs)
         {
           return ARES_ENOMEM;
         }
-      channel->nservers = num_srvrs;
-      /* Fill servers state address data */
+      memset(addrs, 0, num_srvrs * sizeof(struct ares_addr));
+      /* Fill servers address data */
       for (i = 0, srvr = servers; srvr; i++, srvr = srvr->next)
         {
-          channel->servers[i].addr.family = srvr->family;
-          channel->servers[i].addr.udp_port = 0;
-          channel->servers[i].addr.tcp_port = 0;
+          addrs[i].family = srvr->family;
+          addrs[i].udp_port = 0;
+          addrs[i].tcp_port = 0;
           if (srvr->family == AF_INET)
-            memcpy(&channel->servers[i].addr.addrV4, &srvr->addrV4,
-                   sizeof(srvr->addrV4));
+            memcpy(&addrs[i].addrV4, &srvr->addrV4, sizeof(srvr->addrV4));
           else
-            memcpy(&channel->servers[i].addr.addrV6, &srvr->addrV6,
-                   sizeof(srvr->addrV6));
+            memcpy(&addrs[i].addrV6, &srvr->addrV6, sizeof(srvr->addrV6));
         }
-      /* Initialize servers state remaining data */
-      ares__init_servers_state(channel);
     }
 
-  return ARES_SUCCESS;
+  /* Keep what we can of the servers we had and move the queries waiting
+   * on the others to the new ones. */
+  status = ares__update_servers(channel, addrs, num_srvrs);
+  if (addrs)
+    ares_free(addrs);
+  /* From now on ares_reinit() leaves the servers alone. */
+  if (status == ARES_SUCCESS)
+    channel->optmask |= ARES_OPT_SERVERS;
+  return status;
 }
 
 int ares_set_servers_ports(ares_channel channel,
                            struct ares_addr_port_node *servers)
 {
   struct ares_addr_port_node *srvr;
+  struct ares_addr *addrs = NULL;
   int num_srvrs = 0;
+  int status;
   int i;
 
   if (ares_library_initialized() != ARES_SUCCESS)
@@ -205,11 +207,6 @@ int ares_set_servers_ports(ares_channel channel,
   if (!channel)
     return ARES_ENODATA;
 
-  if (!ares__is_list_empty(&channel->all_queries))
-    return ARES_ENOTIMP;
-
-  ares__destroy_servers_state(channel);
-
   for (srvr = servers; srvr; srvr = srvr->next)
     {
       num_srvrs++;
@@ -217,31 +214,31 @@ int ares_set_servers_ports(ares_channel channel,
 
   if (num_srvrs > 0)
     {
-      /* Allocate storage for servers state */
-      channel->servers = ares_malloc(num_srvrs * sizeof(struct server_state));
-      if (!channel->servers)
+      addrs = ares_malloc(num_srvrs * sizeof(struct ares_addr));
+      if (!addrs)
         {
           return ARES_ENOMEM;
         }
-      channel->nservers = num_srvrs;
-      /* Fill servers state address data */
+      memset(addrs, 0, num_srvrs * sizeof(struct ares_addr));
+      /* Fill servers address data */
       for (i = 0, srvr = servers; srvr; i++, srvr = srvr->next)
         {
-          channel->servers[i].addr.family = srvr->family;
-          channel->servers[i].addr.udp_port = htons((unsigned short)srvr->udp_port);
-          channel->servers[i].addr.tcp_port = htons((unsigned short)srvr->tcp_port);
+          addrs[i].family = srvr->family;
+          addrs[i].udp_port = htons((unsigned short)srvr->udp_port);
+          addrs[i].tcp_port = htons((unsigned short)srvr->tcp_port);
           if (srvr->family == AF_INET)
-            memcpy(&channel->servers[i].addr.addrV4, &srvr->addrV4,
-                   sizeof(srvr->addrV4));
+            memcpy(&addrs[i].addrV4, &srvr->addrV4, sizeof(srvr->addrV4));
           else
-            memcpy(&channel->servers[i].addr.addrV6, &srvr->addrV6,
-                   sizeof(srvr->addrV6));
+            memcpy(&addrs[i].addrV6, &srvr->addrV6, sizeof(srvr->addrV6));
         }
-      /* Initialize servers state remaining data */
-      ares__init_servers_state(channel);
     }
 
-  return ARES_SUCCESS;
+  status = ares__update_servers(channel, addrs, num_srvrs);
+  if (addrs)
+    ares_free(addrs);
+  if (status == ARES_SUCCESS)
+    channel->optmask |= ARES_OPT_SERVERS;
+  return status;
 }
 
 /* Incomming string format: host[:port][,host[:port]]... */
@@ -266,7 +263,7 @@ static int set_servers_csv(ares_channel channel,
 
   i = strlen(_csv);
   if (i == 0)
-     return ARES_SUCCESS; /* blank all servers */
+     return ares_set_servers_ports(channel, NULL); /* blank all servers */
 
   csv = ares_malloc(i + 2);
   if (!csv)
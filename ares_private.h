@@ -39,6 +39,13 @@
 
 #define DEFAULT_TIMEOUT         5000 /* milliseconds */
 #define DEFAULT_TRIES           4
+#define DEFAULT_QCACHE_ENTRIES  4096
+#define DEFAULT_NEGCACHE_ENTRIES 1024
+#define DEFAULT_UDP_POOL_SIZE   1
+#define DEFAULT_POOL_MAX_FREE   256
+
+/* Initial size of the buffer TCP answers are read into */
+#define ARES_TCP_RBUF_SIZE      4096
 #ifndef INADDR_NONE
 #define INADDR_NONE 0xffffffff
 #endif
@@ -138,6 +145,10 @@ struct ares_addr {
 #define addrV6 addr.addr6
 
 struct query;
+struct ares_qcache;
+struct ares_negcache;
+struct ares_submitq;
+struct ares_health;
 
 struct send_request {
   /* Remaining data to send */
@@ -153,19 +164,52 @@ struct send_request {
   struct send_request *next;
 };
 
+/* One of a server's sockets: its TCP connection or one of its UDP
+ * sockets.  These are never freed before the server itself, a closed one
+ * just has fd == ARES_SOCKET_BAD and can be reused, so pointers to them
+ * stay valid while answers are processed.
+ */
+struct server_connection {
+  ares_socket_t fd;
+  struct server_state *server;
+  int is_tcp;
+
+  /* Number of queries sent on this socket since it was opened; once it
+     reaches channel->udp_max_queries no new queries are sent on it and it
+     is closed when the last answer is in */
+  int total_queries;
+
+  /* Queries last sent on this socket that are still waiting for an
+     answer, which must come in on this same socket */
+  struct list_node queries_to_conn;
+
+  /* UDP queries waiting to be sent together (ARES_FLAG_DEFERSEND) */
+  struct list_node udp_pending;
+
+  /* Link in server->connections (UDP only) */
+  struct list_node node;
+
+  /* Link in channel->conns_by_fd while the socket is open */
+  struct list_node node_by_fd;
+};
+
 struct server_state {
   struct ares_addr addr;
-  ares_socket_t udp_socket;
-  ares_socket_t tcp_socket;
+  struct server_connection tcp_conn;
+
+  /* Buffer answers are read into from the TCP connection, several at a
+     time; holds tcp_rbuf_len bytes not yet processed.  It is grown as
+     needed and kept for the next connection once one is closed, until
+     the channel has no queries left. */
+  unsigned char *tcp_rbuf;
+  size_t tcp_rbuf_alloc;
+  size_t tcp_rbuf_len;
 
-  /* Mini-buffer for reading the length word */
-  unsigned char tcp_lenbuf[2];
-  int tcp_lenbuf_pos;
-  int tcp_length;
+  /* When the TCP connection was last used, for channel->tcp_idle_timeout */
+  struct timeval tcp_last_used;
 
-  /* Buffer for reading actual TCP data */
-  unsigned char *tcp_buffer;
-  int tcp_buffer_pos;
+  /* Number of queries waiting for an answer on the TCP connection */
+  int tcp_inflight;
 
   /* TCP output queue */
   struct send_request *qhead;
@@ -180,6 +224,10 @@ struct server_state {
   /* Circular, doubly-linked list of outstanding queries to this server */
   struct list_node queries_to_server;
 
+  /* The server's UDP sockets, up to channel->udp_pool_size of them in use
+     plus any retired ones still waiting for answers */
+  struct list_node connections;
+
   /* Link back to owning channel */
   ares_channel channel;
 
@@ -187,6 +235,27 @@ struct server_state {
    * request that is queued for sending times out.
    */
   int is_broken;
+
+  /* Health of the server (ares__server_health.c): smoothed round trip
+     time and its variation in microseconds (0 until measured), failures in
+     a row, when the last of them was seen and the end of the probation
+     they earned it */
+  long srtt;
+  long rttvar;
+  /* Histogram of round trip times: rtt_hist[i] counts those from 2^i to
+     2^(i+1) microseconds, with older samples counting for less */
+#define ARES_RTT_BUCKETS 24
+  unsigned int rtt_hist[ARES_RTT_BUCKETS];
+  unsigned int rtt_samples;
+  int failures;
+  struct timeval failed_at;
+  struct timeval probation_until;
+  /* The last event of the server's word on channel->health taken in */
+  unsigned int health_seen;
+
+  /* Counters reported by ares_get_server_stat() */
+#define ARES_NSERVER_STATS 8
+  unsigned long stats[ARES_NSERVER_STATS];
 };
 
 /* State to represent a DNS query */
@@ -194,6 +263,8 @@ struct query {
   /* Query ID from qbuf, for faster lookup, and current timeout */
   unsigned short qid;
   struct timeval timeout;
+  int timeout_idx; /* position in channel->queries_by_timeout, or -1 */
+  struct timeval ts; /* when last sent, for round trip times */
 
   /*
    * Links for the doubly-linked lists in which we insert a query.
@@ -202,9 +273,11 @@ struct query {
    * operations O(1).
    */
   struct list_node queries_by_qid;    /* hopefully in same cache line as qid */
-  struct list_node queries_by_timeout;
+  struct list_node queries_timed_out; /* only used within process_timeouts */
   struct list_node queries_to_server;
   struct list_node all_queries;
+  struct list_node queries_to_conn;
+  struct list_node udp_pending;       /* in conn->udp_pending until sent */
 
   /* Query buf with length at beginning, for TCP transmission */
   unsigned char *tcpbuf;
@@ -213,18 +286,67 @@ struct query {
   /* Arguments passed to ares_send() (qbuf points into tcpbuf) */
   const unsigned char *qbuf;
   int qlen;
+
+  /* The questions of qbuf as ares__normalize_questions() wrote them, for
+     matching answers (in the tcpbuf allocation, after the query; a
+     length of -1 if they are malformed) */
+  const unsigned char *question;
+  int questionlen;
   ares_callback callback;
   void *arg;
 
   /* Query status */
   int try_count; /* Number of times we tried this query already. */
   int server; /* Server this query has last been sent to. */
+  struct server_connection *conn; /* UDP socket it was sent on, or NULL */
+
+  /* With ARES_OPT_HEDGE, a copy of the query goes to a second server if
+     no answer came in time.  While hedge_armed is set, the timeout above is
+     when to send it and hedge_timeout the query's real timeout; hedge_conn
+     is the UDP socket the copy went out on. */
+  int hedge_armed;
+  struct timeval hedge_timeout;
+  struct server_connection *hedge_conn;
+  struct list_node hedge_to_conn;
+  struct list_node hedges_by_qid;
   struct query_server_info *server_info;   /* per-server state */
+
+  /* With ARES_FLAG_COALESCE, the link into channel->queries_by_question,
+     and the callers who sent the same request while the query was in
+     flight, in order (struct query_waiter) */
+  struct list_node queries_by_question;
+  unsigned int question_hash;
+  struct list_node waiters;
+
+  /* The handle it was sent for, if any, and the link into its list */
+  struct ares_handledata *handle;
+  struct list_node node_by_handle;
+
   int using_tcp;
+  int tcp_server; /* server whose tcp_inflight counts the query, or -1 */
   int error_status;
   int timeouts; /* number of timeouts we saw for this request */
 };
 
+/* What the ares_*_handle() functions return: the operation started, for
+ * ares_cancel_query() to cut short.  Every query sent for it, by whatever
+ * layer, is in its list of queries, until the caller has been called back.
+ */
+struct ares_handledata {
+  ares_channel channel;
+  struct list_node queries;
+
+  /* The caller's callback, of whichever kind the operation has */
+  ares_callback callback;
+  ares_addrinfo_callback ai_callback;
+  void *arg;
+
+  int starting;    /* the ares_*_handle() function has not returned yet */
+  int cancelling;  /* ares_cancel_query() is at work on it */
+  int cancelled;   /* ares_cancel_query() was called */
+  int done;        /* the caller has been called back */
+};
+
 /* Per-server state for a query */
 struct query_server_info {
   int skip_server;  /* should we skip server, due to errors, etc? */
@@ -251,6 +373,18 @@ struct apattern {
   unsigned short type;
 };
 
+/* What we last saw of a file, to notice when it is rewritten or replaced */
+struct ares_filestamp {
+  int exists;
+  time_t mtime;
+  long size;
+  unsigned long dev;
+  unsigned long ino;
+};
+
+/* The hosts file, read and indexed; defined in ares__hosts.c */
+struct ares_hosts;
+
 typedef struct rc4_key
 {
   unsigned char state[256];
@@ -297,22 +431,31 @@ struct ares_channeldata {
   /* Generation number to use for the next TCP socket open/close */
   int tcp_connection_generation;
 
-  /* The time at which we last called process_timeouts(). Uses integer seconds
-     just to draw the line somewhere. */
-  time_t last_timeout_processed;
-
   /* Last server we sent a query to. */
   int last_server;
 
   /* Circular, doubly-linked list of queries, bucketed various ways.... */
   /* All active queries in a single list: */
   struct list_node all_queries;
-  /* Queries bucketed by qid, for quickly dispatching DNS responses: */
-#define ARES_QID_TABLE_SIZE 2048
-  struct list_node queries_by_qid[ARES_QID_TABLE_SIZE];
-  /* Queries bucketed by timeout, for quickly handling timeouts: */
-#define ARES_TIMEOUT_TABLE_SIZE 1024
-  struct list_node queries_by_timeout[ARES_TIMEOUT_TABLE_SIZE];
+  /* Queries bucketed by qid and the UDP socket they were last sent on, for
+     quickly dispatching DNS responses; those not on a UDP socket, as over
+     TCP, are bucketed by qid alone.  A qid is only unique on its socket: */
+  struct list_table queries_by_qid;
+  /* Likewise the hedged copies of queries, by qid and hedge_conn: */
+  struct list_table hedges_by_qid;
+
+  /* With ARES_FLAG_COALESCE, queries hashed by their request, to find one
+     already in flight for a request sent again */
+  struct list_table queries_by_question;
+
+  /* Open sockets hashed by descriptor, so that the server and connection
+     an event is for are found without scanning */
+  struct list_table conns_by_fd;
+  /* Sent queries in a binary min-heap ordered by timeout, for quickly
+     finding the next one to expire: */
+  struct query **queries_by_timeout;
+  int nqueries_by_timeout;
+  int queries_by_timeout_alloc;
 
   ares_sock_state_cb sock_state_cb;
   void *sock_state_cb_data;
@@ -328,6 +471,81 @@ struct ares_channeldata {
 
   /* Path for resolv.conf file, configurable via ares_options */
   char *resolvconf_path;
+
+  /* Number of UDP sockets used per server, and number of queries sent on
+     one before it is replaced (0 for no limit) */
+  int udp_pool_size;
+  int udp_max_queries;
+
+  /* Answer cache, only allocated if ARES_OPT_QUERY_CACHE is in effect */
+  unsigned int qcache_max_ttl; /* in seconds, 0 disables the cache */
+  int qcache_max_entries;
+  struct ares_qcache *qcache;
+
+  /* Names ares_search() need not try again, only allocated if
+     ARES_OPT_NEG_CACHE is in effect */
+  unsigned int negcache_max_ttl; /* in seconds, 0 disables the cache */
+  int negcache_max_entries;
+  struct ares_negcache *negcache;
+
+  /* Buffers for reading several UDP answers with one call, allocated the
+     first time they are needed; one recvmmsg() call reads up to
+     ARES_UDP_RECV_BATCH answers */
+#define ARES_UDP_RECV_BATCH 16
+  unsigned char *udp_recv_bufs;
+
+  /* Free lists of query memory by size class, each keeping at most
+     pool_max_free blocks (ares__pool.c) */
+#define ARES_NPOOLS 5
+  struct {
+    void *head;
+    int nfree;
+  } pools[ARES_NPOOLS];
+  int pool_max_free;
+
+  /* Milliseconds an unused TCP connection is kept open, or 0 to close
+     sockets as soon as the channel has no queries */
+  int tcp_idle_timeout;
+
+  /* Bounds in milliseconds on the retransmission timeouts derived from the
+     round trip times of each server, or 0 to use the fixed timeout */
+  int rto_min;
+  int rto_max;
+
+  /* Milliseconds after which a UDP query is also sent to a second server,
+     or 0 to take that time from the hedge_percentile-th percentile of the
+     round trip times of the first; hedging is off if both are 0 */
+  int hedge_delay;
+  int hedge_percentile;
+
+  /* Milliseconds between checks of whether resolv.conf changed, after
+     which the system configuration is read again, or 0 not to check */
+  int reload_interval;
+  struct timeval reload_checked;
+  struct ares_filestamp resolvconf_stamp;
+
+  /* Requests other threads submitted, only allocated if
+     ARES_OPT_SUBMIT_QUEUE is in effect (ares_submit.c) */
+  int submit_queue_size;
+  struct ares_submitq *submitq;
+
+  /* The hosts file last read for lookups, or NULL */
+  struct ares_hosts *hosts;
+
+  /* Server failures shared with the other channels of an ares_resolver,
+     or NULL (ares__server_health.c); owned by the resolver */
+  struct ares_health *health;
+
+  /* Nonzero while the channel's queries and sockets are being processed,
+     so that callbacks made meanwhile cannot replace the server list */
+  int processing;
+
+  /* Counters reported by ares_get_stat(), indexed by ARES_STAT_* */
+#define ARES_NSTATS 8   /* ARES_STAT_MEMORY_BYTES is computed instead */
+  unsigned long stats[ARES_NSTATS];
+  /* Copy of stats as of the end of the last ares_process*() call, which
+     ares_resolver_get_stat() may read from another thread (ares_stats.c) */
+  volatile unsigned long published_stats[ARES_NSTATS];
 };
 
 /* Does the domain end in ".onion" or ".onion."? Case-insensitive. */
@@ -344,24 +562,167 @@ int ares__timedout(struct timeval *now,
 
 void ares__send_query(ares_channel channel, struct query *query,
                       struct timeval *now);
+void ares__send_pending(ares_channel channel);
 void ares__close_sockets(ares_channel channel, struct server_state *server);
+void ares__close_tcp(ares_channel channel, struct server_state *server);
+void ares__close_unused_sockets(ares_channel channel);
+void ares__unlink_query_server(ares_channel channel, struct query *query);
+int ares__tcp_idle_deadline(ares_channel channel, struct timeval *deadline);
+void ares__close_idle_tcp(ares_channel channel, struct timeval *now);
+void ares__server_answered(ares_channel channel, int whichserver,
+                           struct query *query, struct timeval *now);
+void ares__server_failed(ares_channel channel, int whichserver,
+                         struct query *query, int stat, struct timeval *now);
+void ares__stats_publish(ares_channel channel);
+int ares__stats_read(ares_channel channel, int stat, unsigned long *value);
+struct ares_health *ares__health_create(int nservers);
+void ares__health_destroy(struct ares_health *health);
+int ares__choose_server(ares_channel channel, struct query *query,
+                        int exclude, struct timeval *now);
+int ares__server_rto(ares_channel channel, struct server_state *server);
+int ares__server_hedge_delay(ares_channel channel,
+                             struct server_state *server);
+void ares__init_connection(struct server_connection *conn,
+                           struct server_state *server, int is_tcp);
+void ares__close_connection(ares_channel channel,
+                            struct server_connection *conn);
+unsigned int ares__qid_hash(const struct server_connection *conn,
+                            unsigned short qid);
+void ares__attach_query_conn(ares_channel channel, struct query *query,
+                             struct server_connection *conn);
+void ares__attach_hedge_conn(ares_channel channel, struct query *query,
+                             struct server_connection *conn);
+void ares__detach_query_conn(ares_channel channel, struct query *query);
+void ares__detach_hedge_conn(ares_channel channel, struct query *query);
 int ares__get_hostent(FILE *fp, int family, struct hostent **host);
 int ares__read_line(FILE *fp, char **buf, size_t *bufsize);
-void ares__free_query(struct query *query);
+void ares__free_query(ares_channel channel, struct query *query);
+struct query *ares__coalesce_find(ares_channel channel,
+                                  const unsigned char *qbuf, int qlen);
+void ares__coalesce_insert(ares_channel channel, struct query *query);
+int ares__coalesce_attach(ares_channel channel, struct query *query,
+                          const unsigned char *qbuf,
+                          ares_callback callback, void *arg);
+void ares__coalesce_free_waiters(ares_channel channel, struct query *query);
+size_t ares__coalesce_memory(struct query *query);
+void ares__query_callback(ares_channel channel, struct query *query,
+                          int status, int timeouts,
+                          unsigned char *abuf, int alen);
 unsigned short ares__generate_new_id(rc4_key* key);
 struct timeval ares__tvnow(void);
 int ares__expand_name_for_response(const unsigned char *encoded,
                                    const unsigned char *abuf, int alen,
                                    char **s, long *enclen);
 void ares__init_servers_state(ares_channel channel);
+void ares__init_server_state(ares_channel channel, struct server_state *server);
 void ares__destroy_servers_state(ares_channel channel);
+void ares__destroy_server_state(ares_channel channel,
+                                struct server_state *server);
+int ares__update_servers(ares_channel channel, const struct ares_addr *addrs,
+                         int naddrs);
+int ares__filestamp_update(const char *path, struct ares_filestamp *stamp);
+int ares__resolvconf_changed(ares_channel channel);
+void ares__reload_check(ares_channel channel);
 int ares__parse_qtype_reply(const unsigned char* abuf, int alen, int* qtype);
+void ares__send(ares_channel channel, const unsigned char *qbuf, int qlen,
+                ares_handle handle, ares_callback callback, void *arg);
+void ares__query(ares_channel channel, const char *name, int dnsclass,
+                 int type, ares_handle handle, ares_callback callback,
+                 void *arg);
+void ares__search(ares_channel channel, const char *name, int dnsclass,
+                  int type, ares_handle handle, ares_callback callback,
+                  void *arg);
+int ares__addrinfo_port(const char *service, int flags, unsigned short *port);
+int ares__addrinfo_merge_status(int prev, int cur);
+void ares__getaddrinfo(ares_channel channel, const char *node,
+                       const char *service,
+                       const struct ares_addrinfo_hints *hints,
+                       ares_handle handle, ares_addrinfo_callback callback,
+                       void *arg);
+ares_handle ares__handle_create(ares_channel channel, ares_callback callback,
+                                ares_addrinfo_callback ai_callback,
+                                void *arg);
+ares_handle ares__handle_started(ares_handle handle);
+void ares__handle_callback(void *arg, int status, int timeouts,
+                           unsigned char *abuf, int alen);
+void ares__handle_ai_callback(void *arg, int status, int timeouts,
+                              struct ares_addrinfo *res);
 int ares__single_domain(ares_channel channel, const char *name, char **s);
 int ares__cat_domain(const char *name, const char *domain, char **s);
 int ares__sortaddrinfo(ares_channel channel, struct ares_addrinfo_node *ai_node);
+int ares__sortaddrs(ares_channel channel,
+                    struct ares_addrinfo_batch_addr *addrs, size_t naddrs);
+
+int ares__create_query(const char *name, int dnsclass, int type,
+                       unsigned short id, int rd, unsigned char *space,
+                       size_t spacelen, unsigned char **bufp,
+                       int *buflenp, int max_udp_size);
+
+int ares__normalize_questions(const unsigned char *msg, int mlen,
+                              unsigned char *out);
+int ares__same_questions(const unsigned char *norm, int normlen, int qdcount,
+                         const unsigned char *abuf, int alen);
+const unsigned char *ares__skip_name(const unsigned char *p,
+                                     const unsigned char *msg, int mlen);
+
+void *ares__pool_alloc(ares_channel channel, size_t size);
+void ares__pool_free(ares_channel channel, void *ptr);
+void ares__pool_destroy(ares_channel channel);
+size_t ares__pool_block_size(size_t size);
+size_t ares__pool_memory(ares_channel channel);
+
+int ares__timeout_heap_reserve(ares_channel channel);
+void ares__timeout_heap_update(ares_channel channel, struct query *query);
+void ares__timeout_heap_remove(ares_channel channel, struct query *query);
+void ares__timeout_heap_expired(ares_channel channel, struct timeval *now,
+                                struct list_node *expired);
+struct query *ares__timeout_heap_first(ares_channel channel);
+
+int ares__qcache_create(ares_channel channel);
+void ares__qcache_destroy(struct ares_qcache *cache);
+void ares__qcache_insert(struct ares_qcache *cache,
+                         const unsigned char *qbuf, int qlen,
+                         const unsigned char *abuf, int alen,
+                         struct timeval *now);
+int ares__qcache_fetch(struct ares_qcache *cache,
+                       const unsigned char *qbuf, int qlen,
+                       struct timeval *now,
+                       ares_callback callback, void *arg);
+size_t ares__qcache_memory(struct ares_qcache *cache);
+unsigned int ares__answer_ttl(const unsigned char *abuf, int alen);
+int ares__negcache_create(ares_channel channel);
+void ares__negcache_destroy(struct ares_negcache *cache);
+void ares__negcache_flush(struct ares_negcache *cache);
+void ares__negcache_insert(struct ares_negcache *cache, const char *name,
+                           int dnsclass, int type,
+                           const unsigned char *abuf, int alen,
+                           struct timeval *now);
+int ares__negcache_fetch(struct ares_negcache *cache, const char *name,
+                         int dnsclass, int type, struct timeval *now);
+size_t ares__negcache_memory(struct ares_negcache *cache);
 int ares__readaddrinfo(FILE *fp, const char *name, unsigned short port,
                        const struct ares_addrinfo_hints *hints,
                        struct ares_addrinfo *ai);
+int ares__hosts_lookup_name(ares_channel channel, const char *name,
+                            int family, struct hostent **host);
+int ares__hosts_lookup_addr(ares_channel channel,
+                            const struct ares_addr *addr,
+                            struct hostent **host);
+int ares__hosts_addrinfo(ares_channel channel, const char *path,
+                         const char *name, unsigned short port,
+                         const struct ares_addrinfo_hints *hints,
+                         struct ares_addrinfo *ai);
+int ares__hosts_addrs(ares_channel channel, const char *path,
+                      const char *name, int family,
+                      int (*callback)(void *arg, int family, const void *addr),
+                      void *arg);
+void ares__hosts_destroy(struct ares_hosts *hosts);
+size_t ares__hosts_memory(struct ares_hosts *hosts);
+int ares__submitq_create(ares_channel channel);
+void ares__submitq_drain(ares_channel channel);
+void ares__submitq_fail(ares_channel channel, int status);
+void ares__submitq_destroy(ares_channel channel);
+size_t ares__submitq_memory(ares_channel channel);
 
 struct ares_addrinfo *ares__malloc_addrinfo(void);
 
@@ -63,11 +63,20 @@
 
 static int try_again(int errnum);
 static void write_tcp_data(ares_channel channel, fd_set *write_fds,
-                           ares_socket_t write_fd, struct timeval *now);
+                           struct timeval *now);
 static void read_tcp_data(ares_channel channel, fd_set *read_fds,
-                          ares_socket_t read_fd, struct timeval *now);
+                          struct timeval *now);
 static void read_udp_packets(ares_channel channel, fd_set *read_fds,
-                             ares_socket_t read_fd, struct timeval *now);
+                             struct timeval *now);
+static void write_tcp_server(ares_channel channel, int whichserver,
+                             struct timeval *now);
+static void read_tcp_server(ares_channel channel, int whichserver,
+                            struct timeval *now);
+static void read_udp_conn(ares_channel channel, int whichserver,
+                          struct server_connection *conn,
+                          struct timeval *now);
+static void process_fd_event(ares_channel channel, ares_socket_t fd,
+                             unsigned int events, struct timeval *now);
 static void advance_tcp_send_queue(ares_channel channel, int whichserver,
                                    ares_ssize_t num_bytes);
 static void process_timeouts(ares_channel channel, struct timeval *now);
@@ -75,6 +84,7 @@ static void process_broken_connections(ares_channel channel,
                                        struct timeval *now);
 static void process_answer(ares_channel channel, unsigned char *abuf,
                            int alen, int whichserver, int tcp,
+                           struct server_connection *conn,
                            struct timeval *now);
 static void handle_error(ares_channel channel, int whichserver,
                          struct timeval *now);
@@ -83,12 +93,13 @@ static void skip_server(ares_channel channel, struct query *query,
 static void next_server(ares_channel channel, struct query *query,
                         struct timeval *now);
 static int open_tcp_socket(ares_channel channel, struct server_state *server);
-static int open_udp_socket(ares_channel channel, struct server_state *server);
-static int same_questions(const unsigned char *qbuf, int qlen,
-                          const unsigned char *abuf, int alen);
+static int open_udp_socket(ares_channel channel, struct server_state *server,
+                           struct server_connection *conn);
 static int same_address(struct sockaddr *sa, struct ares_addr *aa);
 static void end_query(ares_channel channel, struct query *query, int status,
                       unsigned char *abuf, int alen);
+static void send_hedge(ares_channel channel, struct query *query,
+                       struct timeval *now);
 
 /* return true if now is exactly check time or later */
 int ares__timedout(struct timeval *now,
@@ -117,20 +128,13 @@ static void timeadd(struct timeval *now, int millisecs)
   }
 }
 
-/*
- * generic process function
- */
-static void processfds(ares_channel channel,
-                       fd_set *read_fds, ares_socket_t read_fd,
-                       fd_set *write_fds, ares_socket_t write_fd)
+/* Handle everything that is not tied to an event on one of our sockets. */
+static void process_non_fd(ares_channel channel, struct timeval *now)
 {
-  struct timeval now = ares__tvnow();
-
-  write_tcp_data(channel, write_fds, write_fd, &now);
-  read_tcp_data(channel, read_fds, read_fd, &now);
-  read_udp_packets(channel, read_fds, read_fd, &now);
-  process_timeouts(channel, &now);
-  process_broken_connections(channel, &now);
+  process_timeouts(channel, now);
+  process_broken_connections(channel, now);
+  ares__close_idle_tcp(channel, now);
+  ares__send_pending(channel);
 }
 
 /* Something interesting happened on the wire, or there was a timeout.
@@ -138,7 +142,17 @@ static void processfds(ares_channel channel,
  */
 void ares_process(ares_channel channel, fd_set *read_fds, fd_set *write_fds)
 {
-  processfds(channel, read_fds, ARES_SOCKET_BAD, write_fds, ARES_SOCKET_BAD);
+  struct timeval now = ares__tvnow();
+
+  channel->processing++;
+  ares__submitq_drain(channel);
+  write_tcp_data(channel, write_fds, &now);
+  read_tcp_data(channel, read_fds, &now);
+  read_udp_packets(channel, read_fds, &now);
+  process_non_fd(channel, &now);
+  channel->processing--;
+  ares__close_unused_sockets(channel);
+  ares__stats_publish(channel);
 }
 
 /* Something interesting happened on the wire, or there was a timeout.
@@ -149,7 +163,100 @@ void ares_process_fd(ares_channel channel,
                                                file descriptors */
                      ares_socket_t write_fd)
 {
-  processfds(channel, NULL, read_fd, NULL, write_fd);
+  struct ares_fd_events events[2];
+  size_t nevents = 0;
+
+  if (write_fd != ARES_SOCKET_BAD)
+    {
+      events[nevents].fd = write_fd;
+      events[nevents].events = ARES_FD_EVENT_WRITE;
+      nevents++;
+    }
+  if (read_fd != ARES_SOCKET_BAD)
+    {
+      events[nevents].fd = read_fd;
+      events[nevents].events = ARES_FD_EVENT_READ;
+      nevents++;
+    }
+  ares_process_fds(channel, events, nevents, 0);
+}
+
+/* Process the events an event loop reported for some of our sockets.
+ * Each socket is found through channel->conns_by_fd, so the cost does not
+ * depend on how many servers or sockets the channel has.
+ */
+int ares_process_fds(ares_channel channel, const struct ares_fd_events *events,
+                     size_t nevents, int flags)
+{
+  struct timeval now;
+  size_t i;
+
+  if (!channel || (nevents && !events))
+    return ARES_ENODATA;
+
+  now = ares__tvnow();
+  channel->processing++;
+  ares__submitq_drain(channel);
+  for (i = 0; i < nevents; i++)
+    process_fd_event(channel, events[i].fd, events[i].events, &now);
+
+  if (!(flags & ARES_PROCESS_FLAG_SKIP_NON_FD))
+    process_non_fd(channel, &now);
+  channel->processing--;
+  ares__close_unused_sockets(channel);
+  ares__stats_publish(channel);
+  return ARES_SUCCESS;
+}
+
+/* Index a socket that has just been opened by its descriptor. */
+static void link_conn_fd(ares_channel channel, struct server_connection *conn)
+{
+  ares__list_table_insert(&(channel->conns_by_fd), &(conn->node_by_fd),
+                          (unsigned int)conn->fd);
+}
+
+/* Return the open socket with the given descriptor, or NULL. */
+static struct server_connection *conn_by_fd(ares_channel channel,
+                                            ares_socket_t fd)
+{
+  struct list_node* list_head = ares__list_table_bucket(&(channel->conns_by_fd),
+                                                        (unsigned int)fd);
+  struct list_node* list_node;
+  struct server_connection *conn;
+
+  for (list_node = list_head->next; list_node != list_head;
+       list_node = list_node->next)
+    {
+      conn = list_node->data;
+      if (conn->fd == fd)
+        return conn;
+    }
+  return NULL;
+}
+
+/* Deal with the readiness of a single socket. */
+static void process_fd_event(ares_channel channel, ares_socket_t fd,
+                             unsigned int events, struct timeval *now)
+{
+  struct server_connection *conn = conn_by_fd(channel, fd);
+  int whichserver;
+
+  if (!conn)
+    return; /* not one of ours, or closed since the event was reported */
+
+  whichserver = (int)(conn->server - channel->servers);
+  if (!conn->is_tcp)
+    {
+      if ((events & ARES_FD_EVENT_READ) && !conn->server->is_broken)
+        read_udp_conn(channel, whichserver, conn, now);
+      return;
+    }
+
+  if (events & ARES_FD_EVENT_WRITE)
+    write_tcp_server(channel, whichserver, now);
+  /* Writing may have failed and closed the connection. */
+  if ((events & ARES_FD_EVENT_READ) && conn->fd == fd)
+    read_tcp_server(channel, whichserver, now);
 }
 
 
@@ -199,97 +306,101 @@ static ares_ssize_t socket_write(ares_channel channel, ares_socket_t s, const vo
   return swrite(s, data, len);
 }
 
+/* Write out the data queued for a server's TCP connection. */
+static void write_tcp_server(ares_channel channel, int whichserver,
+                             struct timeval *now)
+{
+  struct server_state *server = &channel->servers[whichserver];
+  struct send_request *sendreq;
+  struct iovec *vec;
+  ares_ssize_t scount;
+  ares_ssize_t wcount;
+  size_t n;
+
+  /* Make sure server has data to send. */
+  if (!server->qhead || server->tcp_conn.fd == ARES_SOCKET_BAD ||
+      server->is_broken)
+    return;
+
+  /* Count the number of send queue items. */
+  n = 0;
+  for (sendreq = server->qhead; sendreq; sendreq = sendreq->next)
+    n++;
+
+  /* Allocate iovecs so we can send all our data at once. */
+  vec = ares_malloc(n * sizeof(struct iovec));
+  if (vec)
+    {
+      /* Fill in the iovecs and send. */
+      n = 0;
+      for (sendreq = server->qhead; sendreq; sendreq = sendreq->next)
+        {
+          vec[n].iov_base = (char *) sendreq->data;
+          vec[n].iov_len = sendreq->len;
+          n++;
+        }
+      wcount = socket_writev(channel, server->tcp_conn.fd, vec, (int)n);
+      ares_free(vec);
+      if (wcount < 0)
+        {
+          if (!try_again(SOCKERRNO))
+            handle_error(channel, whichserver, now);
+          return;
+        }
+      server->stats[ARES_SERVER_STAT_TCP_BYTES_SENT] += (unsigned long)wcount;
+
+      /* Advance the send queue by as many bytes as we sent. */
+      advance_tcp_send_queue(channel, whichserver, wcount);
+    }
+  else
+    {
+      /* Can't allocate iovecs; just send the first request. */
+      sendreq = server->qhead;
+
+      scount = socket_write(channel, server->tcp_conn.fd, sendreq->data, sendreq->len);
+      if (scount < 0)
+        {
+          if (!try_again(SOCKERRNO))
+            handle_error(channel, whichserver, now);
+          return;
+        }
+      server->stats[ARES_SERVER_STAT_TCP_BYTES_SENT] += (unsigned long)scount;
+
+      /* Advance the send queue by as many bytes as we sent. */
+      advance_tcp_send_queue(channel, whichserver, scount);
+    }
+}
+
 /* If any TCP sockets select true for writing, write out queued data
  * we have for them.
  */
 static void write_tcp_data(ares_channel channel,
                            fd_set *write_fds,
-                           ares_socket_t write_fd,
                            struct timeval *now)
 {
   struct server_state *server;
-  struct send_request *sendreq;
-  struct iovec *vec;
   int i;
-  ares_ssize_t scount;
-  ares_ssize_t wcount;
-  size_t n;
 
-  if(!write_fds && (write_fd == ARES_SOCKET_BAD))
+  if(!write_fds)
     /* no possible action */
     return;
 
   for (i = 0; i < channel->nservers; i++)
     {
-      /* Make sure server has data to send and is selected in write_fds or
-         write_fd. */
+      /* Make sure server is selected in write_fds. */
       server = &channel->servers[i];
-      if (!server->qhead || server->tcp_socket == ARES_SOCKET_BAD ||
-          server->is_broken)
+      if (server->tcp_conn.fd == ARES_SOCKET_BAD ||
+          !FD_ISSET(server->tcp_conn.fd, write_fds))
         continue;
 
-      if(write_fds) {
-        if(!FD_ISSET(server->tcp_socket, write_fds))
-          continue;
-      }
-      else {
-        if(server->tcp_socket != write_fd)
-          continue;
-      }
-
-      if(write_fds)
-        /* If there's an error and we close this socket, then open
-         * another with the same fd to talk to another server, then we
-         * don't want to think that it was the new socket that was
-         * ready. This is not disastrous, but is likely to result in
-         * extra system calls and confusion. */
-        FD_CLR(server->tcp_socket, write_fds);
-
-      /* Count the number of send queue items. */
-      n = 0;
-      for (sendreq = server->qhead; sendreq; sendreq = sendreq->next)
-        n++;
-
-      /* Allocate iovecs so we can send all our data at once. */
-      vec = ares_malloc(n * sizeof(struct iovec));
-      if (vec)
-        {
-          /* Fill in the iovecs and send. */
-          n = 0;
-          for (sendreq = server->qhead; sendreq; sendreq = sendreq->next)
-            {
-              vec[n].iov_base = (char *) sendreq->data;
-              vec[n].iov_len = sendreq->len;
-              n++;
-            }
-          wcount = socket_writev(channel, server->tcp_socket, vec, (int)n);
-          ares_free(vec);
-          if (wcount < 0)
-            {
-              if (!try_again(SOCKERRNO))
-                handle_error(channel, i, now);
-              continue;
-            }
+      /* If there's an error and we close this socket, then open
+       * another with the same fd to talk to another server, then we
+       * don't want to think that it was the new socket that was
+       * ready. This is not disastrous, but is likely to result in
+       * extra system calls and confusion. */
+      FD_CLR(server->tcp_conn.fd, write_fds);
 
-          /* Advance the send queue by as many bytes as we sent. */
-          advance_tcp_send_queue(channel, i, wcount);
-        }
-      else
-        {
-          /* Can't allocate iovecs; just send the first request. */
-          sendreq = server->qhead;
-
-          scount = socket_write(channel, server->tcp_socket, sendreq->data, sendreq->len);
-          if (scount < 0)
-            {
-              if (!try_again(SOCKERRNO))
-                handle_error(channel, i, now);
-              continue;
-            }
-
-          /* Advance the send queue by as many bytes as we sent. */
-          advance_tcp_send_queue(channel, i, scount);
-        }
+      write_tcp_server(channel, i, now);
     }
 }
 
@@ -306,9 +417,9 @@ static void advance_tcp_send_queue(ares_channel channel, int whichserver,
       server->qhead = sendreq->next;
       if (sendreq->data_storage)
         ares_free(sendreq->data_storage);
-      ares_free(sendreq);
+      ares__pool_free(channel, sendreq);
       if (server->qhead == NULL) {
-        SOCK_STATE_CALLBACK(channel, server->tcp_socket, 1, 0);
+        SOCK_STATE_CALLBACK(channel, server->tcp_conn.fd, 1, 0);
         server->qtail = NULL;
 
         /* qhead is NULL so we cannot continue this loop */
@@ -355,18 +466,90 @@ static ares_ssize_t socket_recv(ares_channel channel,
    return sread(s, data, data_len);
 }
 
-/* If any TCP socket selects true for reading, read some data,
- * allocate a buffer if we finish reading the length word, and process
- * a packet if we finish reading one.
+/* Read what has arrived on a server's TCP connection and process every
+ * answer that is now complete.  Answers are read into a buffer kept with
+ * the server, so one read can take in several of them; a partial answer
+ * is moved to the front of the buffer to be completed by later reads.
  */
+static void read_tcp_server(ares_channel channel, int whichserver,
+                            struct timeval *now)
+{
+  struct server_state *server = &channel->servers[whichserver];
+  unsigned char *rbuf;
+  size_t need;
+  size_t pos;
+  size_t msglen;
+  int generation;
+  ares_ssize_t count;
+
+  /* Make sure the server has a socket. */
+  if (server->tcp_conn.fd == ARES_SOCKET_BAD || server->is_broken)
+    return;
+
+  /* Make room for at least the rest of the answer at the front. */
+  need = ARES_TCP_RBUF_SIZE;
+  if (server->tcp_rbuf_len >= 2)
+    {
+      msglen = server->tcp_rbuf[0] << 8 | server->tcp_rbuf[1];
+      if (msglen + 2 > need)
+        need = msglen + 2;
+    }
+  if (server->tcp_rbuf_alloc < need)
+    {
+      rbuf = ares_realloc(server->tcp_rbuf, need);
+      if (!rbuf)
+        {
+          handle_error(channel, whichserver, now);
+          return;
+        }
+      server->tcp_rbuf = rbuf;
+      server->tcp_rbuf_alloc = need;
+    }
+
+  count = socket_recv(channel, server->tcp_conn.fd,
+                      server->tcp_rbuf + server->tcp_rbuf_len,
+                      server->tcp_rbuf_alloc - server->tcp_rbuf_len);
+  if (count <= 0)
+    {
+      if (!(count == -1 && try_again(SOCKERRNO)))
+        handle_error(channel, whichserver, now);
+      return;
+    }
+  server->tcp_rbuf_len += (size_t)count;
+  server->stats[ARES_SERVER_STAT_TCP_BYTES_RECV] += (unsigned long)count;
+  server->tcp_last_used = *now;
+
+  /* Process each complete answer.  Answering a query may close this
+   * connection (or open a new one), so stop if that happened.
+   */
+  generation = server->tcp_connection_generation;
+  pos = 0;
+  while (server->tcp_rbuf_len - pos >= 2)
+    {
+      rbuf = server->tcp_rbuf + pos;
+      msglen = rbuf[0] << 8 | rbuf[1];
+      if (server->tcp_rbuf_len - pos < msglen + 2)
+        break;
+      pos += msglen + 2;
+      process_answer(channel, rbuf + 2, (int)msglen, whichserver, 1, NULL,
+                     now);
+      if (server->tcp_connection_generation != generation)
+        return;
+    }
+
+  server->tcp_rbuf_len -= pos;
+  if (pos && server->tcp_rbuf_len)
+    memmove(server->tcp_rbuf, server->tcp_rbuf + pos, server->tcp_rbuf_len);
+}
+
+/* If any TCP socket selects true for reading, read from it. */
 static void read_tcp_data(ares_channel channel, fd_set *read_fds,
-                          ares_socket_t read_fd, struct timeval *now)
+                          struct timeval *now)
 {
   struct server_state *server;
   int i;
-  ares_ssize_t count;
 
-  if(!read_fds && (read_fd == ARES_SOCKET_BAD))
+  if(!read_fds)
     /* no possible action */
     return;
 
@@ -374,94 +557,99 @@ static void read_tcp_data(ares_channel channel, fd_set *read_fds,
     {
       /* Make sure the server has a socket and is selected in read_fds. */
       server = &channel->servers[i];
-      if (server->tcp_socket == ARES_SOCKET_BAD || server->is_broken)
+      if (server->tcp_conn.fd == ARES_SOCKET_BAD ||
+          !FD_ISSET(server->tcp_conn.fd, read_fds))
         continue;
 
-      if(read_fds) {
-        if(!FD_ISSET(server->tcp_socket, read_fds))
-          continue;
-      }
-      else {
-        if(server->tcp_socket != read_fd)
-          continue;
+      /* If there's an error and we close this socket, then open another
+       * with the same fd to talk to another server, then we don't want to
+       * think that it was the new socket that was ready. This is not
+       * disastrous, but is likely to result in extra system calls and
+       * confusion. */
+      FD_CLR(server->tcp_conn.fd, read_fds);
+
+      read_tcp_server(channel, i, now);
+    }
+}
+
+#ifdef HAVE_RECVMMSG
+/* Read and process all answers waiting on one of a server's UDP sockets,
+ * fetching up to ARES_UDP_RECV_BATCH datagrams per system call.  Returns 0
+ * without reading anything if the receive buffers cannot be allocated, so
+ * that the caller falls back to reading one datagram at a time.
+ */
+static int read_udp_batch(ares_channel channel, int whichserver,
+                          struct server_connection *conn,
+                          struct timeval *now)
+{
+  struct server_state *server = &channel->servers[whichserver];
+  struct mmsghdr msgs[ARES_UDP_RECV_BATCH];
+  struct iovec iovs[ARES_UDP_RECV_BATCH];
+  union {
+    struct sockaddr     sa;
+    struct sockaddr_in  sa4;
+    struct sockaddr_in6 sa6;
+  } from[ARES_UDP_RECV_BATCH];
+  int count, n;
+
+  if (!channel->udp_recv_bufs)
+    {
+      channel->udp_recv_bufs = ares_malloc(ARES_UDP_RECV_BATCH *
+                                           (MAXENDSSZ + 1));
+      if (!channel->udp_recv_bufs)
+        return 0;
+    }
+
+  do {
+    if (conn->fd == ARES_SOCKET_BAD)
+      break;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (n = 0; n < ARES_UDP_RECV_BATCH; n++)
+      {
+        iovs[n].iov_base = channel->udp_recv_bufs + n * (MAXENDSSZ + 1);
+        iovs[n].iov_len = MAXENDSSZ + 1;
+        msgs[n].msg_hdr.msg_iov = &iovs[n];
+        msgs[n].msg_hdr.msg_iovlen = 1;
+        msgs[n].msg_hdr.msg_name = &from[n];
+        msgs[n].msg_hdr.msg_namelen = sizeof(from[n]);
       }
 
-      if(read_fds)
-        /* If there's an error and we close this socket, then open another
-         * with the same fd to talk to another server, then we don't want to
-         * think that it was the new socket that was ready. This is not
-         * disastrous, but is likely to result in extra system calls and
-         * confusion. */
-        FD_CLR(server->tcp_socket, read_fds);
+    count = recvmmsg(conn->fd, msgs, ARES_UDP_RECV_BATCH, 0, NULL);
+    channel->stats[ARES_STAT_UDP_RECV_CALLS]++;
 
-      if (server->tcp_lenbuf_pos != 2)
-        {
-          /* We haven't yet read a length word, so read that (or
-           * what's left to read of it).
-           */
-          count = socket_recv(channel, server->tcp_socket,
-			      server->tcp_lenbuf + server->tcp_lenbuf_pos,
-			      2 - server->tcp_lenbuf_pos);
-          if (count <= 0)
-            {
-              if (!(count == -1 && try_again(SOCKERRNO)))
-                handle_error(channel, i, now);
-              continue;
-            }
+    if (count == -1 && try_again(SOCKERRNO))
+      break;
+    else if (count <= 0)
+      {
+        handle_error(channel, whichserver, now);
+        break;
+      }
+    channel->stats[ARES_STAT_UDP_RECV_PACKETS] += count;
 
-          server->tcp_lenbuf_pos += (int)count;
-          if (server->tcp_lenbuf_pos == 2)
-            {
-              /* We finished reading the length word.  Decode the
-               * length and allocate a buffer for the data.
-               */
-              server->tcp_length = server->tcp_lenbuf[0] << 8
-                | server->tcp_lenbuf[1];
-              server->tcp_buffer = ares_malloc(server->tcp_length);
-              if (!server->tcp_buffer) {
-                handle_error(channel, i, now);
-                return; /* bail out on malloc failure. TODO: make this
-                           function return error codes */
-              }
-              server->tcp_buffer_pos = 0;
-            }
-        }
-      else
-        {
-          /* Read data into the allocated buffer. */
-          count = socket_recv(channel, server->tcp_socket,
-			      server->tcp_buffer + server->tcp_buffer_pos,
-			      server->tcp_length - server->tcp_buffer_pos);
-          if (count <= 0)
-            {
-              if (!(count == -1 && try_again(SOCKERRNO)))
-                handle_error(channel, i, now);
-              continue;
-            }
+    for (n = 0; n < count; n++)
+      {
+        /* Drop answers that don't come from the server we asked, someone
+         * may be attempting to perform a cache poisoning attack. */
+        if (!same_address(&from[n].sa, &server->addr))
+          continue;
+        process_answer(channel, iovs[n].iov_base, (int)msgs[n].msg_len,
+                       whichserver, 0, conn, now);
+      }
 
-          server->tcp_buffer_pos += (int)count;
-          if (server->tcp_buffer_pos == server->tcp_length)
-            {
-              /* We finished reading this answer; process it and
-               * prepare to read another length word.
-               */
-              process_answer(channel, server->tcp_buffer, server->tcp_length,
-                             i, 1, now);
-              ares_free(server->tcp_buffer);
-              server->tcp_buffer = NULL;
-              server->tcp_lenbuf_pos = 0;
-              server->tcp_buffer_pos = 0;
-            }
-        }
-    }
+    /* A short batch means the socket has been drained. */
+  } while (count == ARES_UDP_RECV_BATCH);
+
+  return 1;
 }
+#endif
 
-/* If any UDP sockets select true for reading, process them. */
-static void read_udp_packets(ares_channel channel, fd_set *read_fds,
-                             ares_socket_t read_fd, struct timeval *now)
+/* Read and process all answers waiting on one of a server's UDP sockets. */
+static void read_udp_conn(ares_channel channel, int whichserver,
+                          struct server_connection *conn,
+                          struct timeval *now)
 {
-  struct server_state *server;
-  int i;
+  struct server_state *server = &channel->servers[whichserver];
   ares_ssize_t count;
   unsigned char buf[MAXENDSSZ + 1];
 #ifdef HAVE_RECVFROM
@@ -473,108 +661,173 @@ static void read_udp_packets(ares_channel channel, fd_set *read_fds,
   } from;
 #endif
 
-  if(!read_fds && (read_fd == ARES_SOCKET_BAD))
+#ifdef HAVE_RECVMMSG
+  if (!channel->sock_funcs && read_udp_batch(channel, whichserver, conn, now))
+    return;
+#endif
+
+  /* To reduce event loop overhead, read and process as many
+   * packets as we can. */
+  do {
+    /* Handling an answer may have closed the socket. */
+    if (conn->fd == ARES_SOCKET_BAD)
+      break;
+
+    if (server->addr.family == AF_INET)
+      fromlen = sizeof(from.sa4);
+    else
+      fromlen = sizeof(from.sa6);
+    count = socket_recvfrom(channel, conn->fd, (void *)buf,
+                            sizeof(buf), 0, &from.sa, &fromlen);
+    channel->stats[ARES_STAT_UDP_RECV_CALLS]++;
+    if (count > 0)
+      channel->stats[ARES_STAT_UDP_RECV_PACKETS]++;
+
+    if (count == -1 && try_again(SOCKERRNO))
+      continue;
+    else if (count <= 0)
+      handle_error(channel, whichserver, now);
+#ifdef HAVE_RECVFROM
+    else if (!same_address(&from.sa, &server->addr))
+      /* The address the response comes from does not match the address we
+       * sent the request to. Someone may be attempting to perform a cache
+       * poisoning attack. */
+      break;
+#endif
+    else
+      process_answer(channel, buf, (int)count, whichserver, 0, conn, now);
+  } while (count > 0);
+}
+
+/* If any UDP sockets select true for reading, process them. */
+static void read_udp_packets(ares_channel channel, fd_set *read_fds,
+                             struct timeval *now)
+{
+  struct server_state *server;
+  struct server_connection *conn;
+  struct list_node* list_head;
+  struct list_node* list_node;
+  int i;
+
+  if(!read_fds)
     /* no possible action */
     return;
 
   for (i = 0; i < channel->nservers; i++)
     {
-      /* Make sure the server has a socket and is selected in read_fds. */
       server = &channel->servers[i];
 
-      if (server->udp_socket == ARES_SOCKET_BAD || server->is_broken)
+      if (server->is_broken)
         continue;
 
-      if(read_fds) {
-        if(!FD_ISSET(server->udp_socket, read_fds))
-          continue;
-      }
-      else {
-        if(server->udp_socket != read_fd)
-          continue;
-      }
+      /* Connections are never freed while we process answers, so it is
+       * safe to move on to the next one afterwards. */
+      list_head = &(server->connections);
+      for (list_node = list_head->next; list_node != list_head;
+           list_node = list_node->next)
+        {
+          /* Make sure the socket is open and is selected in read_fds. */
+          conn = list_node->data;
 
-      if(read_fds)
-        /* If there's an error and we close this socket, then open
-         * another with the same fd to talk to another server, then we
-         * don't want to think that it was the new socket that was
-         * ready. This is not disastrous, but is likely to result in
-         * extra system calls and confusion. */
-        FD_CLR(server->udp_socket, read_fds);
-
-      /* To reduce event loop overhead, read and process as many
-       * packets as we can. */
-      do {
-        if (server->udp_socket == ARES_SOCKET_BAD)
-          count = 0;
-
-        else {
-          if (server->addr.family == AF_INET)
-            fromlen = sizeof(from.sa4);
-          else
-            fromlen = sizeof(from.sa6);
-          count = socket_recvfrom(channel, server->udp_socket, (void *)buf,
-                                  sizeof(buf), 0, &from.sa, &fromlen);
-        }
+          if (conn->fd == ARES_SOCKET_BAD || !FD_ISSET(conn->fd, read_fds))
+            continue;
 
-        if (count == -1 && try_again(SOCKERRNO))
-          continue;
-        else if (count <= 0)
-          handle_error(channel, i, now);
-#ifdef HAVE_RECVFROM
-        else if (!same_address(&from.sa, &server->addr))
-          /* The address the response comes from does not match the address we
-           * sent the request to. Someone may be attempting to perform a cache
-           * poisoning attack. */
-          break;
-#endif
-        else
-          process_answer(channel, buf, (int)count, i, 0, now);
-       } while (count > 0);
+          /* If there's an error and we close this socket, then open
+           * another with the same fd to talk to another server, then we
+           * don't want to think that it was the new socket that was
+           * ready. This is not disastrous, but is likely to result in
+           * extra system calls and confusion. */
+          FD_CLR(conn->fd, read_fds);
+
+          read_udp_conn(channel, i, conn, now);
+        }
     }
 }
 
 /* If any queries have timed out, note the timeout and move them on. */
 static void process_timeouts(ares_channel channel, struct timeval *now)
 {
-  time_t t;  /* the time of the timeouts we're processing */
   struct query *query;
-  struct list_node* list_head;
-  struct list_node* list_node;
+  struct list_node expired;
 
-  /* Process all the timeouts that have fired since the last time we processed
-   * timeouts. If things are going well, then we'll have hundreds/thousands of
-   * queries that fall into future buckets, and only a handful of requests
-   * that fall into the "now" bucket, so this should be quite quick.
+  /* Gather the expired queries first.  Moving a query on gives it a new
+   * timeout, which may already have passed if the configured timeout is
+   * tiny, and it must not be retried again in the same pass.
    */
-  for (t = channel->last_timeout_processed; t <= now->tv_sec; t++)
+  ares__init_list_head(&expired);
+  ares__timeout_heap_expired(channel, now, &expired);
+
+  while (!ares__is_list_empty(&expired))
     {
-      list_head = &(channel->queries_by_timeout[t % ARES_TIMEOUT_TABLE_SIZE]);
-      for (list_node = list_head->next; list_node != list_head; )
+      query = expired.next->data;
+      /* Unlink first; callbacks may free any of the other gathered queries,
+       * which takes them off this list too. */
+      ares__remove_from_list(&(query->queries_timed_out));
+      if (query->hedge_armed)
         {
-          query = list_node->data;
-          list_node = list_node->next;  /* in case the query gets deleted */
-          if (query->timeout.tv_sec && ares__timedout(now, &query->timeout))
-            {
-              query->error_status = ARES_ETIMEOUT;
-              ++query->timeouts;
-              next_server(channel, query, now);
-            }
+          /* Not timed out yet; it is only time to hedge. */
+          send_hedge(channel, query, now);
+          continue;
         }
-     }
-  channel->last_timeout_processed = now->tv_sec;
+      query->error_status = ARES_ETIMEOUT;
+      ++query->timeouts;
+      ares__server_failed(channel, query->server, query,
+                          ARES_SERVER_STAT_TIMEOUTS, now);
+      next_server(channel, query, now);
+    }
+}
+
+/* Find the query with the given id that is waiting for an answer on a UDP
+ * socket, or on none if conn is NULL, or whose hedged copy is if hedge is
+ * set.  Unless abuf is NULL, the questions must also be those of the answer
+ * in it.
+ */
+static struct query *find_query(ares_channel channel,
+                                struct server_connection *conn,
+                                unsigned short id, int hedge,
+                                const unsigned char *abuf, int alen)
+{
+  struct list_table *table;
+  struct list_node* list_head;
+  struct list_node* list_node;
+
+  table = hedge ? &(channel->hedges_by_qid) : &(channel->queries_by_qid);
+  list_head = ares__list_table_bucket(table, ares__qid_hash(conn, id));
+  for (list_node = list_head->next; list_node != list_head;
+       list_node = list_node->next)
+    {
+      struct query *q = list_node->data;
+      if ((q->qid == id) && (hedge ? q->hedge_conn : q->conn) == conn &&
+          (!abuf || ares__same_questions(q->question, q->questionlen,
+                                         DNS_HEADER_QDCOUNT(q->qbuf),
+                                         abuf, alen)))
+        return q;
+    }
+  return NULL;
 }
 
-/* Handle an answer from a server. */
+/* Send the query again, to the server whose answer asked for that.  That
+ * is not query->server when the answer was to the hedged copy, which is
+ * done with either way.
+ */
+static void resend_query(ares_channel channel, struct query *query,
+                         int whichserver, struct timeval *now)
+{
+  ares__detach_hedge_conn(channel, query);
+  query->server = whichserver;
+  ares__send_query(channel, query, now);
+}
+
+/* Handle an answer from a server, which came in on the UDP socket conn
+ * unless tcp is set. */
 static void process_answer(ares_channel channel, unsigned char *abuf,
                            int alen, int whichserver, int tcp,
+                           struct server_connection *conn,
                            struct timeval *now)
 {
   int tc, rcode, packetsz;
   unsigned short id;
   struct query *query;
-  struct list_node* list_head;
-  struct list_node* list_node;
 
   /* If there's no room in the answer for a header, we can't do much
    * with it. */
@@ -587,22 +840,21 @@ static void process_answer(ares_channel channel, unsigned char *abuf,
   rcode = DNS_HEADER_RCODE(abuf);
 
   /* Find the query corresponding to this packet. The queries are
-   * hashed/bucketed by query id, so this lookup should be quick.  Note that
-   * both the query id and the questions must be the same; when the query id
-   * wraps around we can have multiple outstanding queries with the same query
-   * id, so we need to check both the id and question.
+   * hashed/bucketed by query id and UDP socket, so this lookup should be
+   * quick.  An answer over UDP must arrive on the socket the query, or its
+   * hedged copy, was last sent on; any other port would have had to be
+   * guessed by a spoofer.  Note that both the query id and the questions
+   * must be the same; a query id is only unique on its socket, and over
+   * TCP queries with the same id can be outstanding, so we need to check
+   * both the id and question.
    */
-  query = NULL;
-  list_head = &(channel->queries_by_qid[id % ARES_QID_TABLE_SIZE]);
-  for (list_node = list_head->next; list_node != list_head;
-       list_node = list_node->next)
+  if (tcp || !conn)
+    query = find_query(channel, NULL, id, 0, abuf, alen);
+  else
     {
-      struct query *q = list_node->data;
-      if ((q->qid == id) && same_questions(q->qbuf, q->qlen, abuf, alen))
-        {
-          query = q;
-          break;
-        }
+      query = find_query(channel, conn, id, 0, abuf, alen);
+      if (!query)
+        query = find_query(channel, conn, id, 1, abuf, alen);
     }
   if (!query)
     return;
@@ -624,9 +876,8 @@ static void process_answer(ares_channel channel, unsigned char *abuf,
           query->tcpbuf[0] = (unsigned char)((qlen >> 8) & 0xff);
           query->tcpbuf[1] = (unsigned char)(qlen & 0xff);
           DNS_HEADER_SET_ARCOUNT(query->tcpbuf + 2, 0);
-          query->tcpbuf = ares_realloc(query->tcpbuf, query->tcplen);
-          query->qbuf = query->tcpbuf + 2;
-          ares__send_query(channel, query, now);
+          /* The OPT record was last, so just stop short of it. */
+          resend_query(channel, query, whichserver, now);
           return;
       }
   }
@@ -640,7 +891,7 @@ static void process_answer(ares_channel channel, unsigned char *abuf,
       if (!query->using_tcp)
         {
           query->using_tcp = 1;
-          ares__send_query(channel, query, now);
+          resend_query(channel, query, whichserver, now);
         }
       return;
     }
@@ -654,6 +905,12 @@ static void process_answer(ares_channel channel, unsigned char *abuf,
   /* If we aren't passing through all error packets, discard packets
    * with SERVFAIL, NOTIMP, or REFUSED response codes.
    */
+  if (rcode == SERVFAIL || rcode == REFUSED)
+    ares__server_failed(channel, whichserver, query,
+                        ARES_SERVER_STAT_SERVFAILS, now);
+  else if (rcode != NOTIMP)
+    ares__server_answered(channel, whichserver, query, now);
+
   if (!(channel->flags & ARES_FLAG_NOCHECKRESP))
     {
       if (rcode == SERVFAIL || rcode == NOTIMP || rcode == REFUSED)
@@ -665,6 +922,8 @@ static void process_answer(ares_channel channel, unsigned char *abuf,
         }
     }
 
+  if (conn && conn == query->hedge_conn)
+    channel->stats[ARES_STAT_HEDGE_WINS]++;
   end_query(channel, query, ARES_SUCCESS, abuf, alen);
 }
 
@@ -714,7 +973,6 @@ static void handle_error(ares_channel channel, int whichserver,
   struct server_state *server;
   struct query *query;
   struct list_node list_head;
-  struct list_node* list_node;
 
   server = &channel->servers[whichserver];
 
@@ -725,22 +983,19 @@ static void handle_error(ares_channel channel, int whichserver,
    * server again. We steal the current list of queries that were in-flight to
    * this server, since when we call next_server this can cause the queries to
    * be re-sent to this server, which will re-insert these queries in that
-   * same server->queries_to_server list.
+   * same server->queries_to_server list.  Each query removes itself from
+   * our temporary list as it re-sends itself or finishes up, and callbacks
+   * may cancel any of the others, so always take the first one left.
    */
   ares__init_list_head(&list_head);
   swap_lists(&list_head, &(server->queries_to_server));
-  for (list_node = list_head.next; list_node != &list_head; )
+  while (!ares__is_list_empty(&list_head))
     {
-      query = list_node->data;
-      list_node = list_node->next;  /* in case the query gets deleted */
+      query = list_head.next->data;
       assert(query->server == whichserver);
       skip_server(channel, query, whichserver);
       next_server(channel, query, now);
     }
-  /* Each query should have removed itself from our temporary list as
-   * it re-sent itself or finished up...
-   */
-  assert(ares__is_list_empty(&list_head));
 }
 
 static void skip_server(ares_channel channel, struct query *query,
@@ -771,8 +1026,12 @@ static void next_server(ares_channel channel, struct query *query,
     {
       struct server_state *server;
 
-      /* Move on to the next server. */
-      query->server = (query->server + 1) % channel->nservers;
+      /* Move on to the next server, or the best other one. */
+      if (channel->flags & ARES_FLAG_SRVHEALTH)
+        query->server = ares__choose_server(channel, query, query->server,
+                                            now);
+      else
+        query->server = (query->server + 1) % channel->nservers;
       server = &channel->servers[query->server];
 
       /* We don't want to use this server if (1) we decided this connection is
@@ -802,20 +1061,258 @@ static void next_server(ares_channel channel, struct query *query,
   end_query(channel, query, query->error_status, NULL, 0);
 }
 
+#ifdef HAVE_SENDMMSG
+/* Number of UDP queries sent with one sendmmsg() call */
+#define ARES_UDP_SEND_BATCH 64
+#endif
+
+/* Write UDP queries to one of a server's sockets.  With a pending list,
+ * sends as many queries from the head of the list as one system call
+ * allows, otherwise just the given query.  Returns the number of queries
+ * sent, or -1 if the first of them could not be.
+ */
+static int write_udp_queries(ares_channel channel,
+                             struct server_connection *conn,
+                             struct list_node *pending,
+                             struct query *query)
+{
+#ifdef HAVE_SENDMMSG
+  struct mmsghdr msgs[ARES_UDP_SEND_BATCH];
+  struct iovec iovs[ARES_UDP_SEND_BATCH];
+  struct list_node *list_node;
+  int n;
+#endif
+  int count;
+
+#ifdef HAVE_SENDMMSG
+  if (pending && !channel->sock_funcs)
+    {
+      memset(msgs, 0, sizeof(msgs));
+      n = 0;
+      for (list_node = pending->next;
+           list_node != pending && n < ARES_UDP_SEND_BATCH;
+           list_node = list_node->next, n++)
+        {
+          query = list_node->data;
+          iovs[n].iov_base = (void *)query->qbuf;
+          iovs[n].iov_len = query->qlen;
+          msgs[n].msg_hdr.msg_iov = &iovs[n];
+          msgs[n].msg_hdr.msg_iovlen = 1;
+        }
+      count = sendmmsg(conn->fd, msgs, n, 0);
+      channel->stats[ARES_STAT_UDP_SEND_CALLS]++;
+      if (count > 0)
+        channel->stats[ARES_STAT_UDP_SEND_PACKETS] += count;
+      return (count > 0) ? count : -1;
+    }
+#endif
+
+  if (pending)
+    query = pending->next->data;
+  count = (int)socket_write(channel, conn->fd, query->qbuf, query->qlen);
+  channel->stats[ARES_STAT_UDP_SEND_CALLS]++;
+  if (count == -1)
+    return -1;
+  channel->stats[ARES_STAT_UDP_SEND_PACKETS]++;
+  return 1;
+}
+
+/* Send the UDP queries queued on one of a server's sockets. */
+static void send_udp_pending(ares_channel channel, int whichserver,
+                             struct server_connection *conn,
+                             struct timeval *now)
+{
+  struct list_node pending;
+  struct query *query;
+  int count;
+
+  /* Take over the socket's queue, so that queries queued again while we
+   * deal with failures below are left for the next round.
+   */
+  pending.data = NULL;
+  pending.prev = conn->udp_pending.prev;
+  pending.next = conn->udp_pending.next;
+  pending.prev->next = &pending;
+  pending.next->prev = &pending;
+  ares__init_list_head(&(conn->udp_pending));
+
+  while (!ares__is_list_empty(&pending))
+    {
+      query = pending.next->data;
+      if (conn->fd == ARES_SOCKET_BAD)
+        {
+          /* The socket went away while the query was waiting; start over
+           * on another one. */
+          ares__send_query(channel, query, now);
+          continue;
+        }
+
+      count = write_udp_queries(channel, conn, &pending, NULL);
+      if (count == -1)
+        {
+          /* FIXME: Handle EAGAIN here since it likely can happen. */
+          ares__remove_from_list(&(query->udp_pending));
+          skip_server(channel, query, whichserver);
+          next_server(channel, query, now);
+          continue;
+        }
+
+      while (count-- > 0)
+        {
+          query = pending.next->data;
+          ares__remove_from_list(&(query->udp_pending));
+        }
+    }
+}
+
+/* Send every UDP query queued by ares__send_query() when the channel
+ * defers its sends.  Called whenever the application hands control back
+ * to the library, before it would wait for answers.
+ */
+void ares__send_pending(ares_channel channel)
+{
+  struct server_connection *conn;
+  struct list_node* list_head;
+  struct list_node* list_node;
+  struct timeval now;
+  int have_now = 0;
+  int sent;
+  int i;
+
+  if (!(channel->flags & ARES_FLAG_DEFERSEND))
+    return;
+
+  /* Failed sends move queries on to other servers, which may have been
+   * looked at already, so go round until nothing is left waiting. */
+  channel->processing++;
+  do {
+    sent = 0;
+    for (i = 0; i < channel->nservers; i++)
+      {
+        list_head = &(channel->servers[i].connections);
+        for (list_node = list_head->next; list_node != list_head;
+             list_node = list_node->next)
+          {
+            conn = list_node->data;
+            if (ares__is_list_empty(&(conn->udp_pending)))
+              continue;
+            if (!have_now)
+              {
+                now = ares__tvnow();
+                have_now = 1;
+              }
+            send_udp_pending(channel, i, conn, &now);
+            sent = 1;
+          }
+      }
+  } while (sent);
+  channel->processing--;
+}
+
+/* Can a new query be sent on this UDP socket? */
+static int udp_conn_usable(ares_channel channel,
+                           struct server_connection *conn)
+{
+  if (conn->fd == ARES_SOCKET_BAD)
+    return 0;
+  return channel->udp_max_queries <= 0 ||
+         conn->total_queries < channel->udp_max_queries;
+}
+
+/* Is a query with this id, or its hedged copy, already waiting for an
+ * answer on this UDP socket? */
+static int udp_conn_has_qid(ares_channel channel,
+                            struct server_connection *conn,
+                            unsigned short qid)
+{
+  return find_query(channel, conn, qid, 0, NULL, 0) != NULL ||
+         find_query(channel, conn, qid, 1, NULL, 0) != NULL;
+}
+
+/* Pick the UDP socket to send a query with the given id to a server on.
+ * A new socket is opened while fewer than channel->udp_pool_size are
+ * usable, otherwise one of the open ones is picked at random so that the
+ * source port of a query can't be predicted.  Answers are told apart by
+ * their socket and id, so a socket that already has a query with the id
+ * waiting is not picked; if all of them have, one more is opened, which
+ * lets a channel have more than 65536 queries in flight.  Returns NULL if
+ * there is no socket to use.
+ */
+static struct server_connection *udp_conn_for_query(ares_channel channel,
+                                                    struct server_state *server,
+                                                    unsigned short qid)
+{
+  struct server_connection *conn;
+  struct server_connection *spare = NULL;
+  struct list_node* list_head = &(server->connections);
+  struct list_node* list_node;
+  int usable = 0;
+  int free_id = 0;
+  int pick;
+
+  for (list_node = list_head->next; list_node != list_head;
+       list_node = list_node->next)
+    {
+      conn = list_node->data;
+      if (udp_conn_usable(channel, conn))
+        {
+          usable++;
+          if (!udp_conn_has_qid(channel, conn, qid))
+            free_id++;
+        }
+      else if (conn->fd == ARES_SOCKET_BAD && !spare &&
+               ares__is_list_empty(&(conn->queries_to_conn)))
+        spare = conn;
+    }
+
+  if (usable < channel->udp_pool_size || free_id == 0)
+    {
+      if (!spare)
+        {
+          spare = ares_malloc(sizeof(struct server_connection));
+          if (spare)
+            {
+              ares__init_connection(spare, server, 0);
+              ares__insert_in_list(&(spare->node), &(server->connections));
+            }
+        }
+      if (spare && open_udp_socket(channel, server, spare) == 0)
+        return spare;
+    }
+
+  if (!free_id)
+    return NULL;
+
+  pick = (free_id > 1) ? ares__generate_new_id(&channel->id_key) % free_id : 0;
+  for (list_node = list_head->next; list_node != list_head;
+       list_node = list_node->next)
+    {
+      conn = list_node->data;
+      if (udp_conn_usable(channel, conn) &&
+          !udp_conn_has_qid(channel, conn, qid) && pick-- == 0)
+        return conn;
+    }
+  return NULL; /* LCOV_EXCL_LINE */
+}
+
 void ares__send_query(ares_channel channel, struct query *query,
                       struct timeval *now)
 {
   struct send_request *sendreq;
   struct server_state *server;
+  struct server_connection *conn;
   int timeplus;
 
+  /* Whatever socket the query went out on before, it is done with it. */
+  ares__detach_query_conn(channel, query);
+
   server = &channel->servers[query->server];
   if (query->using_tcp)
     {
       /* Make sure the TCP socket for this server is set up and queue
        * a send request.
        */
-      if (server->tcp_socket == ARES_SOCKET_BAD)
+      if (server->tcp_conn.fd == ARES_SOCKET_BAD)
         {
           if (open_tcp_socket(channel, server) == -1)
             {
@@ -824,7 +1321,7 @@ void ares__send_query(ares_channel channel, struct query *query,
               return;
             }
         }
-      sendreq = ares_malloc(sizeof(struct send_request));
+      sendreq = ares__pool_alloc(channel, sizeof(struct send_request));
       if (!sendreq)
         {
         end_query(channel, query, ARES_ENOMEM, NULL, 0);
@@ -846,25 +1343,33 @@ void ares__send_query(ares_channel channel, struct query *query,
         server->qtail->next = sendreq;
       else
         {
-          SOCK_STATE_CALLBACK(channel, server->tcp_socket, 1, 1);
+          SOCK_STATE_CALLBACK(channel, server->tcp_conn.fd, 1, 1);
           server->qhead = sendreq;
         }
       server->qtail = sendreq;
       query->server_info[query->server].tcp_connection_generation =
         server->tcp_connection_generation;
+      server->stats[ARES_SERVER_STAT_TCP_QUERIES]++;
+      server->tcp_last_used = *now;
     }
   else
     {
-      if (server->udp_socket == ARES_SOCKET_BAD)
+      conn = udp_conn_for_query(channel, server, query->qid);
+      if (!conn)
         {
-          if (open_udp_socket(channel, server) == -1)
-            {
-              skip_server(channel, query, query->server);
-              next_server(channel, query, now);
-              return;
-            }
+          skip_server(channel, query, query->server);
+          next_server(channel, query, now);
+          return;
+        }
+      ares__attach_query_conn(channel, query, conn);
+
+      if (channel->flags & ARES_FLAG_DEFERSEND)
+        {
+          /* Queue the query; ares__send_pending() sends everything queued
+           * on this socket in as few system calls as it can. */
+          ares__insert_in_list(&(query->udp_pending), &(conn->udp_pending));
         }
-      if (socket_write(channel, server->udp_socket, query->qbuf, query->qlen) == -1)
+      else if (write_udp_queries(channel, conn, NULL, query) == -1)
         {
           /* FIXME: Handle EAGAIN here since it likely can happen. */
           skip_server(channel, query, query->server);
@@ -874,10 +1379,14 @@ void ares__send_query(ares_channel channel, struct query *query,
     }
 
     /* For each trip through the entire server list, double the channel's
-     * assigned timeout, avoiding overflow.  If channel->timeout is negative,
-     * leave it as-is, even though that should be impossible here.
+     * assigned timeout (or the one derived from the server's round trip
+     * times), avoiding overflow.  If channel->timeout is negative, leave it
+     * as-is, even though that should be impossible here.
      */
-    timeplus = channel->timeout;
+    if (channel->rto_min > 0)
+      timeplus = ares__server_rto(channel, server);
+    else
+      timeplus = channel->timeout;
     {
       /* How many times do we want to double it?  Presume sane values here. */
       const int shift = query->try_count / channel->nservers;
@@ -897,24 +1406,59 @@ void ares__send_query(ares_channel channel, struct query *query,
         timeplus <<= shift;
       }
     }
+    if (channel->rto_min > 0 && timeplus > channel->rto_max)
+      timeplus = channel->rto_max;
 
+    query->ts = *now;
     query->timeout = *now;
     timeadd(&query->timeout, timeplus);
-    /* Keep track of queries bucketed by timeout, so we can process
+
+    /* If hedging, wake up early to send the query to a second server as
+     * well, unless it was retried already (or is going over TCP).
+     */
+    query->hedge_armed = 0;
+    if ((channel->hedge_delay > 0 || channel->hedge_percentile > 0) &&
+        channel->nservers > 1 && !query->using_tcp &&
+        query->try_count == 0 && !query->hedge_conn)
+      {
+        int hedge = ares__server_hedge_delay(channel, server);
+        if (hedge >= 0 && hedge < timeplus)
+          {
+            query->hedge_timeout = query->timeout;
+            query->timeout = *now;
+            timeadd(&query->timeout, hedge);
+            query->hedge_armed = 1;
+          }
+      }
+    /* Keep track of queries ordered by timeout, so we can process
      * timeout events quickly.
      */
-    ares__remove_from_list(&(query->queries_by_timeout));
-    ares__insert_in_list(
-        &(query->queries_by_timeout),
-        &(channel->queries_by_timeout[query->timeout.tv_sec %
-                                      ARES_TIMEOUT_TABLE_SIZE]));
+    ares__timeout_heap_update(channel, query);
 
     /* Keep track of queries bucketed by server, so we can process server
-     * errors quickly.
+     * errors quickly, and count those waiting on its TCP connection.
      */
-    ares__remove_from_list(&(query->queries_to_server));
+    ares__unlink_query_server(channel, query);
     ares__insert_in_list(&(query->queries_to_server),
                          &(server->queries_to_server));
+    if (query->using_tcp)
+      {
+        query->tcp_server = query->server;
+        server->tcp_inflight++;
+      }
+}
+
+/* Take a query off the list of queries to its server, and out of the
+ * count of those waiting on the server's TCP connection.
+ */
+void ares__unlink_query_server(ares_channel channel, struct query *query)
+{
+  ares__remove_from_list(&(query->queries_to_server));
+  if (query->tcp_server != -1)
+    {
+      channel->servers[query->tcp_server].tcp_inflight--;
+      query->tcp_server = -1;
+    }
 }
 
 /*
@@ -1147,13 +1691,16 @@ static int open_tcp_socket(ares_channel channel, struct server_state *server)
     }
 
   SOCK_STATE_CALLBACK(channel, s, 1, 0);
-  server->tcp_buffer_pos = 0;
-  server->tcp_socket = s;
+  server->tcp_rbuf_len = 0;
+  server->tcp_conn.fd = s;
+  link_conn_fd(channel, &server->tcp_conn);
   server->tcp_connection_generation = ++channel->tcp_connection_generation;
+  server->stats[ARES_SERVER_STAT_TCP_CONNECTS]++;
   return 0;
 }
 
-static int open_udp_socket(ares_channel channel, struct server_state *server)
+static int open_udp_socket(ares_channel channel, struct server_state *server,
+                           struct server_connection *conn)
 {
   ares_socket_t s;
   ares_socklen_t salen;
@@ -1243,89 +1790,12 @@ static int open_udp_socket(ares_channel channel, struct server_state *server)
 
   SOCK_STATE_CALLBACK(channel, s, 1, 0);
 
-  server->udp_socket = s;
+  conn->fd = s;
+  conn->total_queries = 0;
+  link_conn_fd(channel, conn);
   return 0;
 }
 
-static int same_questions(const unsigned char *qbuf, int qlen,
-                          const unsigned char *abuf, int alen)
-{
-  struct {
-    const unsigned char *p;
-    int qdcount;
-    char *name;
-    long namelen;
-    int type;
-    int dnsclass;
-  } q, a;
-  int i, j;
-
-  if (qlen < HFIXEDSZ || alen < HFIXEDSZ)
-    return 0;
-
-  /* Extract qdcount from the request and reply buffers and compare them. */
-  q.qdcount = DNS_HEADER_QDCOUNT(qbuf);
-  a.qdcount = DNS_HEADER_QDCOUNT(abuf);
-  if (q.qdcount != a.qdcount)
-    return 0;
-
-  /* For each question in qbuf, find it in abuf. */
-  q.p = qbuf + HFIXEDSZ;
-  for (i = 0; i < q.qdcount; i++)
-    {
-      /* Decode the question in the query. */
-      if (ares_expand_name(q.p, qbuf, qlen, &q.name, &q.namelen)
-          != ARES_SUCCESS)
-        return 0;
-      q.p += q.namelen;
-      if (q.p + QFIXEDSZ > qbuf + qlen)
-        {
-          ares_free(q.name);
-          return 0;
-        }
-      q.type = DNS_QUESTION_TYPE(q.p);
-      q.dnsclass = DNS_QUESTION_CLASS(q.p);
-      q.p += QFIXEDSZ;
-
-      /* Search for this question in the answer. */
-      a.p = abuf + HFIXEDSZ;
-      for (j = 0; j < a.qdcount; j++)
-        {
-          /* Decode the question in the answer. */
-          if (ares_expand_name(a.p, abuf, alen, &a.name, &a.namelen)
-              != ARES_SUCCESS)
-            {
-              ares_free(q.name);
-              return 0;
-            }
-          a.p += a.namelen;
-          if (a.p + QFIXEDSZ > abuf + alen)
-            {
-              ares_free(q.name);
-              ares_free(a.name);
-              return 0;
-            }
-          a.type = DNS_QUESTION_TYPE(a.p);
-          a.dnsclass = DNS_QUESTION_CLASS(a.p);
-          a.p += QFIXEDSZ;
-
-          /* Compare the decoded questions. */
-          if (strcasecmp(q.name, a.name) == 0 && q.type == a.type
-              && q.dnsclass == a.dnsclass)
-            {
-              ares_free(a.name);
-              break;
-            }
-          ares_free(a.name);
-        }
-
-      ares_free(q.name);
-      if (j == a.qdcount)
-        return 0;
-    }
-  return 1;
-}
-
 static int same_address(struct sockaddr *sa, struct ares_addr *aa)
 {
   void *addr1;
@@ -1409,35 +1879,74 @@ static void end_query (ares_channel channel, struct query *query, int status,
           }
     }
 
-  /* Invoke the callback */
-  query->callback(query->arg, status, query->timeouts, abuf, alen);
-  ares__free_query(query);
-
-  /* Simple cleanup policy: if no queries are remaining, close all network
-   * sockets unless STAYOPEN is set.
-   */
-  if (!(channel->flags & ARES_FLAG_STAYOPEN) &&
-      ares__is_list_empty(&(channel->all_queries)))
+  /* Remember the answer for identical questions to come */
+  if (channel->qcache && status == ARES_SUCCESS)
     {
-      for (i = 0; i < channel->nservers; i++)
-        ares__close_sockets(channel, &channel->servers[i]);
+      struct timeval now = ares__tvnow();
+      ares__qcache_insert(channel->qcache, query->qbuf, query->qlen,
+                          abuf, alen, &now);
     }
+
+  /* Invoke the callback, and those of any callers waiting on the query */
+  ares__query_callback(channel, query, status, query->timeouts, abuf, alen);
+  ares__free_query(channel, query);
+
+  ares__close_unused_sockets(channel);
+}
+
+/* No answer came from the server the query was sent to in time, so send
+ * it to another server as well.  The first answer from either wins; the
+ * other is ignored as the query will be gone by then.
+ */
+static void send_hedge(ares_channel channel, struct query *query,
+                       struct timeval *now)
+{
+  struct server_connection *conn;
+  int whichserver;
+
+  query->hedge_armed = 0;
+  query->timeout = query->hedge_timeout;
+  ares__timeout_heap_update(channel, query);
+
+  if (channel->flags & ARES_FLAG_SRVHEALTH)
+    whichserver = ares__choose_server(channel, query, query->server, now);
+  else
+    whichserver = (query->server + 1) % channel->nservers;
+  if (whichserver == query->server ||
+      query->server_info[whichserver].skip_server ||
+      channel->servers[whichserver].is_broken)
+    return;
+
+  conn = udp_conn_for_query(channel, &channel->servers[whichserver],
+                            query->qid);
+  if (!conn || write_udp_queries(channel, conn, NULL, query) == -1)
+    return;
+  ares__attach_hedge_conn(channel, query, conn);
+  channel->stats[ARES_STAT_HEDGES_SENT]++;
 }
 
-void ares__free_query(struct query *query)
+void ares__free_query(ares_channel channel, struct query *query)
 {
   /* Remove the query from all the lists in which it is linked */
-  ares__remove_from_list(&(query->queries_by_qid));
-  ares__remove_from_list(&(query->queries_by_timeout));
-  ares__remove_from_list(&(query->queries_to_server));
+  ares__list_table_remove(&(channel->queries_by_qid),
+                          &(query->queries_by_qid));
+  ares__remove_from_list(&(query->queries_timed_out));
+  ares__timeout_heap_remove(channel, query);
+  ares__unlink_query_server(channel, query);
   ares__remove_from_list(&(query->all_queries));
+  ares__list_table_remove(&(channel->queries_by_question),
+                          &(query->queries_by_question));
+  ares__remove_from_list(&(query->node_by_handle));
+  ares__coalesce_free_waiters(channel, query);
+  ares__detach_query_conn(channel, query);
+  ares__detach_hedge_conn(channel, query);
   /* Zero out some important stuff, to help catch bugs */
   query->callback = NULL;
   query->arg = NULL;
   /* Deallocate the memory associated with the query */
-  ares_free(query->tcpbuf);
-  ares_free(query->server_info);
-  ares_free(query);
+  ares__pool_free(channel, query->tcpbuf);
+  ares__pool_free(channel, query->server_info);
+  ares__pool_free(channel, query);
 }
 
 ares_socket_t ares__open_socket(ares_channel channel,
@@ -33,6 +33,7 @@
 #include "ares_private.h"
 
 struct qquery {
+  ares_channel channel;
   ares_callback callback;
   void *arg;
 };
@@ -65,42 +66,6 @@ static void rc4(rc4_key* key, unsigned char *buffer_ptr, int buffer_len)
   key->y = y;
 }
 
-static struct query* find_query_by_id(ares_channel channel, unsigned short id)
-{
-  unsigned short qid;
-  struct list_node* list_head;
-  struct list_node* list_node;
-  DNS_HEADER_SET_QID(((unsigned char*)&qid), id);
-
-  /* Find the query corresponding to this packet. */
-  list_head = &(channel->queries_by_qid[qid % ARES_QID_TABLE_SIZE]);
-  for (list_node = list_head->next; list_node != list_head;
-       list_node = list_node->next)
-    {
-       struct query *q = list_node->data;
-       if (q->qid == qid)
-	  return q;
-    }
-  return NULL;
-}
-
-
-/* a unique query id is generated using an rc4 key. Since the id may already
-   be used by a running query (as infrequent as it may be), a lookup is
-   performed per id generation. In practice this search should happen only
-   once per newly generated id
-*/
-static unsigned short generate_unique_id(ares_channel channel)
-{
-  unsigned short id;
-
-  do {
-    id = ares__generate_new_id(&channel->id_key);
-  } while (find_query_by_id(channel, id));
-
-  return (unsigned short)id;
-}
-
 unsigned short ares__generate_new_id(rc4_key* key)
 {
   unsigned short r=0;
@@ -110,38 +75,70 @@ unsigned short ares__generate_new_id(rc4_key* key)
 
 void ares_query(ares_channel channel, const char *name, int dnsclass,
                 int type, ares_callback callback, void *arg)
+{
+  ares__query(channel, name, dnsclass, type, NULL, callback, arg);
+}
+
+ares_handle ares_query_handle(ares_channel channel, const char *name,
+                              int dnsclass, int type, ares_callback callback,
+                              void *arg)
+{
+  ares_handle handle;
+
+  handle = ares__handle_create(channel, callback, NULL, arg);
+  if (!handle)
+    {
+      callback(arg, ARES_ENOMEM, 0, NULL, 0);
+      return NULL;
+    }
+  ares__query(channel, name, dnsclass, type, handle, ares__handle_callback,
+              handle);
+  return ares__handle_started(handle);
+}
+
+void ares__query(ares_channel channel, const char *name, int dnsclass,
+                 int type, ares_handle handle, ares_callback callback,
+                 void *arg)
 {
   struct qquery *qquery;
+  unsigned char space[HFIXEDSZ + MAXCDNAME + 2 + QFIXEDSZ + EDNSFIXEDSZ];
   unsigned char *qbuf;
   int qlen, rd, status;
 
-  /* Compose the query. */
+  /* Compose the query, on the stack unless the name is unusually long;
+   * ares_send() makes its own copy. */
   rd = !(channel->flags & ARES_FLAG_NORECURSE);
-  status = ares_create_query(name, dnsclass, type, channel->next_id, rd, &qbuf,
-              &qlen, (channel->flags & ARES_FLAG_EDNS) ? channel->ednspsz : 0);
+  status = ares__create_query(name, dnsclass, type, channel->next_id, rd,
+              space, sizeof(space), &qbuf, &qlen,
+              (channel->flags & ARES_FLAG_EDNS) ? channel->ednspsz : 0);
   if (status != ARES_SUCCESS)
     {
-      if (qbuf != NULL) ares_free(qbuf);
       callback(arg, status, 0, NULL, 0);
       return;
     }
 
-  channel->next_id = generate_unique_id(channel);
+  /* The id need not be unique in the channel: an answer is matched on the
+   * socket the query went out on as well, and ares__send_query() picks one
+   * on which the id is not in use yet. */
+  channel->next_id = ares__generate_new_id(&channel->id_key);
 
   /* Allocate and fill in the query structure. */
-  qquery = ares_malloc(sizeof(struct qquery));
+  qquery = ares__pool_alloc(channel, sizeof(struct qquery));
   if (!qquery)
     {
-      ares_free_string(qbuf);
+      if (qbuf != space)
+        ares_free_string(qbuf);
       callback(arg, ARES_ENOMEM, 0, NULL, 0);
       return;
     }
+  qquery->channel = channel;
   qquery->callback = callback;
   qquery->arg = arg;
 
   /* Send it off.  qcallback will be called when we get an answer. */
-  ares_send(channel, qbuf, qlen, qcallback, qquery);
-  ares_free_string(qbuf);
+  ares__send(channel, qbuf, qlen, handle, qcallback, qquery);
+  if (qbuf != space)
+    ares_free_string(qbuf);
 }
 
 static void qcallback(void *arg, int status, int timeouts, unsigned char *abuf, int alen)
@@ -182,5 +179,5 @@ static void qcallback(void *arg, int status, int timeouts, unsigned char *abuf,
         }
       qquery->callback(qquery->arg, status, timeouts, abuf, alen);
     }
-  ares_free(qquery);
+  ares__pool_free(qquery->channel, qquery);
 }
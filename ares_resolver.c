@@ -0,0 +1,189 @@
+/* Copyright (C) 2019 by The c-ares project
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+#include "ares_setup.h"
+
+#include "ares.h"
+#include "ares_private.h"
+
+/* A resolver spreads lookups over several copies of one channel, each
+ * meant to be processed by a thread of its own.  Lookups are handed over
+ * through the submission queues of the channels (ares_submit.c), and a
+ * name always goes to the same channel while its queue has room, so that
+ * each channel's answer cache holds its share of the names rather than a
+ * copy of the others' and identical lookups can be coalesced.  Server
+ * failures are not sharded that way: one channel's timeouts put the server
+ * on probation in all of them (ares__server_health.c).
+ */
+
+struct ares_resolverdata {
+  struct ares_health *health;
+  int nchannels;
+  ares_channel channels[1];  /* nchannels of them */
+};
+
+/* FNV-1a over the bytes, ignoring case as DNS names do.  Label lengths
+ * are all below 'A', so they are left alone. */
+static unsigned int resolver_hash(const unsigned char *data, size_t len)
+{
+  unsigned int hash = 2166136261U;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    {
+      hash ^= (unsigned int)TOLOWER(data[i]);
+      hash *= 16777619U;
+    }
+  return hash;
+}
+
+int ares_resolver_init(ares_resolver *resolverptr, ares_channel channel,
+                       int nchannels)
+{
+  struct ares_resolverdata *resolver;
+  int status;
+  int i;
+
+  if (!resolverptr)
+    return ARES_ENODATA;
+  *resolverptr = NULL;
+  if (!channel || nchannels < 1)
+    return ARES_ENODATA;
+  if (!channel->submitq)
+    return ARES_ENOTIMP;
+
+  resolver = ares_malloc(sizeof(struct ares_resolverdata) +
+                         (nchannels - 1) * sizeof(ares_channel));
+  if (!resolver)
+    return ARES_ENOMEM;
+  resolver->nchannels = 0;
+  resolver->health = ares__health_create(channel->nservers);
+  if (!resolver->health)
+    {
+      ares_free(resolver);
+      return ARES_ENOMEM;
+    }
+  for (i = 0; i < nchannels; i++)
+    {
+      status = ares_dup(&resolver->channels[i], channel);
+      if (status != ARES_SUCCESS)
+        {
+          ares_resolver_destroy(resolver);
+          return status;
+        }
+      resolver->channels[i]->health = resolver->health;
+      resolver->nchannels++;
+    }
+
+  *resolverptr = resolver;
+  return ARES_SUCCESS;
+}
+
+void ares_resolver_destroy(ares_resolver resolver)
+{
+  int i;
+
+  if (!resolver)
+    return;
+  for (i = 0; i < resolver->nchannels; i++)
+    ares_destroy(resolver->channels[i]);
+  ares__health_destroy(resolver->health);
+  ares_free(resolver);
+}
+
+int ares_resolver_nchannels(ares_resolver resolver)
+{
+  return resolver ? resolver->nchannels : 0;
+}
+
+ares_channel ares_resolver_channel(ares_resolver resolver, int index)
+{
+  if (!resolver || index < 0 || index >= resolver->nchannels)
+    return NULL;
+  return resolver->channels[index];
+}
+
+int ares_resolver_send(ares_resolver resolver, const unsigned char *qbuf,
+                       int qlen, ares_callback callback, void *arg)
+{
+  unsigned int first;
+  int status = ARES_ENODATA;
+  int i;
+
+  if (!resolver)
+    return ARES_ENODATA;
+
+  /* The question, without the query id */
+  first = qlen > 2 ? resolver_hash(qbuf + 2, (size_t)qlen - 2) : 0;
+  first %= (unsigned int)resolver->nchannels;
+
+  /* Spill over to the next channels if the one for the name is full */
+  for (i = 0; i < resolver->nchannels; i++)
+    {
+      status = ares_submit_send(
+          resolver->channels[(first + i) % resolver->nchannels],
+          qbuf, qlen, callback, arg);
+      if (status != ARES_ENOMEM)
+        break;
+    }
+  return status;
+}
+
+int ares_resolver_getaddrinfo(ares_resolver resolver, const char *node,
+                              const char *service,
+                              const struct ares_addrinfo_hints *hints,
+                              ares_addrinfo_callback callback, void *arg)
+{
+  unsigned int first;
+  int status = ARES_ENODATA;
+  int i;
+
+  if (!resolver)
+    return ARES_ENODATA;
+
+  first = node ? resolver_hash((const unsigned char *)node, strlen(node)) : 0;
+  first %= (unsigned int)resolver->nchannels;
+
+  for (i = 0; i < resolver->nchannels; i++)
+    {
+      status = ares_submit_getaddrinfo(
+          resolver->channels[(first + i) % resolver->nchannels],
+          node, service, hints, callback, arg);
+      if (status != ARES_ENOMEM)
+        break;
+    }
+  return status;
+}
+
+int ares_resolver_get_stat(ares_resolver resolver, int stat,
+                           unsigned long *value)
+{
+  unsigned long channel_value;
+  int status;
+  int i;
+
+  if (!resolver || !value)
+    return ARES_ENODATA;
+
+  *value = 0;
+  for (i = 0; i < resolver->nchannels; i++)
+    {
+      status = ares__stats_read(resolver->channels[i], stat, &channel_value);
+      if (status != ARES_SUCCESS)
+        return status;
+      *value += channel_value;
+    }
+  return ARES_SUCCESS;
+}
@@ -31,21 +31,76 @@ struct search_query {
   int type;
   ares_callback callback;
   void *arg;
+  ares_handle handle;           /* the caller's, if any, for every query */
 
   int status_as_is;             /* error status from trying as-is */
   int next_domain;              /* next search domain to try */
   int trying_as_is;             /* current query is for name as-is */
+  char *current;                /* name with a domain we are trying */
   int timeouts;                 /* number of timeouts we saw for this request */
   int ever_got_nodata;          /* did we ever get ARES_ENODATA along the way? */
+
+  /* With ARES_FLAG_PARALLELSEARCH, the answers to all the names, in the
+     order the names would have been tried one after another */
+  struct search_answer *answers;
+  int nanswers;
+  int as_is;                    /* index of the answer for the name as-is */
+  int outstanding;              /* queries not called back yet, plus one
+                                   while we are sending or called back */
+  int done;                     /* has the caller been called back? */
+};
+
+struct search_answer {
+  struct search_query *squery;
+  char *name;                   /* name queried, NULL for the name as-is */
+  int status;                   /* -1 until the query is called back */
+  int timeouts;
+  unsigned char *abuf;          /* copy of an answer held for later */
+  int alen;
 };
 
+static void search_query(struct search_query *squery, const char *name,
+                         ares_callback callback, void *arg);
+static void search_remember(struct search_query *squery, const char *name,
+                            int status, unsigned char *abuf, int alen);
 static void search_callback(void *arg, int status, int timeouts,
                             unsigned char *abuf, int alen);
+static void search_parallel(struct search_query *squery, int as_is_first);
+static void parallel_callback(void *arg, int status, int timeouts,
+                              unsigned char *abuf, int alen);
+static void parallel_decide(struct search_query *squery,
+                            struct search_answer *current,
+                            unsigned char *abuf, int alen);
 static void end_squery(struct search_query *squery, int status,
                        unsigned char *abuf, int alen);
+static void free_squery(struct search_query *squery);
 
 void ares_search(ares_channel channel, const char *name, int dnsclass,
                  int type, ares_callback callback, void *arg)
+{
+  ares__search(channel, name, dnsclass, type, NULL, callback, arg);
+}
+
+ares_handle ares_search_handle(ares_channel channel, const char *name,
+                               int dnsclass, int type, ares_callback callback,
+                               void *arg)
+{
+  ares_handle handle;
+
+  handle = ares__handle_create(channel, callback, NULL, arg);
+  if (!handle)
+    {
+      callback(arg, ARES_ENOMEM, 0, NULL, 0);
+      return NULL;
+    }
+  ares__search(channel, name, dnsclass, type, handle, ares__handle_callback,
+               handle);
+  return ares__handle_started(handle);
+}
+
+void ares__search(ares_channel channel, const char *name, int dnsclass,
+                  int type, ares_handle handle, ares_callback callback,
+                  void *arg)
 {
   struct search_query *squery;
   char *s;
@@ -70,7 +125,7 @@ void ares_search(ares_channel channel, const char *name, int dnsclass,
     }
   if (s)
     {
-      ares_query(channel, s, dnsclass, type, callback, arg);
+      ares__query(channel, s, dnsclass, type, handle, callback, arg);
       ares_free(s);
       return;
     }
@@ -97,8 +152,15 @@ void ares_search(ares_channel channel, const char *name, int dnsclass,
   squery->status_as_is = -1;
   squery->callback = callback;
   squery->arg = arg;
+  squery->handle = handle;
   squery->timeouts = 0;
   squery->ever_got_nodata = 0;
+  squery->current = NULL;
+  squery->answers = NULL;
+  squery->nanswers = 0;
+  squery->as_is = 0;
+  squery->outstanding = 0;
+  squery->done = 0;
 
   /* Count the number of dots in name. */
   ndots = 0;
@@ -112,12 +174,14 @@ void ares_search(ares_channel channel, const char *name, int dnsclass,
    * then we try the name as-is first.  Otherwise, we try the name
    * as-is last.
    */
-  if (ndots >= channel->ndots)
+  if (channel->flags & ARES_FLAG_PARALLELSEARCH)
+    search_parallel(squery, ndots >= channel->ndots);
+  else if (ndots >= channel->ndots)
     {
       /* Try the name as-is first. */
       squery->next_domain = 0;
       squery->trying_as_is = 1;
-      ares_query(channel, name, dnsclass, type, search_callback, squery);
+      search_query(squery, name, search_callback, squery);
     }
   else
     {
@@ -127,19 +191,61 @@ void ares_search(ares_channel channel, const char *name, int dnsclass,
       status = ares__cat_domain(name, channel->domains[0], &s);
       if (status == ARES_SUCCESS)
         {
-          ares_query(channel, s, dnsclass, type, search_callback, squery);
-          ares_free(s);
+          squery->current = s;
+          search_query(squery, s, search_callback, squery);
         }
       else
       {
         /* failed, free the malloc()ed memory */
-        ares_free(squery->name);
-        ares_free(squery);
+        free_squery(squery);
         callback(arg, status, 0, NULL, 0);
       }
     }
 }
 
+/* Query one of the names of the search, unless it is known not to exist. */
+static void search_query(struct search_query *squery, const char *name,
+                         ares_callback callback, void *arg)
+{
+  ares_channel channel = squery->channel;
+  struct timeval now;
+
+  if (channel->negcache)
+    {
+      now = ares__tvnow();
+      if (ares__negcache_fetch(channel->negcache, name, squery->dnsclass,
+                               squery->type, &now))
+        {
+          callback(arg, ARES_ENOTFOUND, 0, NULL, 0);
+          return;
+        }
+    }
+  ares__query(channel, name, squery->dnsclass, squery->type, squery->handle,
+              callback, arg);
+}
+
+/* Remember that name does not exist, if the answer to it says so. */
+static void search_remember(struct search_query *squery, const char *name,
+                            int status, unsigned char *abuf, int alen)
+{
+  ares_channel channel = squery->channel;
+  struct timeval now;
+
+  if (channel->negcache && status == ARES_ENOTFOUND && abuf)
+    {
+      now = ares__tvnow();
+      ares__negcache_insert(channel->negcache, name, squery->dnsclass,
+                            squery->type, abuf, alen, &now);
+    }
+}
+
+/* Does a query ending with status let the search go on to the next name? */
+static int search_goes_on(int status)
+{
+  return status == ARES_ENODATA || status == ARES_ESERVFAIL ||
+         status == ARES_ENOTFOUND;
+}
+
 static void search_callback(void *arg, int status, int timeouts,
                             unsigned char *abuf, int alen)
 {
@@ -148,10 +254,11 @@ static void search_callback(void *arg, int status, int timeouts,
   char *s;
 
   squery->timeouts += timeouts;
+  search_remember(squery, squery->trying_as_is ? squery->name : squery->current,
+                  status, abuf, alen);
 
   /* Stop searching unless we got a non-fatal error. */
-  if (status != ARES_ENODATA && status != ARES_ESERVFAIL
-      && status != ARES_ENOTFOUND)
+  if (!search_goes_on(status))
     end_squery(squery, status, abuf, alen);
   else
     {
@@ -180,17 +287,17 @@ static void search_callback(void *arg, int status, int timeouts,
             {
               squery->trying_as_is = 0;
               squery->next_domain++;
-              ares_query(channel, s, squery->dnsclass, squery->type,
-                         search_callback, squery);
-              ares_free(s);
+              if (squery->current)
+                ares_free(squery->current);
+              squery->current = s;
+              search_query(squery, s, search_callback, squery);
             }
         }
       else if (squery->status_as_is == -1)
         {
           /* Try the name as-is at the end. */
           squery->trying_as_is = 1;
-          ares_query(channel, squery->name, squery->dnsclass, squery->type,
-                     search_callback, squery);
+          search_query(squery, squery->name, search_callback, squery);
         }
       else {
         if (squery->status_as_is == ARES_ENOTFOUND && squery->ever_got_nodata) {
@@ -202,10 +309,176 @@ static void search_callback(void *arg, int status, int timeouts,
     }
 }
 
+/* Query all the names at once rather than one after another.  The result
+ * is still the one the sequential search would give: answers are looked at
+ * in the order the names would have been tried, and the first one that
+ * would have ended the search does so once all those before it are in.
+ * Queries for the names after it are left to finish unheeded.
+ */
+static void search_parallel(struct search_query *squery, int as_is_first)
+{
+  ares_channel channel = squery->channel;
+  struct search_answer *answer;
+  int domain;
+  int status;
+  char *s;
+  int last;
+  int i;
+
+  squery->nanswers = channel->ndomains + 1;
+  squery->as_is = as_is_first ? 0 : channel->ndomains;
+  squery->answers = ares_malloc(squery->nanswers *
+                                sizeof(struct search_answer));
+  if (!squery->answers)
+    {
+      end_squery(squery, ARES_ENOMEM, NULL, 0);
+      return;
+    }
+  for (i = 0; i < squery->nanswers; i++)
+    {
+      answer = &squery->answers[i];
+      answer->squery = squery;
+      answer->name = NULL;
+      answer->status = -1;
+      answer->timeouts = 0;
+      answer->abuf = NULL;
+      answer->alen = 0;
+    }
+
+  /* Make all the names before sending anything, as sending may read
+   * resolv.conf again and replace channel->domains. */
+  for (last = 0; last < squery->nanswers; last++)
+    {
+      if (last == squery->as_is)
+        continue;
+      domain = as_is_first ? last - 1 : last;
+      status = ares__cat_domain(squery->name, channel->domains[domain], &s);
+      if (status != ARES_SUCCESS)
+        {
+          /* The search cannot get past this name. */
+          squery->answers[last].status = status;
+          break;
+        }
+      squery->answers[last].name = s;
+    }
+
+  /* Hold on to squery while sending, as answers may come back at once. */
+  squery->outstanding = 1;
+  for (i = 0; i < last && !squery->done; i++)
+    {
+      answer = &squery->answers[i];
+      squery->outstanding++;
+      search_query(squery, i == squery->as_is ? squery->name : answer->name,
+                   parallel_callback, answer);
+    }
+  if (last < squery->nanswers && !squery->done)
+    parallel_decide(squery, NULL, NULL, 0);
+
+  if (--squery->outstanding == 0)
+    free_squery(squery);
+}
+
+static void parallel_callback(void *arg, int status, int timeouts,
+                              unsigned char *abuf, int alen)
+{
+  struct search_answer *answer = (struct search_answer *) arg;
+  struct search_query *squery = answer->squery;
+
+  search_remember(squery, answer->name ? answer->name : squery->name,
+                  status, abuf, alen);
+
+  if (!squery->done)
+    {
+      answer->status = status;
+      answer->timeouts = timeouts;
+      parallel_decide(squery, answer, abuf, alen);
+
+      /* An answer that will end the search once the names before it are
+       * done has to be kept until then. */
+      if (!squery->done && !search_goes_on(status) && abuf)
+        {
+          answer->abuf = ares_malloc(alen);
+          if (answer->abuf)
+            {
+              memcpy(answer->abuf, abuf, alen);
+              answer->alen = alen;
+            }
+          else
+            answer->status = ARES_ENOMEM;
+        }
+    }
+
+  if (--squery->outstanding == 0)
+    free_squery(squery);
+}
+
+/* Call back the caller if the answers in so far decide the search.  current
+ * is the answer that just came in, with its message in abuf, if any.
+ */
+static void parallel_decide(struct search_query *squery,
+                            struct search_answer *current,
+                            unsigned char *abuf, int alen)
+{
+  struct search_answer *answer;
+  int timeouts = 0;
+  int nodata = 0;
+  int status;
+  int i;
+
+  for (i = 0; i < squery->nanswers; i++)
+    {
+      answer = &squery->answers[i];
+      if (answer->status == -1)
+        return;
+      timeouts += answer->timeouts;
+      if (!search_goes_on(answer->status))
+        {
+          squery->done = 1;
+          if (answer != current)
+            {
+              abuf = answer->abuf;
+              alen = answer->alen;
+            }
+          squery->callback(squery->arg, answer->status, timeouts, abuf, alen);
+          return;
+        }
+      if (answer->status == ARES_ENODATA)
+        nodata = 1;
+    }
+
+  /* No name got anywhere; report on the name as-is, as search_callback()
+   * does. */
+  status = squery->answers[squery->as_is].status;
+  if (status == ARES_ENOTFOUND && nodata)
+    status = ARES_ENODATA;
+  squery->done = 1;
+  squery->callback(squery->arg, status, timeouts, NULL, 0);
+}
+
 static void end_squery(struct search_query *squery, int status,
                        unsigned char *abuf, int alen)
 {
   squery->callback(squery->arg, status, squery->timeouts, abuf, alen);
+  free_squery(squery);
+}
+
+static void free_squery(struct search_query *squery)
+{
+  int i;
+
+  if (squery->answers)
+    {
+      for (i = 0; i < squery->nanswers; i++)
+        {
+          if (squery->answers[i].name)
+            ares_free(squery->answers[i].name);
+          if (squery->answers[i].abuf)
+            ares_free(squery->answers[i].abuf);
+        }
+      ares_free(squery->answers);
+    }
+  if (squery->current)
+    ares_free(squery->current);
   ares_free(squery->name);
   ares_free(squery);
 }
@@ -34,11 +34,40 @@
 
 void ares_send(ares_channel channel, const unsigned char *qbuf, int qlen,
                ares_callback callback, void *arg)
+{
+  ares__send(channel, qbuf, qlen, NULL, callback, arg);
+}
+
+ares_handle ares_send_handle(ares_channel channel, const unsigned char *qbuf,
+                             int qlen, ares_callback callback, void *arg)
+{
+  ares_handle handle;
+
+  handle = ares__handle_create(channel, callback, NULL, arg);
+  if (!handle)
+    {
+      callback(arg, ARES_ENOMEM, 0, NULL, 0);
+      return NULL;
+    }
+  ares__send(channel, qbuf, qlen, handle, ares__handle_callback, handle);
+  return ares__handle_started(handle);
+}
+
+/* Send a query on behalf of handle, if not NULL. */
+void ares__send(ares_channel channel, const unsigned char *qbuf, int qlen,
+                ares_handle handle, ares_callback callback, void *arg)
 {
   struct query *query;
-  int i, packetsz;
+  int i, packetsz, questionlen;
   struct timeval now;
 
+  /* Nothing more goes out for an operation being cancelled. */
+  if (handle && handle->cancelled)
+    {
+      callback(arg, ARES_ECANCELLED, 0, NULL, 0);
+      return;
+    }
+
   /* Verify that the query is at least long enough to hold the header. */
   if (qlen < HFIXEDSZ || qlen >= (1 << 16))
     {
@@ -46,32 +75,72 @@ void ares_send(ares_channel channel, const unsigned char *qbuf, int qlen,
       return;
     }
 
+  /* Pick up a changed resolv.conf, if we are watching it. */
+  ares__reload_check(channel);
+
+  /* Answer straight from the cache if we can, without setting up a query. */
+  if (channel->qcache)
+    {
+      now = ares__tvnow();
+      if (ares__qcache_fetch(channel->qcache, qbuf, qlen, &now,
+                             callback, arg) == ARES_SUCCESS)
+        return;
+    }
+
+  /* Wait on a query for the same request already in flight, if allowed.
+   * Queries sent for a handle are left out, as each must be free to be
+   * cancelled on its own. */
+  if ((channel->flags & ARES_FLAG_COALESCE) && !handle)
+    {
+      query = ares__coalesce_find(channel, qbuf, qlen);
+      if (query)
+        {
+          if (ares__coalesce_attach(channel, query, qbuf, callback,
+                                    arg) != ARES_SUCCESS)
+            callback(arg, ARES_ENOMEM, 0, NULL, 0);
+          return;
+        }
+    }
+
+  /* Make room for the query in the timeout heap up front, so that sending
+   * it (and resending it later) cannot fail for lack of memory. */
+  if (ares__timeout_heap_reserve(channel) != ARES_SUCCESS)
+    {
+      callback(arg, ARES_ENOMEM, 0, NULL, 0);
+      return;
+    }
+
   /* Allocate space for query and allocated fields. */
-  query = ares_malloc(sizeof(struct query));
+  query = ares__pool_alloc(channel, sizeof(struct query));
   if (!query)
     {
       callback(arg, ARES_ENOMEM, 0, NULL, 0);
       return;
     }
-  query->tcpbuf = ares_malloc(qlen + 2);
+  /* The tcpbuf allocation also holds the normalized questions the
+   * answers will be matched against. */
+  questionlen = ares__normalize_questions(qbuf, qlen, NULL);
+  query->tcpbuf = ares__pool_alloc(channel, qlen + 2 +
+                                   (questionlen > 0 ? questionlen : 0));
   if (!query->tcpbuf)
     {
-      ares_free(query);
+      ares__pool_free(channel, query);
       callback(arg, ARES_ENOMEM, 0, NULL, 0);
       return;
     }
   if (channel->nservers < 1)
     {
-      ares_free(query);
+      ares__pool_free(channel, query->tcpbuf);
+      ares__pool_free(channel, query);
       callback(arg, ARES_ESERVFAIL, 0, NULL, 0);
       return;
     }
-  query->server_info = ares_malloc(channel->nservers *
-                                   sizeof(query->server_info[0]));
+  query->server_info = ares__pool_alloc(channel, channel->nservers *
+                                        sizeof(query->server_info[0]));
   if (!query->server_info)
     {
-      ares_free(query->tcpbuf);
-      ares_free(query);
+      ares__pool_free(channel, query->tcpbuf);
+      ares__pool_free(channel, query);
       callback(arg, ARES_ENOMEM, 0, NULL, 0);
       return;
     }
@@ -80,6 +149,7 @@ void ares_send(ares_channel channel, const unsigned char *qbuf, int qlen,
   query->qid = DNS_HEADER_QID(qbuf);
   query->timeout.tv_sec = 0;
   query->timeout.tv_usec = 0;
+  query->timeout_idx = -1;
 
   /* Form the TCP query buffer by prepending qlen (as two
    * network-order bytes) to qbuf.
@@ -92,18 +162,16 @@ void ares_send(ares_channel channel, const unsigned char *qbuf, int qlen,
   /* Fill in query arguments. */
   query->qbuf = query->tcpbuf + 2;
   query->qlen = qlen;
+  query->question = query->tcpbuf + 2 + qlen;
+  query->questionlen = questionlen;
+  if (questionlen > 0)
+    ares__normalize_questions(qbuf, qlen, query->tcpbuf + 2 + qlen);
   query->callback = callback;
   query->arg = arg;
 
   /* Initialize query status. */
   query->try_count = 0;
 
-  /* Choose the server to send the query to. If rotation is enabled, keep track
-   * of the next server we want to use. */
-  query->server = channel->last_server;
-  if (channel->rotate == 1)
-    channel->last_server = (channel->last_server + 1) % channel->nservers;
-
   for (i = 0; i < channel->nservers; i++)
     {
       query->server_info[i].skip_server = 0;
@@ -112,26 +180,56 @@ void ares_send(ares_channel channel, const unsigned char *qbuf, int qlen,
 
   packetsz = (channel->flags & ARES_FLAG_EDNS) ? channel->ednspsz : PACKETSZ;
   query->using_tcp = (channel->flags & ARES_FLAG_USEVC) || qlen > packetsz;
+  query->tcp_server = -1;
+
+  /* Choose the server to send the query to. If rotation is enabled, keep track
+   * of the next server we want to use. */
+  now = ares__tvnow();
+  if (channel->flags & ARES_FLAG_SRVHEALTH)
+    query->server = ares__choose_server(channel, query, -1, &now);
+  else
+    {
+      query->server = channel->last_server;
+      if (channel->rotate == 1)
+        channel->last_server = (channel->last_server + 1) % channel->nservers;
+    }
 
   query->error_status = ARES_ECONNREFUSED;
   query->timeouts = 0;
 
   /* Initialize our list nodes. */
   ares__init_list_node(&(query->queries_by_qid),     query);
-  ares__init_list_node(&(query->queries_by_timeout), query);
+  ares__init_list_node(&(query->queries_timed_out),  query);
   ares__init_list_node(&(query->queries_to_server),  query);
   ares__init_list_node(&(query->all_queries),        query);
+  ares__init_list_node(&(query->udp_pending),        query);
+  ares__init_list_node(&(query->queries_to_conn),    query);
+  ares__init_list_node(&(query->hedge_to_conn),      query);
+  ares__init_list_node(&(query->hedges_by_qid),      query);
+  ares__init_list_node(&(query->queries_by_question), query);
+  ares__init_list_head(&(query->waiters));
+  ares__init_list_node(&(query->node_by_handle),     query);
+  query->conn = NULL;
+  query->hedge_conn = NULL;
+  query->hedge_armed = 0;
 
   /* Chain the query into the list of all queries. */
   ares__insert_in_list(&(query->all_queries), &(channel->all_queries));
   /* Keep track of queries bucketed by qid, so we can process DNS
-   * responses quickly.
+   * responses quickly.  Once sent over UDP, a query is rebucketed by its
+   * socket as well.
    */
-  ares__insert_in_list(
-    &(query->queries_by_qid),
-    &(channel->queries_by_qid[query->qid % ARES_QID_TABLE_SIZE]));
+  ares__list_table_insert(&(channel->queries_by_qid),
+                          &(query->queries_by_qid),
+                          ares__qid_hash(NULL, query->qid));
+  /* And by request, for identical requests to come to wait on it. */
+  if ((channel->flags & ARES_FLAG_COALESCE) && !handle)
+    ares__coalesce_insert(channel, query);
+  /* And with the handle it is sent for, so it can be cancelled. */
+  query->handle = handle;
+  if (handle)
+    ares__insert_in_list(&(query->node_by_handle), &(handle->queries));
 
   /* Perform the first query action. */
-  now = ares__tvnow();
   ares__send_query(channel, query, &now);
 }
@@ -0,0 +1,179 @@
+/* Copyright (C) 2019 by The c-ares project
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+#include "ares_setup.h"
+
+#include "ares.h"
+#include "ares_private.h"
+#include "ares_atomic.h"
+
+static size_t string_memory(const char *s)
+{
+  return s ? strlen(s) + 1 : 0;
+}
+
+/* Add up the memory held by a server: its TCP read buffer, its UDP
+ * sockets and the requests queued on its TCP connection. */
+static size_t server_memory(struct server_state *server)
+{
+  struct list_node *node;
+  struct send_request *sendreq;
+  size_t bytes = server->tcp_rbuf_alloc;
+
+  for (node = server->connections.next; node != &(server->connections);
+       node = node->next)
+    bytes += sizeof(struct server_connection);
+  for (sendreq = server->qhead; sendreq; sendreq = sendreq->next)
+    {
+      bytes += ares__pool_block_size(sizeof(struct send_request));
+      if (sendreq->data_storage)
+        bytes += sendreq->len;
+    }
+  return bytes;
+}
+
+/* Add up the memory held by a query and what was allocated along with
+ * it. */
+static size_t query_memory(ares_channel channel, struct query *query)
+{
+  return ares__pool_block_size(sizeof(struct query)) +
+         ares__pool_block_size(query->tcplen +
+                               (query->questionlen > 0 ?
+                                query->questionlen : 0)) +
+         ares__pool_block_size(channel->nservers *
+                               sizeof(query->server_info[0])) +
+         ares__coalesce_memory(query);
+}
+
+/* Add up the memory the channel holds: the channel itself, its
+ * configuration, servers, queries, tables, caches and free lists. */
+static size_t channel_memory(ares_channel channel)
+{
+  struct list_node *node;
+  size_t bytes = sizeof(struct ares_channeldata);
+  int i;
+
+  if (channel->domains)
+    {
+      bytes += channel->ndomains * sizeof(char *);
+      for (i = 0; i < channel->ndomains; i++)
+        bytes += string_memory(channel->domains[i]);
+    }
+  if (channel->sortlist)
+    bytes += channel->nsort * sizeof(struct apattern);
+  bytes += string_memory(channel->lookups);
+  bytes += string_memory(channel->resolvconf_path);
+
+  if (channel->servers)
+    {
+      bytes += channel->nservers * sizeof(struct server_state);
+      for (i = 0; i < channel->nservers; i++)
+        bytes += server_memory(&channel->servers[i]);
+    }
+
+  for (node = channel->all_queries.next; node != &(channel->all_queries);
+       node = node->next)
+    bytes += query_memory(channel, node->data);
+  bytes += ares__list_table_memory(&(channel->queries_by_qid));
+  bytes += ares__list_table_memory(&(channel->hedges_by_qid));
+  bytes += ares__list_table_memory(&(channel->queries_by_question));
+  bytes += ares__list_table_memory(&(channel->conns_by_fd));
+  bytes += channel->queries_by_timeout_alloc * sizeof(struct query *);
+
+  if (channel->qcache)
+    bytes += ares__qcache_memory(channel->qcache);
+  if (channel->negcache)
+    bytes += ares__negcache_memory(channel->negcache);
+  if (channel->hosts)
+    bytes += ares__hosts_memory(channel->hosts);
+  bytes += ares__submitq_memory(channel);
+  if (channel->udp_recv_bufs)
+    bytes += ARES_UDP_RECV_BATCH * (MAXENDSSZ + 1);
+  bytes += ares__pool_memory(channel);
+  return bytes;
+}
+
+int ares_get_stat(ares_channel channel, int stat, unsigned long *value)
+{
+  if (!channel || !value)
+    return ARES_ENODATA;
+
+  if (stat == ARES_STAT_MEMORY_BYTES)
+    *value = (unsigned long)channel_memory(channel);
+  else if (stat >= 0 && stat < ARES_NSTATS)
+    *value = channel->stats[stat];
+  else
+    return ARES_ENOTIMP;
+  return ARES_SUCCESS;
+}
+
+/* Copy the channel's counters where ares__stats_read() can read them
+ * while the channel goes on being processed. */
+void ares__stats_publish(ares_channel channel)
+{
+#ifdef ARES_HAVE_ATOMICS
+  int i;
+
+  for (i = 0; i < ARES_NSTATS; i++)
+    {
+      if (channel->published_stats[i] != channel->stats[i])
+        ATOMIC_STORE(&channel->published_stats[i], channel->stats[i]);
+    }
+#else
+  (void)channel;
+#endif
+}
+
+/* Read a counter as of the end of the last ares_process*() call on the
+ * channel, from any thread.  ARES_STAT_MEMORY_BYTES cannot be read this
+ * way, as working it out walks the channel's state. */
+int ares__stats_read(ares_channel channel, int stat, unsigned long *value)
+{
+#ifdef ARES_HAVE_ATOMICS
+  if (stat < 0 || stat >= ARES_NSTATS)
+    return ARES_ENOTIMP;
+  *value = ATOMIC_LOAD(&channel->published_stats[stat]);
+  return ARES_SUCCESS;
+#else
+  (void)channel;
+  (void)stat;
+  (void)value;
+  return ARES_ENOTIMP;
+#endif
+}
+
+int ares_get_server_stat(ares_channel channel, int server, int stat,
+                         unsigned long *value)
+{
+  if (!channel || !value || server < 0 || server >= channel->nservers)
+    return ARES_ENODATA;
+
+  if (stat == ARES_SERVER_STAT_TCP_INFLIGHT)
+    *value = (unsigned long)channel->servers[server].tcp_inflight;
+  else if (stat == ARES_SERVER_STAT_SRTT)
+    *value = (unsigned long)channel->servers[server].srtt;
+  else if (stat == ARES_SERVER_STAT_RTTVAR)
+    *value = (unsigned long)channel->servers[server].rttvar;
+  else if (stat == ARES_SERVER_STAT_RTO)
+    *value = (unsigned long)(channel->rto_min > 0 ?
+                             ares__server_rto(channel,
+                                              &channel->servers[server]) :
+                             channel->timeout);
+  else if (stat >= 0 && stat < ARES_NSERVER_STATS)
+    *value = channel->servers[server].stats[stat];
+  else
+    return ARES_ENOTIMP;
+  return ARES_SUCCESS;
+}
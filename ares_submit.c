@@ -0,0 +1,430 @@
+/* Copyright (C) 2019 by The c-ares project
+ *
+ * Permission to use, copy, modify, and distribute this
+ * software and its documentation for any purpose and without
+ * fee is hereby granted, provided that the above copyright
+ * notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ * M.I.T. makes no representations about the suitability of
+ * this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+#include "ares_setup.h"
+
+#ifdef HAVE_UNISTD_H
+#  include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#  include <fcntl.h>
+#endif
+
+#include "ares.h"
+#include "ares_private.h"
+#include "ares_atomic.h"
+
+/* With ARES_OPT_SUBMIT_QUEUE, any thread may hand requests for a channel
+ * to the thread that drives it.  They go through a bounded ring of cells,
+ * a power of two in number, each holding a request with its packet or
+ * strings and a sequence number telling whose turn it is: producers claim
+ * a position by advancing the tail with compare-and-swap, write their
+ * request into the cell and then publish it by bumping its sequence
+ * number.  The one consumer, the thread calling ares_process(), takes
+ * cells in order from the head without any atomic read-modify-write.
+ * Neither side takes locks or allocates memory, and producers never wait
+ * for the consumer; a full ring makes the submission fail instead.
+ *
+ * So that the consumer need not poll, a producer that finds no wakeup
+ * pending writes a byte to a pipe whose reading end the event loop
+ * watches (see ares_submit_fd()).
+ */
+
+#ifdef ARES_HAVE_ATOMICS
+#  define HAVE_SUBMIT_QUEUE 1
+#endif
+
+#define SUBMIT_SEND         1
+#define SUBMIT_GETADDRINFO  2
+
+/* Room for a UDP query, or a name and a service */
+#define SUBMIT_DATA_SIZE    512
+
+/* A request waiting in the ring.  The packet of ares_submit_send(), or
+ * the node and service strings of ares_submit_getaddrinfo() one after the
+ * other, are held in data. */
+struct submission {
+  int type;
+  ares_callback callback;
+  ares_addrinfo_callback ai_callback;
+  void *arg;
+  int qlen;
+  int service_offset;  /* -1 for no node or service */
+  int node_offset;
+  struct ares_addrinfo_hints hints;
+  int has_hints;
+  unsigned char data[SUBMIT_DATA_SIZE];
+};
+
+struct submit_cell {
+  volatile unsigned int seq;
+  struct submission sub;
+};
+
+struct ares_submitq {
+  struct submit_cell *cells;
+  unsigned int mask;
+  volatile unsigned int tail;  /* next position producers claim */
+  unsigned int head;           /* next position the consumer takes */
+  volatile unsigned int wakeup_pending;
+  int wakeup_fds[2];           /* pipe, or -1 where there is none */
+};
+
+#ifdef HAVE_SUBMIT_QUEUE
+
+#ifndef WIN32
+static void set_nonblocking(int fd)
+{
+#if defined(HAVE_FCNTL_O_NONBLOCK)
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags != -1)
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+#ifdef FD_CLOEXEC
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+#else
+  (void)fd;
+#endif
+}
+#endif
+
+int ares__submitq_create(ares_channel channel)
+{
+  struct ares_submitq *queue;
+  unsigned int size = 1;
+  unsigned int i;
+
+  while (size < (unsigned int)channel->submit_queue_size && size < 0x40000000)
+    size <<= 1;
+
+  queue = ares_malloc(sizeof(struct ares_submitq));
+  if (!queue)
+    return ARES_ENOMEM;
+  queue->cells = ares_malloc(size * sizeof(struct submit_cell));
+  if (!queue->cells)
+    {
+      ares_free(queue);
+      return ARES_ENOMEM;
+    }
+  for (i = 0; i < size; i++)
+    queue->cells[i].seq = i;
+  queue->mask = size - 1;
+  queue->tail = 0;
+  queue->head = 0;
+  queue->wakeup_pending = 0;
+  queue->wakeup_fds[0] = -1;
+  queue->wakeup_fds[1] = -1;
+#ifndef WIN32
+  if (pipe(queue->wakeup_fds) == -1)
+    {
+      ares_free(queue->cells);
+      ares_free(queue);
+      return ARES_ENOMEM;
+    }
+  set_nonblocking(queue->wakeup_fds[0]);
+  set_nonblocking(queue->wakeup_fds[1]);
+#endif
+
+  channel->submitq = queue;
+  return ARES_SUCCESS;
+}
+
+/* Copy the next request off the ring.  Returns 0 if it is empty.  The
+ * cell is handed back to producers before the request is acted on, as
+ * callbacks may process the channel, and so the ring, again. */
+static int submitq_pop(struct ares_submitq *queue, struct submission *sub)
+{
+  struct submit_cell *cell = &queue->cells[queue->head & queue->mask];
+
+  if (ATOMIC_LOAD(&cell->seq) != queue->head + 1)
+    return 0;
+  memcpy(sub, &cell->sub, sizeof(*sub));
+  ATOMIC_STORE(&cell->seq, queue->head + queue->mask + 1);
+  queue->head++;
+  return 1;
+}
+
+/* Note that the consumer is about to look at the ring, so that producers
+ * from here on wake it up again. */
+static void submitq_clear_wakeup(struct ares_submitq *queue)
+{
+  char buf[64];
+
+  if (!ATOMIC_SWAP(&queue->wakeup_pending, 0))
+    return;
+#ifndef WIN32
+  while (read(queue->wakeup_fds[0], buf, sizeof(buf)) > 0)
+    ;
+#else
+  (void)buf;
+#endif
+}
+
+/* Start the requests other threads have submitted.  Runs on the thread
+ * processing the channel; at most a ring's worth is taken each time, so
+ * that busy producers cannot keep it here. */
+void ares__submitq_drain(ares_channel channel)
+{
+  struct ares_submitq *queue = channel->submitq;
+  struct submission sub;
+  unsigned int n;
+
+  if (!queue)
+    return;
+
+  submitq_clear_wakeup(queue);
+  for (n = 0; n <= queue->mask && submitq_pop(queue, &sub); n++)
+    {
+      if (sub.type == SUBMIT_SEND)
+        ares_send(channel, sub.data, sub.qlen, sub.callback, sub.arg);
+      else
+        ares_getaddrinfo(channel,
+                         sub.node_offset < 0 ? NULL :
+                         (const char *)sub.data + sub.node_offset,
+                         sub.service_offset < 0 ? NULL :
+                         (const char *)sub.data + sub.service_offset,
+                         sub.has_hints ? &sub.hints : NULL,
+                         sub.ai_callback, sub.arg);
+    }
+}
+
+/* Call back the callers of all the requests still in the ring with the
+ * given status, without starting them. */
+void ares__submitq_fail(ares_channel channel, int status)
+{
+  struct ares_submitq *queue = channel->submitq;
+  struct submission sub;
+
+  if (!queue)
+    return;
+
+  submitq_clear_wakeup(queue);
+  while (submitq_pop(queue, &sub))
+    {
+      if (sub.type == SUBMIT_SEND)
+        sub.callback(sub.arg, status, 0, NULL, 0);
+      else
+        sub.ai_callback(sub.arg, status, 0, NULL);
+    }
+}
+
+void ares__submitq_destroy(ares_channel channel)
+{
+  struct ares_submitq *queue = channel->submitq;
+
+  if (!queue)
+    return;
+
+#ifndef WIN32
+  close(queue->wakeup_fds[0]);
+  close(queue->wakeup_fds[1]);
+#endif
+  ares_free(queue->cells);
+  ares_free(queue);
+  channel->submitq = NULL;
+}
+
+/* Return the memory held by the ring. */
+size_t ares__submitq_memory(ares_channel channel)
+{
+  struct ares_submitq *queue = channel->submitq;
+
+  if (!queue)
+    return 0;
+  return sizeof(struct ares_submitq) +
+         (queue->mask + 1) * sizeof(struct submit_cell);
+}
+
+/* Claim the next free cell of the ring for a request, or return NULL if
+ * the ring is full.  Any thread may call this. */
+static struct submit_cell *submitq_claim(struct ares_submitq *queue)
+{
+  struct submit_cell *cell;
+  unsigned int pos;
+  unsigned int seq;
+
+  pos = ATOMIC_LOAD(&queue->tail);
+  for (;;)
+    {
+      cell = &queue->cells[pos & queue->mask];
+      seq = ATOMIC_LOAD(&cell->seq);
+      if (seq == pos)
+        {
+          /* The cell is free for this round; try to claim it.  If another
+             producer got there first, the CAS leaves the tail it saw in
+             pos, so the next round looks at that cell. */
+          if (ATOMIC_CAS(&queue->tail, pos, pos + 1))
+            return cell;
+        }
+      else if ((int)(seq - pos) < 0)
+        {
+          /* The consumer has not taken this cell's last request yet */
+          return NULL;
+        }
+      else
+        pos = ATOMIC_LOAD(&queue->tail);
+    }
+}
+
+/* Make the request written into a claimed cell visible to the consumer,
+ * and wake it up unless that is pending already. */
+static void submitq_publish(struct ares_submitq *queue,
+                            struct submit_cell *cell)
+{
+  char byte = 0;
+
+  ATOMIC_STORE(&cell->seq, cell->seq + 1);
+  if (!ATOMIC_SWAP(&queue->wakeup_pending, 1))
+    {
+#ifndef WIN32
+      if (write(queue->wakeup_fds[1], &byte, 1) < 0)
+        {
+          /* The pipe is full, so the consumer wakes up anyway */
+        }
+#else
+      (void)byte;
+#endif
+    }
+}
+
+int ares_submit_send(ares_channel channel, const unsigned char *qbuf,
+                     int qlen, ares_callback callback, void *arg)
+{
+  struct submit_cell *cell;
+  struct submission *sub;
+
+  if (!channel || !channel->submitq)
+    return ARES_ENOTIMP;
+  if (qlen < 0 || qlen > (int)sizeof(sub->data))
+    return ARES_EBADQUERY;
+
+  cell = submitq_claim(channel->submitq);
+  if (!cell)
+    return ARES_ENOMEM;
+  sub = &cell->sub;
+  sub->type = SUBMIT_SEND;
+  sub->callback = callback;
+  sub->ai_callback = NULL;
+  sub->arg = arg;
+  sub->qlen = qlen;
+  sub->node_offset = -1;
+  sub->service_offset = -1;
+  sub->has_hints = 0;
+  memcpy(sub->data, qbuf, qlen);
+  submitq_publish(channel->submitq, cell);
+  return ARES_SUCCESS;
+}
+
+int ares_submit_getaddrinfo(ares_channel channel, const char *node,
+                            const char *service,
+                            const struct ares_addrinfo_hints *hints,
+                            ares_addrinfo_callback callback, void *arg)
+{
+  struct submit_cell *cell;
+  struct submission *sub;
+  size_t nodelen = node ? strlen(node) + 1 : 0;
+  size_t servicelen = service ? strlen(service) + 1 : 0;
+
+  if (!channel || !channel->submitq)
+    return ARES_ENOTIMP;
+  if (nodelen + servicelen > sizeof(sub->data))
+    return ARES_EBADNAME;
+
+  cell = submitq_claim(channel->submitq);
+  if (!cell)
+    return ARES_ENOMEM;
+  sub = &cell->sub;
+  sub->type = SUBMIT_GETADDRINFO;
+  sub->callback = NULL;
+  sub->ai_callback = callback;
+  sub->arg = arg;
+  sub->qlen = 0;
+  sub->node_offset = node ? 0 : -1;
+  sub->service_offset = service ? (int)nodelen : -1;
+  if (node)
+    memcpy(sub->data, node, nodelen);
+  if (service)
+    memcpy(sub->data + nodelen, service, servicelen);
+  sub->has_hints = hints != NULL;
+  if (hints)
+    sub->hints = *hints;
+  submitq_publish(channel->submitq, cell);
+  return ARES_SUCCESS;
+}
+
+#else  /* !HAVE_SUBMIT_QUEUE */
+
+/* Without atomic operations there is no queue, and submitting fails. */
+int ares__submitq_create(ares_channel channel)
+{
+  (void)channel;
+  return ARES_SUCCESS;
+}
+
+void ares__submitq_drain(ares_channel channel)
+{
+  (void)channel;
+}
+
+void ares__submitq_fail(ares_channel channel, int status)
+{
+  (void)channel;
+  (void)status;
+}
+
+void ares__submitq_destroy(ares_channel channel)
+{
+  (void)channel;
+}
+
+size_t ares__submitq_memory(ares_channel channel)
+{
+  (void)channel;
+  return 0;
+}
+
+int ares_submit_send(ares_channel channel, const unsigned char *qbuf,
+                     int qlen, ares_callback callback, void *arg)
+{
+  (void)channel;
+  (void)qbuf;
+  (void)qlen;
+  (void)callback;
+  (void)arg;
+  return ARES_ENOTIMP;
+}
+
+int ares_submit_getaddrinfo(ares_channel channel, const char *node,
+                            const char *service,
+                            const struct ares_addrinfo_hints *hints,
+                            ares_addrinfo_callback callback, void *arg)
+{
+  (void)channel;
+  (void)node;
+  (void)service;
+  (void)hints;
+  (void)callback;
+  (void)arg;
+  return ARES_ENOTIMP;
+}
+
+#endif  /* HAVE_SUBMIT_QUEUE */
+
+ares_socket_t ares_submit_fd(ares_channel channel)
+{
+  if (!channel || !channel->submitq)
+    return ARES_SOCKET_BAD;
+  return (ares_socket_t)channel->submitq->wakeup_fds[0];
+}
@@ -23,65 +23,61 @@
 #include "ares.h"
 #include "ares_private.h"
 
-/* return time offset between now and (future) check, in milliseconds */
+/* return time offset between now and (future) check, in milliseconds,
+   rounded up so that a wakeup at that offset finds the timeout expired */
 static long timeoffset(struct timeval *now, struct timeval *check)
 {
-  return (check->tv_sec - now->tv_sec)*1000 +
-         (check->tv_usec - now->tv_usec)/1000;
+  long usecs = check->tv_usec - now->tv_usec;
+  long offset = (check->tv_sec - now->tv_sec)*1000 + usecs/1000;
+
+  if (usecs % 1000 > 0)
+    offset++;
+  return offset;
 }
 
-/* WARNING: Beware that this is linear in the number of outstanding
- * requests! You are probably far better off just calling ares_process()
- * once per second, rather than calling ares_timeout() to figure out
- * when to next call ares_process().
- */
 struct timeval *ares_timeout(ares_channel channel, struct timeval *maxtv,
                              struct timeval *tvbuf)
 {
   struct query *query;
-  struct list_node* list_head;
-  struct list_node* list_node;
   struct timeval now;
   struct timeval nextstop;
-  long offset, min_offset;
+  struct timeval deadline;
+  int idle;
+  long offset;
+  int ioffset;
+
+  /* Queries held back by ARES_FLAG_DEFERSEND go out before we wait. */
+  ares__send_pending(channel);
 
-  /* No queries, no timeout (and no fetch of the current time). */
-  if (ares__is_list_empty(&(channel->all_queries)))
+  /* Sent queries are kept ordered by timeout, so the first one to expire
+   * is found without looking at the others.  We also have to wake up to
+   * close TCP connections that have been idle for too long.  Neither of
+   * those, no timeout (and no fetch of the current time).
+   */
+  query = ares__timeout_heap_first(channel);
+  idle = ares__tcp_idle_deadline(channel, &deadline);
+  if (!query && !idle)
     return maxtv;
+  if (query && (!idle || ares__timedout(&deadline, &query->timeout)))
+    deadline = query->timeout;
 
-  /* Find the minimum timeout for the current set of queries. */
   now = ares__tvnow();
-  min_offset = -1;
+  offset = timeoffset(&now, &deadline);
+  if (offset < 0)
+    offset = 0;
 
-  list_head = &(channel->all_queries);
-  for (list_node = list_head->next; list_node != list_head;
-       list_node = list_node->next)
-    {
-      query = list_node->data;
-      if (query->timeout.tv_sec == 0)
-        continue;
-      offset = timeoffset(&now, &query->timeout);
-      if (offset < 0)
-        offset = 0;
-      if (min_offset == -1 || offset < min_offset)
-        min_offset = offset;
-    }
-
-  /* If we found a minimum timeout and it's sooner than the one specified in
-   * maxtv (if any), return it.  Otherwise go with maxtv.
+  /* If it's sooner than the one specified in maxtv (if any), return it.
+   * Otherwise go with maxtv.
    */
-  if (min_offset != -1)
-    {
-      int ioffset = (min_offset > (long)INT_MAX) ? INT_MAX : (int)min_offset;
+  ioffset = (offset > (long)INT_MAX) ? INT_MAX : (int)offset;
 
-      nextstop.tv_sec = ioffset/1000;
-      nextstop.tv_usec = (ioffset%1000)*1000;
+  nextstop.tv_sec = ioffset/1000;
+  nextstop.tv_usec = (ioffset%1000)*1000;
 
-      if (!maxtv || ares__timedout(maxtv, &nextstop))
-        {
-          *tvbuf = nextstop;
-          return tvbuf;
-        }
+  if (!maxtv || ares__timedout(maxtv, &nextstop))
+    {
+      *tvbuf = nextstop;
+      return tvbuf;
     }
 
   return maxtv;
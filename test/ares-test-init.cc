@@ -88,6 +88,30 @@ TEST_F(LibraryTest, OptionsChannelInit) {
   optmask |= ARES_OPT_ROTATE;
   opts.resolvconf_path = strdup("/etc/resolv.conf");
   optmask |= ARES_OPT_RESOLVCONF;
+  opts.qcache_max_ttl = 300;
+  opts.qcache_max_entries = 100;
+  optmask |= ARES_OPT_QUERY_CACHE;
+  opts.udp_pool_size = 8;
+  optmask |= ARES_OPT_UDP_POOL;
+  opts.udp_max_queries = 1000;
+  optmask |= ARES_OPT_UDP_MAX_QUERIES;
+  opts.pool_max_free = 32;
+  optmask |= ARES_OPT_POOL_MAX_FREE;
+  opts.tcp_idle_timeout = 5000;
+  optmask |= ARES_OPT_TCP_IDLE_TIMEOUT;
+  opts.rto_min = 50;
+  opts.rto_max = 2000;
+  optmask |= ARES_OPT_RTO;
+  opts.hedge_delay = 0;
+  opts.hedge_percentile = 95;
+  optmask |= ARES_OPT_HEDGE;
+  opts.reload_interval = 5000;
+  optmask |= ARES_OPT_RELOAD;
+  opts.negcache_max_ttl = 600;
+  opts.negcache_max_entries = 200;
+  optmask |= ARES_OPT_NEG_CACHE;
+  opts.submit_queue_size = 32;
+  optmask |= ARES_OPT_SUBMIT_QUEUE;
 
   ares_channel channel = nullptr;
   EXPECT_EQ(ARES_SUCCESS, ares_init_options(&channel, &opts, optmask));
@@ -115,6 +139,31 @@ TEST_F(LibraryTest, OptionsChannelInit) {
   EXPECT_EQ(std::string(opts.domains[1]), std::string(opts2.domains[1]));
   EXPECT_EQ(std::string(opts.lookups), std::string(opts2.lookups));
   EXPECT_EQ(std::string(opts.resolvconf_path), std::string(opts2.resolvconf_path));
+  EXPECT_NE(0, optmask2 & ARES_OPT_QUERY_CACHE);
+  EXPECT_EQ(opts.qcache_max_ttl, opts2.qcache_max_ttl);
+  EXPECT_EQ(opts.qcache_max_entries, opts2.qcache_max_entries);
+  EXPECT_NE(0, optmask2 & ARES_OPT_UDP_POOL);
+  EXPECT_EQ(opts.udp_pool_size, opts2.udp_pool_size);
+  EXPECT_NE(0, optmask2 & ARES_OPT_UDP_MAX_QUERIES);
+  EXPECT_EQ(opts.udp_max_queries, opts2.udp_max_queries);
+  EXPECT_NE(0, optmask2 & ARES_OPT_POOL_MAX_FREE);
+  EXPECT_EQ(opts.pool_max_free, opts2.pool_max_free);
+  EXPECT_NE(0, optmask2 & ARES_OPT_TCP_IDLE_TIMEOUT);
+  EXPECT_EQ(opts.tcp_idle_timeout, opts2.tcp_idle_timeout);
+  EXPECT_NE(0, optmask2 & ARES_OPT_RTO);
+  EXPECT_EQ(opts.rto_min, opts2.rto_min);
+  EXPECT_EQ(opts.rto_max, opts2.rto_max);
+  EXPECT_NE(0, optmask2 & ARES_OPT_HEDGE);
+  EXPECT_EQ(opts.hedge_percentile, opts2.hedge_percentile);
+  EXPECT_NE(0, optmask2 & ARES_OPT_RELOAD);
+  EXPECT_EQ(opts.reload_interval, opts2.reload_interval);
+  EXPECT_NE(0, optmask2 & ARES_OPT_NEG_CACHE);
+  EXPECT_EQ(opts.negcache_max_ttl, opts2.negcache_max_ttl);
+  EXPECT_EQ(opts.negcache_max_entries, opts2.negcache_max_entries);
+  EXPECT_NE(0, optmask2 & ARES_OPT_SUBMIT_QUEUE);
+  EXPECT_EQ(opts.submit_queue_size, opts2.submit_queue_size);
+  EXPECT_NE(ARES_SOCKET_BAD, ares_submit_fd(channel2));
+  EXPECT_NE(ares_submit_fd(channel), ares_submit_fd(channel2));
 
   ares_destroy_options(&opts);
   ares_destroy_options(&opts2);
@@ -122,6 +171,124 @@ TEST_F(LibraryTest, OptionsChannelInit) {
   ares_destroy(channel2);
 }
 
+TEST_F(LibraryTest, ReinitResolvConf) {
+  std::string filename = TempNam(nullptr, "ares");
+  struct ares_options opts = {0};
+  int optmask = 0;
+  opts.resolvconf_path = strdup(filename.c_str());
+  optmask |= ARES_OPT_RESOLVCONF;
+  opts.tries = 5;
+  optmask |= ARES_OPT_TRIES;
+  ares_channel channel = nullptr;
+  {
+    TransientFile conf(filename, "nameserver 1.2.3.4\n"
+                                 "search first.com\n"
+                                 "options ndots:3 retry:2\n");
+    EXPECT_EQ(ARES_SUCCESS, ares_init_options(&channel, &opts, optmask));
+  }
+  std::vector<std::string> expected = {"1.2.3.4"};
+  EXPECT_EQ(expected, GetNameServers(channel));
+
+  TransientFile conf(filename, "nameserver 2.3.4.5\n"
+                               "nameserver 3.4.5.6\n"
+                               "search second.com third.com\n"
+                               "options ndots:2 retry:3\n");
+  EXPECT_EQ(ARES_ENODATA, ares_reinit(nullptr));
+  EXPECT_EQ(ARES_SUCCESS, ares_reinit(channel));
+  expected = {"2.3.4.5", "3.4.5.6"};
+  EXPECT_EQ(expected, GetNameServers(channel));
+
+  struct ares_options opts2 = {0};
+  int optmask2 = 0;
+  EXPECT_EQ(ARES_SUCCESS, ares_save_options(channel, &opts2, &optmask2));
+  EXPECT_EQ(2, opts2.ndots);
+  EXPECT_EQ(5, opts2.tries);  // Given as an option, so not reread
+  EXPECT_EQ(2, opts2.ndomains);
+  EXPECT_EQ(std::string("second.com"), std::string(opts2.domains[0]));
+  EXPECT_EQ(std::string("third.com"), std::string(opts2.domains[1]));
+  ares_destroy_options(&opts2);
+
+  // Servers that were set explicitly are kept.
+  EXPECT_EQ(ARES_SUCCESS, ares_set_servers_csv(channel, "4.5.6.7"));
+  EXPECT_EQ(ARES_SUCCESS, ares_reinit(channel));
+  expected = {"4.5.6.7"};
+  EXPECT_EQ(expected, GetNameServers(channel));
+
+  ares_destroy_options(&opts);
+  ares_destroy(channel);
+}
+
+TEST_F(LibraryTest, ReloadChangedResolvConf) {
+  std::string filename = TempNam(nullptr, "ares");
+  struct ares_options opts = {0};
+  int optmask = 0;
+  opts.resolvconf_path = strdup(filename.c_str());
+  optmask |= ARES_OPT_RESOLVCONF;
+  opts.reload_interval = 60000;
+  optmask |= ARES_OPT_RELOAD;
+  ares_channel channel = nullptr;
+  {
+    TransientFile conf(filename, "nameserver 127.0.0.1\n");
+    EXPECT_EQ(ARES_SUCCESS, ares_init_options(&channel, &opts, optmask));
+  }
+
+  // The first query looks at the file, and finds it changed.
+  SearchResult result1;
+  {
+    TransientFile conf(filename, "nameserver 127.0.0.2\n"
+                                 "nameserver 127.0.0.3\n");
+    ares_query(channel, "www.example.com", C_IN, T_A, SearchCallback, &result1);
+  }
+  std::vector<std::string> expected = {"127.0.0.2", "127.0.0.3"};
+  EXPECT_EQ(expected, GetNameServers(channel));
+
+  // Later ones wait for the interval to pass before looking again.
+  SearchResult result2;
+  {
+    TransientFile conf(filename, "nameserver 127.0.0.4\n");
+    ares_query(channel, "www.example.com", C_IN, T_A, SearchCallback, &result2);
+  }
+  EXPECT_EQ(expected, GetNameServers(channel));
+
+  ares_cancel(channel);
+  EXPECT_TRUE(result1.done_);
+  EXPECT_TRUE(result2.done_);
+  ares_destroy_options(&opts);
+  ares_destroy(channel);
+}
+
+TEST_F(LibraryTest, ReloadDuringParallelSearch) {
+  std::string filename = TempNam(nullptr, "ares");
+  struct ares_options opts = {0};
+  int optmask = 0;
+  opts.resolvconf_path = strdup(filename.c_str());
+  optmask |= ARES_OPT_RESOLVCONF;
+  opts.reload_interval = 60000;
+  optmask |= ARES_OPT_RELOAD;
+  opts.flags = ARES_FLAG_PARALLELSEARCH;
+  optmask |= ARES_OPT_FLAGS;
+  ares_channel channel = nullptr;
+  {
+    TransientFile conf(filename, "nameserver 127.0.0.1\n"
+                                 "search first.com second.org third.gov\n");
+    EXPECT_EQ(ARES_SUCCESS, ares_init_options(&channel, &opts, optmask));
+  }
+
+  // Sending the first name reads the file again, which has fewer domains
+  // than the search started with.
+  SearchResult result;
+  {
+    TransientFile conf(filename, "nameserver 127.0.0.1\n"
+                                 "search first.com\n");
+    ares_search(channel, "www", C_IN, T_A, SearchCallback, &result);
+  }
+
+  ares_cancel(channel);
+  EXPECT_TRUE(result.done_);
+  ares_destroy_options(&opts);
+  ares_destroy(channel);
+}
+
 TEST_F(LibraryTest, ChannelAllocFail) {
   ares_channel channel;
   for (int ii = 1; ii <= 25; ii++) {
@@ -436,6 +436,39 @@ TEST_F(DefaultChannelTest, GetAddrInfoHostsIPV6) {
   EXPECT_EQ("{ipv6.com addr=[[0000:0000:0000:0000:0000:0000:0000:0001]]}", ss.str());
 }
 
+TEST_F(DefaultChannelTest, GetAddrInfoHostsChanged) {
+  std::string filename = TempNam(nullptr, "ares");
+  EnvValue with_env("CARES_HOSTS", filename.c_str());
+  struct ares_addrinfo_hints hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_flags = ARES_AI_ENVHOSTS | ARES_AI_NOSORT;
+
+  AddrInfoResult result1 = {};
+  {
+    TransientFile hostsfile(filename, "1.2.3.4 example.com\n"
+                                      "2.3.4.5 other.com example.com\n");
+    ares_getaddrinfo(channel_, "example.com", NULL, &hints, AddrInfoCallback, &result1);
+    Process();
+  }
+  EXPECT_TRUE(result1.done_);
+  std::stringstream ss1;
+  ss1 << result1.ai_;
+  EXPECT_EQ("{addr=[1.2.3.4], addr=[2.3.4.5]}", ss1.str());
+
+  // Rewriting the file is noticed by the next lookup.
+  AddrInfoResult result2 = {};
+  {
+    TransientFile hostsfile(filename, "10.20.30.40 EXAMPLE.com\n"
+                                      "::1 example.com\n");
+    ares_getaddrinfo(channel_, "example.com", NULL, &hints, AddrInfoCallback, &result2);
+    Process();
+  }
+  EXPECT_TRUE(result2.done_);
+  std::stringstream ss2;
+  ss2 << result2.ai_;
+  EXPECT_EQ("{addr=[10.20.30.40], addr=[[0000:0000:0000:0000:0000:0000:0000:0001]]}", ss2.str());
+}
+
 TEST_F(LibraryTest, GetAddrInfoAllocFail) {
   TempFile hostsfile("1.2.3.4 example.com alias1 alias2\n");
   struct ares_addrinfo_hints hints;
@@ -467,6 +500,58 @@ TEST(Misc, OnionDomain) {
   EXPECT_EQ(1, ares__is_onion_domain("YES.ONION"));
   EXPECT_EQ(1, ares__is_onion_domain("YES.ONION."));
 }
+
+TEST(Misc, SameQuestions) {
+  // Two questions, the second name compressed against the first.
+  std::vector<byte> query = {
+    0x12, 0x34, 0x01, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x03, 'w', 'w', 'w', 0x07, 'E', 'x', 'a', 'm', 'p', 'l', 'e',
+    0x03, 'c', 'o', 'm', 0x00, 0x00, 0x01, 0x00, 0x01,
+    0x04, 'm', 'a', 'i', 'l', 0xC0, 0x10, 0x00, 0x0F, 0x00, 0x01,
+  };
+  int normlen = ares__normalize_questions(query.data(), (int)query.size(), nullptr);
+  ASSERT_LT(0, normlen);
+  std::vector<byte> norm(normlen);
+  EXPECT_EQ(normlen, ares__normalize_questions(query.data(), (int)query.size(),
+                                               norm.data()));
+  std::vector<byte> expected = {
+    0x03, 'w', 'w', 'w', 0x07, 'e', 'x', 'a', 'm', 'p', 'l', 'e',
+    0x03, 'c', 'o', 'm', 0x00, 0x00, 0x01, 0x00, 0x01,
+    0x04, 'm', 'a', 'i', 'l', 0x07, 'e', 'x', 'a', 'm', 'p', 'l', 'e',
+    0x03, 'c', 'o', 'm', 0x00, 0x00, 0x0F, 0x00, 0x01,
+  };
+  EXPECT_EQ(expected, norm);
+
+  // An answer with the questions in the other order, spelt differently.
+  std::vector<byte> answer = {
+    0x12, 0x34, 0x81, 0x80, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x04, 'M', 'A', 'I', 'L', 0x07, 'e', 'x', 'a', 'm', 'p', 'l', 'e',
+    0x03, 'C', 'O', 'M', 0x00, 0x00, 0x0F, 0x00, 0x01,
+    0x03, 'W', 'w', 'W', 0xC0, 0x11, 0x00, 0x01, 0x00, 0x01,
+  };
+  EXPECT_EQ(1, ares__same_questions(norm.data(), normlen, 2,
+                                    answer.data(), (int)answer.size()));
+  // Different type.
+  answer[answer.size() - 3] = 0x1C;
+  EXPECT_EQ(0, ares__same_questions(norm.data(), normlen, 2,
+                                    answer.data(), (int)answer.size()));
+  answer[answer.size() - 3] = 0x01;
+  // Different name.
+  answer[37] = 'x';
+  EXPECT_EQ(0, ares__same_questions(norm.data(), normlen, 2,
+                                    answer.data(), (int)answer.size()));
+  answer[37] = 'w';
+  // Truncated.
+  EXPECT_EQ(0, ares__same_questions(norm.data(), normlen, 2,
+                                    answer.data(), (int)answer.size() - 1));
+  // A pointer loop.
+  answer[38] = 0xC0;
+  answer[39] = 0x26;
+  EXPECT_EQ(0, ares__same_questions(norm.data(), normlen, 2,
+                                    answer.data(), (int)answer.size()));
+  EXPECT_EQ(-1, ares__normalize_questions(answer.data(), (int)answer.size(),
+                                          nullptr));
+}
 #endif
 
 #ifdef CARES_EXPOSE_STATICS
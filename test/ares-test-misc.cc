@@ -46,11 +46,16 @@ TEST_F(DefaultChannelTest, SetServers) {
   std::vector<std::string> expected = {"1.2.3.4", "2.3.4.5"};
   EXPECT_EQ(expected, GetNameServers(channel_));
 
-  // Change not allowed while request is pending
+  // Change allowed while request is pending, but not to an empty list
   HostResult result;
   ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result);
-  EXPECT_EQ(ARES_ENOTIMP, ares_set_servers(channel_, &server1));
+  EXPECT_EQ(ARES_SUCCESS, ares_set_servers(channel_, &server2));
+  std::vector<std::string> expected2 = {"2.3.4.5"};
+  EXPECT_EQ(expected2, GetNameServers(channel_));
+  EXPECT_EQ(ARES_ENOTIMP, ares_set_servers(channel_, nullptr));
+  EXPECT_EQ(expected2, GetNameServers(channel_));
   ares_cancel(channel_);
+  EXPECT_TRUE(result.done_);
 }
 
 TEST_F(DefaultChannelTest, SetServersPorts) {
@@ -76,11 +81,15 @@ TEST_F(DefaultChannelTest, SetServersPorts) {
   std::vector<std::string> expected = {"1.2.3.4:111", "2.3.4.5"};
   EXPECT_EQ(expected, GetNameServers(channel_));
 
-  // Change not allowed while request is pending
+  // Change allowed while request is pending, but not to an empty list
   HostResult result;
   ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result);
-  EXPECT_EQ(ARES_ENOTIMP, ares_set_servers_ports(channel_, &server1));
+  EXPECT_EQ(ARES_SUCCESS, ares_set_servers_ports(channel_, &server2));
+  std::vector<std::string> expected2 = {"2.3.4.5"};
+  EXPECT_EQ(expected2, GetNameServers(channel_));
+  EXPECT_EQ(ARES_ENOTIMP, ares_set_servers_ports(channel_, nullptr));
   ares_cancel(channel_);
+  EXPECT_TRUE(result.done_);
 }
 
 TEST_F(DefaultChannelTest, SetServersCSV) {
@@ -108,11 +117,15 @@ TEST_F(DefaultChannelTest, SetServersCSV) {
   std::vector<std::string> expected2 = {"1.2.3.4:54", "[0102:0304:0506:0708:0910:1112:1314:1516]:80", "2.3.4.5:55"};
   EXPECT_EQ(expected2, GetNameServers(channel_));
 
-  // Change not allowed while request is pending
+  // Change allowed while request is pending
   HostResult result;
   ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result);
-  EXPECT_EQ(ARES_ENOTIMP, ares_set_servers_csv(channel_, "1.2.3.4,2.3.4.5"));
-  EXPECT_EQ(ARES_ENOTIMP, ares_set_servers_ports_csv(channel_, "1.2.3.4:56,2.3.4.5:67"));
+  EXPECT_EQ(ARES_SUCCESS, ares_set_servers_csv(channel_, "1.2.3.4,2.3.4.5"));
+  EXPECT_EQ(ARES_SUCCESS, ares_set_servers_ports_csv(channel_, "1.2.3.4:56,2.3.4.5:67"));
+  std::vector<std::string> expected3 = {"1.2.3.4:56", "2.3.4.5:67"};
+  EXPECT_EQ(expected3, GetNameServers(channel_));
+  EXPECT_EQ(ARES_SUCCESS,
+            ares_set_servers_ports_csv(channel_, "1.2.3.4:54,[0102:0304:0506:0708:0910:1112:1314:1516]:80,2.3.4.5:55"));
   ares_cancel(channel_);
 
   // Should survive duplication
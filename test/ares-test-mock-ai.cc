@@ -99,6 +99,162 @@ TEST_P(MockUDPChannelTestAI, GetAddrInfoParallelLookups) {
   EXPECT_THAT(result3.ai_, IncludesV4Address("2.3.4.5"));
 }
 
+struct BatchResult {
+  BatchResult() : done_(false), status_(ARES_SUCCESS) {}
+  bool done_;
+  int status_;
+  // Addresses of each item, copied as they only live during the callback
+  std::vector<std::vector<std::string>> addrs_;
+  std::vector<std::vector<int>> ttls_;
+};
+
+static void BatchCallback(void *data, int status,
+                          struct ares_addrinfo_batch_item *items,
+                          size_t nitems) {
+  BatchResult* result = reinterpret_cast<BatchResult*>(data);
+  EXPECT_FALSE(result->done_);
+  result->done_ = true;
+  result->status_ = status;
+  for (size_t ii = 0; ii < nitems; ii++) {
+    std::vector<std::string> addrs;
+    std::vector<int> ttls;
+    for (size_t jj = 0; jj < items[ii].naddrs; jj++) {
+      const struct ares_addrinfo_batch_addr *addr = &items[ii].addrs[jj];
+      if (addr->family == AF_INET)
+        addrs.push_back(AddressToString(&addr->addr.addr4, 4));
+      else
+        addrs.push_back(AddressToString(&addr->addr.addr6, 16));
+      ttls.push_back(addr->ttl);
+    }
+    if (verbose) std::cerr << "BatchCallback item " << ii << ": "
+                           << ares_strerror(items[ii].status) << std::endl;
+    result->addrs_.push_back(addrs);
+    result->ttls_.push_back(ttls);
+  }
+}
+
+// UDP only so mock server doesn't get confused by concatenated requests
+TEST_P(MockUDPChannelTestAI, GetAddrInfoBatch) {
+  DNSPacket rsp1;
+  rsp1.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}))
+    .add_answer(new DNSARR("www.google.com", 200, {3, 4, 5, 6}));
+  ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp1));
+  DNSPacket rsp2;
+  rsp2.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", ns_t_a))
+    .add_answer(new DNSARR("www.example.com", 100, {1, 2, 3, 4}));
+  ON_CALL(server_, OnRequest("www.example.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp2));
+  DNSPacket rsp3;
+  rsp3.set_response().set_aa().set_rcode(ns_r_nxdomain)
+    .add_question(new DNSQuestion("www.missing.com", ns_t_a));
+  ON_CALL(server_, OnRequest("www.missing.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp3));
+
+  struct ares_addrinfo_hints hints = {};
+  hints.ai_family = AF_INET;
+  struct ares_addrinfo_hints nosort = {};
+  nosort.ai_family = AF_INET;
+  nosort.ai_flags = ARES_AI_NOSORT;
+  struct ares_addrinfo_hints numeric = {};
+  numeric.ai_family = AF_INET;
+  numeric.ai_flags = ARES_AI_NUMERICSERV;
+
+  struct ares_addrinfo_batch_item items[6] = {};
+  const char *names[6] = {"www.google.com.", "10.1.2.3", "www.example.com.",
+                          "www.missing.com.", "www.google.com.",
+                          "www.example.com."};
+  const char *services[6] = {"80", "8080", NULL, NULL, "443", "http"};
+  const struct ares_addrinfo_hints *itemhints[6] = {&nosort, &numeric, &hints,
+                                                    &hints, &hints, &numeric};
+  for (int ii = 0; ii < 6; ii++) {
+    items[ii].node = names[ii];
+    items[ii].service = services[ii];
+    items[ii].hints = itemhints[ii];
+  }
+  BatchResult result;
+  ares_getaddrinfo_batch(channel_, items, 6, 2, 1, BatchCallback, &result);
+  Process();
+
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(ARES_SUCCESS, result.status_);
+  EXPECT_EQ(ARES_SUCCESS, items[0].status);
+  EXPECT_EQ(80, items[0].port);
+  EXPECT_EQ(std::vector<std::string>({"2.3.4.5", "3.4.5.6"}), result.addrs_[0]);
+  EXPECT_EQ(std::vector<int>({100, 200}), result.ttls_[0]);
+  EXPECT_EQ(ARES_SUCCESS, items[1].status);
+  EXPECT_EQ(8080, items[1].port);
+  EXPECT_EQ(std::vector<std::string>({"10.1.2.3"}), result.addrs_[1]);
+  EXPECT_EQ(std::vector<int>({0}), result.ttls_[1]);
+  EXPECT_EQ(ARES_SUCCESS, items[2].status);
+  EXPECT_EQ(0, items[2].port);
+  EXPECT_EQ(std::vector<std::string>({"1.2.3.4"}), result.addrs_[2]);
+  EXPECT_EQ(ARES_ENOTFOUND, items[3].status);
+  EXPECT_EQ(0U, items[3].naddrs);
+  EXPECT_TRUE(result.addrs_[3].empty());
+  // Sorted, but both addresses rank the same
+  EXPECT_EQ(ARES_SUCCESS, items[4].status);
+  EXPECT_EQ(443, items[4].port);
+  EXPECT_EQ(2U, items[4].naddrs);
+  // A service name with ARES_AI_NUMERICSERV is not looked up
+  EXPECT_EQ(ARES_ESERVICE, items[5].status);
+  EXPECT_EQ(0U, items[5].naddrs);
+}
+
+TEST_P(MockUDPChannelTestAI, GetAddrInfoBatchRetry) {
+  DNSPacket servfail;
+  servfail.set_response().set_aa().set_rcode(ns_r_servfail)
+    .add_question(new DNSQuestion("www.google.com", ns_t_a));
+  DNSPacket rspok;
+  rspok.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  // The channel's own 3 tries all fail, so the batch has to try again
+  EXPECT_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillOnce(SetReply(&server_, &servfail))
+    .WillOnce(SetReply(&server_, &servfail))
+    .WillOnce(SetReply(&server_, &servfail))
+    .WillOnce(SetReply(&server_, &rspok));
+
+  struct ares_addrinfo_hints hints = {};
+  hints.ai_family = AF_INET;
+  struct ares_addrinfo_batch_item items[1] = {};
+  items[0].node = "www.google.com.";
+  items[0].hints = &hints;
+  BatchResult result;
+  ares_getaddrinfo_batch(channel_, items, 1, 0, 2, BatchCallback, &result);
+  Process();
+
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(ARES_SUCCESS, result.status_);
+  EXPECT_EQ(ARES_SUCCESS, items[0].status);
+  EXPECT_EQ(std::vector<std::string>({"2.3.4.5"}), result.addrs_[0]);
+}
+
+TEST_P(MockUDPChannelTestAI, GetAddrInfoBatchCancelled) {
+  struct ares_addrinfo_hints hints = {};
+  hints.ai_family = AF_INET;
+  struct ares_addrinfo_batch_item items[3] = {};
+  for (int ii = 0; ii < 3; ii++) {
+    items[ii].node = "www.google.com.";
+    items[ii].hints = &hints;
+  }
+  BatchResult result;
+  ares_getaddrinfo_batch(channel_, items, 3, 1, 3, BatchCallback, &result);
+  EXPECT_FALSE(result.done_);
+  ares_cancel(channel_);
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(ARES_ECANCELLED, result.status_);
+  for (int ii = 0; ii < 3; ii++) {
+    EXPECT_EQ(ARES_ECANCELLED, items[ii].status);
+    EXPECT_EQ(0U, items[ii].naddrs);
+    EXPECT_EQ(nullptr, items[ii].addrs);
+  }
+}
+
 // UDP to TCP specific test
 TEST_P(MockUDPChannelTestAI, TruncationRetry) {
   DNSPacket rsptruncated;
@@ -442,6 +598,60 @@ TEST_P(MockChannelTestAI, FamilyUnspecified) {
   EXPECT_THAT(result.ai_, IncludesV6Address("2121:0000:0000:0000:0000:0000:0000:0303"));
 }
 
+// The AAAA and A queries are sent together; an empty answer for one of them
+// must not discard the addresses found by the other.
+TEST_P(MockChannelTestAI, FamilyUnspecifiedNoAAAA) {
+  DNSPacket rsp6;
+  rsp6.set_response().set_aa()
+    .add_question(new DNSQuestion("example.com", ns_t_aaaa));
+  ON_CALL(server_, OnRequest("example.com", ns_t_aaaa))
+    .WillByDefault(SetReply(&server_, &rsp6));
+  DNSPacket rsp4;
+  rsp4.set_response().set_aa()
+    .add_question(new DNSQuestion("example.com", ns_t_a))
+    .add_answer(new DNSARR("example.com", 100, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("example.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp4));
+  AddrInfoResult result;
+  struct ares_addrinfo_hints hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_flags = ARES_AI_NOSORT;
+  ares_getaddrinfo(channel_, "example.com.", NULL, &hints,
+                   AddrInfoCallback, &result);
+  Process();
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(ARES_SUCCESS, result.status_);
+  EXPECT_THAT(result.ai_, IncludesNumAddresses(1));
+  EXPECT_THAT(result.ai_, IncludesV4Address("2.3.4.5"));
+}
+
+TEST_P(MockChannelTestAI, FamilyUnspecifiedNoA) {
+  DNSPacket rsp6;
+  rsp6.set_response().set_aa()
+    .add_question(new DNSQuestion("example.com", ns_t_aaaa))
+    .add_answer(new DNSAaaaRR("example.com", 100,
+                              {0x21, 0x21, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+                               0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03, 0x03}));
+  ON_CALL(server_, OnRequest("example.com", ns_t_aaaa))
+    .WillByDefault(SetReply(&server_, &rsp6));
+  DNSPacket rsp4;
+  rsp4.set_response().set_aa()
+    .add_question(new DNSQuestion("example.com", ns_t_a));
+  ON_CALL(server_, OnRequest("example.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp4));
+  AddrInfoResult result;
+  struct ares_addrinfo_hints hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_flags = ARES_AI_NOSORT;
+  ares_getaddrinfo(channel_, "example.com.", NULL, &hints,
+                   AddrInfoCallback, &result);
+  Process();
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(ARES_SUCCESS, result.status_);
+  EXPECT_THAT(result.ai_, IncludesNumAddresses(1));
+  EXPECT_THAT(result.ai_, IncludesV6Address("2121:0000:0000:0000:0000:0000:0000:0303"));
+}
+
 class MockEDNSChannelTestAI : public MockFlagsChannelOptsTestAI {
  public:
   MockEDNSChannelTestAI() : MockFlagsChannelOptsTestAI(ARES_FLAG_EDNS) {}
@@ -666,6 +876,33 @@ TEST_P(NoRotateMultiMockTestAI, ThirdServer) {
   CheckExample();
 }
 
+TEST_P(MockChannelTestAI, CancelOneLookup) {
+  ON_CALL(server_, OnRequest("example.com", ns_t_a))
+    .WillByDefault(SetReplyData(&server_, std::vector<byte>()));
+  ON_CALL(server_, OnRequest("example.com", ns_t_aaaa))
+    .WillByDefault(SetReplyData(&server_, std::vector<byte>()));
+
+  AddrInfoResult result;
+  struct ares_addrinfo_hints hints = {};
+  hints.ai_family = AF_UNSPEC;
+  ares_handle handle = ares_getaddrinfo_handle(channel_, "example.com.", NULL,
+                                               &hints, AddrInfoCallback, &result);
+  EXPECT_NE(nullptr, handle);
+  ares_cancel_query(handle);
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(ARES_ECANCELLED, result.status_);
+  EXPECT_EQ(nullptr, result.ai_);
+
+  // A lookup that completes at once leaves nothing to cancel.
+  AddrInfoResult result2;
+  hints.ai_family = AF_INET;
+  handle = ares_getaddrinfo_handle(channel_, "1.2.3.4", NULL, &hints,
+                                   AddrInfoCallback, &result2);
+  EXPECT_EQ(nullptr, handle);
+  EXPECT_TRUE(result2.done_);
+  EXPECT_EQ(ARES_SUCCESS, result2.status_);
+}
+
 TEST_P(MockChannelTestAI, FamilyV4ServiceName) {
   DNSPacket rsp4;
   rsp4.set_response().set_aa()
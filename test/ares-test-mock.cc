@@ -1,7 +1,10 @@
 #include "ares-test.h"
 #include "dns-proto.h"
 
+#include <chrono>
+#include <map>
 #include <sstream>
+#include <thread>
 #include <vector>
 
 using testing::InvokeWithoutArgs;
@@ -86,6 +89,133 @@ TEST_P(MockUDPChannelTest, GetHostByNameParallelLookups) {
   EXPECT_EQ("{'www.google.com' aliases=[] addrs=[2.3.4.5]}", ss3.str());
 }
 
+TEST_P(MockUDPChannelTest, ReadQueuedAnswers) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp));
+
+  const int count = 8;
+  HostResult results[count];
+  for (int ii = 0; ii < count; ii++) {
+    ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback,
+                       &results[ii]);
+  }
+
+  // Let the server answer every request before the library reads anything,
+  // so that all the answers are queued on the one UDP socket.
+  for (int fd : server_.fds()) {
+    int type = 0;
+    ares_socklen_t len = sizeof(type);
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, (char*)&type, &len) == 0 &&
+        type == SOCK_DGRAM) {
+      for (int ii = 0; ii < count; ii++) server_.ProcessFD(fd);
+    }
+  }
+  ares_socket_t socks[ARES_GETSOCK_MAXNUM];
+  int bitmask = ares_getsock(channel_, socks, ARES_GETSOCK_MAXNUM);
+  ASSERT_TRUE(ARES_GETSOCK_READABLE(bitmask, 0));
+  ares_process_fd(channel_, socks[0], ARES_SOCKET_BAD);
+
+  for (int ii = 0; ii < count; ii++) {
+    EXPECT_TRUE(results[ii].done_);
+    EXPECT_EQ(ARES_SUCCESS, results[ii].status_);
+  }
+  unsigned long calls = 0;
+  unsigned long packets = 0;
+  EXPECT_EQ(ARES_SUCCESS,
+            ares_get_stat(channel_, ARES_STAT_UDP_RECV_CALLS, &calls));
+  EXPECT_EQ(ARES_SUCCESS,
+            ares_get_stat(channel_, ARES_STAT_UDP_RECV_PACKETS, &packets));
+  EXPECT_EQ(count, packets);
+#ifdef HAVE_RECVMMSG
+  EXPECT_EQ(1, calls);
+#else
+  EXPECT_EQ(count + 1, calls);
+#endif
+  EXPECT_EQ(ARES_ENOTIMP, ares_get_stat(channel_, -1, &calls));
+}
+
+// Microbenchmark of how many answers per second the library can match to
+// their queries and deliver; run with --gtest_also_run_disabled_tests.
+// Answers are queued on the socket before the clock starts, so the time
+// taken is that of reading and processing them.
+TEST_P(MockUDPChannelTest, DISABLED_AnswerThroughput) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp));
+
+  const int rounds = 500;
+  const int batch = 64;
+  double elapsed = 0.0;
+  for (int round = 0; round < rounds; round++) {
+    HostResult results[batch];
+    for (int ii = 0; ii < batch; ii++) {
+      ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback,
+                         &results[ii]);
+    }
+    for (int fd : server_.fds()) {
+      int type = 0;
+      ares_socklen_t len = sizeof(type);
+      if (getsockopt(fd, SOL_SOCKET, SO_TYPE, (char*)&type, &len) == 0 &&
+          type == SOCK_DGRAM) {
+        for (int ii = 0; ii < batch; ii++) server_.ProcessFD(fd);
+      }
+    }
+    ares_socket_t socks[ARES_GETSOCK_MAXNUM];
+    int bitmask = ares_getsock(channel_, socks, ARES_GETSOCK_MAXNUM);
+    ASSERT_TRUE(ARES_GETSOCK_READABLE(bitmask, 0));
+
+    auto start = std::chrono::steady_clock::now();
+    ares_process_fd(channel_, socks[0], ARES_SOCKET_BAD);
+    elapsed += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    for (int ii = 0; ii < batch; ii++) {
+      ASSERT_TRUE(results[ii].done_);
+    }
+  }
+  std::cerr << "Processed " << (rounds * batch) << " answers in " << elapsed
+            << "s: " << (rounds * batch / elapsed) << " answers/s" << std::endl;
+}
+
+TEST_P(MockUDPChannelTest, ReuseQueryMemory) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp));
+
+  HostResult result1;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result1);
+  Process();
+  EXPECT_TRUE(result1.done_);
+  unsigned long hits = 0;
+  unsigned long misses = 0;
+  EXPECT_EQ(ARES_SUCCESS, ares_get_stat(channel_, ARES_STAT_POOL_HITS, &hits));
+  EXPECT_EQ(ARES_SUCCESS, ares_get_stat(channel_, ARES_STAT_POOL_MISSES, &misses));
+  EXPECT_EQ(0, hits);
+  EXPECT_LT(0, misses);
+
+  // The second query is served entirely from memory the first one freed.
+  HostResult result2;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result2);
+  Process();
+  EXPECT_TRUE(result2.done_);
+  EXPECT_EQ(ARES_SUCCESS, result2.status_);
+  unsigned long misses2 = 0;
+  EXPECT_EQ(ARES_SUCCESS, ares_get_stat(channel_, ARES_STAT_POOL_HITS, &hits));
+  EXPECT_EQ(ARES_SUCCESS, ares_get_stat(channel_, ARES_STAT_POOL_MISSES, &misses2));
+  EXPECT_EQ(misses, misses2);
+  EXPECT_EQ(misses, hits);
+}
+
 // UDP to TCP specific test
 TEST_P(MockUDPChannelTest, TruncationRetry) {
   DNSPacket rsptruncated;
@@ -413,183 +543,1182 @@ TEST_P(MockEDNSChannelTest, RetryWithoutEDNS) {
   EXPECT_EQ("{'www.google.com' aliases=[] addrs=[1.2.3.4]}", ss.str());
 }
 
-TEST_P(MockChannelTest, SearchDomains) {
-  DNSPacket nofirst;
-  nofirst.set_response().set_aa().set_rcode(ns_r_nxdomain)
-    .add_question(new DNSQuestion("www.first.com", ns_t_a));
-  ON_CALL(server_, OnRequest("www.first.com", ns_t_a))
-    .WillByDefault(SetReply(&server_, &nofirst));
-  DNSPacket nosecond;
-  nosecond.set_response().set_aa().set_rcode(ns_r_nxdomain)
-    .add_question(new DNSQuestion("www.second.org", ns_t_a));
-  ON_CALL(server_, OnRequest("www.second.org", ns_t_a))
-    .WillByDefault(SetReply(&server_, &nosecond));
-  DNSPacket yesthird;
-  yesthird.set_response().set_aa()
-    .add_question(new DNSQuestion("www.third.gov", ns_t_a))
-    .add_answer(new DNSARR("www.third.gov", 0x0200, {2, 3, 4, 5}));
-  ON_CALL(server_, OnRequest("www.third.gov", ns_t_a))
-    .WillByDefault(SetReply(&server_, &yesthird));
+class MockDeferSendChannelTest : public MockFlagsChannelOptsTest {
+ public:
+  MockDeferSendChannelTest() : MockFlagsChannelOptsTest(ARES_FLAG_DEFERSEND) {}
+};
 
-  HostResult result;
-  ares_gethostbyname(channel_, "www", AF_INET, HostCallback, &result);
-  Process();
-  EXPECT_TRUE(result.done_);
-  std::stringstream ss;
-  ss << result.host_;
-  EXPECT_EQ("{'www.third.gov' aliases=[] addrs=[2.3.4.5]}", ss.str());
-}
+TEST_P(MockDeferSendChannelTest, SendTogether) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp));
 
-// Relies on retries so is UDP-only
-TEST_P(MockUDPChannelTest, SearchDomainsWithResentReply) {
-  DNSPacket nofirst;
-  nofirst.set_response().set_aa().set_rcode(ns_r_nxdomain)
-    .add_question(new DNSQuestion("www.first.com", ns_t_a));
-  EXPECT_CALL(server_, OnRequest("www.first.com", ns_t_a))
-    .WillOnce(SetReply(&server_, &nofirst));
-  DNSPacket nosecond;
-  nosecond.set_response().set_aa().set_rcode(ns_r_nxdomain)
-    .add_question(new DNSQuestion("www.second.org", ns_t_a));
-  EXPECT_CALL(server_, OnRequest("www.second.org", ns_t_a))
-    .WillOnce(SetReply(&server_, &nosecond));
-  DNSPacket yesthird;
-  yesthird.set_response().set_aa()
-    .add_question(new DNSQuestion("www.third.gov", ns_t_a))
-    .add_answer(new DNSARR("www.third.gov", 0x0200, {2, 3, 4, 5}));
-  // Before sending the real answer, resend an earlier reply
-  EXPECT_CALL(server_, OnRequest("www.third.gov", ns_t_a))
-    .WillOnce(DoAll(SetReply(&server_, &nofirst),
-                    SetReplyQID(&server_, 123)))
-    .WillOnce(DoAll(SetReply(&server_, &yesthird),
-                    SetReplyQID(&server_, -1)));
+  const int count = 8;
+  HostResult results[count];
+  for (int ii = 0; ii < count; ii++) {
+    ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback,
+                       &results[ii]);
+  }
+
+  // Nothing goes out until the library is asked what to wait for.
+  unsigned long calls = 0;
+  unsigned long packets = 0;
+  EXPECT_EQ(ARES_SUCCESS,
+            ares_get_stat(channel_, ARES_STAT_UDP_SEND_CALLS, &calls));
+  EXPECT_EQ(0, calls);
 
-  HostResult result;
-  ares_gethostbyname(channel_, "www", AF_INET, HostCallback, &result);
   Process();
-  EXPECT_TRUE(result.done_);
-  std::stringstream ss;
-  ss << result.host_;
-  EXPECT_EQ("{'www.third.gov' aliases=[] addrs=[2.3.4.5]}", ss.str());
+  for (int ii = 0; ii < count; ii++) {
+    EXPECT_TRUE(results[ii].done_);
+    EXPECT_EQ(ARES_SUCCESS, results[ii].status_);
+  }
+  EXPECT_EQ(ARES_SUCCESS,
+            ares_get_stat(channel_, ARES_STAT_UDP_SEND_CALLS, &calls));
+  EXPECT_EQ(ARES_SUCCESS,
+            ares_get_stat(channel_, ARES_STAT_UDP_SEND_PACKETS, &packets));
+  EXPECT_EQ(count, packets);
+#ifdef HAVE_SENDMMSG
+  EXPECT_EQ(1, calls);
+#else
+  EXPECT_EQ(count, calls);
+#endif
 }
 
-TEST_P(MockChannelTest, SearchDomainsBare) {
-  DNSPacket nofirst;
-  nofirst.set_response().set_aa().set_rcode(ns_r_nxdomain)
-    .add_question(new DNSQuestion("www.first.com", ns_t_a));
-  ON_CALL(server_, OnRequest("www.first.com", ns_t_a))
-    .WillByDefault(SetReply(&server_, &nofirst));
-  DNSPacket nosecond;
-  nosecond.set_response().set_aa().set_rcode(ns_r_nxdomain)
-    .add_question(new DNSQuestion("www.second.org", ns_t_a));
-  ON_CALL(server_, OnRequest("www.second.org", ns_t_a))
-    .WillByDefault(SetReply(&server_, &nosecond));
-  DNSPacket nothird;
-  nothird.set_response().set_aa().set_rcode(ns_r_nxdomain)
-    .add_question(new DNSQuestion("www.third.gov", ns_t_a));
-  ON_CALL(server_, OnRequest("www.third.gov", ns_t_a))
-    .WillByDefault(SetReply(&server_, &nothird));
-  DNSPacket yesbare;
-  yesbare.set_response().set_aa()
-    .add_question(new DNSQuestion("www", ns_t_a))
-    .add_answer(new DNSARR("www", 0x0200, {2, 3, 4, 5}));
-  ON_CALL(server_, OnRequest("www", ns_t_a))
-    .WillByDefault(SetReply(&server_, &yesbare));
-
+TEST_P(MockDeferSendChannelTest, CancelBeforeSend) {
   HostResult result;
-  ares_gethostbyname(channel_, "www", AF_INET, HostCallback, &result);
-  Process();
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result);
+  ares_cancel(channel_);
   EXPECT_TRUE(result.done_);
-  std::stringstream ss;
-  ss << result.host_;
-  EXPECT_EQ("{'www' aliases=[] addrs=[2.3.4.5]}", ss.str());
+  EXPECT_EQ(ARES_ECANCELLED, result.status_);
+
+  Process();
+  unsigned long calls = 0;
+  EXPECT_EQ(ARES_SUCCESS,
+            ares_get_stat(channel_, ARES_STAT_UDP_SEND_CALLS, &calls));
+  EXPECT_EQ(0, calls);
 }
 
-TEST_P(MockChannelTest, SearchNoDataThenSuccess) {
-  // First two search domains recognize the name but have no A records.
-  DNSPacket nofirst;
-  nofirst.set_response().set_aa()
-    .add_question(new DNSQuestion("www.first.com", ns_t_a));
-  ON_CALL(server_, OnRequest("www.first.com", ns_t_a))
-    .WillByDefault(SetReply(&server_, &nofirst));
-  DNSPacket nosecond;
-  nosecond.set_response().set_aa()
-    .add_question(new DNSQuestion("www.second.org", ns_t_a));
-  ON_CALL(server_, OnRequest("www.second.org", ns_t_a))
-    .WillByDefault(SetReply(&server_, &nosecond));
-  DNSPacket yesthird;
-  yesthird.set_response().set_aa()
-    .add_question(new DNSQuestion("www.third.gov", ns_t_a))
-    .add_answer(new DNSARR("www.third.gov", 0x0200, {2, 3, 4, 5}));
-  ON_CALL(server_, OnRequest("www.third.gov", ns_t_a))
-    .WillByDefault(SetReply(&server_, &yesthird));
+class MockUDPPoolTest
+    : public MockChannelOptsTest,
+      public ::testing::WithParamInterface<int> {
+ public:
+  MockUDPPoolTest(int pool_size, int max_queries)
+    : MockChannelOptsTest(1, GetParam(), false,
+                          FillOptions(&opts_, pool_size, max_queries),
+                          ARES_OPT_UDP_POOL|ARES_OPT_UDP_MAX_QUERIES) {}
+  static struct ares_options* FillOptions(struct ares_options * opts,
+                                          int pool_size, int max_queries) {
+    memset(opts, 0, sizeof(struct ares_options));
+    opts->udp_pool_size = pool_size;
+    opts->udp_max_queries = max_queries;
+    return opts;
+  }
+  int CountSockets() {
+    ares_socket_t socks[ARES_GETSOCK_MAXNUM];
+    int bitmask = ares_getsock(channel_, socks, ARES_GETSOCK_MAXNUM);
+    int count = 0;
+    for (int ii = 0; ii < ARES_GETSOCK_MAXNUM; ii++) {
+      if (ARES_GETSOCK_READABLE(bitmask, ii)) count++;
+    }
+    return count;
+  }
+  void SendQueries(HostResult *results, int count) {
+    rsp_.set_response().set_aa()
+      .add_question(new DNSQuestion("www.google.com", ns_t_a))
+      .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+    ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
+      .WillByDefault(SetReply(&server_, &rsp_));
+    for (int ii = 0; ii < count; ii++) {
+      ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback,
+                         &results[ii]);
+    }
+  }
+ private:
+  struct ares_options opts_;
+  DNSPacket rsp_;
+};
+
+class MockUDPPoolSizeTest : public MockUDPPoolTest {
+ public:
+  MockUDPPoolSizeTest() : MockUDPPoolTest(4, 0) {}
+};
+
+TEST_P(MockUDPPoolSizeTest, SpreadOverSockets) {
+  const int count = 12;
+  HostResult results[count];
+  SendQueries(results, count);
+  EXPECT_EQ(4, CountSockets());
 
-  HostResult result;
-  ares_gethostbyname(channel_, "www", AF_INET, HostCallback, &result);
   Process();
-  EXPECT_TRUE(result.done_);
-  std::stringstream ss;
-  ss << result.host_;
-  EXPECT_EQ("{'www.third.gov' aliases=[] addrs=[2.3.4.5]}", ss.str());
+  for (int ii = 0; ii < count; ii++) {
+    EXPECT_TRUE(results[ii].done_);
+    EXPECT_EQ(ARES_SUCCESS, results[ii].status_);
+  }
 }
 
-TEST_P(MockChannelTest, SearchNoDataThenNoDataBare) {
-  // First two search domains recognize the name but have no A records.
-  DNSPacket nofirst;
-  nofirst.set_response().set_aa()
-    .add_question(new DNSQuestion("www.first.com", ns_t_a));
-  ON_CALL(server_, OnRequest("www.first.com", ns_t_a))
-    .WillByDefault(SetReply(&server_, &nofirst));
-  DNSPacket nosecond;
-  nosecond.set_response().set_aa()
-    .add_question(new DNSQuestion("www.second.org", ns_t_a));
-  ON_CALL(server_, OnRequest("www.second.org", ns_t_a))
-    .WillByDefault(SetReply(&server_, &nosecond));
-  DNSPacket nothird;
-  nothird.set_response().set_aa()
-    .add_question(new DNSQuestion("www.third.gov", ns_t_a));
-  ON_CALL(server_, OnRequest("www.third.gov", ns_t_a))
-    .WillByDefault(SetReply(&server_, &nothird));
-  DNSPacket nobare;
-  nobare.set_response().set_aa()
-    .add_question(new DNSQuestion("www", ns_t_a));
-  ON_CALL(server_, OnRequest("www", ns_t_a))
-    .WillByDefault(SetReply(&server_, &nobare));
+class MockUDPMaxQueriesTest : public MockUDPPoolTest {
+ public:
+  MockUDPMaxQueriesTest() : MockUDPPoolTest(1, 1) {}
+};
+
+TEST_P(MockUDPMaxQueriesTest, RotateSockets) {
+  const int count = 3;
+  HostResult results[count];
+  SendQueries(results, count);
+  // Each query retires its socket, so every one gets a new source port.
+  EXPECT_EQ(count, CountSockets());
 
-  HostResult result;
-  ares_gethostbyname(channel_, "www", AF_INET, HostCallback, &result);
   Process();
-  EXPECT_TRUE(result.done_);
-  EXPECT_EQ(ARES_ENODATA, result.status_);
+  for (int ii = 0; ii < count; ii++) {
+    EXPECT_TRUE(results[ii].done_);
+    EXPECT_EQ(ARES_SUCCESS, results[ii].status_);
+  }
 }
 
-TEST_P(MockChannelTest, SearchNoDataThenFail) {
-  // First two search domains recognize the name but have no A records.
-  DNSPacket nofirst;
-  nofirst.set_response().set_aa()
-    .add_question(new DNSQuestion("www.first.com", ns_t_a));
-  ON_CALL(server_, OnRequest("www.first.com", ns_t_a))
-    .WillByDefault(SetReply(&server_, &nofirst));
-  DNSPacket nosecond;
-  nosecond.set_response().set_aa()
-    .add_question(new DNSQuestion("www.second.org", ns_t_a));
-  ON_CALL(server_, OnRequest("www.second.org", ns_t_a))
-    .WillByDefault(SetReply(&server_, &nosecond));
-  DNSPacket nothird;
-  nothird.set_response().set_aa()
-    .add_question(new DNSQuestion("www.third.gov", ns_t_a));
-  ON_CALL(server_, OnRequest("www.third.gov", ns_t_a))
-    .WillByDefault(SetReply(&server_, &nothird));
-  DNSPacket nobare;
-  nobare.set_response().set_aa().set_rcode(ns_r_nxdomain)
-    .add_question(new DNSQuestion("www", ns_t_a));
-  ON_CALL(server_, OnRequest("www", ns_t_a))
-    .WillByDefault(SetReply(&server_, &nobare));
+class MockQidSpaceTest : public MockUDPPoolTest {
+ public:
+  MockQidSpaceTest() : MockUDPPoolTest(1, 0) {}
+  static void CountCallback(void *data, int status, int timeouts,
+                            unsigned char *abuf, int alen) {
+    std::map<int, int> *statuses = (std::map<int, int>*)data;
+    (*statuses)[status]++;
+  }
+  // Let the server read whatever requests have reached it.
+  void DrainServer() {
+    while (true) {
+      fd_set readers;
+      FD_ZERO(&readers);
+      int nfds = 0;
+      std::set<int> serverfds = fds();
+      for (int fd : serverfds) {
+        FD_SET(fd, &readers);
+        if (fd >= nfds) nfds = fd + 1;
+      }
+      struct timeval tv = {0, 0};
+      if (select(nfds, &readers, nullptr, nullptr, &tv) <= 0) return;
+      for (int fd : serverfds) {
+        if (FD_ISSET(fd, &readers)) ProcessFD(fd);
+      }
+    }
+  }
+  // Process the channel and the server until the result is in, as other
+  // queries stay in flight.
+  void ProcessUntilDone(HostResult *result) {
+    while (!result->done_) {
+      fd_set readers, writers;
+      FD_ZERO(&readers);
+      FD_ZERO(&writers);
+      int nfds = ares_fds(channel_, &readers, &writers);
+      std::set<int> serverfds = fds();
+      for (int fd : serverfds) {
+        FD_SET(fd, &readers);
+        if (fd >= nfds) nfds = fd + 1;
+      }
+      struct timeval tv;
+      tv.tv_sec = 0;
+      tv.tv_usec = 100000;
+      ASSERT_LE(0, select(nfds, &readers, &writers, nullptr, &tv));
+      ares_process(channel_, &readers, &writers);
+      for (int fd : serverfds) {
+        if (FD_ISSET(fd, &readers)) ProcessFD(fd);
+      }
+    }
+  }
+};
 
+TEST_P(MockQidSpaceTest, MoreThan64KInFlight) {
+  // Use up every query id on the one socket with queries that the server
+  // does not answer.
+  DNSPacket req;
+  req.set_rd().add_question(new DNSQuestion("hang.example.com", ns_t_a));
+  std::vector<byte> qbuf = req.data();
+  std::map<int, int> statuses;
+  const int count = 65536;
+  for (int id = 0; id < count; id++) {
+    qbuf[0] = (byte)(id >> 8);
+    qbuf[1] = (byte)(id & 0xff);
+    ares_send(channel_, qbuf.data(), qbuf.size(), CountCallback, &statuses);
+  }
+  EXPECT_EQ(1, CountSockets());
+  DrainServer();
+
+  // One more query still goes out, on a socket of its own, and its answer
+  // is told apart from the queries with the same id on the first socket.
   HostResult result;
-  ares_gethostbyname(channel_, "www", AF_INET, HostCallback, &result);
-  Process();
-  EXPECT_TRUE(result.done_);
-  EXPECT_EQ(ARES_ENODATA, result.status_);
+  SendQueries(&result, 1);
+  EXPECT_EQ(2, CountSockets());
+  ProcessUntilDone(&result);
+  EXPECT_EQ(ARES_SUCCESS, result.status_);
+  std::stringstream ss;
+  ss << result.host_;
+  EXPECT_EQ("{'www.google.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
+  EXPECT_EQ(0, statuses.size());
+
+  ares_cancel(channel_);
+  EXPECT_EQ(1, statuses.size());
+  EXPECT_EQ(count, statuses[ARES_ECANCELLED]);
+}
+
+class MockMemoryTest
+    : public MockChannelOptsTest,
+      public ::testing::WithParamInterface<int> {
+ public:
+  MockMemoryTest()
+    : MockChannelOptsTest(1, GetParam(), false, FillOptions(&opts_),
+                          ARES_OPT_POOL_MAX_FREE) {}
+  static struct ares_options* FillOptions(struct ares_options * opts) {
+    memset(opts, 0, sizeof(struct ares_options));
+    opts->pool_max_free = 0;
+    return opts;
+  }
+  unsigned long Memory() {
+    unsigned long value = 0;
+    EXPECT_EQ(ARES_SUCCESS,
+              ares_get_stat(channel_, ARES_STAT_MEMORY_BYTES, &value));
+    return value;
+  }
+  // Send a burst of queries and return the memory held while they are in
+  // flight.  Each has an id of its own, so that they all fit on the one
+  // socket and every burst takes the same memory.
+  unsigned long Burst(int count) {
+    std::vector<SearchResult> results(count);
+    for (int ii = 0; ii < count; ii++) {
+      DNSPacket req;
+      req.set_qid(ii).set_rd()
+        .add_question(new DNSQuestion("www.google.com", ns_t_a));
+      std::vector<byte> qbuf = req.data();
+      ares_send(channel_, qbuf.data(), (int)qbuf.size(), SearchCallback,
+                &results[ii]);
+    }
+    unsigned long busy = Memory();
+    Process();
+    for (const auto& result : results) {
+      EXPECT_TRUE(result.done_);
+      EXPECT_EQ(ARES_SUCCESS, result.status_);
+    }
+    return busy;
+  }
+ private:
+  struct ares_options opts_;
+};
+
+TEST_P(MockMemoryTest, ShrinksWhenIdle) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp));
+
+  unsigned long idle = Memory();
+
+  // Memory grows with the queries in flight, and what indexes them is
+  // given back once they have been answered.
+  const int count = 200;
+  unsigned long busy = Burst(count);
+  EXPECT_LT(idle + count * sizeof(void*), busy);
+  unsigned long after = Memory();
+  EXPECT_GT(busy, after);
+  EXPECT_GT(idle + 1024, after);
+
+  // Another burst leaves the channel as it was.
+  EXPECT_EQ(busy, Burst(count));
+  EXPECT_EQ(after, Memory());
+
+  unsigned long value;
+  EXPECT_EQ(ARES_ENOTIMP,
+            ares_get_stat(channel_, ARES_STAT_MEMORY_BYTES + 1, &value));
+}
+
+class MockSubmitTest
+    : public MockChannelOptsTest,
+      public ::testing::WithParamInterface<int> {
+ public:
+  MockSubmitTest()
+    : MockChannelOptsTest(1, GetParam(), false, FillOptions(&opts_),
+                          ARES_OPT_SUBMIT_QUEUE) {}
+  static struct ares_options* FillOptions(struct ares_options * opts) {
+    memset(opts, 0, sizeof(struct ares_options));
+    opts->submit_queue_size = 64;
+    return opts;
+  }
+  bool SubmitFdReadable() {
+    ares_socket_t fd = ares_submit_fd(channel_);
+    fd_set readers;
+    FD_ZERO(&readers);
+    FD_SET(fd, &readers);
+    struct timeval tv = {0, 0};
+    return select(fd + 1, &readers, nullptr, nullptr, &tv) == 1;
+  }
+ private:
+  struct ares_options opts_;
+};
+
+TEST_P(MockSubmitTest, FromThreads) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp));
+  DNSPacket req;
+  req.set_rd().add_question(new DNSQuestion("www.google.com", ns_t_a));
+  std::vector<byte> qbuf = req.data();
+
+  ASSERT_NE(ARES_SOCKET_BAD, ares_submit_fd(channel_));
+  EXPECT_FALSE(SubmitFdReadable());
+
+  const int nthreads = 4;
+  const int count = 8;
+  std::vector<SearchResult> results(nthreads * count);
+  std::vector<std::thread> threads;
+  for (int tt = 0; tt < nthreads; tt++) {
+    threads.emplace_back([&, tt]() {
+      for (int ii = 0; ii < count; ii++) {
+        EXPECT_EQ(ARES_SUCCESS,
+                  ares_submit_send(channel_, qbuf.data(), (int)qbuf.size(),
+                                   SearchCallback, &results[tt * count + ii]));
+      }
+    });
+  }
+  for (auto& thread : threads) thread.join();
+
+  // Nothing is started until the thread processing the channel, woken up
+  // by the descriptor, gets to it.
+  for (const auto& result : results) EXPECT_FALSE(result.done_);
+  EXPECT_TRUE(SubmitFdReadable());
+  ares_process_fd(channel_, ares_submit_fd(channel_), ARES_SOCKET_BAD);
+  EXPECT_FALSE(SubmitFdReadable());
+  Process();
+  for (const auto& result : results) {
+    EXPECT_TRUE(result.done_);
+    EXPECT_EQ(ARES_SUCCESS, result.status_);
+  }
+}
+
+TEST_P(MockSubmitTest, QueueFullAndCancel) {
+  DNSPacket req;
+  req.set_rd().add_question(new DNSQuestion("www.google.com", ns_t_a));
+  std::vector<byte> qbuf = req.data();
+
+  std::vector<SearchResult> results(64);
+  for (auto& result : results) {
+    EXPECT_EQ(ARES_SUCCESS,
+              ares_submit_send(channel_, qbuf.data(), (int)qbuf.size(),
+                               SearchCallback, &result));
+  }
+  SearchResult extra = {};
+  EXPECT_EQ(ARES_ENOMEM,
+            ares_submit_send(channel_, qbuf.data(), (int)qbuf.size(),
+                             SearchCallback, &extra));
+  AddrInfoResult airesult;
+  struct ares_addrinfo_hints hints = {};
+  hints.ai_family = AF_INET;
+  EXPECT_EQ(ARES_ENOMEM,
+            ares_submit_getaddrinfo(channel_, "www.google.com.", nullptr,
+                                    &hints, AddrInfoCallback, &airesult));
+
+  // Cancelling the channel fails what is queued without sending it.
+  ares_cancel(channel_);
+  for (const auto& result : results) {
+    EXPECT_TRUE(result.done_);
+    EXPECT_EQ(ARES_ECANCELLED, result.status_);
+  }
+  EXPECT_FALSE(extra.done_);
+  EXPECT_FALSE(airesult.done_);
+  EXPECT_FALSE(SubmitFdReadable());
+
+  EXPECT_EQ(ARES_SUCCESS,
+            ares_submit_getaddrinfo(channel_, "www.google.com.", nullptr,
+                                    &hints, AddrInfoCallback, &airesult));
+  ares_cancel(channel_);
+  EXPECT_TRUE(airesult.done_);
+  EXPECT_EQ(ARES_ECANCELLED, airesult.status_);
+}
+
+TEST_P(MockSubmitTest, ResolverSpreadsNames) {
+  const int nnames = 8;
+  DNSPacket rsps[nnames];
+  std::vector<std::vector<byte>> qbufs;
+  for (int ii = 0; ii < nnames; ii++) {
+    std::string name = "host" + std::to_string(ii) + ".example.com";
+    rsps[ii].set_response().set_aa()
+      .add_question(new DNSQuestion(name, ns_t_a))
+      .add_answer(new DNSARR(name, 100, {2, 3, 4, (byte)ii}));
+    ON_CALL(server_, OnRequest(name, ns_t_a))
+      .WillByDefault(SetReply(&server_, &rsps[ii]));
+    DNSPacket req;
+    req.set_rd().add_question(new DNSQuestion(name, ns_t_a));
+    qbufs.push_back(req.data());
+  }
+
+  ares_resolver resolver = nullptr;
+  EXPECT_EQ(ARES_ENODATA, ares_resolver_init(&resolver, nullptr, 4));
+  ASSERT_EQ(ARES_SUCCESS, ares_resolver_init(&resolver, channel_, 4));
+  EXPECT_EQ(4, ares_resolver_nchannels(resolver));
+  EXPECT_EQ(nullptr, ares_resolver_channel(resolver, 4));
+  auto queued = [&]() {
+    int count = 0;
+    for (int ii = 0; ii < 4; ii++) {
+      ares_socket_t fd = ares_submit_fd(ares_resolver_channel(resolver, ii));
+      fd_set readers;
+      FD_ZERO(&readers);
+      FD_SET(fd, &readers);
+      struct timeval tv = {0, 0};
+      if (select(fd + 1, &readers, nullptr, nullptr, &tv) == 1) count++;
+    }
+    return count;
+  };
+
+  // The same name, whatever its case, goes to the same channel.
+  std::vector<SearchResult> results(nnames + 1);
+  EXPECT_EQ(ARES_SUCCESS,
+            ares_resolver_send(resolver, qbufs[0].data(), (int)qbufs[0].size(),
+                               SearchCallback, &results[0]));
+  DNSPacket upper;
+  upper.set_rd().add_question(new DNSQuestion("HOST0.Example.COM", ns_t_a));
+  std::vector<byte> upperbuf = upper.data();
+  EXPECT_EQ(ARES_SUCCESS,
+            ares_resolver_send(resolver, upperbuf.data(), (int)upperbuf.size(),
+                               SearchCallback, &results[nnames]));
+  EXPECT_EQ(1, queued());
+  for (int ii = 1; ii < nnames; ii++) {
+    EXPECT_EQ(ARES_SUCCESS,
+              ares_resolver_send(resolver, qbufs[ii].data(),
+                                 (int)qbufs[ii].size(), SearchCallback,
+                                 &results[ii]));
+  }
+  EXPECT_LT(1, queued());
+
+  for (int ii = 0; ii < 4; ii++) {
+    ares_channel channel = ares_resolver_channel(resolver, ii);
+    ares_process_fds(channel, nullptr, 0, 0);
+    ProcessWork(channel, [this]() { return fds(); },
+                [this](int fd) { ProcessFD(fd); });
+  }
+  for (const auto& result : results) {
+    EXPECT_TRUE(result.done_);
+    EXPECT_EQ(ARES_SUCCESS, result.status_);
+  }
+  unsigned long packets = 0;
+  EXPECT_EQ(ARES_SUCCESS,
+            ares_resolver_get_stat(resolver, ARES_STAT_UDP_SEND_PACKETS,
+                                   &packets));
+  EXPECT_EQ(nnames + 1, packets);
+  // Working out the memory walks each channel, so it is left to them.
+  EXPECT_EQ(ARES_ENOTIMP,
+            ares_resolver_get_stat(resolver, ARES_STAT_MEMORY_BYTES,
+                                   &packets));
+  ares_resolver_destroy(resolver);
+}
+
+TEST_P(MockSubmitTest, ResolverSpillsWhenFull) {
+  DNSPacket req;
+  req.set_rd().add_question(new DNSQuestion("www.google.com", ns_t_a));
+  std::vector<byte> qbuf = req.data();
+
+  ares_resolver resolver = nullptr;
+  ASSERT_EQ(ARES_SUCCESS, ares_resolver_init(&resolver, channel_, 2));
+
+  // Once the queue of its channel is full, the name goes to the other one.
+  std::vector<SearchResult> results(128);
+  for (auto& result : results) {
+    EXPECT_EQ(ARES_SUCCESS,
+              ares_resolver_send(resolver, qbuf.data(), (int)qbuf.size(),
+                                 SearchCallback, &result));
+  }
+  SearchResult extra = {};
+  EXPECT_EQ(ARES_ENOMEM,
+            ares_resolver_send(resolver, qbuf.data(), (int)qbuf.size(),
+                               SearchCallback, &extra));
+
+  ares_resolver_destroy(resolver);
+  for (const auto& result : results) {
+    EXPECT_TRUE(result.done_);
+    EXPECT_EQ(ARES_EDESTRUCTION, result.status_);
+  }
+  EXPECT_FALSE(extra.done_);
+}
+
+// Microbenchmark of how many requests per second producer threads can hand
+// to the thread processing the channel; run with
+// --gtest_also_run_disabled_tests.  The channel has no servers, so each
+// request fails as soon as it is started and only the hand-over is timed.
+TEST_P(MockSubmitTest, DISABLED_SubmitThroughput) {
+  EXPECT_EQ(ARES_SUCCESS, ares_set_servers(channel_, nullptr));
+  DNSPacket req;
+  req.set_rd().add_question(new DNSQuestion("www.google.com", ns_t_a));
+  std::vector<byte> qbuf = req.data();
+
+  const int total = 256 * 1024;
+  for (int nthreads = 1; nthreads <= 64; nthreads *= 2) {
+    int done = 0;
+    ares_callback callback = [](void *arg, int, int, unsigned char *, int) {
+      (*reinterpret_cast<int*>(arg))++;
+    };
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int tt = 0; tt < nthreads; tt++) {
+      threads.emplace_back([&]() {
+        for (int ii = 0; ii < total / nthreads; ii++) {
+          while (ares_submit_send(channel_, qbuf.data(), (int)qbuf.size(),
+                                  callback, &done) != ARES_SUCCESS) {
+            std::this_thread::yield();
+          }
+        }
+      });
+    }
+    // Sleep until woken up, as an event loop would.
+    ares_socket_t fd = ares_submit_fd(channel_);
+    while (done < total) {
+      fd_set readers;
+      FD_ZERO(&readers);
+      FD_SET(fd, &readers);
+      struct timeval tv = {0, 100000};
+      select(fd + 1, &readers, nullptr, nullptr, &tv);
+      ares_process_fds(channel_, nullptr, 0, 0);
+    }
+    double elapsed = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    for (auto& thread : threads) thread.join();
+    std::cerr << nthreads << " threads: " << (total / elapsed)
+              << " submissions/s" << std::endl;
+  }
+}
+
+class MockTCPIdleTest
+    : public MockChannelOptsTest,
+      public ::testing::WithParamInterface<int> {
+ public:
+  MockTCPIdleTest()
+    : MockChannelOptsTest(1, GetParam(), true, FillOptions(&opts_),
+                          ARES_OPT_TCP_IDLE_TIMEOUT) {}
+  static struct ares_options* FillOptions(struct ares_options * opts) {
+    memset(opts, 0, sizeof(struct ares_options));
+    opts->tcp_idle_timeout = 200;
+    return opts;
+  }
+  unsigned long ServerStat(int stat) {
+    unsigned long value = 0;
+    EXPECT_EQ(ARES_SUCCESS, ares_get_server_stat(channel_, 0, stat, &value));
+    return value;
+  }
+  int CountSockets() {
+    ares_socket_t socks[ARES_GETSOCK_MAXNUM];
+    int bitmask = ares_getsock(channel_, socks, ARES_GETSOCK_MAXNUM);
+    int count = 0;
+    for (int ii = 0; ii < ARES_GETSOCK_MAXNUM; ii++) {
+      if (ARES_GETSOCK_READABLE(bitmask, ii)) count++;
+    }
+    return count;
+  }
+  // Send a burst of queries and process until all of them are answered,
+  // without waiting for the idle connection to be closed.
+  void Burst(int count) {
+    std::vector<HostResult> results(count);
+    for (auto& result : results) {
+      result.done_ = false;
+      ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback,
+                         &result);
+    }
+    EXPECT_EQ(count, (int)ServerStat(ARES_SERVER_STAT_TCP_INFLIGHT));
+    for (int ii = 0; ii < 50; ii++) {
+      bool done = true;
+      for (const auto& result : results) done = done && result.done_;
+      if (done) break;
+      fd_set readers, writers;
+      FD_ZERO(&readers);
+      FD_ZERO(&writers);
+      int nfds = ares_fds(channel_, &readers, &writers);
+      for (int fd : fds()) {
+        FD_SET(fd, &readers);
+        if (fd >= nfds) nfds = fd + 1;
+      }
+      struct timeval tv;
+      tv.tv_sec = 0;
+      tv.tv_usec = 100000;
+      ASSERT_LE(0, select(nfds, &readers, &writers, nullptr, &tv));
+      ares_process(channel_, &readers, &writers);
+      for (int fd : fds()) {
+        if (FD_ISSET(fd, &readers)) ProcessFD(fd);
+      }
+    }
+    for (const auto& result : results) {
+      EXPECT_TRUE(result.done_);
+      EXPECT_EQ(ARES_SUCCESS, result.status_);
+    }
+  }
+ private:
+  struct ares_options opts_;
+};
+
+TEST_P(MockTCPIdleTest, ReuseConnection) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp));
+
+  // All queries of a burst share one connection, which stays open after
+  // they have been answered and is used again by the next burst.
+  Burst(4);
+  EXPECT_EQ(1, CountSockets());
+  EXPECT_EQ(0UL, ServerStat(ARES_SERVER_STAT_TCP_INFLIGHT));
+  Burst(4);
+  EXPECT_EQ(1UL, ServerStat(ARES_SERVER_STAT_TCP_CONNECTS));
+  EXPECT_EQ(8UL, ServerStat(ARES_SERVER_STAT_TCP_QUERIES));
+  EXPECT_LT(0UL, ServerStat(ARES_SERVER_STAT_TCP_BYTES_SENT));
+  EXPECT_LT(0UL, ServerStat(ARES_SERVER_STAT_TCP_BYTES_RECV));
+
+  // Once idle for long enough, the connection is closed.
+  Process();
+  EXPECT_EQ(0, CountSockets());
+
+  unsigned long value;
+  EXPECT_EQ(ARES_ENODATA, ares_get_server_stat(channel_, 1,
+                                               ARES_SERVER_STAT_TCP_QUERIES,
+                                               &value));
+  EXPECT_EQ(ARES_ENOTIMP, ares_get_server_stat(channel_, 0, 99, &value));
+}
+
+class MockRTOTest
+    : public MockChannelOptsTest,
+      public ::testing::WithParamInterface<int> {
+ public:
+  MockRTOTest()
+    : MockChannelOptsTest(1, GetParam(), false, FillOptions(&opts_),
+                          ARES_OPT_RTO) {}
+  static struct ares_options* FillOptions(struct ares_options * opts) {
+    memset(opts, 0, sizeof(struct ares_options));
+    opts->rto_min = 20;
+    opts->rto_max = 300;
+    return opts;
+  }
+  unsigned long ServerStat(int stat) {
+    unsigned long value = 0;
+    EXPECT_EQ(ARES_SUCCESS, ares_get_server_stat(channel_, 0, stat, &value));
+    return value;
+  }
+ private:
+  struct ares_options opts_;
+};
+
+TEST_P(MockRTOTest, RetryOnMeasuredSchedule) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  std::vector<byte> nothing;
+  EXPECT_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillOnce(SetReply(&server_, &rsp))
+    .WillOnce(SetReplyData(&server_, nothing))
+    .WillOnce(SetReply(&server_, &rsp));
+
+  // Until the server has answered, the fixed timeout applies.
+  EXPECT_EQ(300UL, ServerStat(ARES_SERVER_STAT_RTO));
+  HostResult result1;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result1);
+  Process();
+  EXPECT_TRUE(result1.done_);
+  EXPECT_LT(0UL, ServerStat(ARES_SERVER_STAT_SRTT));
+  EXPECT_EQ(20UL, ServerStat(ARES_SERVER_STAT_RTO));
+
+  // A lost query is retried long before the 1500ms fixed timeout.
+  auto start = std::chrono::steady_clock::now();
+  HostResult result2;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result2);
+  Process();
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  EXPECT_TRUE(result2.done_);
+  EXPECT_EQ(ARES_SUCCESS, result2.status_);
+  EXPECT_EQ(1, result2.timeouts_);
+  EXPECT_GT(std::chrono::milliseconds(1000), elapsed);
+}
+
+class MockEventLoopTest
+    : public MockChannelOptsTest,
+      public ::testing::WithParamInterface< std::pair<int, bool> > {
+ public:
+  MockEventLoopTest()
+    : MockChannelOptsTest(1, GetParam().first, GetParam().second,
+                          FillOptions(&opts_, &watched_),
+                          ARES_OPT_SOCK_STATE_CB) {}
+  static struct ares_options* FillOptions(struct ares_options * opts,
+                                          std::map<int, unsigned int> *watched) {
+    memset(opts, 0, sizeof(struct ares_options));
+    opts->sock_state_cb = SockStateCallback;
+    opts->sock_state_cb_data = watched;
+    return opts;
+  }
+  static void SockStateCallback(void *data, ares_socket_t fd,
+                                int readable, int writable) {
+    std::map<int, unsigned int> *watched = (std::map<int, unsigned int>*)data;
+    unsigned int events = (readable ? ARES_FD_EVENT_READ : 0) |
+                          (writable ? ARES_FD_EVENT_WRITE : 0);
+    if (events)
+      (*watched)[fd] = events;
+    else
+      watched->erase(fd);
+  }
+  // Wait for events on the sockets the callback told us about, the way an
+  // epoll based loop would, and hand exactly those to the library.
+  void ProcessEvents(HostResult *result) {
+    while (!result->done_) {
+      fd_set readers, writers;
+      FD_ZERO(&readers);
+      FD_ZERO(&writers);
+      int nfds = 0;
+      for (const auto& entry : watched_) {
+        if (entry.second & ARES_FD_EVENT_READ) FD_SET(entry.first, &readers);
+        if (entry.second & ARES_FD_EVENT_WRITE) FD_SET(entry.first, &writers);
+        if (entry.first >= nfds) nfds = entry.first + 1;
+      }
+      std::set<int> serverfds = fds();
+      for (int fd : serverfds) {
+        FD_SET(fd, &readers);
+        if (fd >= nfds) nfds = fd + 1;
+      }
+      struct timeval tv;
+      tv.tv_sec = 0;
+      tv.tv_usec = 100000;
+      ASSERT_LE(0, select(nfds, &readers, &writers, nullptr, &tv));
+
+      std::vector<struct ares_fd_events> events;
+      for (const auto& entry : watched_) {
+        struct ares_fd_events ev;
+        ev.fd = entry.first;
+        ev.events = (FD_ISSET(entry.first, &readers) ? ARES_FD_EVENT_READ : 0) |
+                    (FD_ISSET(entry.first, &writers) ? ARES_FD_EVENT_WRITE : 0);
+        if (ev.events) events.push_back(ev);
+      }
+      EXPECT_EQ(ARES_SUCCESS, ares_process_fds(channel_, events.data(),
+                                               events.size(), 0));
+      for (int fd : serverfds) {
+        if (FD_ISSET(fd, &readers)) ProcessFD(fd);
+      }
+    }
+  }
+ private:
+  struct ares_options opts_;
+  std::map<int, unsigned int> watched_;
+};
+
+TEST_P(MockEventLoopTest, ProcessFds) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp));
+
+  HostResult result;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result);
+  ProcessEvents(&result);
+  std::stringstream ss;
+  ss << result.host_;
+  EXPECT_EQ("{'www.google.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
+
+  // Events for sockets the channel does not own are ignored.
+  struct ares_fd_events stray = {ARES_SOCKET_BAD, ARES_FD_EVENT_READ};
+  EXPECT_EQ(ARES_SUCCESS, ares_process_fds(channel_, &stray, 1, 0));
+  EXPECT_EQ(ARES_ENODATA, ares_process_fds(channel_, nullptr, 1, 0));
+  EXPECT_EQ(ARES_ENODATA, ares_process_fds(nullptr, &stray, 1, 0));
+}
+
+class MockShortTimeoutTest
+    : public MockChannelOptsTest,
+      public ::testing::WithParamInterface<int> {
+ public:
+  MockShortTimeoutTest()
+    : MockChannelOptsTest(1, GetParam(), false, FillOptions(&opts_),
+                          ARES_OPT_TIMEOUTMS|ARES_OPT_TRIES) {}
+  static struct ares_options* FillOptions(struct ares_options * opts) {
+    memset(opts, 0, sizeof(struct ares_options));
+    opts->timeout = 50;
+    opts->tries = 1;
+    return opts;
+  }
+ private:
+  struct ares_options opts_;
+};
+
+TEST_P(MockShortTimeoutTest, SubSecondTimeouts) {
+  EXPECT_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .Times(1);
+  EXPECT_CALL(server_, OnRequest("www.example.com", ns_t_a))
+    .Times(1);
+
+  HostResult result1;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result1);
+  HostResult result2;
+  ares_gethostbyname(channel_, "www.example.com.", AF_INET, HostCallback, &result2);
+
+  // The next wakeup is for the first query to expire, to the millisecond.
+  struct timeval tv;
+  EXPECT_EQ(&tv, ares_timeout(channel_, nullptr, &tv));
+  EXPECT_EQ(0, tv.tv_sec);
+  EXPECT_GE(50000, tv.tv_usec);
+
+  Process();
+  EXPECT_TRUE(result1.done_);
+  EXPECT_EQ(ARES_ETIMEOUT, result1.status_);
+  EXPECT_TRUE(result2.done_);
+  EXPECT_EQ(ARES_ETIMEOUT, result2.status_);
+}
+
+class MockQueryCacheTest
+    : public MockChannelOptsTest,
+      public ::testing::WithParamInterface< std::pair<int, bool> > {
+ public:
+  MockQueryCacheTest()
+    : MockChannelOptsTest(1, GetParam().first, GetParam().second,
+                          FillOptions(&opts_), ARES_OPT_QUERY_CACHE) {}
+  static struct ares_options* FillOptions(struct ares_options * opts) {
+    memset(opts, 0, sizeof(struct ares_options));
+    opts->qcache_max_ttl = 3600;
+    return opts;
+  }
+ private:
+  struct ares_options opts_;
+};
+
+TEST_P(MockQueryCacheTest, PositiveHit) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  EXPECT_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillOnce(SetReply(&server_, &rsp));
+
+  SearchResult result1;
+  ares_query(channel_, "www.google.com", ns_c_in, ns_t_a, SearchCallback, &result1);
+  Process();
+  EXPECT_TRUE(result1.done_);
+  EXPECT_EQ(ARES_SUCCESS, result1.status_);
+
+  // Served synchronously, and case-insensitively, from the cache.
+  SearchResult result2;
+  result2.done_ = false;
+  ares_query(channel_, "WWW.Google.com", ns_c_in, ns_t_a, SearchCallback, &result2);
+  EXPECT_TRUE(result2.done_);
+  EXPECT_EQ(ARES_SUCCESS, result2.status_);
+  struct hostent *host = nullptr;
+  EXPECT_EQ(ARES_SUCCESS, ares_parse_a_reply(result2.data_.data(),
+                                             (int)result2.data_.size(),
+                                             &host, nullptr, nullptr));
+  std::stringstream ss;
+  ss << HostEnt(host);
+  EXPECT_EQ("{'www.google.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
+  ares_free_hostent(host);
+
+  // A different type is a different question.
+  DNSPacket rsp6;
+  rsp6.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_aaaa))
+    .add_answer(new DNSAaaaRR("www.google.com", 100,
+                              {0x01, 0x01, 0x01, 0x01, 0x02, 0x02, 0x02, 0x02,
+                               0x03, 0x03, 0x03, 0x03, 0x04, 0x04, 0x04, 0x04}));
+  EXPECT_CALL(server_, OnRequest("www.google.com", ns_t_aaaa))
+    .WillOnce(SetReply(&server_, &rsp6));
+  SearchResult result3;
+  result3.done_ = false;
+  ares_query(channel_, "www.google.com", ns_c_in, ns_t_aaaa, SearchCallback, &result3);
+  EXPECT_FALSE(result3.done_);
+  Process();
+  EXPECT_TRUE(result3.done_);
+}
+
+TEST_P(MockQueryCacheTest, NegativeHitUsesSOA) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa().set_rcode(ns_r_nxdomain)
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_auth(new DNSSoaRR("google.com", 600, "ns1.google.com",
+                           "dns-admin.google.com", 1, 900, 900, 1800, 60));
+  EXPECT_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillOnce(SetReply(&server_, &rsp));
+
+  SearchResult result1;
+  ares_query(channel_, "www.google.com", ns_c_in, ns_t_a, SearchCallback, &result1);
+  Process();
+  EXPECT_TRUE(result1.done_);
+  EXPECT_EQ(ARES_ENOTFOUND, result1.status_);
+
+  SearchResult result2;
+  result2.done_ = false;
+  ares_query(channel_, "www.google.com", ns_c_in, ns_t_a, SearchCallback, &result2);
+  EXPECT_TRUE(result2.done_);
+  EXPECT_EQ(ARES_ENOTFOUND, result2.status_);
+}
+
+TEST_P(MockQueryCacheTest, NoCacheWithoutTTL) {
+  DNSPacket rspzero;
+  rspzero.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 0, {2, 3, 4, 5}));
+  EXPECT_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .Times(2)
+    .WillRepeatedly(SetReply(&server_, &rspzero));
+  // Negative answer without an SOA record.
+  DNSPacket rspnosoa;
+  rspnosoa.set_response().set_aa().set_rcode(ns_r_nxdomain)
+    .add_question(new DNSQuestion("www.example.com", ns_t_a));
+  EXPECT_CALL(server_, OnRequest("www.example.com", ns_t_a))
+    .Times(2)
+    .WillRepeatedly(SetReply(&server_, &rspnosoa));
+
+  for (int i = 0; i < 2; i++) {
+    SearchResult result1;
+    ares_query(channel_, "www.google.com", ns_c_in, ns_t_a, SearchCallback, &result1);
+    Process();
+    SearchResult result2;
+    ares_query(channel_, "www.example.com", ns_c_in, ns_t_a, SearchCallback, &result2);
+    Process();
+    EXPECT_TRUE(result1.done_);
+    EXPECT_EQ(ARES_SUCCESS, result1.status_);
+    EXPECT_TRUE(result2.done_);
+    EXPECT_EQ(ARES_ENOTFOUND, result2.status_);
+  }
+}
+
+class MockNegCacheTest
+    : public MockChannelOptsTest,
+      public ::testing::WithParamInterface< std::pair<int, bool> > {
+ public:
+  MockNegCacheTest()
+    : MockChannelOptsTest(1, GetParam().first, GetParam().second,
+                          FillOptions(&opts_), ARES_OPT_NEG_CACHE) {}
+  static struct ares_options* FillOptions(struct ares_options * opts) {
+    memset(opts, 0, sizeof(struct ares_options));
+    opts->negcache_max_ttl = 3600;
+    return opts;
+  }
+ private:
+  struct ares_options opts_;
+};
+
+TEST_P(MockNegCacheTest, SearchSkipsMissingNames) {
+  DNSPacket nofirst;
+  nofirst.set_response().set_aa().set_rcode(ns_r_nxdomain)
+    .add_question(new DNSQuestion("www.first.com", ns_t_a))
+    .add_auth(new DNSSoaRR("first.com", 600, "ns1.first.com",
+                           "dns-admin.first.com", 1, 900, 900, 1800, 60));
+  // Without an SOA record there is no telling how long the denial holds.
+  DNSPacket nosecond;
+  nosecond.set_response().set_aa().set_rcode(ns_r_nxdomain)
+    .add_question(new DNSQuestion("www.second.org", ns_t_a));
+  DNSPacket yesthird;
+  yesthird.set_response().set_aa()
+    .add_question(new DNSQuestion("www.third.gov", ns_t_a))
+    .add_answer(new DNSARR("www.third.gov", 0x0200, {2, 3, 4, 5}));
+  EXPECT_CALL(server_, OnRequest("www.first.com", ns_t_a))
+    .Times(2)
+    .WillRepeatedly(SetReply(&server_, &nofirst));
+  EXPECT_CALL(server_, OnRequest("www.second.org", ns_t_a))
+    .Times(3)
+    .WillRepeatedly(SetReply(&server_, &nosecond));
+  EXPECT_CALL(server_, OnRequest("www.third.gov", ns_t_a))
+    .Times(3)
+    .WillRepeatedly(SetReply(&server_, &yesthird));
+
+  for (int ii = 0; ii < 3; ii++) {
+    if (ii == 2) {
+      // Setting the servers forgets what the old ones denied.
+      struct ares_addr_port_node* servers = nullptr;
+      EXPECT_EQ(ARES_SUCCESS, ares_get_servers_ports(channel_, &servers));
+      EXPECT_EQ(ARES_SUCCESS, ares_set_servers_ports(channel_, servers));
+      ares_free_data(servers);
+    }
+    HostResult result;
+    ares_gethostbyname(channel_, "www", AF_INET, HostCallback, &result);
+    Process();
+    EXPECT_TRUE(result.done_);
+    std::stringstream ss;
+    ss << result.host_;
+    EXPECT_EQ("{'www.third.gov' aliases=[] addrs=[2.3.4.5]}", ss.str());
+  }
+}
+
+TEST_P(MockChannelTest, SearchDomains) {
+  DNSPacket nofirst;
+  nofirst.set_response().set_aa().set_rcode(ns_r_nxdomain)
+    .add_question(new DNSQuestion("www.first.com", ns_t_a));
+  ON_CALL(server_, OnRequest("www.first.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &nofirst));
+  DNSPacket nosecond;
+  nosecond.set_response().set_aa().set_rcode(ns_r_nxdomain)
+    .add_question(new DNSQuestion("www.second.org", ns_t_a));
+  ON_CALL(server_, OnRequest("www.second.org", ns_t_a))
+    .WillByDefault(SetReply(&server_, &nosecond));
+  DNSPacket yesthird;
+  yesthird.set_response().set_aa()
+    .add_question(new DNSQuestion("www.third.gov", ns_t_a))
+    .add_answer(new DNSARR("www.third.gov", 0x0200, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.third.gov", ns_t_a))
+    .WillByDefault(SetReply(&server_, &yesthird));
+
+  HostResult result;
+  ares_gethostbyname(channel_, "www", AF_INET, HostCallback, &result);
+  Process();
+  EXPECT_TRUE(result.done_);
+  std::stringstream ss;
+  ss << result.host_;
+  EXPECT_EQ("{'www.third.gov' aliases=[] addrs=[2.3.4.5]}", ss.str());
+}
+
+// Relies on retries so is UDP-only
+TEST_P(MockUDPChannelTest, SearchDomainsWithResentReply) {
+  DNSPacket nofirst;
+  nofirst.set_response().set_aa().set_rcode(ns_r_nxdomain)
+    .add_question(new DNSQuestion("www.first.com", ns_t_a));
+  EXPECT_CALL(server_, OnRequest("www.first.com", ns_t_a))
+    .WillOnce(SetReply(&server_, &nofirst));
+  DNSPacket nosecond;
+  nosecond.set_response().set_aa().set_rcode(ns_r_nxdomain)
+    .add_question(new DNSQuestion("www.second.org", ns_t_a));
+  EXPECT_CALL(server_, OnRequest("www.second.org", ns_t_a))
+    .WillOnce(SetReply(&server_, &nosecond));
+  DNSPacket yesthird;
+  yesthird.set_response().set_aa()
+    .add_question(new DNSQuestion("www.third.gov", ns_t_a))
+    .add_answer(new DNSARR("www.third.gov", 0x0200, {2, 3, 4, 5}));
+  // Before sending the real answer, resend an earlier reply
+  EXPECT_CALL(server_, OnRequest("www.third.gov", ns_t_a))
+    .WillOnce(DoAll(SetReply(&server_, &nofirst),
+                    SetReplyQID(&server_, 123)))
+    .WillOnce(DoAll(SetReply(&server_, &yesthird),
+                    SetReplyQID(&server_, -1)));
+
+  HostResult result;
+  ares_gethostbyname(channel_, "www", AF_INET, HostCallback, &result);
+  Process();
+  EXPECT_TRUE(result.done_);
+  std::stringstream ss;
+  ss << result.host_;
+  EXPECT_EQ("{'www.third.gov' aliases=[] addrs=[2.3.4.5]}", ss.str());
+}
+
+TEST_P(MockChannelTest, SearchDomainsBare) {
+  DNSPacket nofirst;
+  nofirst.set_response().set_aa().set_rcode(ns_r_nxdomain)
+    .add_question(new DNSQuestion("www.first.com", ns_t_a));
+  ON_CALL(server_, OnRequest("www.first.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &nofirst));
+  DNSPacket nosecond;
+  nosecond.set_response().set_aa().set_rcode(ns_r_nxdomain)
+    .add_question(new DNSQuestion("www.second.org", ns_t_a));
+  ON_CALL(server_, OnRequest("www.second.org", ns_t_a))
+    .WillByDefault(SetReply(&server_, &nosecond));
+  DNSPacket nothird;
+  nothird.set_response().set_aa().set_rcode(ns_r_nxdomain)
+    .add_question(new DNSQuestion("www.third.gov", ns_t_a));
+  ON_CALL(server_, OnRequest("www.third.gov", ns_t_a))
+    .WillByDefault(SetReply(&server_, &nothird));
+  DNSPacket yesbare;
+  yesbare.set_response().set_aa()
+    .add_question(new DNSQuestion("www", ns_t_a))
+    .add_answer(new DNSARR("www", 0x0200, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www", ns_t_a))
+    .WillByDefault(SetReply(&server_, &yesbare));
+
+  HostResult result;
+  ares_gethostbyname(channel_, "www", AF_INET, HostCallback, &result);
+  Process();
+  EXPECT_TRUE(result.done_);
+  std::stringstream ss;
+  ss << result.host_;
+  EXPECT_EQ("{'www' aliases=[] addrs=[2.3.4.5]}", ss.str());
+}
+
+TEST_P(MockChannelTest, SearchNoDataThenSuccess) {
+  // First two search domains recognize the name but have no A records.
+  DNSPacket nofirst;
+  nofirst.set_response().set_aa()
+    .add_question(new DNSQuestion("www.first.com", ns_t_a));
+  ON_CALL(server_, OnRequest("www.first.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &nofirst));
+  DNSPacket nosecond;
+  nosecond.set_response().set_aa()
+    .add_question(new DNSQuestion("www.second.org", ns_t_a));
+  ON_CALL(server_, OnRequest("www.second.org", ns_t_a))
+    .WillByDefault(SetReply(&server_, &nosecond));
+  DNSPacket yesthird;
+  yesthird.set_response().set_aa()
+    .add_question(new DNSQuestion("www.third.gov", ns_t_a))
+    .add_answer(new DNSARR("www.third.gov", 0x0200, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.third.gov", ns_t_a))
+    .WillByDefault(SetReply(&server_, &yesthird));
+
+  HostResult result;
+  ares_gethostbyname(channel_, "www", AF_INET, HostCallback, &result);
+  Process();
+  EXPECT_TRUE(result.done_);
+  std::stringstream ss;
+  ss << result.host_;
+  EXPECT_EQ("{'www.third.gov' aliases=[] addrs=[2.3.4.5]}", ss.str());
+}
+
+TEST_P(MockChannelTest, SearchNoDataThenNoDataBare) {
+  // First two search domains recognize the name but have no A records.
+  DNSPacket nofirst;
+  nofirst.set_response().set_aa()
+    .add_question(new DNSQuestion("www.first.com", ns_t_a));
+  ON_CALL(server_, OnRequest("www.first.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &nofirst));
+  DNSPacket nosecond;
+  nosecond.set_response().set_aa()
+    .add_question(new DNSQuestion("www.second.org", ns_t_a));
+  ON_CALL(server_, OnRequest("www.second.org", ns_t_a))
+    .WillByDefault(SetReply(&server_, &nosecond));
+  DNSPacket nothird;
+  nothird.set_response().set_aa()
+    .add_question(new DNSQuestion("www.third.gov", ns_t_a));
+  ON_CALL(server_, OnRequest("www.third.gov", ns_t_a))
+    .WillByDefault(SetReply(&server_, &nothird));
+  DNSPacket nobare;
+  nobare.set_response().set_aa()
+    .add_question(new DNSQuestion("www", ns_t_a));
+  ON_CALL(server_, OnRequest("www", ns_t_a))
+    .WillByDefault(SetReply(&server_, &nobare));
+
+  HostResult result;
+  ares_gethostbyname(channel_, "www", AF_INET, HostCallback, &result);
+  Process();
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(ARES_ENODATA, result.status_);
+}
+
+TEST_P(MockChannelTest, SearchNoDataThenFail) {
+  // First two search domains recognize the name but have no A records.
+  DNSPacket nofirst;
+  nofirst.set_response().set_aa()
+    .add_question(new DNSQuestion("www.first.com", ns_t_a));
+  ON_CALL(server_, OnRequest("www.first.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &nofirst));
+  DNSPacket nosecond;
+  nosecond.set_response().set_aa()
+    .add_question(new DNSQuestion("www.second.org", ns_t_a));
+  ON_CALL(server_, OnRequest("www.second.org", ns_t_a))
+    .WillByDefault(SetReply(&server_, &nosecond));
+  DNSPacket nothird;
+  nothird.set_response().set_aa()
+    .add_question(new DNSQuestion("www.third.gov", ns_t_a));
+  ON_CALL(server_, OnRequest("www.third.gov", ns_t_a))
+    .WillByDefault(SetReply(&server_, &nothird));
+  DNSPacket nobare;
+  nobare.set_response().set_aa().set_rcode(ns_r_nxdomain)
+    .add_question(new DNSQuestion("www", ns_t_a));
+  ON_CALL(server_, OnRequest("www", ns_t_a))
+    .WillByDefault(SetReply(&server_, &nobare));
+
+  HostResult result;
+  ares_gethostbyname(channel_, "www", AF_INET, HostCallback, &result);
+  Process();
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(ARES_ENODATA, result.status_);
 }
 
 TEST_P(MockChannelTest, SearchAllocFailure) {
@@ -807,7 +1936,113 @@ TEST_P(MockChannelTest, SortListV6) {
 }
 
 // Relies on retries so is UDP-only
-TEST_P(MockUDPChannelTest, SearchDomainsAllocFail) {
+TEST_P(MockUDPChannelTest, SearchDomainsAllocFail) {
+  DNSPacket nofirst;
+  nofirst.set_response().set_aa().set_rcode(ns_r_nxdomain)
+    .add_question(new DNSQuestion("www.first.com", ns_t_a));
+  ON_CALL(server_, OnRequest("www.first.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &nofirst));
+  DNSPacket nosecond;
+  nosecond.set_response().set_aa().set_rcode(ns_r_nxdomain)
+    .add_question(new DNSQuestion("www.second.org", ns_t_a));
+  ON_CALL(server_, OnRequest("www.second.org", ns_t_a))
+    .WillByDefault(SetReply(&server_, &nosecond));
+  DNSPacket yesthird;
+  yesthird.set_response().set_aa()
+    .add_question(new DNSQuestion("www.third.gov", ns_t_a))
+    .add_answer(new DNSARR("www.third.gov", 0x0200, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.third.gov", ns_t_a))
+    .WillByDefault(SetReply(&server_, &yesthird));
+
+  // Fail a variety of different memory allocations, and confirm
+  // that the operation either fails with ENOMEM or succeeds
+  // with the expected result.
+  const int kCount = 34;
+  HostResult results[kCount];
+  for (int ii = 1; ii <= kCount; ii++) {
+    HostResult* result = &(results[ii - 1]);
+    ClearFails();
+    SetAllocFail(ii);
+    ares_gethostbyname(channel_, "www", AF_INET, HostCallback, result);
+    Process();
+    EXPECT_TRUE(result->done_);
+    if (result->status_ == ARES_SUCCESS) {
+      std::stringstream ss;
+      ss << result->host_;
+      EXPECT_EQ("{'www.third.gov' aliases=[] addrs=[2.3.4.5]}", ss.str()) << " failed alloc #" << ii;
+      if (verbose) std::cerr << "Succeeded despite failure of alloc #" << ii << std::endl;
+    }
+  }
+
+  // Explicitly destroy the channel now, so that the HostResult objects
+  // are still valid (in case any pending work refers to them).
+  ares_destroy(channel_);
+  channel_ = nullptr;
+}
+
+class MockParallelSearchTest : public MockFlagsChannelOptsTest {
+ public:
+  MockParallelSearchTest() : MockFlagsChannelOptsTest(ARES_FLAG_PARALLELSEARCH) {}
+};
+
+// Relies on retries so is UDP-only
+TEST_P(MockParallelSearchTest, FirstDomainWins) {
+  DNSPacket yesfirst;
+  yesfirst.set_response().set_aa()
+    .add_question(new DNSQuestion("www.first.com", ns_t_a))
+    .add_answer(new DNSARR("www.first.com", 0x0200, {1, 2, 3, 4}));
+  DNSPacket yessecond;
+  yessecond.set_response().set_aa()
+    .add_question(new DNSQuestion("www.second.org", ns_t_a))
+    .add_answer(new DNSARR("www.second.org", 0x0200, {2, 3, 4, 5}));
+  DNSPacket nothird;
+  nothird.set_response().set_aa().set_rcode(ns_r_nxdomain)
+    .add_question(new DNSQuestion("www.third.gov", ns_t_a));
+  DNSPacket nobare;
+  nobare.set_response().set_aa().set_rcode(ns_r_nxdomain)
+    .add_question(new DNSQuestion("www", ns_t_a));
+  // The first domain only answers when asked again, after the others have
+  // all answered.
+  EXPECT_CALL(server_, OnRequest("www.first.com", ns_t_a))
+    .WillOnce(SetReplyData(&server_, std::vector<byte>()))
+    .WillOnce(SetReply(&server_, &yesfirst));
+  EXPECT_CALL(server_, OnRequest("www.second.org", ns_t_a))
+    .WillOnce(SetReply(&server_, &yessecond));
+  EXPECT_CALL(server_, OnRequest("www.third.gov", ns_t_a))
+    .WillOnce(SetReply(&server_, &nothird));
+  EXPECT_CALL(server_, OnRequest("www", ns_t_a))
+    .WillOnce(SetReply(&server_, &nobare));
+
+  HostResult result;
+  ares_gethostbyname(channel_, "www", AF_INET, HostCallback, &result);
+  Process();
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(1, result.timeouts_);
+  std::stringstream ss;
+  ss << result.host_;
+  EXPECT_EQ("{'www.first.com' aliases=[] addrs=[1.2.3.4]}", ss.str());
+}
+
+TEST_P(MockParallelSearchTest, CancelOneSearch) {
+  // The queries for all the domains go out at once.
+  SearchResult result = {};
+  ares_handle handle = ares_search_handle(channel_, "www", ns_c_in, ns_t_a,
+                                          SearchCallback, &result);
+  EXPECT_NE(nullptr, handle);
+  ares_cancel_query(handle);
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(ARES_ECANCELLED, result.status_);
+
+  // None of the queries for the other domains is left in flight.
+  struct timeval tv;
+  EXPECT_EQ(nullptr, ares_timeout(channel_, nullptr, &tv));
+  fd_set readers, writers;
+  FD_ZERO(&readers);
+  FD_ZERO(&writers);
+  EXPECT_EQ(0, ares_fds(channel_, &readers, &writers));
+}
+
+TEST_P(MockParallelSearchTest, AllocFail) {
   DNSPacket nofirst;
   nofirst.set_response().set_aa().set_rcode(ns_r_nxdomain)
     .add_question(new DNSQuestion("www.first.com", ns_t_a));
@@ -824,10 +2059,12 @@ TEST_P(MockUDPChannelTest, SearchDomainsAllocFail) {
     .add_answer(new DNSARR("www.third.gov", 0x0200, {2, 3, 4, 5}));
   ON_CALL(server_, OnRequest("www.third.gov", ns_t_a))
     .WillByDefault(SetReply(&server_, &yesthird));
+  DNSPacket nobare;
+  nobare.set_response().set_aa().set_rcode(ns_r_nxdomain)
+    .add_question(new DNSQuestion("www", ns_t_a));
+  ON_CALL(server_, OnRequest("www", ns_t_a))
+    .WillByDefault(SetReply(&server_, &nobare));
 
-  // Fail a variety of different memory allocations, and confirm
-  // that the operation either fails with ENOMEM or succeeds
-  // with the expected result.
   const int kCount = 34;
   HostResult results[kCount];
   for (int ii = 1; ii <= kCount; ii++) {
@@ -841,16 +2078,67 @@ TEST_P(MockUDPChannelTest, SearchDomainsAllocFail) {
       std::stringstream ss;
       ss << result->host_;
       EXPECT_EQ("{'www.third.gov' aliases=[] addrs=[2.3.4.5]}", ss.str()) << " failed alloc #" << ii;
-      if (verbose) std::cerr << "Succeeded despite failure of alloc #" << ii << std::endl;
+    } else {
+      EXPECT_EQ(ARES_ENOMEM, result->status_) << " failed alloc #" << ii;
     }
   }
 
-  // Explicitly destroy the channel now, so that the HostResult objects
-  // are still valid (in case any pending work refers to them).
   ares_destroy(channel_);
   channel_ = nullptr;
 }
 
+class MockCoalesceTest : public MockFlagsChannelOptsTest {
+ public:
+  MockCoalesceTest() : MockFlagsChannelOptsTest(ARES_FLAG_COALESCE) {}
+};
+
+TEST_P(MockCoalesceTest, SameNameSentOnce) {
+  DNSPacket reply;
+  reply.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 0x0100, {0x01, 0x02, 0x03, 0x04}));
+  EXPECT_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillOnce(SetReply(&server_, &reply));
+  DNSPacket other;
+  other.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", ns_t_a))
+    .add_answer(new DNSARR("www.example.com", 0x0100, {0x02, 0x03, 0x04, 0x05}));
+  EXPECT_CALL(server_, OnRequest("www.example.com", ns_t_a))
+    .WillOnce(SetReply(&server_, &other));
+
+  const int kCount = 5;
+  HostResult results[kCount];
+  for (int ii = 0; ii < kCount; ii++) {
+    ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &results[ii]);
+  }
+  HostResult result;
+  ares_gethostbyname(channel_, "www.example.com.", AF_INET, HostCallback, &result);
+  Process();
+  for (int ii = 0; ii < kCount; ii++) {
+    EXPECT_TRUE(results[ii].done_);
+    std::stringstream ss;
+    ss << results[ii].host_;
+    EXPECT_EQ("{'www.google.com' aliases=[] addrs=[1.2.3.4]}", ss.str());
+  }
+  EXPECT_TRUE(result.done_);
+  std::stringstream ss;
+  ss << result.host_;
+  EXPECT_EQ("{'www.example.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
+}
+
+TEST_P(MockCoalesceTest, CancelWaiters) {
+  const int kCount = 3;
+  HostResult results[kCount];
+  for (int ii = 0; ii < kCount; ii++) {
+    ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &results[ii]);
+  }
+  ares_cancel(channel_);
+  for (int ii = 0; ii < kCount; ii++) {
+    EXPECT_TRUE(results[ii].done_);
+    EXPECT_EQ(ARES_ECANCELLED, results[ii].status_);
+  }
+}
+
 // Relies on retries so is UDP-only
 TEST_P(MockUDPChannelTest, Resend) {
   std::vector<byte> nothing;
@@ -895,6 +2183,49 @@ TEST_P(MockChannelTest, CancelImmediateGetHostByAddr) {
   EXPECT_EQ(0, result.timeouts_);
 }
 
+TEST_P(MockChannelTest, CancelOneQuery) {
+  EXPECT_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillRepeatedly(SetReplyData(&server_, std::vector<byte>()));
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", ns_t_a))
+    .add_answer(new DNSARR("www.example.com", 100, {2, 3, 4, 5}));
+  EXPECT_CALL(server_, OnRequest("www.example.com", ns_t_a))
+    .WillOnce(SetReply(&server_, &rsp));
+
+  SearchResult result1 = {};
+  ares_handle handle = ares_query_handle(channel_, "www.google.com", ns_c_in,
+                                         ns_t_a, SearchCallback, &result1);
+  EXPECT_NE(nullptr, handle);
+  SearchResult result2 = {};
+  ares_query(channel_, "www.example.com", ns_c_in, ns_t_a, SearchCallback, &result2);
+  EXPECT_FALSE(result1.done_);
+  ares_cancel_query(handle);
+  EXPECT_TRUE(result1.done_);
+  EXPECT_EQ(ARES_ECANCELLED, result1.status_);
+  EXPECT_EQ(0, result1.timeouts_);
+  EXPECT_FALSE(result2.done_);
+  Process();
+  EXPECT_TRUE(result2.done_);
+  EXPECT_EQ(ARES_SUCCESS, result2.status_);
+}
+
+TEST_P(MockChannelTest, CancelOneSearch) {
+  EXPECT_CALL(server_, OnRequest("www.first.com", ns_t_a))
+    .WillRepeatedly(SetReplyData(&server_, std::vector<byte>()));
+  // The search goes no further once cancelled.
+  EXPECT_CALL(server_, OnRequest("www.second.org", ns_t_a)).Times(0);
+
+  SearchResult result = {};
+  ares_handle handle = ares_search_handle(channel_, "www", ns_c_in, ns_t_a,
+                                          SearchCallback, &result);
+  EXPECT_NE(nullptr, handle);
+  ares_cancel_query(handle);
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(ARES_ECANCELLED, result.status_);
+  Process();
+}
+
 // Relies on retries so is UDP-only
 TEST_P(MockUDPChannelTest, CancelLater) {
   std::vector<byte> nothing;
@@ -1138,6 +2469,270 @@ TEST_P(NoRotateMultiMockTest, ThirdServer) {
   CheckExample();
 }
 
+class MockServerHealthTest
+  : public MockChannelOptsTest,
+    public ::testing::WithParamInterface< std::pair<int, bool> > {
+ public:
+  MockServerHealthTest()
+    : MockChannelOptsTest(3, GetParam().first, GetParam().second,
+                          FillOptions(&opts_), ARES_OPT_FLAGS) {}
+  static struct ares_options* FillOptions(struct ares_options * opts) {
+    memset(opts, 0, sizeof(struct ares_options));
+    opts->flags = ARES_FLAG_SRVHEALTH;
+    return opts;
+  }
+  void CheckExample() {
+    HostResult result;
+    ares_gethostbyname(channel_, "www.example.com.", AF_INET, HostCallback, &result);
+    Process();
+    EXPECT_TRUE(result.done_);
+    std::stringstream ss;
+    ss << result.host_;
+    EXPECT_EQ("{'www.example.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
+  }
+  unsigned long ServerStat(int server, int stat) {
+    unsigned long value = 0;
+    EXPECT_EQ(ARES_SUCCESS, ares_get_server_stat(channel_, server, stat, &value));
+    return value;
+  }
+ private:
+  struct ares_options opts_;
+};
+
+TEST_P(MockServerHealthTest, AvoidFailingServers) {
+  DNSPacket servfailrsp;
+  servfailrsp.set_response().set_aa().set_rcode(ns_r_servfail)
+    .add_question(new DNSQuestion("www.example.com", ns_t_a));
+  DNSPacket refusedrsp;
+  refusedrsp.set_response().set_aa().set_rcode(ns_r_refused)
+    .add_question(new DNSQuestion("www.example.com", ns_t_a));
+  DNSPacket okrsp;
+  okrsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", ns_t_a))
+    .add_answer(new DNSARR("www.example.com", 100, {2,3,4,5}));
+
+  EXPECT_CALL(*servers_[0], OnRequest("www.example.com", ns_t_a))
+    .WillOnce(SetReply(servers_[0].get(), &servfailrsp));
+  EXPECT_CALL(*servers_[1], OnRequest("www.example.com", ns_t_a))
+    .WillOnce(SetReply(servers_[1].get(), &refusedrsp));
+  EXPECT_CALL(*servers_[2], OnRequest("www.example.com", ns_t_a))
+    .WillOnce(SetReply(servers_[2].get(), &okrsp));
+  CheckExample();
+
+  // The failing servers are on probation, so the next query goes straight
+  // to the one that answered.
+  EXPECT_CALL(*servers_[0], OnRequest("www.example.com", ns_t_a)).Times(0);
+  EXPECT_CALL(*servers_[1], OnRequest("www.example.com", ns_t_a)).Times(0);
+  EXPECT_CALL(*servers_[2], OnRequest("www.example.com", ns_t_a))
+    .WillOnce(SetReply(servers_[2].get(), &okrsp));
+  CheckExample();
+
+  EXPECT_EQ(1UL, ServerStat(0, ARES_SERVER_STAT_SERVFAILS));
+  EXPECT_EQ(1UL, ServerStat(1, ARES_SERVER_STAT_SERVFAILS));
+  EXPECT_EQ(0UL, ServerStat(2, ARES_SERVER_STAT_SERVFAILS));
+  EXPECT_EQ(2UL, ServerStat(2, ARES_SERVER_STAT_ANSWERS));
+  EXPECT_LT(0UL, ServerStat(2, ARES_SERVER_STAT_SRTT));
+  EXPECT_EQ(0UL, ServerStat(0, ARES_SERVER_STAT_SRTT));
+}
+
+class MockResolverHealthTest
+  : public MockChannelOptsTest,
+    public ::testing::WithParamInterface<int> {
+ public:
+  MockResolverHealthTest()
+    : MockChannelOptsTest(2, GetParam(), false, FillOptions(&opts_),
+                          ARES_OPT_FLAGS | ARES_OPT_SUBMIT_QUEUE) {}
+  static struct ares_options* FillOptions(struct ares_options * opts) {
+    memset(opts, 0, sizeof(struct ares_options));
+    opts->flags = ARES_FLAG_SRVHEALTH;
+    opts->submit_queue_size = 16;
+    return opts;
+  }
+  void CheckExample(ares_channel channel) {
+    HostResult result;
+    ares_gethostbyname(channel, "www.example.com.", AF_INET, HostCallback, &result);
+    ProcessWork(channel, [this]() { return fds(); },
+                [this](int fd) { ProcessFD(fd); });
+    EXPECT_TRUE(result.done_);
+    std::stringstream ss;
+    ss << result.host_;
+    EXPECT_EQ("{'www.example.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
+  }
+ private:
+  struct ares_options opts_;
+};
+
+TEST_P(MockResolverHealthTest, SharesServerFailures) {
+  DNSPacket servfailrsp;
+  servfailrsp.set_response().set_aa().set_rcode(ns_r_servfail)
+    .add_question(new DNSQuestion("www.example.com", ns_t_a));
+  DNSPacket okrsp;
+  okrsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", ns_t_a))
+    .add_answer(new DNSARR("www.example.com", 100, {2,3,4,5}));
+
+  ares_resolver resolver = nullptr;
+  ASSERT_EQ(ARES_SUCCESS, ares_resolver_init(&resolver, channel_, 2));
+
+  EXPECT_CALL(*servers_[0], OnRequest("www.example.com", ns_t_a))
+    .WillOnce(SetReply(servers_[0].get(), &servfailrsp));
+  EXPECT_CALL(*servers_[1], OnRequest("www.example.com", ns_t_a))
+    .WillOnce(SetReply(servers_[1].get(), &okrsp));
+  CheckExample(ares_resolver_channel(resolver, 0));
+
+  // The other channel has not sent anything to the failing server, but
+  // avoids it all the same.
+  EXPECT_CALL(*servers_[0], OnRequest("www.example.com", ns_t_a)).Times(0);
+  EXPECT_CALL(*servers_[1], OnRequest("www.example.com", ns_t_a))
+    .WillOnce(SetReply(servers_[1].get(), &okrsp));
+  CheckExample(ares_resolver_channel(resolver, 1));
+
+  ares_resolver_destroy(resolver);
+}
+
+class MockHedgeTest
+  : public MockChannelOptsTest,
+    public ::testing::WithParamInterface<int> {
+ public:
+  MockHedgeTest()
+    : MockChannelOptsTest(2, GetParam(), false, FillOptions(&opts_),
+                          ARES_OPT_HEDGE) {}
+  static struct ares_options* FillOptions(struct ares_options * opts) {
+    memset(opts, 0, sizeof(struct ares_options));
+    opts->hedge_delay = 50;
+    return opts;
+  }
+  unsigned long Stat(int stat) {
+    unsigned long value = 0;
+    EXPECT_EQ(ARES_SUCCESS, ares_get_stat(channel_, stat, &value));
+    return value;
+  }
+ private:
+  struct ares_options opts_;
+};
+
+TEST_P(MockHedgeTest, SecondServerAnswers) {
+  DNSPacket okrsp;
+  okrsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", ns_t_a))
+    .add_answer(new DNSARR("www.example.com", 100, {2,3,4,5}));
+  std::vector<byte> nothing;
+  EXPECT_CALL(*servers_[0], OnRequest("www.example.com", ns_t_a))
+    .WillOnce(SetReplyData(servers_[0].get(), nothing));
+  EXPECT_CALL(*servers_[1], OnRequest("www.example.com", ns_t_a))
+    .WillOnce(SetReply(servers_[1].get(), &okrsp));
+
+  // The silent first server is not waited on for the 1500ms timeout.
+  auto start = std::chrono::steady_clock::now();
+  HostResult result;
+  ares_gethostbyname(channel_, "www.example.com.", AF_INET, HostCallback, &result);
+  Process();
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(ARES_SUCCESS, result.status_);
+  EXPECT_EQ(0, result.timeouts_);
+  EXPECT_GT(std::chrono::milliseconds(1000), elapsed);
+  EXPECT_EQ(1UL, Stat(ARES_STAT_HEDGES_SENT));
+  EXPECT_EQ(1UL, Stat(ARES_STAT_HEDGE_WINS));
+}
+
+TEST_P(MockHedgeTest, SecondServerTruncates) {
+  DNSPacket tcrsp;
+  tcrsp.set_response().set_aa().set_tc()
+    .add_question(new DNSQuestion("www.example.com", ns_t_a));
+  DNSPacket okrsp;
+  okrsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", ns_t_a))
+    .add_answer(new DNSARR("www.example.com", 100, {2,3,4,5}));
+  std::vector<byte> nothing;
+  // The query goes over TCP to the server that truncated the hedged copy,
+  // not to the silent first server.
+  EXPECT_CALL(*servers_[0], OnRequest("www.example.com", ns_t_a))
+    .WillOnce(SetReplyData(servers_[0].get(), nothing));
+  EXPECT_CALL(*servers_[1], OnRequest("www.example.com", ns_t_a))
+    .WillOnce(SetReply(servers_[1].get(), &tcrsp))
+    .WillOnce(SetReply(servers_[1].get(), &okrsp));
+
+  auto start = std::chrono::steady_clock::now();
+  HostResult result;
+  ares_gethostbyname(channel_, "www.example.com.", AF_INET, HostCallback, &result);
+  Process();
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(ARES_SUCCESS, result.status_);
+  EXPECT_EQ(0, result.timeouts_);
+  EXPECT_GT(std::chrono::milliseconds(1000), elapsed);
+  EXPECT_EQ(1UL, Stat(ARES_STAT_HEDGES_SENT));
+  std::stringstream ss;
+  ss << result.host_;
+  EXPECT_EQ("{'www.example.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
+}
+
+class MockSetServersTest
+  : public MockChannelOptsTest,
+    public ::testing::WithParamInterface<int> {
+ public:
+  MockSetServersTest() : MockChannelOptsTest(2, GetParam(), false, nullptr, 0) {}
+  // Point the channel at the given mock servers, in order.
+  int SetServers(const std::vector<int>& which) {
+    std::vector<struct ares_addr_port_node> nodes(which.size());
+    for (size_t i = 0; i < which.size(); i++) {
+      memset(&nodes[i], 0, sizeof(nodes[i]));
+      nodes[i].next = (i + 1 < which.size()) ? &nodes[i + 1] : nullptr;
+      nodes[i].family = GetParam();
+      nodes[i].udp_port = servers_[which[i]]->udpport();
+      nodes[i].tcp_port = servers_[which[i]]->tcpport();
+      if (GetParam() == AF_INET) {
+        nodes[i].addr.addr4.s_addr = htonl(0x7F000001);
+      } else {
+        nodes[i].addr.addr6._S6_un._S6_u8[15] = 1;
+      }
+    }
+    return ares_set_servers_ports(channel_, nodes.empty() ? nullptr : &nodes[0]);
+  }
+};
+
+TEST_P(MockSetServersTest, SwapWhileQueryPending) {
+  DNSPacket okrsp;
+  okrsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", ns_t_a))
+    .add_answer(new DNSARR("www.example.com", 100, {2,3,4,5}));
+  std::vector<byte> nothing;
+  EXPECT_CALL(*servers_[0], OnRequest("www.example.com", ns_t_a))
+    .WillOnce(SetReplyData(servers_[0].get(), nothing));
+  EXPECT_CALL(*servers_[1], OnRequest("www.example.com", ns_t_a))
+    .WillOnce(SetReply(servers_[1].get(), &okrsp));
+
+  auto start = std::chrono::steady_clock::now();
+  HostResult result;
+  ares_gethostbyname(channel_, "www.example.com.", AF_INET, HostCallback, &result);
+  ares_socket_t before[ARES_GETSOCK_MAXNUM];
+  EXPECT_EQ(ARES_GETSOCK_READABLE(1, 0),
+            ares_getsock(channel_, before, ARES_GETSOCK_MAXNUM));
+
+  // Reordering the list keeps the first server, its socket and the query
+  // waiting on it.
+  EXPECT_EQ(ARES_SUCCESS, SetServers({1, 0}));
+  ares_socket_t after[ARES_GETSOCK_MAXNUM];
+  EXPECT_EQ(ARES_GETSOCK_READABLE(1, 0),
+            ares_getsock(channel_, after, ARES_GETSOCK_MAXNUM));
+  EXPECT_EQ(before[0], after[0]);
+  EXPECT_FALSE(result.done_);
+
+  // Dropping it sends the query on to the remaining server at once, rather
+  // than after a timeout.
+  EXPECT_EQ(ARES_SUCCESS, SetServers({1}));
+  Process();
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(ARES_SUCCESS, result.status_);
+  EXPECT_EQ(0, result.timeouts_);
+  EXPECT_GT(std::chrono::milliseconds(1000), elapsed);
+  std::stringstream ss;
+  ss << result.host_;
+  EXPECT_EQ("{'www.example.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
+}
+
 INSTANTIATE_TEST_CASE_P(AddressFamilies, MockChannelTest, ::testing::ValuesIn(ares::test::families_modes));
 
 INSTANTIATE_TEST_CASE_P(AddressFamilies, MockUDPChannelTest, ::testing::ValuesIn(ares::test::families));
@@ -1150,9 +2745,49 @@ INSTANTIATE_TEST_CASE_P(AddressFamilies, MockNoCheckRespChannelTest, ::testing::
 
 INSTANTIATE_TEST_CASE_P(AddressFamilies, MockEDNSChannelTest, ::testing::ValuesIn(ares::test::families_modes));
 
+INSTANTIATE_TEST_CASE_P(AddressFamilies, MockDeferSendChannelTest,
+                        ::testing::Values(std::make_pair<int, bool>(AF_INET, false),
+                                          std::make_pair<int, bool>(AF_INET6, false)));
+
+INSTANTIATE_TEST_CASE_P(AddressFamilies, MockParallelSearchTest,
+                        ::testing::Values(std::make_pair<int, bool>(AF_INET, false),
+                                          std::make_pair<int, bool>(AF_INET6, false)));
+
+INSTANTIATE_TEST_CASE_P(AddressFamilies, MockCoalesceTest, ::testing::ValuesIn(ares::test::families_modes));
+
+INSTANTIATE_TEST_CASE_P(AddressFamilies, MockUDPPoolSizeTest, ::testing::ValuesIn(ares::test::families));
+
+INSTANTIATE_TEST_CASE_P(AddressFamilies, MockUDPMaxQueriesTest, ::testing::ValuesIn(ares::test::families));
+
+INSTANTIATE_TEST_CASE_P(AddressFamilies, MockQidSpaceTest, ::testing::ValuesIn(ares::test::families));
+
+INSTANTIATE_TEST_CASE_P(AddressFamilies, MockMemoryTest, ::testing::ValuesIn(ares::test::families));
+
+INSTANTIATE_TEST_CASE_P(AddressFamilies, MockSubmitTest, ::testing::ValuesIn(ares::test::families));
+
+INSTANTIATE_TEST_CASE_P(AddressFamilies, MockTCPIdleTest, ::testing::ValuesIn(ares::test::families));
+
+INSTANTIATE_TEST_CASE_P(AddressFamilies, MockRTOTest, ::testing::ValuesIn(ares::test::families));
+
+INSTANTIATE_TEST_CASE_P(AddressFamilies, MockEventLoopTest, ::testing::ValuesIn(ares::test::families_modes));
+
+INSTANTIATE_TEST_CASE_P(AddressFamilies, MockShortTimeoutTest, ::testing::ValuesIn(ares::test::families));
+
+INSTANTIATE_TEST_CASE_P(AddressFamilies, MockQueryCacheTest, ::testing::ValuesIn(ares::test::families_modes));
+
+INSTANTIATE_TEST_CASE_P(AddressFamilies, MockNegCacheTest, ::testing::ValuesIn(ares::test::families_modes));
+
 INSTANTIATE_TEST_CASE_P(TransportModes, RotateMultiMockTest, ::testing::ValuesIn(ares::test::families_modes));
 
 INSTANTIATE_TEST_CASE_P(TransportModes, NoRotateMultiMockTest, ::testing::ValuesIn(ares::test::families_modes));
 
+INSTANTIATE_TEST_CASE_P(TransportModes, MockServerHealthTest, ::testing::ValuesIn(ares::test::families_modes));
+
+INSTANTIATE_TEST_CASE_P(AddressFamilies, MockResolverHealthTest, ::testing::ValuesIn(ares::test::families));
+
+INSTANTIATE_TEST_CASE_P(AddressFamilies, MockHedgeTest, ::testing::ValuesIn(ares::test::families));
+
+INSTANTIATE_TEST_CASE_P(AddressFamilies, MockSetServersTest, ::testing::ValuesIn(ares::test::families));
+
 }  // namespace test
 }  // namespace ares
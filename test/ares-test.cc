@@ -251,12 +251,19 @@ void MockServer::ProcessFD(int fd) {
   int len = recvfrom(fd, BYTE_CAST buffer, sizeof(buffer), 0,
                      (struct sockaddr *)&addr, &addrlen);
   byte* data = buffer;
-  if (fd != udpfd_) {
-    if (len == 0) {
-      connfds_.erase(std::find(connfds_.begin(), connfds_.end(), fd));
-      sclose(fd);
-      return;
-    }
+  if (fd == udpfd_) {
+    ProcessPacket(fd, &addr, addrlen, data, len);
+    return;
+  }
+
+  if (len == 0) {
+    connfds_.erase(std::find(connfds_.begin(), connfds_.end(), fd));
+    sclose(fd);
+    return;
+  }
+  // A client may pipeline several requests, so one read can hold more
+  // than one of them.
+  while (len > 0) {
     if (len < 2) {
       std::cerr << "Packet too short (" << len << ")" << std::endl;
       return;
@@ -264,12 +271,19 @@ void MockServer::ProcessFD(int fd) {
     int tcplen = (data[0] << 8) + data[1];
     data += 2;
     len -= 2;
-    if (tcplen != len) {
+    if (tcplen > len) {
       std::cerr << "Warning: TCP length " << tcplen
                 << " doesn't match remaining data length " << len << std::endl;
+      tcplen = len;
     }
+    ProcessPacket(fd, &addr, addrlen, data, tcplen);
+    data += tcplen;
+    len -= tcplen;
   }
+}
 
+void MockServer::ProcessPacket(int fd, struct sockaddr_storage *addr,
+                               socklen_t addrlen, byte *data, int len) {
   // Assume the packet is a well-formed DNS request and extract the request
   // details.
   if (len < NS_HFIXEDSZ) {
@@ -325,7 +339,7 @@ void MockServer::ProcessFD(int fd) {
     std::cerr << "ProcessRequest(" << qid << ", '" << namestr
               << "', " << RRTypeToString(rrtype) << ")" << std::endl;
   }
-  ProcessRequest(fd, &addr, addrlen, qid, namestr, rrtype);
+  ProcessRequest(fd, addr, addrlen, qid, namestr, rrtype);
 }
 
 std::set<int> MockServer::fds() const {